@@ -411,10 +411,26 @@ CMD(phys)
 
 CMD(commit)
 {
+	int stats = 0;
+	const Tcl_ArgvInfo opts[] = {
+		{TCL_ARGV_CONSTANT, "-stats", (void *) 1, &stats},
+		{TCL_ARGV_END}
+	};
+	argc--; argv++;
+
 	if(check_no_scope(interp, ctx))
 		return TCL_ERROR;
+	if(Tcl_ParseArgsObjv(interp, opts, &argc, argv, NULL) != TCL_OK)
+		return TCL_ERROR;
 
-	if(lsdn_commit(ctx->lsctx, lsdn_problem_stderr_handler, NULL) != LSDNE_OK)
+	lsdn_err_t err = lsdn_commit(ctx->lsctx, lsdn_problem_stderr_handler, NULL);
+	/* Where the time went is interesting especially if the commit has failed */
+	if (stats) {
+		struct lsdn_commit_stats s;
+		lsdn_context_get_commit_stats(ctx->lsctx, &s);
+		lsdn_commit_stats_format(stdout, &s);
+	}
+	if(err != LSDNE_OK)
 		return tcl_error(interp, "commit error");
 	return TCL_OK;
 }
@@ -0,0 +1,922 @@
+/** \file
+ * Adopting the kernel state left behind by a previous context (warm restart).
+ *
+ * On a warm restart, the model is built from scratch and committed as usual. While committing,
+ * the requests creating links, qdiscs, filters and shared actions are compared with a snapshot of the kernel
+ * taken by `lsdn_adopt_start`, instead of being sent right away. Identical objects are adopted
+ * and their requests dropped, different objects are replaced and only the missing ones are
+ * created. `lsdn_adopt_finish` then removes what the previous context has set up and the new
+ * model did not ask for. The traffic flowing through the adopted objects is not interrupted.
+ *
+ * The requests are compared with the dumps attribute by attribute. The kernel reports more than
+ * was asked for (statistics, defaults, masks), so a request matches if all of its attributes are
+ * found in the dump with the same value. */
+#include "private/adopt.h"
+#include "private/nl.h"
+#include "include/util.h"
+#include <uthash.h>
+#include <libmnl/libmnl.h>
+#include <linux/rtnetlink.h>
+#include <linux/if_link.h>
+#include <linux/pkt_sched.h>
+#include <linux/pkt_cls.h>
+#include <linux/tc_act/tc_gact.h>
+#include <net/if.h>
+#include <assert.h>
+#include <ctype.h>
+#include <string.h>
+#include <stdlib.h>
+
+struct adopt_link {
+	unsigned int ifindex;
+	char name[IFNAMSIZ];
+	unsigned int master;
+	bool up;
+	bool adopted;
+	struct nlmsghdr *msg;
+	UT_hash_handle hh_index;
+	UT_hash_handle hh_name;
+};
+
+struct adopt_qdisc_key {
+	uint32_t ifindex;
+	uint32_t handle;
+};
+
+struct adopt_qdisc {
+	struct adopt_qdisc_key key;
+	/** Shared blocks bound by a clsact qdisc, zero if none. */
+	uint32_t blocks[2];
+	bool adopted;
+	struct nlmsghdr *msg;
+	UT_hash_handle hh;
+};
+
+struct adopt_filter {
+	struct lsdn_adopt_filter_key key;
+	bool adopted;
+	struct nlmsghdr *msg;
+	UT_hash_handle hh;
+};
+
+struct adopt_block {
+	uint32_t index;
+	/** Number of qdiscs in the snapshot bound to the block. The kernel destroys the block with
+	 * the last one. */
+	unsigned int binders;
+	/** Bound by a qdisc of the new model. */
+	bool used;
+	UT_hash_handle hh;
+};
+
+/* Standalone tunnel_key action, see `lsdn_tunnel_key_create_async` */
+struct adopt_action {
+	uint32_t index;
+	/** The cookie names the context, the action is not someone else's. */
+	bool owned;
+	bool adopted;
+	/** Copy of the action, with the kind, options and cookie nested. */
+	struct nlattr *attr;
+	UT_hash_handle hh;
+};
+
+struct lsdn_adopt {
+	char *prefix;
+	struct adopt_link *links_by_index;
+	struct adopt_link *links_by_name;
+	struct adopt_qdisc *qdiscs;
+	struct adopt_filter *filters;
+	struct adopt_block *blocks;
+	struct adopt_action *actions;
+	/* The filters being dumped are attached to */
+	uint32_t dump_ifindex;
+	uint32_t dump_parent;
+	bool nomem;
+};
+
+/* Attribute comparison */
+
+#define ATTR_ANY UINT16_MAX
+
+enum attr_cmp {
+	/** The payloads must be the same. */
+	ATTR_EQUAL,
+	/** Strings, the payload may or may not include the NUL. The kernel dumps it, libmnl's
+	 * `mnl_attr_put_str` does not send it. */
+	ATTR_STRING,
+	/** The nested attributes of the request must all match. */
+	ATTR_NESTED,
+	/** Parameters of a tc action, starting with `tc_gen`. The reference counts are filled in
+	 * by the kernel and so is the index, unless the request refers to a shared action. */
+	ATTR_TC_PARMS,
+	/** Not compared at all. */
+	ATTR_IGNORED
+};
+
+/** How to compare an attribute. Rule lists end with a rule for `ATTR_ANY`. */
+struct attr_rule {
+	uint16_t type;
+	enum attr_cmp cmp;
+	const struct attr_rule *nested;
+};
+
+static const struct attr_rule plain_rules[] = {
+	{ATTR_ANY, ATTR_EQUAL, NULL}
+};
+
+static const struct attr_rule qdisc_rules[] = {
+	{TCA_KIND, ATTR_STRING, NULL},
+	{ATTR_ANY, ATTR_EQUAL, NULL}
+};
+
+static const struct attr_rule act_options_rules[] = {
+	/* Same type for all the actions used, TCA_MIRRED_PARMS, TCA_TUNNEL_KEY_PARMS ... */
+	{TCA_GACT_PARMS, ATTR_TC_PARMS, NULL},
+	{ATTR_ANY, ATTR_EQUAL, NULL}
+};
+
+static const struct attr_rule act_rules[] = {
+	{TCA_ACT_KIND, ATTR_STRING, NULL},
+	{TCA_ACT_OPTIONS, ATTR_NESTED, act_options_rules},
+	{ATTR_ANY, ATTR_EQUAL, NULL}
+};
+
+/* The actions are nested under their order */
+static const struct attr_rule act_list_rules[] = {
+	{ATTR_ANY, ATTR_NESTED, act_rules}
+};
+
+static const struct attr_rule flower_rules[] = {
+	{TCA_FLOWER_ACT, ATTR_NESTED, act_list_rules},
+	{ATTR_ANY, ATTR_EQUAL, NULL}
+};
+
+static const struct attr_rule filter_rules[] = {
+	{TCA_KIND, ATTR_STRING, NULL},
+	{TCA_OPTIONS, ATTR_NESTED, flower_rules},
+	{ATTR_ANY, ATTR_EQUAL, NULL}
+};
+
+static const struct attr_rule bpf_rules[] = {
+	/* The program is dumped by its ID, the name tells it apart */
+	{TCA_BPF_FD, ATTR_IGNORED, NULL},
+	{TCA_BPF_NAME, ATTR_STRING, NULL},
+	{ATTR_ANY, ATTR_EQUAL, NULL}
+};
+
+/* The option types differ by the kind of the filter */
+static const struct attr_rule bpf_filter_rules[] = {
+	{TCA_KIND, ATTR_STRING, NULL},
+	{TCA_OPTIONS, ATTR_NESTED, bpf_rules},
+	{ATTR_ANY, ATTR_EQUAL, NULL}
+};
+
+static const struct attr_rule linkinfo_rules[] = {
+	{IFLA_INFO_KIND, ATTR_STRING, NULL},
+	{IFLA_INFO_DATA, ATTR_NESTED, plain_rules},
+	{ATTR_ANY, ATTR_EQUAL, NULL}
+};
+
+static const struct attr_rule link_rules[] = {
+	/* Enslaving is handled by lsdn_adopt_link_attach */
+	{IFLA_MASTER, ATTR_IGNORED, NULL},
+	{IFLA_IFNAME, ATTR_STRING, NULL},
+	{IFLA_LINKINFO, ATTR_NESTED, linkinfo_rules},
+	{ATTR_ANY, ATTR_EQUAL, NULL}
+};
+
+static const struct nlattr *attr_find(const void *payload, size_t len, uint16_t type)
+{
+	const struct nlattr *attr;
+	mnl_attr_for_each_payload(attr, payload, len) {
+		if (mnl_attr_get_type(attr) == type)
+			return attr;
+	}
+	return NULL;
+}
+
+static bool attrs_match(const void *req, size_t req_len, const void *dump, size_t dump_len,
+	const struct attr_rule *rules);
+
+/* Length of a string attribute, with or without the NUL */
+static size_t attr_strlen(const struct nlattr *attr)
+{
+	return strnlen(mnl_attr_get_payload(attr), mnl_attr_get_payload_len(attr));
+}
+
+static bool attr_match(const struct nlattr *req, const struct nlattr *dump,
+	const struct attr_rule *rule)
+{
+	size_t len = mnl_attr_get_payload_len(req);
+	size_t dump_len = mnl_attr_get_payload_len(dump);
+	const char *r = mnl_attr_get_payload(req);
+	const char *d = mnl_attr_get_payload(dump);
+	const size_t gen_size = sizeof(struct tc_gact);
+
+	switch (rule->cmp) {
+	case ATTR_NESTED:
+		return attrs_match(r, len, d, dump_len, rule->nested);
+	case ATTR_STRING:
+		len = attr_strlen(req);
+		return len == attr_strlen(dump) && memcmp(r, d, len) == 0;
+	case ATTR_TC_PARMS:
+		if (len != dump_len || len < gen_size)
+			return false;
+		if (((const struct tc_gact *) r)->index
+		    && ((const struct tc_gact *) r)->index != ((const struct tc_gact *) d)->index)
+			return false;
+		return ((const struct tc_gact *) r)->action == ((const struct tc_gact *) d)->action
+			&& memcmp(r + gen_size, d + gen_size, len - gen_size) == 0;
+	default:
+		return len == dump_len && memcmp(r, d, len) == 0;
+	}
+}
+
+/* Are all attributes of the request found in the dump? */
+static bool attrs_match(const void *req, size_t req_len, const void *dump, size_t dump_len,
+	const struct attr_rule *rules)
+{
+	const struct nlattr *attr;
+	mnl_attr_for_each_payload(attr, req, req_len) {
+		uint16_t type = mnl_attr_get_type(attr);
+		const struct attr_rule *rule = rules;
+		while (rule->type != type && rule->type != ATTR_ANY)
+			rule++;
+		if (rule->cmp == ATTR_IGNORED)
+			continue;
+
+		const struct nlattr *other = attr_find(dump, dump_len, type);
+		if (!other || !attr_match(attr, other, rule))
+			return false;
+	}
+	return true;
+}
+
+static size_t msg_attrs(const struct nlmsghdr *nlh, size_t hdr_size, const char **attrs)
+{
+	*attrs = mnl_nlmsg_get_payload_offset(nlh, hdr_size);
+	return (const char *) mnl_nlmsg_get_payload_tail(nlh) - *attrs;
+}
+
+static bool msg_match(const struct nlmsghdr *req, const struct nlmsghdr *dump, size_t hdr_size,
+	const struct attr_rule *rules)
+{
+	const char *r, *d;
+	size_t req_len = msg_attrs(req, hdr_size, &r);
+	size_t dump_len = msg_attrs(dump, hdr_size, &d);
+	return attrs_match(r, req_len, d, dump_len, rules);
+}
+
+static const struct nlattr *msg_attr(const struct nlmsghdr *nlh, size_t hdr_size, uint16_t type)
+{
+	const char *attrs;
+	size_t len = msg_attrs(nlh, hdr_size, &attrs);
+	return attr_find(attrs, len, type);
+}
+
+static uint32_t msg_attr_u32(const struct nlmsghdr *nlh, size_t hdr_size, uint16_t type)
+{
+	const struct nlattr *attr = msg_attr(nlh, hdr_size, type);
+	return attr ? mnl_attr_get_u32(attr) : 0;
+}
+
+static struct nlattr *attr_dup(const struct nlattr *attr)
+{
+	struct nlattr *copy = malloc(attr->nla_len);
+	if (copy)
+		memcpy(copy, attr, attr->nla_len);
+	return copy;
+}
+
+static struct nlmsghdr *msg_dup(const struct nlmsghdr *nlh)
+{
+	struct nlmsghdr *copy = malloc(nlh->nlmsg_len);
+	if (copy)
+		memcpy(copy, nlh, nlh->nlmsg_len);
+	return copy;
+}
+
+/* Lookups and forgetting objects destroyed by the kernel */
+
+static struct adopt_link *find_link(struct lsdn_adopt *a, unsigned int ifindex)
+{
+	struct adopt_link *l;
+	HASH_FIND(hh_index, a->links_by_index, &ifindex, sizeof(ifindex), l);
+	return l;
+}
+
+static struct adopt_qdisc *find_qdisc(struct lsdn_adopt *a, uint32_t ifindex, uint32_t handle)
+{
+	struct adopt_qdisc_key key = {ifindex, handle};
+	struct adopt_qdisc *q;
+	HASH_FIND(hh, a->qdiscs, &key, sizeof(key), q);
+	return q;
+}
+
+static struct adopt_block *find_block(struct lsdn_adopt *a, uint32_t index)
+{
+	struct adopt_block *b;
+	HASH_FIND(hh, a->blocks, &index, sizeof(index), b);
+	return b;
+}
+
+static void forget_filters(struct lsdn_adopt *a, uint32_t ifindex, bool any_parent, uint32_t parent)
+{
+	struct adopt_filter *f, *tmp;
+	HASH_ITER(hh, a->filters, f, tmp) {
+		if (f->key.ifindex != ifindex || (!any_parent && f->key.parent != parent))
+			continue;
+		HASH_DELETE(hh, a->filters, f);
+		free(f->msg);
+		free(f);
+	}
+}
+
+static void forget_qdisc(struct lsdn_adopt *a, struct adopt_qdisc *q)
+{
+	for (int i = 0; i < 2; i++) {
+		struct adopt_block *b = q->blocks[i] ? find_block(a, q->blocks[i]) : NULL;
+		if (!b || --b->binders > 0)
+			continue;
+		forget_filters(a, TCM_IFINDEX_MAGIC_BLOCK, false, b->index);
+		HASH_DELETE(hh, a->blocks, b);
+		free(b);
+	}
+	forget_filters(a, q->key.ifindex, false, q->key.handle);
+	HASH_DELETE(hh, a->qdiscs, q);
+	free(q->msg);
+	free(q);
+}
+
+static void forget_link(struct lsdn_adopt *a, struct adopt_link *l)
+{
+	struct adopt_qdisc *q, *tmp_q;
+	struct adopt_link *slave, *tmp_slave;
+
+	HASH_ITER(hh, a->qdiscs, q, tmp_q) {
+		if (q->key.ifindex == l->ifindex)
+			forget_qdisc(a, q);
+	}
+	forget_filters(a, l->ifindex, true, 0);
+	HASH_ITER(hh_index, a->links_by_index, slave, tmp_slave) {
+		if (slave->master == l->ifindex)
+			slave->master = 0;
+	}
+	HASH_DELETE(hh_index, a->links_by_index, l);
+	HASH_DELETE(hh_name, a->links_by_name, l);
+	free(l->msg);
+	free(l);
+}
+
+/* Snapshot */
+
+static int link_cb(const struct nlmsghdr *nlh, void *user)
+{
+	struct lsdn_adopt *a = user;
+	const struct ifinfomsg *ifm = mnl_nlmsg_get_payload(nlh);
+	const struct nlattr *name = msg_attr(nlh, sizeof(*ifm), IFLA_IFNAME);
+	if (!name || strlen(mnl_attr_get_str(name)) >= IFNAMSIZ)
+		return MNL_CB_OK;
+
+	struct adopt_link *l = malloc(sizeof(*l));
+	if (!l) {
+		a->nomem = true;
+		return MNL_CB_ERROR;
+	}
+	l->msg = msg_dup(nlh);
+	if (!l->msg) {
+		free(l);
+		a->nomem = true;
+		return MNL_CB_ERROR;
+	}
+	l->ifindex = ifm->ifi_index;
+	strcpy(l->name, mnl_attr_get_str(name));
+	l->master = msg_attr_u32(nlh, sizeof(*ifm), IFLA_MASTER);
+	l->up = ifm->ifi_flags & IFF_UP;
+	l->adopted = false;
+	HASH_ADD(hh_index, a->links_by_index, ifindex, sizeof(l->ifindex), l);
+	HASH_ADD_KEYPTR(hh_name, a->links_by_name, l->name, strlen(l->name), l);
+	return MNL_CB_OK;
+}
+
+static int qdisc_cb(const struct nlmsghdr *nlh, void *user)
+{
+	struct lsdn_adopt *a = user;
+	const struct tcmsg *tcm = mnl_nlmsg_get_payload(nlh);
+	/* Only the qdiscs LSDN might have created, not the defaults */
+	if (tcm->tcm_handle != LSDN_INGRESS_HANDLE && tcm->tcm_handle != LSDN_ROOT_HANDLE)
+		return MNL_CB_OK;
+
+	struct adopt_qdisc *q = malloc(sizeof(*q));
+	if (!q) {
+		a->nomem = true;
+		return MNL_CB_ERROR;
+	}
+	q->msg = msg_dup(nlh);
+	if (!q->msg) {
+		free(q);
+		a->nomem = true;
+		return MNL_CB_ERROR;
+	}
+	q->key.ifindex = tcm->tcm_ifindex;
+	q->key.handle = tcm->tcm_handle;
+	q->blocks[0] = msg_attr_u32(nlh, sizeof(*tcm), TCA_INGRESS_BLOCK);
+	q->blocks[1] = msg_attr_u32(nlh, sizeof(*tcm), TCA_EGRESS_BLOCK);
+	q->adopted = false;
+	HASH_ADD(hh, a->qdiscs, key, sizeof(q->key), q);
+
+	for (int i = 0; i < 2; i++) {
+		if (!q->blocks[i])
+			continue;
+		struct adopt_block *b = find_block(a, q->blocks[i]);
+		if (!b) {
+			b = malloc(sizeof(*b));
+			if (!b) {
+				a->nomem = true;
+				return MNL_CB_ERROR;
+			}
+			b->index = q->blocks[i];
+			b->binders = 0;
+			b->used = false;
+			HASH_ADD(hh, a->blocks, index, sizeof(b->index), b);
+		}
+		b->binders++;
+	}
+	return MNL_CB_OK;
+}
+
+static int filter_cb(const struct nlmsghdr *nlh, void *user)
+{
+	struct lsdn_adopt *a = user;
+	const struct tcmsg *tcm = mnl_nlmsg_get_payload(nlh);
+	/* The kernel also reports the filter priorities themselves, with no handle */
+	if (!tcm->tcm_handle)
+		return MNL_CB_OK;
+
+	struct adopt_filter *f = malloc(sizeof(*f));
+	if (!f) {
+		a->nomem = true;
+		return MNL_CB_ERROR;
+	}
+	f->msg = msg_dup(nlh);
+	if (!f->msg) {
+		free(f);
+		a->nomem = true;
+		return MNL_CB_ERROR;
+	}
+	f->key.ifindex = a->dump_ifindex;
+	f->key.parent = a->dump_parent;
+	f->key.chain = msg_attr_u32(nlh, sizeof(*tcm), TCA_CHAIN);
+	f->key.prio = TC_H_MAJ(tcm->tcm_info) >> 16;
+	f->key.handle = tcm->tcm_handle;
+	f->adopted = false;
+	HASH_ADD(hh, a->filters, key, sizeof(f->key), f);
+	return MNL_CB_OK;
+}
+
+/* The index of a tc action, from the `tc_gen` of its parameters */
+static uint32_t action_index(const struct nlattr *act)
+{
+	const struct nlattr *opts = attr_find(
+		mnl_attr_get_payload(act), mnl_attr_get_payload_len(act), TCA_ACT_OPTIONS);
+	if (!opts)
+		return 0;
+	const struct nlattr *parms = attr_find(
+		mnl_attr_get_payload(opts), mnl_attr_get_payload_len(opts), TCA_GACT_PARMS);
+	if (!parms || mnl_attr_get_payload_len(parms) < sizeof(struct tc_gact))
+		return 0;
+	return ((const struct tc_gact *) mnl_attr_get_payload(parms))->index;
+}
+
+/* Is the cookie of the action the (truncated) prefix? */
+static bool action_owned(struct lsdn_adopt *a, const struct nlattr *act)
+{
+	const struct nlattr *cookie = attr_find(
+		mnl_attr_get_payload(act), mnl_attr_get_payload_len(act), TCA_ACT_COOKIE);
+	size_t len = strnlen(a->prefix, TC_COOKIE_MAX_SIZE);
+	return cookie && mnl_attr_get_payload_len(cookie) == len
+		&& memcmp(mnl_attr_get_payload(cookie), a->prefix, len) == 0;
+}
+
+/* The actions come in batches, nested under their order in the action table */
+static int action_cb(const struct nlmsghdr *nlh, void *user)
+{
+	struct lsdn_adopt *a = user;
+	const struct nlattr *tab = msg_attr(nlh, sizeof(struct tcamsg), TCA_ACT_TAB);
+	if (!tab)
+		return MNL_CB_OK;
+
+	const struct nlattr *act;
+	mnl_attr_for_each_nested(act, tab) {
+		uint32_t index = action_index(act);
+		if (!index)
+			continue;
+		struct adopt_action *x = malloc(sizeof(*x));
+		if (!x) {
+			a->nomem = true;
+			return MNL_CB_ERROR;
+		}
+		x->attr = attr_dup(act);
+		if (!x->attr) {
+			free(x);
+			a->nomem = true;
+			return MNL_CB_ERROR;
+		}
+		x->index = index;
+		x->owned = action_owned(a, act);
+		x->adopted = false;
+		HASH_ADD(hh, a->actions, index, sizeof(x->index), x);
+	}
+	return MNL_CB_OK;
+}
+
+static lsdn_err_t dump(struct lsdn_nlsock *sock, struct lsdn_adopt *a, struct nlmsghdr *nlh,
+	mnl_cb_t cb)
+{
+	lsdn_err_t err = lsdn_nl_dump(sock, nlh, cb, a);
+	if (a->nomem)
+		return LSDNE_NOMEM;
+	return err;
+}
+
+static struct nlmsghdr *tc_dump_msg(char *buf, uint16_t type, uint32_t ifindex, uint32_t parent)
+{
+	struct nlmsghdr *nlh = mnl_nlmsg_put_header(buf);
+	nlh->nlmsg_type = type;
+	struct tcmsg *tcm = mnl_nlmsg_put_extra_header(nlh, sizeof(*tcm));
+	tcm->tcm_family = AF_UNSPEC;
+	tcm->tcm_ifindex = ifindex;
+	tcm->tcm_parent = parent;
+	return nlh;
+}
+
+static lsdn_err_t dump_filters(struct lsdn_nlsock *sock, struct lsdn_adopt *a,
+	uint32_t ifindex, uint32_t parent)
+{
+	char buf[MNL_SOCKET_BUFFER_SIZE];
+	a->dump_ifindex = ifindex;
+	a->dump_parent = parent;
+	return dump(sock, a, tc_dump_msg(buf, RTM_GETTFILTER, ifindex, parent), filter_cb);
+}
+
+static lsdn_err_t snapshot(struct lsdn_nlsock *sock, struct lsdn_adopt *a)
+{
+	char buf[MNL_SOCKET_BUFFER_SIZE];
+	lsdn_err_t err;
+
+	struct nlmsghdr *nlh = mnl_nlmsg_put_header(buf);
+	nlh->nlmsg_type = RTM_GETLINK;
+	struct ifinfomsg *ifm = mnl_nlmsg_put_extra_header(nlh, sizeof(*ifm));
+	ifm->ifi_family = AF_UNSPEC;
+	err = dump(sock, a, nlh, link_cb);
+	if (err != LSDNE_OK)
+		return err;
+
+	err = dump(sock, a, tc_dump_msg(buf, RTM_GETQDISC, 0, 0), qdisc_cb);
+	if (err != LSDNE_OK)
+		return err;
+
+	/* Filters of the qdiscs bound to blocks are in the blocks */
+	struct adopt_qdisc *q, *tmp_q;
+	HASH_ITER(hh, a->qdiscs, q, tmp_q) {
+		if (q->blocks[0] || q->blocks[1])
+			continue;
+		err = dump_filters(sock, a, q->key.ifindex, q->key.handle);
+		if (err != LSDNE_OK)
+			return err;
+	}
+
+	struct adopt_block *b, *tmp_b;
+	HASH_ITER(hh, a->blocks, b, tmp_b) {
+		err = dump_filters(sock, a, TCM_IFINDEX_MAGIC_BLOCK, b->index);
+		if (err != LSDNE_OK)
+			return err;
+	}
+
+	/* The shared actions are dumped by their kind */
+	nlh = mnl_nlmsg_put_header(buf);
+	nlh->nlmsg_type = RTM_GETACTION;
+	struct tcamsg *tca = mnl_nlmsg_put_extra_header(nlh, sizeof(*tca));
+	tca->tca_family = AF_UNSPEC;
+	struct nlattr *tab = mnl_attr_nest_start(nlh, TCA_ACT_TAB);
+	struct nlattr *act = mnl_attr_nest_start(nlh, 1);
+	mnl_attr_put_strz(nlh, TCA_ACT_KIND, "tunnel_key");
+	mnl_attr_nest_end(nlh, act);
+	mnl_attr_nest_end(nlh, tab);
+	return dump(sock, a, nlh, action_cb);
+}
+
+lsdn_err_t lsdn_adopt_new(struct lsdn_nlsock *sock, const char *prefix, struct lsdn_adopt **result)
+{
+	struct lsdn_adopt *a = malloc(sizeof(*a));
+	if (!a)
+		return LSDNE_NOMEM;
+
+	a->links_by_index = NULL;
+	a->links_by_name = NULL;
+	a->qdiscs = NULL;
+	a->filters = NULL;
+	a->blocks = NULL;
+	a->actions = NULL;
+	a->nomem = false;
+	a->prefix = strdup(prefix);
+	if (!a->prefix) {
+		free(a);
+		return LSDNE_NOMEM;
+	}
+
+	lsdn_err_t err = snapshot(sock, a);
+	if (err != LSDNE_OK) {
+		lsdn_adopt_free(a);
+		return err;
+	}
+	*result = a;
+	return LSDNE_OK;
+}
+
+/** Start adopting the kernel state.
+ * From now on, the link, qdisc, filter and tunnel_key action requests made through the socket
+ * are only sent if the kernel does not have the same objects already. */
+lsdn_err_t lsdn_adopt_start(struct lsdn_nlsock *sock, const char *prefix)
+{
+	assert(!sock->adopt);
+	return lsdn_adopt_new(sock, prefix, &sock->adopt);
+}
+
+void lsdn_adopt_free(struct lsdn_adopt *a)
+{
+	struct adopt_link *l, *tmp_l;
+	HASH_ITER(hh_index, a->links_by_index, l, tmp_l) {
+		forget_link(a, l);
+	}
+	/* Qdiscs and filters of links that have disappeared since the snapshot */
+	struct adopt_qdisc *q, *tmp_q;
+	HASH_ITER(hh, a->qdiscs, q, tmp_q) {
+		forget_qdisc(a, q);
+	}
+	struct adopt_filter *f, *tmp_f;
+	HASH_ITER(hh, a->filters, f, tmp_f) {
+		HASH_DELETE(hh, a->filters, f);
+		free(f->msg);
+		free(f);
+	}
+	struct adopt_block *b, *tmp_b;
+	HASH_ITER(hh, a->blocks, b, tmp_b) {
+		HASH_DELETE(hh, a->blocks, b);
+		free(b);
+	}
+	struct adopt_action *x, *tmp_x;
+	HASH_ITER(hh, a->actions, x, tmp_x) {
+		HASH_DELETE(hh, a->actions, x);
+		free(x->attr);
+		free(x);
+	}
+	free(a->prefix);
+	free(a);
+}
+
+/* Matching the requests */
+
+enum lsdn_adopt_match lsdn_adopt_link(
+	struct lsdn_adopt *a, const struct nlmsghdr *req, unsigned int *ifindex)
+{
+	const struct nlattr *name = msg_attr(req, sizeof(struct ifinfomsg), IFLA_IFNAME);
+	if (!name)
+		return LSDN_ADOPT_MISSING;
+
+	struct adopt_link *l;
+	const char *str = mnl_attr_get_str(name);
+	HASH_FIND(hh_name, a->links_by_name, str, attr_strlen(name), l);
+	if (!l)
+		return LSDN_ADOPT_MISSING;
+
+	*ifindex = l->ifindex;
+	if (msg_match(req, l->msg, sizeof(struct ifinfomsg), link_rules)) {
+		l->adopted = true;
+		return LSDN_ADOPT_SAME;
+	}
+	/* The link is going to be deleted, along with everything attached to it */
+	forget_link(a, l);
+	return LSDN_ADOPT_DIFFERENT;
+}
+
+bool lsdn_adopt_link_attach(
+	struct lsdn_adopt *a, unsigned int ifindex, unsigned int master, bool up)
+{
+	struct adopt_link *l = find_link(a, ifindex);
+	if (!l)
+		return false;
+
+	bool same = l->master == master && (l->up || !up);
+	l->master = master;
+	l->up = l->up || up;
+	return same;
+}
+
+enum lsdn_adopt_match lsdn_adopt_qdisc(struct lsdn_adopt *a, const struct nlmsghdr *req)
+{
+	const struct tcmsg *tcm = mnl_nlmsg_get_payload(req);
+	uint32_t blocks[2] = {
+		msg_attr_u32(req, sizeof(*tcm), TCA_INGRESS_BLOCK),
+		msg_attr_u32(req, sizeof(*tcm), TCA_EGRESS_BLOCK)
+	};
+	for (int i = 0; i < 2; i++) {
+		struct adopt_block *b = blocks[i] ? find_block(a, blocks[i]) : NULL;
+		if (b)
+			b->used = true;
+	}
+
+	struct adopt_qdisc *q = find_qdisc(a, tcm->tcm_ifindex, tcm->tcm_handle);
+	if (!q)
+		return LSDN_ADOPT_MISSING;
+
+	if (msg_match(req, q->msg, sizeof(*tcm), qdisc_rules)) {
+		q->adopted = true;
+		return LSDN_ADOPT_SAME;
+	}
+	forget_qdisc(a, q);
+	return LSDN_ADOPT_DIFFERENT;
+}
+
+enum lsdn_adopt_match lsdn_adopt_filter(struct lsdn_adopt *a, const struct nlmsghdr *req)
+{
+	const struct tcmsg *tcm = mnl_nlmsg_get_payload(req);
+	struct lsdn_adopt_filter_key key = {
+		.ifindex = tcm->tcm_ifindex,
+		.parent = tcm->tcm_parent,
+		.chain = msg_attr_u32(req, sizeof(*tcm), TCA_CHAIN),
+		.prio = TC_H_MAJ(tcm->tcm_info) >> 16,
+		.handle = tcm->tcm_handle
+	};
+	struct adopt_filter *f;
+	HASH_FIND(hh, a->filters, &key, sizeof(key), f);
+	if (!f)
+		return LSDN_ADOPT_MISSING;
+
+	/* Either way, the filter now belongs to the model */
+	f->adopted = true;
+	const struct tcmsg *old = mnl_nlmsg_get_payload(f->msg);
+	const struct nlattr *kind = msg_attr(req, sizeof(*tcm), TCA_KIND);
+	const struct attr_rule *rules = filter_rules;
+	if (kind && attr_strlen(kind) == strlen("bpf")
+	    && memcmp(mnl_attr_get_payload(kind), "bpf", strlen("bpf")) == 0)
+		rules = bpf_filter_rules;
+	if (TC_H_MIN(old->tcm_info) == TC_H_MIN(tcm->tcm_info)
+	    && msg_match(req, f->msg, sizeof(*tcm), rules))
+		return LSDN_ADOPT_SAME;
+	return LSDN_ADOPT_DIFFERENT;
+}
+
+enum lsdn_adopt_match lsdn_adopt_action(struct lsdn_adopt *a, const struct nlmsghdr *req)
+{
+	const struct nlattr *tab = msg_attr(req, sizeof(struct tcamsg), TCA_ACT_TAB);
+	const struct nlattr *act = tab ? attr_find(
+		mnl_attr_get_payload(tab), mnl_attr_get_payload_len(tab), 1) : NULL;
+	if (!act)
+		return LSDN_ADOPT_MISSING;
+
+	uint32_t index = action_index(act);
+	struct adopt_action *x;
+	HASH_FIND(hh, a->actions, &index, sizeof(index), x);
+	/* Someone else's action is left for the request to collide with */
+	if (!x || !x->owned)
+		return LSDN_ADOPT_MISSING;
+
+	x->adopted = true;
+	if (attrs_match(mnl_attr_get_payload(act), mnl_attr_get_payload_len(act),
+	    mnl_attr_get_payload(x->attr), mnl_attr_get_payload_len(x->attr), act_rules))
+		return LSDN_ADOPT_SAME;
+	return LSDN_ADOPT_DIFFERENT;
+}
+
+/* Finishing */
+
+/* Only the filters of the qdiscs and blocks used by the model are cleaned up */
+static bool filter_owned(struct lsdn_adopt *a, struct adopt_filter *f)
+{
+	if (f->key.ifindex == TCM_IFINDEX_MAGIC_BLOCK) {
+		struct adopt_block *b = find_block(a, f->key.parent);
+		return b && b->used;
+	}
+	struct adopt_qdisc *q = find_qdisc(a, f->key.ifindex, f->key.parent);
+	return q && q->adopted;
+}
+
+/* Is the link named like the ones created by the context? */
+static bool link_owned(struct lsdn_adopt *a, struct adopt_link *l)
+{
+	size_t len = strlen(a->prefix);
+	if (strncmp(l->name, a->prefix, len) != 0 || l->name[len] != '-' || !l->name[len + 1])
+		return false;
+	for (const char *c = &l->name[len + 1]; *c; c++) {
+		if (!isdigit((unsigned char) *c))
+			return false;
+	}
+	return true;
+}
+
+static void record_failure(const struct nlmsghdr *nlh, int err, void *user)
+{
+	LSDN_UNUSED(nlh);
+	LSDN_UNUSED(err);
+	*(bool *) user = true;
+}
+
+/** Delete the leftovers of the previous context and stop adopting. */
+lsdn_err_t lsdn_adopt_finish(struct lsdn_nlsock *sock)
+{
+	struct lsdn_adopt *a = sock->adopt;
+	bool failed = false;
+	assert(a);
+	/* The deletes below must not be intercepted */
+	sock->adopt = NULL;
+
+	struct adopt_filter *f, *tmp_f;
+	HASH_ITER(hh, a->filters, f, tmp_f) {
+		if (f->adopted || !filter_owned(a, f))
+			continue;
+		lsdn_filter_delete_async(sock, f->key.ifindex, f->key.handle,
+			f->key.parent, f->key.chain, f->key.prio, record_failure, &failed);
+	}
+
+	/* After the filters, which might have used them */
+	struct adopt_action *x, *tmp_x;
+	HASH_ITER(hh, a->actions, x, tmp_x) {
+		if (!x->adopted && x->owned)
+			lsdn_tunnel_key_delete_async(sock, x->index, record_failure, &failed);
+	}
+
+	struct adopt_link *l, *tmp_l;
+	HASH_ITER(hh_index, a->links_by_index, l, tmp_l) {
+		if (!l->adopted && link_owned(a, l))
+			lsdn_link_delete_async(sock, l->ifindex, record_failure, &failed);
+	}
+
+	lsdn_err_t err = lsdn_nl_flush(sock);
+	lsdn_adopt_free(a);
+	if (err != LSDNE_OK)
+		return err;
+	return failed ? LSDNE_NETLINK : LSDNE_OK;
+}
+
+/* Auditing */
+
+bool lsdn_adopt_claim_tcf(struct lsdn_adopt *a, uint32_t ifindex, uint32_t parent)
+{
+	if (ifindex == TCM_IFINDEX_MAGIC_BLOCK) {
+		struct adopt_block *b = find_block(a, parent);
+		if (b)
+			b->used = true;
+		return b;
+	}
+	struct adopt_qdisc *q = find_qdisc(a, ifindex, parent);
+	if (q)
+		q->adopted = true;
+	return q;
+}
+
+bool lsdn_adopt_claim_clsact(struct lsdn_adopt *a, uint32_t ifindex, uint32_t blocks[2])
+{
+	struct adopt_qdisc *q = find_qdisc(a, ifindex, LSDN_INGRESS_HANDLE);
+	if (!q)
+		return false;
+	q->adopted = true;
+	blocks[0] = q->blocks[0];
+	blocks[1] = q->blocks[1];
+	return true;
+}
+
+const char *lsdn_adopt_claim_link(struct lsdn_adopt *a, unsigned int ifindex, unsigned int *master)
+{
+	struct adopt_link *l = find_link(a, ifindex);
+	if (!l)
+		return NULL;
+	l->adopted = true;
+	if (master)
+		*master = l->master;
+	return l->name;
+}
+
+const char *lsdn_adopt_link_name(struct lsdn_adopt *a, unsigned int ifindex)
+{
+	struct adopt_link *l = find_link(a, ifindex);
+	return l ? l->name : NULL;
+}
+
+void lsdn_adopt_foreach_extra_filter(struct lsdn_adopt *a, lsdn_adopt_filter_cb cb, void *user)
+{
+	struct adopt_filter *f, *tmp;
+	HASH_ITER(hh, a->filters, f, tmp) {
+		if (!f->adopted && filter_owned(a, f))
+			cb(&f->key, user);
+	}
+}
+
+void lsdn_adopt_foreach_extra_link(struct lsdn_adopt *a, lsdn_adopt_link_cb cb, void *user)
+{
+	struct adopt_link *l, *tmp;
+	HASH_ITER(hh_index, a->links_by_index, l, tmp) {
+		if (!l->adopted && link_owned(a, l))
+			cb(l->ifindex, l->name, user);
+	}
+}
@@ -0,0 +1,432 @@
+/** \file
+ * Comparing the kernel state with the committed model (drift detection).
+ *
+ * Someone else may change the kernel objects LSDN has set up behind its back: delete a qdisc,
+ * replace a filter, move an interface to a different bridge or add leftovers of an old context.
+ * `lsdn_audit` takes a snapshot of the kernel (the same as `lsdn_context_warm_restart`) and lets
+ * the parts of the model holding kernel objects compare themselves with it. Everything the model
+ * finds is claimed, what is left of the context's own interfaces and filters is extra. */
+#include "private/audit.h"
+#include "private/lsdn.h"
+#include "private/net.h"
+#include "private/errors.h"
+#include "include/lsdn.h"
+#include <uthash.h>
+#include <libmnl/libmnl.h>
+#include <linux/rtnetlink.h>
+#include <linux/neighbour.h>
+#include <linux/pkt_sched.h>
+#include <linux/pkt_cls.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+struct audit_fdb_key {
+	unsigned int ifindex;
+	uint8_t mac[6];
+	uint8_t dst_len;
+	uint8_t dst[16];
+};
+
+struct audit_fdb {
+	struct audit_fdb_key key;
+	UT_hash_handle hh;
+};
+
+struct audit_missing_key {
+	/** Interface index or `TCM_IFINDEX_MAGIC_BLOCK` */
+	uint32_t ifindex;
+	/** Qdisc handle or block index, zero for the interface itself */
+	uint32_t parent;
+};
+
+struct audit_missing {
+	struct audit_missing_key key;
+	enum lsdn_audit_tcf verdict;
+	UT_hash_handle hh;
+};
+
+/* Enough for "chain 4294967295 prio 65535 handle 0xffffffff" */
+#define FILTER_DESC_LEN 64
+/* Enough for "block 4294967295" */
+#define TCF_DESC_LEN (IF_NAMESIZE + 16)
+
+static void fdb_key_init(struct audit_fdb_key *key, unsigned int ifindex,
+	const uint8_t *mac, const void *dst, size_t dst_len)
+{
+	bzero(key, sizeof(*key));
+	key->ifindex = ifindex;
+	memcpy(key->mac, mac, sizeof(key->mac));
+	key->dst_len = dst_len;
+	if (dst_len)
+		memcpy(key->dst, dst, dst_len);
+}
+
+static int fdb_cb(const struct nlmsghdr *nlh, void *user)
+{
+	struct lsdn_audit *audit = user;
+	const struct ndmsg *nd = mnl_nlmsg_get_payload(nlh);
+	const struct nlattr *attr, *lladdr = NULL, *dst = NULL;
+	mnl_attr_for_each(attr, nlh, sizeof(*nd)) {
+		if (mnl_attr_get_type(attr) == NDA_LLADDR)
+			lladdr = attr;
+		else if (mnl_attr_get_type(attr) == NDA_DST)
+			dst = attr;
+	}
+	if (!lladdr || mnl_attr_get_payload_len(lladdr) != 6
+	    || (dst && mnl_attr_get_payload_len(dst) > 16))
+		return MNL_CB_OK;
+
+	struct audit_fdb *e = malloc(sizeof(*e));
+	if (!e) {
+		audit->nomem = true;
+		return MNL_CB_ERROR;
+	}
+	fdb_key_init(&e->key, nd->ndm_ifindex, mnl_attr_get_payload(lladdr),
+		dst ? mnl_attr_get_payload(dst) : NULL, dst ? mnl_attr_get_payload_len(dst) : 0);
+	struct audit_fdb *old;
+	HASH_FIND(hh, audit->fdb, &e->key, sizeof(e->key), old);
+	if (old)
+		free(e);
+	else
+		HASH_ADD(hh, audit->fdb, key, sizeof(e->key), e);
+	return MNL_CB_OK;
+}
+
+static lsdn_err_t fdb_snapshot(struct lsdn_audit *audit)
+{
+	char buf[MNL_SOCKET_BUFFER_SIZE];
+	struct nlmsghdr *nlh = mnl_nlmsg_put_header(buf);
+	nlh->nlmsg_type = RTM_GETNEIGH;
+	struct ndmsg *nd = mnl_nlmsg_put_extra_header(nlh, sizeof(*nd));
+	nd->ndm_family = PF_BRIDGE;
+	lsdn_err_t err = lsdn_nl_dump(audit->ctx->nlsock, nlh, fdb_cb, audit);
+	return audit->nomem ? LSDNE_NOMEM : err;
+}
+
+static void audit_free(struct lsdn_audit *audit)
+{
+	struct audit_fdb *e, *tmp_e;
+	HASH_ITER(hh, audit->fdb, e, tmp_e) {
+		HASH_DEL(audit->fdb, e);
+		free(e);
+	}
+	struct audit_missing *m, *tmp_m;
+	HASH_ITER(hh, audit->missing, m, tmp_m) {
+		HASH_DEL(audit->missing, m);
+		free(m);
+	}
+	if (audit->snapshot)
+		lsdn_adopt_free(audit->snapshot);
+}
+
+/* Remember a missing object, so that it is reported only once.
+ * @return NULL if already reported. */
+static struct audit_missing *add_missing(
+	struct lsdn_audit *audit, uint32_t ifindex, uint32_t parent, enum lsdn_audit_tcf *verdict)
+{
+	struct audit_missing_key key = {ifindex, parent};
+	struct audit_missing *m;
+	HASH_FIND(hh, audit->missing, &key, sizeof(key), m);
+	if (m) {
+		*verdict = m->verdict;
+		return NULL;
+	}
+	m = malloc(sizeof(*m));
+	if (!m)
+		abort();
+	m->key = key;
+	m->verdict = LSDN_AUDIT_SKIP;
+	HASH_ADD(hh, audit->missing, key, sizeof(m->key), m);
+	return m;
+}
+
+/* Claim the interface, report it once if missing */
+static bool claim_link(struct lsdn_audit *audit, struct lsdn_if *iface, unsigned int *master)
+{
+	if (lsdn_adopt_claim_link(audit->snapshot, iface->ifindex, master))
+		return true;
+	enum lsdn_audit_tcf verdict;
+	if (add_missing(audit, iface->ifindex, 0, &verdict))
+		lsdn_problem_report(audit->ctx, LSDNP_KERNEL_NOIF, LSDNS_IF, iface, LSDNS_END);
+	return false;
+}
+
+void lsdn_audit_link(struct lsdn_audit *audit, struct lsdn_if *iface, struct lsdn_if *master)
+{
+	unsigned int current;
+	if (!claim_link(audit, iface, &current) || !master || current == master->ifindex)
+		return;
+	lsdn_problem_report(audit->ctx, LSDNP_KERNEL_NOMASTER,
+		LSDNS_IF, iface, LSDNS_IF, master, LSDNS_END);
+	if (audit->repair)
+		lsdn_link_set_master_async(audit->ctx->nlsock, master->ifindex, iface->ifindex, true,
+			lsdn_nl_problem_cb, audit->ctx);
+}
+
+enum lsdn_audit_tcf lsdn_audit_tcf(struct lsdn_audit *audit, struct lsdn_if *iface, uint32_t parent)
+{
+	char desc[TCF_DESC_LEN];
+	enum lsdn_audit_tcf verdict = LSDN_AUDIT_SKIP;
+	struct audit_missing *m;
+
+	if (!iface) {
+		if (lsdn_adopt_claim_tcf(audit->snapshot, TCM_IFINDEX_MAGIC_BLOCK, parent))
+			return LSDN_AUDIT_CHECK;
+		/* A block lives as long as a qdisc is bound to it, it can not be created alone */
+		if ((m = add_missing(audit, TCM_IFINDEX_MAGIC_BLOCK, parent, &verdict))) {
+			snprintf(desc, sizeof(desc), "%u", parent);
+			lsdn_problem_report(audit->ctx, LSDNP_KERNEL_NOBLOCK,
+				LSDNS_ATTR, desc, LSDNS_END);
+		}
+		return verdict;
+	}
+
+	if (!claim_link(audit, iface, NULL))
+		return LSDN_AUDIT_SKIP;
+	if (lsdn_adopt_claim_tcf(audit->snapshot, iface->ifindex, parent))
+		return LSDN_AUDIT_CHECK;
+	if (!(m = add_missing(audit, iface->ifindex, parent, &verdict)))
+		return verdict;
+
+	bool ingress = parent == LSDN_INGRESS_HANDLE;
+	lsdn_problem_report(audit->ctx, LSDNP_KERNEL_NOQDISC,
+		LSDNS_ATTR, ingress ? "ingress" : "root", LSDNS_IF, iface, LSDNS_END);
+	if (!audit->repair)
+		return LSDN_AUDIT_SKIP;
+	if (ingress)
+		lsdn_qdisc_ingress_create_async(
+			audit->ctx->nlsock, iface->ifindex, lsdn_nl_problem_cb, audit->ctx);
+	else
+		lsdn_qdisc_egress_create_async(
+			audit->ctx->nlsock, iface->ifindex, lsdn_nl_problem_cb, audit->ctx);
+	m->verdict = LSDN_AUDIT_RESEND;
+	return LSDN_AUDIT_RESEND;
+}
+
+/* A missing block is created again with the first qdisc bound to it, by the repair. Its filters
+ * must be sent again when the rulesets in it are audited. */
+static void resend_block(struct lsdn_audit *audit, uint32_t block)
+{
+	char desc[TCF_DESC_LEN];
+	enum lsdn_audit_tcf verdict;
+	struct audit_missing *m;
+	if (lsdn_adopt_claim_tcf(audit->snapshot, TCM_IFINDEX_MAGIC_BLOCK, block))
+		return;
+	if (!(m = add_missing(audit, TCM_IFINDEX_MAGIC_BLOCK, block, &verdict)))
+		return;
+	snprintf(desc, sizeof(desc), "%u", block);
+	lsdn_problem_report(audit->ctx, LSDNP_KERNEL_NOBLOCK, LSDNS_ATTR, desc, LSDNS_END);
+	m->verdict = LSDN_AUDIT_RESEND;
+}
+
+void lsdn_audit_clsact(struct lsdn_audit *audit, struct lsdn_if *iface,
+	uint32_t block_in, uint32_t block_out)
+{
+	char desc[TCF_DESC_LEN];
+	uint32_t blocks[2];
+	if (!claim_link(audit, iface, NULL))
+		return;
+	bool present = lsdn_adopt_claim_clsact(audit->snapshot, iface->ifindex, blocks);
+	if (present && blocks[0] == block_in && blocks[1] == block_out)
+		return;
+
+	if (!present) {
+		lsdn_problem_report(audit->ctx, LSDNP_KERNEL_NOQDISC,
+			LSDNS_ATTR, "clsact", LSDNS_IF, iface, LSDNS_END);
+	} else {
+		snprintf(desc, sizeof(desc), "%u", blocks[0] != block_in ? block_in : block_out);
+		lsdn_problem_report(audit->ctx, LSDNP_KERNEL_NOBINDING,
+			LSDNS_IF, iface, LSDNS_ATTR, desc, LSDNS_END);
+	}
+	if (!audit->repair)
+		return;
+	/* The blocks bound instead are not ours, nothing is lost by unbinding them */
+	if (present)
+		lsdn_qdisc_clsact_delete_async(audit->ctx->nlsock, iface->ifindex, lsdn_nl_problem_cb, audit->ctx);
+	lsdn_qdisc_clsact_create_async(
+		audit->ctx->nlsock, iface->ifindex, block_in, block_out, lsdn_nl_problem_cb, audit->ctx);
+	resend_block(audit, block_in);
+	resend_block(audit, block_out);
+}
+
+/* Describe where the filter is attached, for the problem report */
+static void format_tcf(struct lsdn_audit *audit, char *buf, uint32_t ifindex, uint32_t parent)
+{
+	const char *name = lsdn_adopt_link_name(audit->snapshot, ifindex);
+	if (ifindex == TCM_IFINDEX_MAGIC_BLOCK)
+		snprintf(buf, TCF_DESC_LEN, "block %u", parent);
+	else if (name)
+		snprintf(buf, TCF_DESC_LEN, "%s", name);
+	else
+		snprintf(buf, TCF_DESC_LEN, "ifindex %u", ifindex);
+}
+
+static void format_filter(char *buf, const struct lsdn_adopt_filter_key *key)
+{
+	snprintf(buf, FILTER_DESC_LEN, "chain %u prio %u handle 0x%x",
+		key->chain, key->prio, key->handle);
+}
+
+static void report_filter(struct lsdn_audit *audit, enum lsdn_problem_code code,
+	const struct lsdn_adopt_filter_key *key)
+{
+	char filter[FILTER_DESC_LEN];
+	char tcf[TCF_DESC_LEN];
+	format_filter(filter, key);
+	format_tcf(audit, tcf, key->ifindex, key->parent);
+	lsdn_problem_report(audit->ctx, code, LSDNS_ATTR, filter, LSDNS_ATTR, tcf, LSDNS_END);
+}
+
+bool lsdn_audit_filter(struct lsdn_audit *audit, struct lsdn_filter *filter)
+{
+	enum lsdn_adopt_match match = lsdn_filter_match(filter, audit->snapshot);
+	if (match == LSDN_ADOPT_SAME)
+		return false;
+
+	const struct tcmsg *tcm = mnl_nlmsg_get_payload(filter->nlh);
+	struct lsdn_adopt_filter_key key = {
+		.ifindex = tcm->tcm_ifindex,
+		.parent = tcm->tcm_parent,
+		.chain = 0,
+		.prio = TC_H_MAJ(tcm->tcm_info) >> 16,
+		.handle = tcm->tcm_handle
+	};
+	const struct nlattr *attr;
+	mnl_attr_for_each(attr, filter->nlh, sizeof(*tcm)) {
+		if (mnl_attr_get_type(attr) == TCA_CHAIN)
+			key.chain = mnl_attr_get_u32(attr);
+	}
+	report_filter(audit, match == LSDN_ADOPT_MISSING
+		? LSDNP_KERNEL_NOFILTER : LSDNP_KERNEL_CHANGED_FILTER, &key);
+	return audit->repair;
+}
+
+void lsdn_audit_fdb(struct lsdn_audit *audit, struct lsdn_if *iface, lsdn_mac_t mac, lsdn_ip_t ip)
+{
+	struct audit_fdb_key key;
+	struct audit_fdb *e;
+	if (ip.v == LSDN_IPv4)
+		fdb_key_init(&key, iface->ifindex, mac.bytes, ip.v4.bytes, sizeof(ip.v4.bytes));
+	else
+		fdb_key_init(&key, iface->ifindex, mac.bytes, ip.v6.bytes, sizeof(ip.v6.bytes));
+	HASH_FIND(hh, audit->fdb, &key, sizeof(key), e);
+	if (e)
+		return;
+
+	char ip_str[INET6_ADDRSTRLEN];
+	lsdn_ip_to_string(&ip, ip_str);
+	lsdn_problem_report(audit->ctx, LSDNP_KERNEL_NOROUTE,
+		LSDNS_ATTR, ip_str, LSDNS_IF, iface, LSDNS_END);
+	if (audit->repair)
+		lsdn_fdb_add_entry_async(audit->ctx->nlsock, iface->ifindex, mac, ip,
+			lsdn_nl_problem_cb, audit->ctx);
+}
+
+/* The clsact qdiscs binding the virts to the shared blocks. Must run before the rulesets are
+ * audited, so that the filters of the blocks recreated by the repair are sent again. */
+static void audit_shared_blocks(struct lsdn_audit *audit)
+{
+	lsdn_foreach(audit->ctx->networks_list, networks_entry, struct lsdn_net, net) {
+		lsdn_foreach(net->virt_list, virt_entry, struct lsdn_virt, v) {
+			if (!v->committed_to || !v->in_shared_blocks)
+				continue;
+			lsdn_audit_clsact(audit, &v->committed_if,
+				v->committed_to->shared_rules_in.block,
+				v->committed_to->shared_rules_out.block);
+		}
+	}
+}
+
+static void audit_remote_pas(struct lsdn_audit *audit)
+{
+	lsdn_foreach(audit->ctx->networks_list, networks_entry, struct lsdn_net, net) {
+		struct lsdn_net_ops *ops = net->settings->ops;
+		if (!ops->audit_remote_pa)
+			continue;
+		/* Only the committed local PAs have their remote PAs */
+		lsdn_foreach(net->attached_list, attached_entry, struct lsdn_phys_attachment, pa) {
+			lsdn_foreach(pa->remote_pa_list, remote_pa_entry, struct lsdn_remote_pa, rpa) {
+				ops->audit_remote_pa(rpa, audit);
+			}
+		}
+	}
+}
+
+static void extra_filter(const struct lsdn_adopt_filter_key *key, void *user)
+{
+	struct lsdn_audit *audit = user;
+	report_filter(audit, LSDNP_KERNEL_EXTRA_FILTER, key);
+	if (audit->repair)
+		lsdn_filter_delete_async(audit->ctx->nlsock, key->ifindex, key->handle,
+			key->parent, key->chain, key->prio, lsdn_nl_problem_cb, audit->ctx);
+}
+
+static void extra_link(unsigned int ifindex, const char *name, void *user)
+{
+	struct lsdn_audit *audit = user;
+	lsdn_problem_report(audit->ctx, LSDNP_KERNEL_EXTRA_IF, LSDNS_ATTR, name, LSDNS_END);
+	if (audit->repair)
+		lsdn_link_delete_async(audit->ctx->nlsock, ifindex, lsdn_nl_problem_cb, audit->ctx);
+}
+
+/** Compare the kernel state with the committed model.
+ * Reports the interfaces, qdiscs, filters and fdb entries the last commit has set up but are now
+ * missing or different in the kernel, and the interfaces (named by the context) and filters
+ * (on the qdiscs and blocks of the model) the model does not know about. If `repair` is set,
+ * the differences are fixed, except for missing interfaces, which need the model to be
+ * recommitted. Missing shared blocks are created again by rebinding the virts to them.
+ *
+ * The changes made to the model since the last commit are not taken into account, call after
+ * `lsdn_commit`.
+ * @param ctx LSDN context.
+ * @param repair Fix the differences found.
+ * @param cb Called for each difference found.
+ * @param user Passed to `cb`.
+ * @retval LSDNE_OK The kernel matches the model.
+ * @retval LSDNE_DRIFT Some differences were found (and repaired, if asked).
+ * @retval LSDNE_NETLINK The kernel state could not be read.
+ * @retval LSDNE_NOMEM Allocation failed. */
+lsdn_err_t lsdn_audit(struct lsdn_context *ctx, bool repair, lsdn_problem_cb cb, void *user)
+{
+	struct lsdn_audit audit = {
+		.ctx = ctx,
+		.snapshot = NULL,
+		.fdb = NULL,
+		.missing = NULL,
+		.repair = repair,
+		.nomem = false
+	};
+	ctx->problem_cb = cb;
+	ctx->problem_cb_user = user;
+	ctx->problem_count = 0;
+
+	lsdn_err_t err = lsdn_adopt_new(ctx->nlsock, ctx->name, &audit.snapshot);
+	if (err == LSDNE_OK)
+		err = fdb_snapshot(&audit);
+	if (err != LSDNE_OK) {
+		audit_free(&audit);
+		ret_err(ctx, err);
+	}
+
+	lsdn_lbridge_audit(ctx, &audit);
+	audit_shared_blocks(&audit);
+	lsdn_ruleset_audit(ctx, &audit);
+	lsdn_broadcast_audit(ctx, &audit);
+	lsdn_bpf_filter_audit(ctx, &audit);
+	audit_remote_pas(&audit);
+	lsdn_adopt_foreach_extra_filter(audit.snapshot, extra_filter, &audit);
+	lsdn_adopt_foreach_extra_link(audit.snapshot, extra_link, &audit);
+
+	if (repair) {
+		lsdn_bpf_filter_flush(ctx);
+		lsdn_ruleset_flush(ctx);
+		lsdn_broadcast_flush(ctx);
+		if (lsdn_nl_flush(ctx->nlsock) != LSDNE_OK)
+			abort();
+	}
+	audit_free(&audit);
+	return (ctx->problem_count == 0) ? LSDNE_OK : LSDNE_DRIFT;
+}
@@ -0,0 +1,98 @@
+/** \file
+ * Creating eBPF maps and programs, see `lsdn_bpf_map_create` and `lsdn_bpf_prog_load`. */
+#include "private/bpf.h"
+#include "private/nl.h"
+#include "include/util.h"
+#include <errno.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+static uint64_t ptr_to_u64(const void *ptr)
+{
+	return (uint64_t) (uintptr_t) ptr;
+}
+
+static int bpf_cmd(struct lsdn_nlsock *sock, int cmd, union bpf_attr *attr)
+{
+	long ret = sock->backend->bpf(sock, cmd, attr, sizeof(*attr));
+	return ret < 0 ? -errno : (int) ret;
+}
+
+int lsdn_bpf_map_create(struct lsdn_nlsock *sock, enum bpf_map_type type,
+	uint32_t key_size, uint32_t value_size, uint32_t max_entries, uint32_t flags)
+{
+	union bpf_attr attr;
+	bzero(&attr, sizeof(attr));
+	attr.map_type = type;
+	attr.key_size = key_size;
+	attr.value_size = value_size;
+	attr.max_entries = max_entries;
+	attr.map_flags = flags;
+	return bpf_cmd(sock, BPF_MAP_CREATE, &attr);
+}
+
+int lsdn_bpf_map_update(struct lsdn_nlsock *sock, int fd, const void *key, const void *value)
+{
+	union bpf_attr attr;
+	bzero(&attr, sizeof(attr));
+	attr.map_fd = fd;
+	attr.key = ptr_to_u64(key);
+	attr.value = ptr_to_u64(value);
+	attr.flags = BPF_ANY;
+	return bpf_cmd(sock, BPF_MAP_UPDATE_ELEM, &attr);
+}
+
+int lsdn_bpf_map_delete(struct lsdn_nlsock *sock, int fd, const void *key)
+{
+	union bpf_attr attr;
+	bzero(&attr, sizeof(attr));
+	attr.map_fd = fd;
+	attr.key = ptr_to_u64(key);
+	return bpf_cmd(sock, BPF_MAP_DELETE_ELEM, &attr);
+}
+
+int lsdn_bpf_prog_load(struct lsdn_nlsock *sock, const struct bpf_insn *insns, size_t count,
+	uint32_t *id)
+{
+	union bpf_attr attr;
+	bzero(&attr, sizeof(attr));
+	attr.prog_type = BPF_PROG_TYPE_SCHED_CLS;
+	attr.insns = ptr_to_u64(insns);
+	attr.insn_cnt = count;
+	attr.license = ptr_to_u64("GPL");
+	int fd = bpf_cmd(sock, BPF_PROG_LOAD, &attr);
+	if (fd < 0)
+		return fd;
+
+	struct bpf_prog_info info;
+	bzero(&info, sizeof(info));
+	bzero(&attr, sizeof(attr));
+	attr.info.bpf_fd = fd;
+	attr.info.info_len = sizeof(info);
+	attr.info.info = ptr_to_u64(&info);
+	int err = bpf_cmd(sock, BPF_OBJ_GET_INFO_BY_FD, &attr);
+	if (err < 0) {
+		lsdn_bpf_close(sock, fd);
+		return err;
+	}
+	*id = info.id;
+	return fd;
+}
+
+void lsdn_bpf_close(struct lsdn_nlsock *sock, int fd)
+{
+	sock->backend->bpf_close(sock, fd);
+}
+
+long lsdn_bpf_kernel(struct lsdn_nlsock *sock, int cmd, union bpf_attr *attr, unsigned int size)
+{
+	LSDN_UNUSED(sock);
+	return syscall(__NR_bpf, cmd, attr, size);
+}
+
+void lsdn_bpf_kernel_close(struct lsdn_nlsock *sock, int fd)
+{
+	LSDN_UNUSED(sock);
+	close(fd);
+}
@@ -7,6 +7,7 @@
 #include <assert.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <string.h>
 #include "private/lsdn.h"
 
 
@@ -106,6 +107,14 @@ void lsdn_problem_report(struct lsdn_context *ctx, enum lsdn_problem_code code,
 	ctx->problem_count++;
 }
 
+void lsdn_nl_problem_cb(const struct nlmsghdr *nlh, int err, void *user)
+{
+	char desc[LSDN_NL_DESC_LEN];
+	lsdn_nl_describe(nlh, desc, sizeof(desc));
+	lsdn_problem_report(user, LSDNP_KERNEL_REJECTED,
+		LSDNS_ATTR, desc, LSDNS_ATTR, strerror(-err), LSDNS_END);
+}
+
 void lsdn_problem_stderr_handler(const struct lsdn_problem *problem, void *user)
 {
 	lsdn_problem_format(stderr, problem);
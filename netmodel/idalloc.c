@@ -1,28 +1,141 @@
 /** \file
  * ID allocation routines. */
 #include "private/idalloc.h"
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
 
-/** Set up an ID allocator. */
+#define WORD_BITS 64
+#define FULL_WORD (~(uint64_t) 0)
+
+static size_t words_for(size_t bits)
+{
+	return (bits + WORD_BITS - 1) / WORD_BITS;
+}
+
+/** Set up an ID allocator.
+ * IDs from `min` (inclusive) to `max` (exclusive) will be given out. No memory is allocated
+ * until the first ID is requested. */
 void lsdn_idalloc_init(struct lsdn_idalloc *idalloc, uint32_t min, uint32_t max)
 {
+	assert(min <= max);
 	idalloc->min = min;
 	idalloc->max = max;
-	idalloc->next = min;
+	idalloc->used = NULL;
+	idalloc->full = NULL;
+	idalloc->words = 0;
+	idalloc->allocated = 0;
+	idalloc->peak = 0;
 }
 
-/** Allocate a new ID. */
-bool lsdn_idalloc_get(struct lsdn_idalloc *idalloc, uint32_t *result) {
-	if (idalloc->max ==  idalloc->next)
+/** Double the size of the bitmap (up to the size of the whole range). */
+static bool grow(struct lsdn_idalloc *idalloc)
+{
+	size_t max_words = words_for(idalloc->max - idalloc->min);
+	size_t old_words = idalloc->words;
+	if (old_words == max_words)
 		return false;
-	*result = idalloc->next++;
+	size_t new_words = old_words ? old_words * 2 : 1;
+	if (new_words > max_words)
+		new_words = max_words;
+
+	uint64_t *used = realloc(idalloc->used, new_words * sizeof(*used));
+	if (!used)
+		return false;
+	idalloc->used = used;
+	memset(used + old_words, 0, (new_words - old_words) * sizeof(*used));
+
+	size_t old_full_words = words_for(old_words);
+	size_t new_full_words = words_for(new_words);
+	if (new_full_words != old_full_words) {
+		uint64_t *full = realloc(idalloc->full, new_full_words * sizeof(*full));
+		if (!full)
+			return false;
+		idalloc->full = full;
+		memset(full + old_full_words, 0, (new_full_words - old_full_words) * sizeof(*full));
+	}
+	idalloc->words = new_words;
+
+	/* Mark the IDs past the end of the range as used, so that they are never given out */
+	size_t tail_bits = (idalloc->max - idalloc->min) % WORD_BITS;
+	if (new_words == max_words && tail_bits != 0)
+		used[new_words - 1] |= FULL_WORD << tail_bits;
+	return true;
+}
+
+/** Allocate the lowest free ID.
+ * @return false if all IDs are in use (or the bitmap could not be grown). */
+bool lsdn_idalloc_get(struct lsdn_idalloc *idalloc, uint32_t *result)
+{
+	size_t w = idalloc->words;
+	for (size_t f = 0; f < words_for(idalloc->words); f++) {
+		if (idalloc->full[f] != FULL_WORD) {
+			w = f * WORD_BITS + __builtin_ctzll(~idalloc->full[f]);
+			break;
+		}
+	}
+	if (w >= idalloc->words) {
+		/* All words are full, the new ones start empty */
+		w = idalloc->words;
+		if (!grow(idalloc))
+			return false;
+	}
+
+	uint64_t *word = &idalloc->used[w];
+	unsigned bit = __builtin_ctzll(~*word);
+	*word |= (uint64_t) 1 << bit;
+	if (*word == FULL_WORD)
+		idalloc->full[w / WORD_BITS] |= (uint64_t) 1 << (w % WORD_BITS);
+
+	idalloc->allocated++;
+	if (idalloc->allocated > idalloc->peak)
+		idalloc->peak = idalloc->allocated;
+	*result = idalloc->min + w * WORD_BITS + bit;
 	return true;
 }
 
-void lsdn_idalloc_return(struct lsdn_idalloc *idalloc, uint32_t id) {
-	// TODO
+/** Return an ID to the allocator, so that it can be given out again. */
+void lsdn_idalloc_return(struct lsdn_idalloc *idalloc, uint32_t id)
+{
+	assert(id >= idalloc->min && id < idalloc->max);
+	size_t offset = id - idalloc->min;
+	size_t w = offset / WORD_BITS;
+	uint64_t mask = (uint64_t) 1 << (offset % WORD_BITS);
+	assert(w < idalloc->words && (idalloc->used[w] & mask));
+
+	idalloc->used[w] &= ~mask;
+	idalloc->full[w / WORD_BITS] &= ~((uint64_t) 1 << (w % WORD_BITS));
+	idalloc->allocated--;
+}
+
+/** Fill in the statistics of the allocator.
+ * Takes time proportional to the size of the bitmap, intended for diagnostics only. */
+void lsdn_idalloc_get_stats(struct lsdn_idalloc *idalloc, struct lsdn_idalloc_stats *stats)
+{
+	size_t range = idalloc->max - idalloc->min;
+	stats->allocated = idalloc->allocated;
+	stats->peak = idalloc->peak;
+	stats->capacity = idalloc->words * WORD_BITS < range ? idalloc->words * WORD_BITS : range;
+	stats->span = 0;
+
+	for (size_t w = idalloc->words; w > 0; w--) {
+		uint64_t word = idalloc->used[w - 1];
+		/* Ignore the padding past the end of the range */
+		if (w * WORD_BITS > range)
+			word &= ~(FULL_WORD << (range % WORD_BITS));
+		if (word) {
+			stats->span = (w - 1) * WORD_BITS + (WORD_BITS - __builtin_clzll(word));
+			break;
+		}
+	}
 }
 
 /** Free the ID allocator. */
-void lsdn_idalloc_free(struct lsdn_idalloc *idalloc) {
-	// TODO
+void lsdn_idalloc_free(struct lsdn_idalloc *idalloc)
+{
+	free(idalloc->used);
+	free(idalloc->full);
+	idalloc->used = NULL;
+	idalloc->full = NULL;
+	idalloc->words = 0;
 }
@@ -0,0 +1,154 @@
+/** \file
+ * Routines for tracking the network interfaces present in the kernel. */
+#include "private/iftable.h"
+#include <libmnl/libmnl.h>
+#include <linux/rtnetlink.h>
+#include <string.h>
+#include <stdlib.h>
+
+/** Set up an empty table. */
+void lsdn_iftable_init(struct lsdn_iftable *t)
+{
+	t->by_index = NULL;
+	t->by_name = NULL;
+	t->generation = 0;
+	t->synced = false;
+	t->removed = 0;
+}
+
+static void entry_free(struct lsdn_iftable *t, struct lsdn_ifentry *e)
+{
+	HASH_DELETE(hh_index, t->by_index, e);
+	HASH_DELETE(hh_name, t->by_name, e);
+	free(e);
+}
+
+/** Remove all interfaces from the table. */
+void lsdn_iftable_free(struct lsdn_iftable *t)
+{
+	struct lsdn_ifentry *e, *tmp;
+	HASH_ITER(hh_index, t->by_index, e, tmp) {
+		entry_free(t, e);
+	}
+	t->synced = false;
+}
+
+static struct lsdn_ifentry *find_index(struct lsdn_iftable *t, unsigned int ifindex)
+{
+	struct lsdn_ifentry *e;
+	HASH_FIND(hh_index, t->by_index, &ifindex, sizeof(ifindex), e);
+	return e;
+}
+
+static struct lsdn_ifentry *find_name(struct lsdn_iftable *t, const char *name)
+{
+	struct lsdn_ifentry *e;
+	HASH_FIND(hh_name, t->by_name, name, strlen(name), e);
+	return e;
+}
+
+/** Record that an interface exists, or that it was renamed. */
+lsdn_err_t lsdn_iftable_set(struct lsdn_iftable *t, unsigned int ifindex, const char *name)
+{
+	if (strlen(name) >= IFNAMSIZ)
+		return LSDNE_PARSE;
+
+	struct lsdn_ifentry *e = find_index(t, ifindex);
+	if (e && strcmp(e->name, name) != 0) {
+		HASH_DELETE(hh_name, t->by_name, e);
+	} else if (e) {
+		e->generation = t->generation;
+		return LSDNE_OK;
+	} else {
+		e = malloc(sizeof(*e));
+		if (!e)
+			return LSDNE_NOMEM;
+		e->ifindex = ifindex;
+		HASH_ADD(hh_index, t->by_index, ifindex, sizeof(e->ifindex), e);
+	}
+
+	/* The name might have been taken over before we learned that its owner is gone */
+	struct lsdn_ifentry *old = find_name(t, name);
+	if (old) {
+		entry_free(t, old);
+		t->removed++;
+	}
+
+	strcpy(e->name, name);
+	e->generation = t->generation;
+	HASH_ADD_KEYPTR(hh_name, t->by_name, e->name, strlen(e->name), e);
+	return LSDNE_OK;
+}
+
+/** Record that an interface was deleted. */
+void lsdn_iftable_remove(struct lsdn_iftable *t, unsigned int ifindex)
+{
+	struct lsdn_ifentry *e = find_index(t, ifindex);
+	if (!e)
+		return;
+	entry_free(t, e);
+	t->removed++;
+}
+
+/** Start refreshing the table from a full listing. */
+void lsdn_iftable_resync_start(struct lsdn_iftable *t)
+{
+	t->generation++;
+}
+
+/** Finish refreshing the table, dropping the interfaces that were not listed. */
+void lsdn_iftable_resync_end(struct lsdn_iftable *t)
+{
+	struct lsdn_ifentry *e, *tmp;
+	HASH_ITER(hh_index, t->by_index, e, tmp) {
+		if (e->generation != t->generation) {
+			entry_free(t, e);
+			t->removed++;
+		}
+	}
+	t->synced = true;
+}
+
+/** Find the ifindex of an interface.
+ * @return 0 if there is no such interface. */
+unsigned int lsdn_iftable_find(struct lsdn_iftable *t, const char *name)
+{
+	struct lsdn_ifentry *e = find_name(t, name);
+	return e ? e->ifindex : 0;
+}
+
+/** Check if an interface is (still) present. */
+bool lsdn_iftable_has(struct lsdn_iftable *t, unsigned int ifindex)
+{
+	return find_index(t, ifindex) != NULL;
+}
+
+static int ifname_cb(const struct nlattr *attr, void *data)
+{
+	const char **name = data;
+	if (mnl_attr_get_type(attr) == IFLA_IFNAME)
+		*name = mnl_attr_get_str(attr);
+	return MNL_CB_OK;
+}
+
+/** Update the table from a `RTM_NEWLINK` or `RTM_DELLINK` message.
+ * Can be used as a `mnl_cb_t` callback for both the dumps and the notifications, the table being
+ * the callback data. */
+int lsdn_iftable_msg_cb(const struct nlmsghdr *nlh, void *data)
+{
+	struct lsdn_iftable *t = data;
+	const struct ifinfomsg *ifm = mnl_nlmsg_get_payload(nlh);
+	const char *name = NULL;
+
+	switch (nlh->nlmsg_type) {
+	case RTM_NEWLINK:
+		mnl_attr_parse(nlh, sizeof(*ifm), ifname_cb, &name);
+		if (name && lsdn_iftable_set(t, ifm->ifi_index, name) == LSDNE_NOMEM)
+			return MNL_CB_ERROR;
+		break;
+	case RTM_DELLINK:
+		lsdn_iftable_remove(t, ifm->ifi_index);
+		break;
+	}
+	return MNL_CB_OK;
+}
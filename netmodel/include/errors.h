@@ -31,7 +31,9 @@ enum lsdn_err {
 	/** Network model commit failed. */
 	LSDNE_COMMIT,
 	/** Incompatible rules with the same priority */
-	LSDNE_INCOMPATIBLE_MATCH
+	LSDNE_INCOMPATIBLE_MATCH,
+	/** The kernel state differs from the committed model. */
+	LSDNE_DRIFT
 };
 typedef enum lsdn_err lsdn_err_t;
 
@@ -46,7 +48,20 @@ typedef enum lsdn_err lsdn_err_t;
 	x(NET_BAD_NETTYPE, "Trying to create net %o and net %o of incompatible network types on the same machine.") \
 	x(NET_DUPID, "Trying to create net %o and net %o with the same net id %o.") \
 	x(VR_INCOMPATIBLE_MATCH, "Rules %o and %o on virt %o share the same priority, but have different match targets or masks.")\
-	x(VR_DUPLICATE_RULE, "Rules %o and %o on virt %o share the same priority and are completely equal")
+	x(VR_DUPLICATE_RULE, "Rules %o and %o on virt %o share the same priority and are completely equal") \
+	x(VR_NOT_SHARED, "Virt %o has different rules than virt %o, but they share tc blocks in net %o on phys %o.") \
+	x(KERNEL_NOIF, "The interface %o is missing in the kernel.") \
+	x(KERNEL_NOMASTER, "The interface %o is not enslaved to %o in the kernel.") \
+	x(KERNEL_EXTRA_IF, "The interface %o is not a part of the model.") \
+	x(KERNEL_NOQDISC, "The qdisc %o on interface %o is missing in the kernel.") \
+	x(KERNEL_NOBLOCK, "The tc block %o is missing in the kernel.") \
+	x(KERNEL_NOBINDING, "The interface %o is not bound to the tc block %o in the kernel.") \
+	x(KERNEL_NOFILTER, "The filter %o on %o is missing in the kernel.") \
+	x(KERNEL_CHANGED_FILTER, "The filter %o on %o differs in the kernel.") \
+	x(KERNEL_EXTRA_FILTER, "The filter %o on %o is not a part of the model.") \
+	x(KERNEL_NOROUTE, "The route to %o on interface %o is missing in the kernel.") \
+	x(KERNEL_FOREIGN_ACTION, "The tc action %o already exists in the kernel and belongs to someone else.") \
+	x(KERNEL_REJECTED, "The kernel has rejected the request %o: %o.")
 
 #define lsdn_mk_problem_enum(name, string) LSDNP_##name,
 
@@ -6,6 +6,7 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <stdio.h>
 #include "nettypes.h"
 
 #define LSDN_DECLARE_ATTR(obj, name, type) \
@@ -45,6 +46,173 @@ void lsdn_context_free(struct lsdn_context *ctx);
 /* Will automatically delete all child objects */
 void lsdn_context_cleanup(struct lsdn_context *ctx, lsdn_problem_cb cb, void *user);
 
+/** Kernel interface used by a context to carry out the committed changes. */
+enum lsdn_backend {
+	/** Configure the running kernel through netlink. Requires the CAP_NET_ADMIN capability. */
+	LSDN_BACKEND_NETLINK,
+	/** Apply the changes to an in-process model of the kernel. Needs no privileges and touches
+	 * no real interfaces, which makes it useful for benchmarks and testing. */
+	LSDN_BACKEND_SIMULATOR
+};
+
+struct lsdn_context *lsdn_context_new_backend(const char* name, enum lsdn_backend backend);
+struct lsdn_context *lsdn_context_new_sim_peer(const char* name, struct lsdn_context *peer);
+lsdn_err_t lsdn_context_warm_restart(struct lsdn_context *ctx);
+void lsdn_context_set_commit_threads(struct lsdn_context *ctx, unsigned int threads);
+
+/** Kinds of netlink requests, see `lsdn_nl_stats`. */
+enum lsdn_nl_msg_kind {
+	LSDN_NL_LINK,
+	LSDN_NL_ADDR,
+	LSDN_NL_QDISC,
+	LSDN_NL_FILTER,
+	LSDN_NL_NEIGH,
+	/** Standalone tc actions, shared by filters. */
+	LSDN_NL_ACTION,
+	LSDN_NL_OTHER,
+	LSDN_NL_KIND_COUNT
+};
+
+/** Netlink traffic generated by a context. */
+struct lsdn_nl_stats {
+	/** Batches of requests handed to the kernel at once. */
+	uint64_t batches;
+	/** Requests sent. */
+	uint64_t messages;
+	/** Total size of the requests. */
+	uint64_t bytes;
+	/** Requests rejected by the kernel. */
+	uint64_t errors;
+	/** Requests and their size by the kind of the object they create, change or delete. */
+	struct {
+		uint64_t messages;
+		uint64_t bytes;
+	} kinds[LSDN_NL_KIND_COUNT];
+};
+
+void lsdn_context_get_nl_stats(struct lsdn_context *ctx, struct lsdn_nl_stats *stats);
+void lsdn_context_reset_nl_stats(struct lsdn_context *ctx);
+
+/** Phases of `lsdn_commit`, see `lsdn_commit_stats`. */
+enum lsdn_commit_phase {
+	/** Propagating the changes, the startup hooks and `lsdn_validate`. */
+	LSDN_PHASE_VALIDATE,
+	/** Removing the deleted and changed objects from the kernel. */
+	LSDN_PHASE_DECOMMIT,
+	/** Creating the new and changed objects, including the final flush. */
+	LSDN_PHASE_COMMIT,
+	/** Marking the objects as committed. */
+	LSDN_PHASE_ACK,
+	LSDN_PHASE_COUNT
+};
+
+/** Callbacks of the network types, see `lsdn_commit_stats`. */
+enum lsdn_net_op {
+	LSDN_OP_CREATE_PA,
+	LSDN_OP_DESTROY_PA,
+	LSDN_OP_ADD_VIRT,
+	LSDN_OP_REMOVE_VIRT,
+	LSDN_OP_ADD_REMOTE_PA,
+	LSDN_OP_REMOVE_REMOTE_PA,
+	LSDN_OP_ADD_REMOTE_VIRT,
+	LSDN_OP_REMOVE_REMOTE_VIRT,
+	LSDN_OP_MOVE_REMOTE_VIRT,
+	LSDN_OP_UPDATE_REMOTE_PA,
+	LSDN_OP_VALIDATE_PA,
+	LSDN_OP_VALIDATE_VIRT,
+	LSDN_OP_COUNT
+};
+
+/** Classes of the model objects, see `lsdn_commit_stats`. */
+enum lsdn_object_class {
+	LSDN_OBJ_SETTINGS,
+	LSDN_OBJ_NET,
+	LSDN_OBJ_PHYS,
+	/** Attachments of physes to networks. */
+	LSDN_OBJ_PA,
+	LSDN_OBJ_VIRT,
+	/** Views of remote attachments from the local ones. */
+	LSDN_OBJ_REMOTE_PA,
+	/** Views of virts from the local attachments. */
+	LSDN_OBJ_REMOTE_VIRT,
+	LSDN_OBJ_COUNT
+};
+
+/** Where the commits of a context spend their time and what they do.
+ * All the counters are totals since the context was created or since
+ * `lsdn_context_reset_commit_stats`. */
+struct lsdn_commit_stats {
+	/** Calls of `lsdn_commit`, including those failing validation. */
+	uint64_t commits;
+	/** Wall time spent in each phase, in nanoseconds. */
+	uint64_t phase_ns[LSDN_PHASE_COUNT];
+	/** Calls of each network type callback. */
+	uint64_t net_ops[LSDN_OP_COUNT];
+	/** Flower filters sent for the first time. */
+	uint64_t filters_created;
+	/** Flower filters sent again, after a rule was added or removed. */
+	uint64_t filters_updated;
+	uint64_t filters_deleted;
+	/** Broadcast filters rewritten with a new list of actions. */
+	uint64_t broadcast_rewrites;
+	/** Broadcast filters deleted, since they have no actions left. */
+	uint64_t broadcast_deletes;
+	/** eBPF programs loaded for BPF switching, see `lsdn_settings_set_bpf_switching`. */
+	uint64_t bpf_prog_loads;
+	/** Elements of the eBPF maps written or deleted. */
+	uint64_t bpf_map_updates;
+	uint64_t bpf_map_deletes;
+	/** Model objects of each class. */
+	struct {
+		/** Objects currently allocated. */
+		uint64_t live;
+		/** Most objects allocated at the same time. */
+		uint64_t peak;
+		/** Memory of the objects at the peak, without the names and rules they own. */
+		uint64_t peak_bytes;
+	} objects[LSDN_OBJ_COUNT];
+	/** The netlink traffic, as returned by `lsdn_context_get_nl_stats`. */
+	struct lsdn_nl_stats nl;
+};
+
+void lsdn_context_get_commit_stats(struct lsdn_context *ctx, struct lsdn_commit_stats *stats);
+void lsdn_context_reset_commit_stats(struct lsdn_context *ctx);
+void lsdn_commit_stats_format(FILE *out, const struct lsdn_commit_stats *stats);
+
+/** Objects present in the simulated kernel of a context using `LSDN_BACKEND_SIMULATOR`. */
+struct lsdn_sim_state {
+	uint64_t links;
+	uint64_t qdiscs;
+	/** Shared filter blocks. */
+	uint64_t blocks;
+	/** Filter chains, on interfaces and in blocks. */
+	uint64_t chains;
+	uint64_t filters;
+	/** Standalone tc actions, shared by the filters. */
+	uint64_t actions;
+	uint64_t fdb_entries;
+	/** eBPF programs and maps, including those only kept alive by the filters. */
+	uint64_t bpf_progs;
+	uint64_t bpf_maps;
+	/** Elements of the eBPF hash maps (array elements always exist). */
+	uint64_t bpf_map_entries;
+};
+
+/** A filter in the simulated kernel, see `lsdn_sim_get_filters`. */
+struct lsdn_sim_filter {
+	uint32_t chain;
+	uint32_t prio;
+	/** Number of actions of a flower filter, including the final continue or drop. */
+	size_t actions;
+};
+
+lsdn_err_t lsdn_sim_add_link(struct lsdn_context *ctx, const char *ifname);
+lsdn_err_t lsdn_sim_del_link(struct lsdn_context *ctx, const char *ifname);
+lsdn_err_t lsdn_sim_del_qdiscs(struct lsdn_context *ctx, const char *ifname);
+void lsdn_sim_get_state(struct lsdn_context *ctx, struct lsdn_sim_state *state);
+size_t lsdn_sim_get_filters(struct lsdn_context *ctx, const char *ifname,
+	struct lsdn_sim_filter *filters, size_t max);
+
 /** Type of network encapsulation. */
 enum lsdn_nettype{
 	/** VxLAN encapsulation. */
@@ -93,6 +261,10 @@ struct lsdn_settings *lsdn_settings_new_vxlan_e2e(struct lsdn_context *ctx, uint
 struct lsdn_settings *lsdn_settings_new_vxlan_static(struct lsdn_context *ctx, uint16_t port);
 void lsdn_settings_free(struct lsdn_settings *settings);
 void lsdn_settings_register_user_hooks(struct lsdn_settings *settings, struct lsdn_user_hooks *user_hooks);
+void lsdn_settings_set_shared_blocks(struct lsdn_settings *settings, bool shared);
+void lsdn_settings_set_neigh_suppression(struct lsdn_settings *settings, bool suppress);
+void lsdn_settings_set_chain_switching(struct lsdn_settings *settings, bool chains);
+void lsdn_settings_set_bpf_switching(struct lsdn_settings *settings, bool bpf);
 lsdn_err_t lsdn_settings_set_name(struct lsdn_settings *s, const char *name);
 const char* lsdn_settings_get_name(struct lsdn_settings *s);
 struct lsdn_settings *lsdn_settings_by_name(struct lsdn_context *ctx, const char *name);
@@ -152,7 +324,22 @@ struct lsdn_phys_attachment;
  */
 struct lsdn_virt;
 
+/** Description of a virt created by `lsdn_virts_new`. */
+struct lsdn_virt_desc {
+	/** Name of the virt, or `NULL`. */
+	const char *name;
+	/** Interface the virt is connected through, or `NULL` to leave it unconnected. */
+	const char *iface;
+	/** MAC address of the virt, or `NULL`. */
+	const lsdn_mac_t *mac;
+	/** IP address of the virt, or `NULL`. */
+	const lsdn_ip_t *ip;
+};
+
 struct lsdn_virt *lsdn_virt_new(struct lsdn_net *net);
+lsdn_err_t lsdn_virts_new(
+	struct lsdn_net *net, struct lsdn_phys *phys,
+	const struct lsdn_virt_desc *descs, size_t count, struct lsdn_virt **virts);
 void lsdn_virt_free(struct lsdn_virt* vsirt);
 lsdn_err_t lsdn_virt_set_name(struct lsdn_virt *virt, const char *name);
 const char* lsdn_virt_get_name(struct lsdn_virt *virt);
@@ -162,6 +349,8 @@ lsdn_err_t lsdn_virt_connect(
 void lsdn_virt_disconnect(struct lsdn_virt *virt);
 
 LSDN_DECLARE_ATTR(virt, mac, lsdn_mac_t);
+LSDN_DECLARE_ATTR(virt, ip, lsdn_ip_t);
 
 lsdn_err_t lsdn_validate(struct lsdn_context *ctx, lsdn_problem_cb cb, void *user);
 lsdn_err_t lsdn_commit(struct lsdn_context *ctx, lsdn_problem_cb cb, void *user);
+lsdn_err_t lsdn_audit(struct lsdn_context *ctx, bool repair, lsdn_problem_cb cb, void *user);
@@ -74,6 +74,8 @@ extern const lsdn_mac_t lsdn_broadcast_mac;
 extern const lsdn_mac_t lsdn_all_zeroes_mac;
 extern const lsdn_mac_t lsdn_multicast_mac_mask;
 extern const lsdn_mac_t lsdn_single_mac_mask;
+extern const lsdn_mac_t lsdn_nd_solicit_mac;
+extern const lsdn_mac_t lsdn_nd_solicit_mac_mask;
 extern const lsdn_ip_t lsdn_single_ipv4_mask;
 extern const lsdn_ip_t lsdn_single_ipv6_mask;
 
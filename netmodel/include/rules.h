@@ -11,7 +11,8 @@
 	x(LSDN_MATCH_DST_IPV4, dst_ipv4) \
 	x(LSDN_MATCH_SRC_IPV6, src_ipv6) \
 	x(LSDN_MATCH_DST_IPV6, dst_ipv6) \
-	x(LSDN_MATCH_ENC_KEY_ID, enc_key_id)
+	x(LSDN_MATCH_ENC_KEY_ID, enc_key_id) \
+	x(LSDN_MATCH_ARP_TIP, arp_tip)
 
 #define lsdn_rule_target_id(z, y) z,
 enum lsdn_rule_target{
@@ -45,6 +46,7 @@ struct lsdn_vr;
 struct lsdn_vr *lsdn_vr_new(struct lsdn_virt *virt, uint16_t prio, enum lsdn_direction dir);
 void lsdn_vr_free(struct lsdn_vr *vr);
 void lsdn_vrs_free_all(struct lsdn_virt *virt);
+size_t lsdn_vr_count_lookups(struct lsdn_virt *virt, enum lsdn_direction dir);
 struct lsdn_vr_action;
 
 extern struct lsdn_vr_action lsdn_vr_drop;
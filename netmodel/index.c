@@ -0,0 +1,82 @@
+/** \file
+ * Routines for indexing objects by a binary key. */
+#include "private/index.h"
+
+/** Set up an empty index for keys of `key_size` bytes. */
+void lsdn_index_init(struct lsdn_index *idx, size_t key_size)
+{
+	idx->head = NULL;
+	idx->key_size = key_size;
+}
+
+/** Remove all entries from the index.
+ * Also releases the memory held by the hash table. */
+void lsdn_index_clear(struct lsdn_index *idx)
+{
+	struct lsdn_index_entry *e, *tmp;
+	HASH_ITER(hh, idx->head, e, tmp) {
+		HASH_DELETE(hh, idx->head, e);
+		lsdn_foreach(e->dups, dups, struct lsdn_index_entry, dup) {
+			lsdn_list_remove(&dup->dups);
+			lsdn_index_entry_init(dup);
+		}
+		lsdn_index_entry_init(e);
+	}
+}
+
+/** Set up an index entry that is not in any index. */
+void lsdn_index_entry_init(struct lsdn_index_entry *entry)
+{
+	lsdn_list_init(&entry->dups);
+	entry->key = NULL;
+	entry->indexed = false;
+	entry->is_head = false;
+}
+
+/** Add an entry to the index.
+ * @param key key of the entry. Must stay valid (and unchanged) while the entry is indexed. */
+void lsdn_index_add(struct lsdn_index *idx, struct lsdn_index_entry *entry, const void *key)
+{
+	assert(!entry->indexed);
+	entry->key = key;
+	entry->indexed = true;
+	struct lsdn_index_entry *head = lsdn_index_search(idx, key);
+	if (head) {
+		entry->is_head = false;
+		lsdn_list_init_add(head->dups.previous, &entry->dups);
+	} else {
+		entry->is_head = true;
+		lsdn_list_init(&entry->dups);
+		HASH_ADD_KEYPTR(hh, idx->head, entry->key, idx->key_size, entry);
+	}
+}
+
+/** Remove an entry from the index, if it is indexed. */
+void lsdn_index_remove(struct lsdn_index *idx, struct lsdn_index_entry *entry)
+{
+	if (!entry->indexed)
+		return;
+
+	if (entry->is_head) {
+		HASH_DELETE(hh, idx->head, entry);
+		if (!lsdn_is_list_empty(&entry->dups)) {
+			struct lsdn_index_entry *next =
+				lsdn_container_of(entry->dups.next, struct lsdn_index_entry, dups);
+			next->is_head = true;
+			HASH_ADD_KEYPTR(hh, idx->head, next->key, idx->key_size, next);
+		}
+	}
+	if (!lsdn_is_list_empty(&entry->dups))
+		lsdn_list_remove(&entry->dups);
+	lsdn_index_entry_init(entry);
+}
+
+/** Find the first entry with the given key.
+ * The other entries with the same key can be visited using `lsdn_index_foreach_dup`.
+ * @return NULL if no entry has the key. */
+struct lsdn_index_entry *lsdn_index_search(struct lsdn_index *idx, const void *key)
+{
+	struct lsdn_index_entry *head;
+	HASH_FIND(hh, idx->head, key, idx->key_size, head);
+	return head;
+}
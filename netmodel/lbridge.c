@@ -2,6 +2,7 @@
  * Linux Bridge management functions */
 #include "private/lbridge.h"
 #include "private/net.h"
+#include "private/audit.h"
 #include "include/lsdn.h"
 
 /** Set up a Linux Bridge and associate it with a context. */
@@ -10,16 +11,14 @@ void lsdn_lbridge_init(struct lsdn_context *ctx, struct lsdn_lbridge *br)
 	struct lsdn_if bridge_if;
 	lsdn_if_init(&bridge_if);
 
-	lsdn_err_t err = lsdn_link_bridge_create(ctx->nlsock, &bridge_if, lsdn_mk_ifname(ctx));
-	if(err != LSDNE_OK)
-		abort();
-
-	err = lsdn_link_set(ctx->nlsock, bridge_if.ifindex, true);
+	lsdn_err_t err = lsdn_link_bridge_create(ctx->nlsock, &bridge_if, lsdn_mk_ifname(ctx), 0, true);
 	if(err != LSDNE_OK)
 		abort();
 
 	br->ctx = ctx;
 	br->bridge_if = bridge_if;
+	lsdn_list_init(&br->ports_list);
+	lsdn_list_init_add(&ctx->lbridges_list, &br->lbridges_entry);
 }
 
 /** Free the `lsdn_lbridge` structure. */
@@ -31,6 +30,7 @@ void lsdn_lbridge_free(struct lsdn_lbridge *br)
 			abort();
 	}
 	lsdn_if_free(&br->bridge_if);
+	lsdn_list_remove(&br->lbridges_entry);
 }
 
 /** Add an interface to the bridge.
@@ -39,26 +39,30 @@ void lsdn_lbridge_free(struct lsdn_lbridge *br)
  * @param iface Interface to connect. */
 void lsdn_lbridge_add(struct lsdn_lbridge *br, struct lsdn_lbridge_if *br_if, struct lsdn_if *iface)
 {
-	lsdn_err_t err = lsdn_link_set_master(br->ctx->nlsock, br->bridge_if.ifindex, iface->ifindex);
-	if(err != LSDNE_OK)
-		abort();
-
-	err = lsdn_link_set(br->ctx->nlsock, iface->ifindex, true);
-	if(err != LSDNE_OK)
-		abort();
+	lsdn_link_set_master_async(
+		br->ctx->nlsock, br->bridge_if.ifindex, iface->ifindex, true, lsdn_nl_problem_cb, br->ctx);
+	lsdn_lbridge_add_created(br, br_if, iface);
+}
 
+/** Take note of an interface that was created already connected to the bridge.
+ * See the `master` argument of the link builders in `nl.c`.
+ * @param br Bridge.
+ * @param br_if Resulting bridge interface structure.
+ * @param iface Connected interface. */
+void lsdn_lbridge_add_created(struct lsdn_lbridge *br, struct lsdn_lbridge_if *br_if, struct lsdn_if *iface)
+{
 	br_if->br = br;
 	br_if->iface = iface;
+	lsdn_list_init_add(&br->ports_list, &br_if->ports_entry);
 }
 
 /** Remove an interface from the bridge. */
 void lsdn_lbridge_remove(struct lsdn_lbridge_if *iface)
 {
-	if (!iface->br->ctx->disable_decommit) {
-		lsdn_err_t err = lsdn_link_set_master(iface->br->ctx->nlsock, 0, iface->iface->ifindex);
-		if (err != LSDNE_OK)
-			abort();
-	}
+	lsdn_list_remove(&iface->ports_entry);
+	if (!iface->br->ctx->disable_decommit && !iface->iface->removed)
+		lsdn_link_set_master_async(
+			iface->br->ctx->nlsock, 0, iface->iface->ifindex, false, lsdn_nl_problem_cb, iface->br->ctx);
 }
 
 /** Connect a virt to the Linux Bridge. */
@@ -66,13 +70,26 @@ void lsdn_lbridge_add_virt(struct lsdn_virt *v)
 {
 	struct lsdn_phys_attachment *a = v->connected_through;
 	lsdn_lbridge_add(&a->lbridge, &v->lbridge_if, &v->committed_if);
-	lsdn_prepare_rulesets(v->network->ctx, &v->committed_if, &v->rules_in, &v->rules_out);
+	lsdn_virt_prepare_rulesets(v);
 }
 
 /** Disconnect a virt from the Linux Bridge. */
 void lsdn_lbridge_remove_virt(struct lsdn_virt *v)
 {
-	lsdn_ruleset_free(&v->rules_in);
-	lsdn_ruleset_free(&v->rules_out);
+	lsdn_virt_free_rulesets(v);
 	lsdn_lbridge_remove(&v->lbridge_if);
 }
+
+/** Check that the bridges of the context and their ports are in place.
+ * See `lsdn_audit`. */
+void lsdn_lbridge_audit(struct lsdn_context *ctx, struct lsdn_audit *audit)
+{
+	lsdn_foreach(ctx->lbridges_list, lbridges_entry, struct lsdn_lbridge, br) {
+		lsdn_audit_link(audit, &br->bridge_if, NULL);
+		lsdn_foreach(br->ports_list, ports_entry, struct lsdn_lbridge_if, port) {
+			/* Interfaces known to be gone are handled by the next commit */
+			if (!port->iface->removed)
+				lsdn_audit_link(audit, port->iface, &br->bridge_if);
+		}
+	}
+}
@@ -6,6 +6,7 @@
 #include "private/log.h"
 #include "include/util.h"
 #include "private/errors.h"
+#include "private/pool.h"
 #include <errno.h>
 
 static void settings_do_free(struct lsdn_settings *settings);
@@ -26,10 +27,78 @@ static void renew(enum lsdn_state *state) {
 
 /** Propagate RENEW state.
  * \private
- * If `from` is slated for renewal and `to` is OK, switch to RENEW too. */
-static void propagate(enum lsdn_state *from, enum lsdn_state *to) {
-	if (*from == LSDN_STATE_RENEW && *to == LSDN_STATE_OK)
+ * If `from` is slated for renewal and `to` is OK, switch to RENEW too.
+ * @return true if the state of `to` has changed. */
+static bool propagate(enum lsdn_state *from, enum lsdn_state *to) {
+	if (*from == LSDN_STATE_RENEW && *to == LSDN_STATE_OK) {
 		*to = LSDN_STATE_RENEW;
+		return true;
+	}
+	return false;
+}
+
+/** Put an object on a dirty list.
+ * \private
+ * Every object in a state other than OK must be on the dirty list of its type. Objects in OK
+ * state can be there too, if something they depend on has changed (e.g. virt rules). Validate
+ * and commit only walk the dirty lists, so their cost depends on the size of the change, not on
+ * the size of the whole model. */
+static void mark_dirty(struct lsdn_list_entry *list, struct lsdn_list_entry *entry)
+{
+	if (lsdn_is_list_empty(entry))
+		lsdn_list_init_add(list->previous, entry);
+}
+
+static bool is_dirty(struct lsdn_list_entry *entry)
+{
+	return !lsdn_is_list_empty(entry);
+}
+
+static void mark_clean(struct lsdn_list_entry *entry)
+{
+	if (is_dirty(entry))
+		lsdn_list_remove(entry);
+}
+
+static void settings_touch(struct lsdn_settings *s)
+{
+	mark_dirty(&s->ctx->dirty_settings, &s->dirty_entry);
+}
+
+static void net_touch(struct lsdn_net *net)
+{
+	mark_dirty(&net->ctx->dirty_nets, &net->dirty_entry);
+}
+
+static void phys_touch(struct lsdn_phys *phys)
+{
+	mark_dirty(&phys->ctx->dirty_phys, &phys->dirty_entry);
+}
+
+/* The network and phys validations look at their attachments, so touch them too */
+static void pa_touch(struct lsdn_phys_attachment *pa)
+{
+	mark_dirty(&pa->net->ctx->dirty_pas, &pa->dirty_entry);
+	net_touch(pa->net);
+	phys_touch(pa->phys);
+}
+
+void lsdn_virt_touch(struct lsdn_virt *virt)
+{
+	mark_dirty(&virt->network->ctx->dirty_virts, &virt->dirty_entry);
+}
+
+static void phys_renew(struct lsdn_phys *phys)
+{
+	renew(&phys->state);
+	phys_touch(phys);
+}
+
+static void virt_renew(struct lsdn_virt *virt)
+{
+	renew(&virt->state);
+	virt->only_moved = false;
+	lsdn_virt_touch(virt);
 }
 
 /** Create new LSDN context.
@@ -38,10 +107,18 @@ static void propagate(enum lsdn_state *from, enum lsdn_state *to) {
  * @param name Context name.
  * @return `NULL` if allocation failed, pointer to new `lsdn_context` otherwise. */
 struct lsdn_context *lsdn_context_new(const char* name)
+{
+	return lsdn_context_new_backend(name, LSDN_BACKEND_NETLINK);
+}
+
+/* Set up a context talking to the kernel through the socket. The socket is freed on failure. */
+static struct lsdn_context *context_new_socket(const char *name, struct lsdn_nlsock *nlsock)
 {
 	struct lsdn_context *ctx = malloc(sizeof(*ctx));
-	if(!ctx)
+	if(!ctx) {
+		lsdn_socket_free(nlsock);
 		return NULL;
+	}
 
 	ctx->nomem_cb = NULL;
 	ctx->nomem_cb_user = NULL;
@@ -50,16 +127,14 @@ struct lsdn_context *lsdn_context_new(const char* name)
 	// TODO: restrict the maximum name length
 	ctx->name = strdup(name);
 	if(!ctx->name){
+		lsdn_socket_free(nlsock);
 		free(ctx);
 		return NULL;
 	}
 
-	ctx->nlsock = lsdn_socket_init();
-	if(!ctx->nlsock){
-		free(ctx->name);
-		free(ctx);
-		return NULL;
-	}
+	ctx->nlsock = nlsock;
+	ctx->commit_threads = 1;
+	bzero(&ctx->stats, sizeof(ctx->stats));
 
 	ctx->ifcount = 0;
 	lsdn_names_init(&ctx->phys_names);
@@ -68,9 +143,95 @@ struct lsdn_context *lsdn_context_new(const char* name)
 	lsdn_list_init(&ctx->networks_list);
 	lsdn_list_init(&ctx->settings_list);
 	lsdn_list_init(&ctx->phys_list);
+	lsdn_list_init(&ctx->dirty_settings);
+	lsdn_list_init(&ctx->dirty_phys);
+	lsdn_list_init(&ctx->dirty_nets);
+	lsdn_list_init(&ctx->dirty_pas);
+	lsdn_list_init(&ctx->dirty_virts);
+	lsdn_list_init(&ctx->dirty_fl_rules);
+	lsdn_list_init(&ctx->dirty_br_filters);
+	lsdn_list_init(&ctx->released_tunnel_keys);
+	lsdn_list_init(&ctx->foreign_tunnel_keys);
+	lsdn_list_init(&ctx->dirty_bpf_filters);
+	lsdn_list_init(&ctx->rulesets_list);
+	lsdn_list_init(&ctx->broadcasts_list);
+	lsdn_list_init(&ctx->bpf_filters_list);
+	lsdn_list_init(&ctx->lbridges_list);
+	lsdn_index_init(&ctx->phys_ip_index, sizeof(lsdn_ip_t));
+	lsdn_index_init(&ctx->net_id_index, sizeof(struct lsdn_net_id_key));
+	lsdn_index_init(&ctx->net_port_index, sizeof(struct lsdn_net_port_key));
+	lsdn_index_init(&ctx->virt_mac_index, sizeof(struct lsdn_virt_mac_key));
+	lsdn_index_init(&ctx->virt_ip_index, sizeof(struct lsdn_virt_ip_key));
+	lsdn_idalloc_init(&ctx->block_ids, 1, UINT32_MAX);
+	lsdn_idalloc_init(&ctx->tunnel_key_ids, 1, UINT32_MAX);
 	return ctx;
 }
 
+/** Create new LSDN context using the given backend.
+ * Like `lsdn_context_new`, but the changes may be applied to a simulated kernel instead of the
+ * running one.
+ * @param name Context name.
+ * @param backend Where the changes are applied.
+ * @return `NULL` if allocation failed, pointer to new `lsdn_context` otherwise. */
+struct lsdn_context *lsdn_context_new_backend(const char* name, enum lsdn_backend backend)
+{
+	struct lsdn_nlsock *nlsock;
+	if (backend == LSDN_BACKEND_SIMULATOR)
+		nlsock = lsdn_socket_init_sim();
+	else
+		nlsock = lsdn_socket_init();
+	if (!nlsock)
+		return NULL;
+	return context_new_socket(name, nlsock);
+}
+
+/** Create new LSDN context sharing the simulated kernel with another context.
+ * The simulated kernel lives as long as any of the contexts using it. Useful for testing what
+ * happens when a context is restarted, see `lsdn_context_warm_restart`.
+ * @param name Context name.
+ * @param peer Context using `LSDN_BACKEND_SIMULATOR`.
+ * @return `NULL` if allocation failed, pointer to new `lsdn_context` otherwise. */
+struct lsdn_context *lsdn_context_new_sim_peer(const char* name, struct lsdn_context *peer)
+{
+	struct lsdn_nlsock *nlsock = lsdn_socket_init_sim_peer(peer->nlsock);
+	if (!nlsock)
+		return NULL;
+	return context_new_socket(name, nlsock);
+}
+
+/** Adopt the kernel state left behind by a previous context of the same name.
+ * Call before the first `lsdn_commit` of a newly created context, with the model already
+ * built. The commit then keeps the links, qdiscs and filters already in the kernel if they are
+ * the same as the model needs, replaces those that are different and removes those the model no
+ * longer has. The traffic going through the kept objects is not disturbed.
+ * @param ctx Context to restart.
+ * @return `LSDNE_OK` if the kernel state was read, `LSDNE_NETLINK` or `LSDNE_NOMEM` otherwise.
+ */
+lsdn_err_t lsdn_context_warm_restart(struct lsdn_context *ctx)
+{
+	if (ctx->nlsock->adopt)
+		lsdn_adopt_free(ctx->nlsock->adopt);
+	ctx->nlsock->adopt = NULL;
+	ret_err(ctx, lsdn_adopt_start(ctx->nlsock, ctx->name));
+}
+
+/** Create the new physical attachments on several threads.
+ * Each thread talks to the kernel through its own netlink socket, so the commit does not wait for
+ * the links of one network after another. The networks are independent units of work, except for
+ * those sharing the tunnel of a VXLAN static E2E settings, which are created together.
+ *
+ * The model is still changed by one thread at a time, in an order that only depends on the model
+ * and the number of threads. The interface names and the reported problems thus do not change
+ * from one commit to another, but may differ from a serial commit. The problem callback may be
+ * called from any of the threads. Other parts of the commit are always serial.
+ * @param ctx LSDN context.
+ * @param threads Number of threads, 0 or 1 (the default) for a serial commit.
+ */
+void lsdn_context_set_commit_threads(struct lsdn_context *ctx, unsigned int threads)
+{
+	ctx->commit_threads = threads;
+}
+
 /** Problem handler that aborts when a problem is found.
  * Used in `lsdn_context_free`. When freeing a context, we can't handle errors
  * meaningfully and we don't expect any errors to happen anyway. Any reported problem
@@ -112,11 +273,92 @@ void lsdn_context_cleanup(struct lsdn_context *ctx, lsdn_problem_cb cb, void *us
 		lsdn_settings_free(s);
 	}
 	lsdn_commit(ctx, cb, user);
+	lsdn_names_free(&ctx->phys_names);
+	lsdn_names_free(&ctx->net_names);
+	lsdn_names_free(&ctx->setting_names);
+	lsdn_idalloc_free(&ctx->block_ids);
+	lsdn_idalloc_free(&ctx->tunnel_key_ids);
+	lsdn_tunnel_keys_free(ctx);
 	lsdn_socket_free(ctx->nlsock);
 	free(ctx->name);
 	free(ctx);
 }
 
+/** Get the netlink traffic generated by the context so far.
+ * Counts all requests since the context was created or since `lsdn_context_reset_nl_stats`.
+ * @param ctx LSDN context.
+ * @param stats Filled in with the counters. */
+void lsdn_context_get_nl_stats(struct lsdn_context *ctx, struct lsdn_nl_stats *stats)
+{
+	*stats = ctx->nlsock->stats;
+}
+
+/** Reset the netlink traffic counters of the context. */
+void lsdn_context_reset_nl_stats(struct lsdn_context *ctx)
+{
+	bzero(&ctx->nlsock->stats, sizeof(ctx->nlsock->stats));
+}
+
+/** Create an interface in the simulated kernel.
+ * The simulator starts with no interfaces at all, so the interfaces LSDN expects to exist (phys
+ * interfaces and the interfaces virts connect to) must be added first.
+ * Only valid for contexts using `LSDN_BACKEND_SIMULATOR`.
+ * @param ctx LSDN context.
+ * @param ifname Name of the new interface.
+ * @retval LSDNE_OK Interface created.
+ * @retval LSDNE_DUPLICATE Interface with the same name already exists.
+ * @retval LSDNE_NOMEM Allocation failed. */
+lsdn_err_t lsdn_sim_add_link(struct lsdn_context *ctx, const char *ifname)
+{
+	return lsdn_nlsim_add_link(ctx->nlsock, ifname);
+}
+
+/** Delete an interface from the simulated kernel, as if someone else did it.
+ * Only valid for contexts using `LSDN_BACKEND_SIMULATOR`.
+ * @param ctx LSDN context.
+ * @param ifname Name of the interface.
+ * @retval LSDNE_OK Interface deleted.
+ * @retval LSDNE_NOIF There is no such interface. */
+lsdn_err_t lsdn_sim_del_link(struct lsdn_context *ctx, const char *ifname)
+{
+	return lsdn_nlsim_del_link(ctx->nlsock, ifname);
+}
+
+/** Delete the qdiscs of an interface in the simulated kernel, together with their filters.
+ * Like `tc qdisc del` run by someone else, see `lsdn_audit`.
+ * Only valid for contexts using `LSDN_BACKEND_SIMULATOR`.
+ * @param ctx LSDN context.
+ * @param ifname Name of the interface.
+ * @retval LSDNE_OK Qdiscs deleted (if there were any).
+ * @retval LSDNE_NOIF There is no such interface. */
+lsdn_err_t lsdn_sim_del_qdiscs(struct lsdn_context *ctx, const char *ifname)
+{
+	return lsdn_nlsim_del_qdiscs(ctx->nlsock, ifname);
+}
+
+/** Count the objects in the simulated kernel.
+ * Only valid for contexts using `LSDN_BACKEND_SIMULATOR`.
+ * @param ctx LSDN context.
+ * @param state Filled in with the object counts. */
+void lsdn_sim_get_state(struct lsdn_context *ctx, struct lsdn_sim_state *state)
+{
+	lsdn_nlsim_get_state(ctx->nlsock, state);
+}
+
+/** List the ingress filters of an interface in the simulated kernel, or of the shared block
+ * bound to its ingress, ordered by chain and priority.
+ * Only valid for contexts using `LSDN_BACKEND_SIMULATOR`.
+ * @param ctx LSDN context.
+ * @param ifname Name of the interface.
+ * @param filters Filled in with at most `max` filters.
+ * @param max Size of `filters`.
+ * @return The number of filters, it may be larger than `max`. Zero for unknown interfaces. */
+size_t lsdn_sim_get_filters(struct lsdn_context *ctx, const char *ifname,
+	struct lsdn_sim_filter *filters, size_t max)
+{
+	return lsdn_nlsim_get_filters(ctx->nlsock, ifname, filters, max);
+}
+
 /** Configure out-of-memory callback.
  * By default, LSDN will return an error code to indicate that an allocation
  * failed. This function allows you to set a callback that gets called to handle
@@ -165,7 +407,101 @@ void lsdn_settings_register_user_hooks(
 	settings->user_hooks = user_hooks;
 }
 
+/** Bind the local virts to shared tc blocks.
+ * Normally, each virt has its own tc filters. With shared blocks, all virts of a network on the
+ * same phys are bound to a single pair of ingress and egress blocks and the filters in them are
+ * shared, so the firewall and switching rules are installed only once and not for every virt.
+ *
+ * This requires all virts of the network on the same phys to have the same virt rules (the
+ * same rules, in the same order), which is checked by validation. In static switching networks
+ * (#LSDN_STATIC_E2E), the virts are told apart by their MAC addresses.
+ *
+ * Changing the option recommits all the virts of the networks using the settings. */
+void lsdn_settings_set_shared_blocks(struct lsdn_settings *settings, bool shared)
+{
+	if (settings->shared_blocks == shared)
+		return;
+	settings->shared_blocks = shared;
+	lsdn_foreach(settings->setting_users_list, settings_users_entry, struct lsdn_net, net) {
+		lsdn_foreach(net->virt_list, virt_entry, struct lsdn_virt, v) {
+			if (v->state != LSDN_STATE_DELETE)
+				virt_renew(v);
+		}
+	}
+}
+
+/* Recommit the networks using the settings */
+static void renew_settings_users(struct lsdn_settings *settings)
+{
+	lsdn_foreach(settings->setting_users_list, settings_users_entry, struct lsdn_net, net) {
+		if (net->state != LSDN_STATE_DELETE) {
+			renew(&net->state);
+			net_touch(net);
+		}
+	}
+}
+
+/** Answer ARP requests and IPv6 neighbor solicitations without flooding them.
+ * Only supported by static switching networks (#LSDN_STATIC_E2E), ignored by the others.
+ * Since LSDN knows the IP (`lsdn_virt_set_ip`) and location of every virt, an ARP request or
+ * a neighbor solicitation is sent only to the virt it is asking for, instead of being broadcast
+ * to all physes of the network. Requests for addresses no virt has are dropped.
+ *
+ * All virts of the networks must have an IP. The IPv6 addresses must also differ in their last
+ * 24 bits, since the solicitations are told apart by the solicited-node multicast address.
+ *
+ * Changing the option recommits the networks using the settings. */
+void lsdn_settings_set_neigh_suppression(struct lsdn_settings *settings, bool suppress)
+{
+	if (settings->neigh_suppression == suppress)
+		return;
+	settings->neigh_suppression = suppress;
+	renew_settings_users(settings);
+}
+
+/** Look up the MAC addresses in a tc chain of the virt or tunnel instead of a separate switch.
+ * Only supported by static switching networks (#LSDN_STATIC_E2E), ignored by the others.
+ * Normally, the unicast packets are redirected to a dummy interface, whose ingress filters
+ * forward them by the destination MAC. With chain switching, the packets instead jump to a chain
+ * with the same filters right on the ingress they came from, which saves a pass through the
+ * network stack for every packet.
+ *
+ * On the other hand, the filters are installed for every interface, not just once for every
+ * phys. Use shared blocks (`lsdn_settings_set_shared_blocks`) to share them among the virts.
+ *
+ * Changing the option recommits the networks using the settings. */
+void lsdn_settings_set_chain_switching(struct lsdn_settings *settings, bool chains)
+{
+	if (settings->chain_switching == chains)
+		return;
+	settings->chain_switching = chains;
+	renew_settings_users(settings);
+}
+
+/** Forward the packets by an eBPF program instead of the flower filters.
+ * Only supported by static switching networks (#LSDN_STATIC_E2E), ignored by the others.
+ * Implies chain switching (`lsdn_settings_set_chain_switching`), but the chain holds a single
+ * cls_bpf filter, which looks the destination MAC up in an eBPF hash map. The broadcasts are
+ * sent to all the other interfaces of the network by the same program, following an eBPF array
+ * of the routes. Adding a virt or a remote phys thus only writes a few map elements, no filters
+ * are changed.
+ *
+ * The maps belong to the process that has created them, a warm restart loads new ones.
+ * Neighbor suppression (`lsdn_settings_set_neigh_suppression`) is ignored with BPF switching.
+ * Needs Linux 4.13 or newer; networks with more than about 150 virts and remote physes need
+ * Linux 5.2, which allows larger programs.
+ *
+ * Changing the option recommits the networks using the settings. */
+void lsdn_settings_set_bpf_switching(struct lsdn_settings *settings, bool bpf)
+{
+	if (settings->bpf_switching == bpf)
+		return;
+	settings->bpf_switching = bpf;
+	renew_settings_users(settings);
+}
+
 /** Assign a name to settings.
+ * Passing `NULL` removes the name.
  * @return #LSDNE_OK if the name is successfully set.
  * @return #LSDNE_DUPLICATE if this name is already in use. */
 lsdn_err_t lsdn_settings_set_name(struct lsdn_settings *s, const char *name)
@@ -199,9 +535,11 @@ struct lsdn_settings* lsdn_settings_by_name(struct lsdn_context *ctx, const char
  * */
 static void settings_do_free(struct lsdn_settings *settings)
 {
+	mark_clean(&settings->dirty_entry);
 	lsdn_list_remove(&settings->settings_entry);
 	lsdn_name_free(&settings->name);
 	assert(lsdn_is_list_empty(&settings->setting_users_list));
+	lsdn_stats_object_free(settings->ctx, LSDN_OBJ_SETTINGS);
 	free(settings);
 }
 
@@ -212,6 +550,7 @@ void lsdn_settings_free(struct lsdn_settings *settings)
 	lsdn_foreach(settings->setting_users_list, settings_users_entry, struct lsdn_net, net) {
 		lsdn_net_free(net);
 	}
+	settings_touch(settings);
 	free_helper(settings, settings_do_free);
 }
 
@@ -225,13 +564,24 @@ struct lsdn_net *lsdn_net_new(struct lsdn_settings *s, uint32_t vnet_id)
 	net->state = LSDN_STATE_NEW;
 	net->settings = s;
 	net->vnet_id = vnet_id;
+	bzero(&net->id_key, sizeof(net->id_key));
+	net->id_key.nettype = s->nettype;
+	net->id_key.vnet_id = vnet_id;
+	lsdn_index_entry_init(&net->id_entry);
+	lsdn_index_add(&s->ctx->net_id_index, &net->id_entry, &net->id_key);
+	lsdn_index_entry_init(&net->port_entry);
+	net->commit_unit = SIZE_MAX;
 
 	lsdn_list_init_add(&s->setting_users_list, &net->settings_users_entry);
 	lsdn_list_init_add(&s->ctx->networks_list, &net->networks_entry);
+	lsdn_list_init(&net->dirty_entry);
+	net_touch(net);
 	lsdn_list_init(&net->attached_list);
 	lsdn_list_init(&net->virt_list);
 	lsdn_name_init(&net->name);
 	lsdn_names_init(&net->virt_names);
+	lsdn_slab_init(&net->virt_slab, sizeof(struct lsdn_virt));
+	lsdn_stats_object_new(s->ctx, LSDN_OBJ_NET);
 	ret_ptr(s->ctx, net);
 }
 
@@ -239,10 +589,15 @@ static void net_do_free(struct lsdn_net *net)
 {
 	assert(lsdn_is_list_empty(&net->attached_list));
 	assert(lsdn_is_list_empty(&net->virt_list));
+	mark_clean(&net->dirty_entry);
+	lsdn_index_remove(&net->ctx->net_id_index, &net->id_entry);
+	lsdn_index_remove(&net->ctx->net_port_index, &net->port_entry);
 	lsdn_list_remove(&net->networks_entry);
 	lsdn_list_remove(&net->settings_users_entry);
 	lsdn_name_free(&net->name);
 	lsdn_names_free(&net->virt_names);
+	lsdn_slab_free(&net->virt_slab);
+	lsdn_stats_object_free(net->ctx, LSDN_OBJ_NET);
 	free(net);
 }
 
@@ -254,6 +609,7 @@ void lsdn_net_free(struct lsdn_net *net)
 	lsdn_foreach(net->attached_list, attached_entry, struct lsdn_phys_attachment, pa) {
 		phys_detach_by_pa(pa);
 	}
+	net_touch(net);
 	free_helper(net, net_do_free);
 }
 
@@ -287,18 +643,26 @@ struct lsdn_phys *lsdn_phys_new(struct lsdn_context *ctx)
 	phys->attr_ip = NULL;
 	phys->is_local = false;
 	phys->committed_as_local = false;
+	phys->ip_changed = false;
+	lsdn_index_entry_init(&phys->ip_entry);
 	lsdn_name_init(&phys->name);
 	lsdn_list_init_add(&ctx->phys_list, &phys->phys_entry);
 	lsdn_list_init(&phys->attached_to_list);
+	lsdn_list_init(&phys->dirty_entry);
+	phys_touch(phys);
+	lsdn_stats_object_new(ctx, LSDN_OBJ_PHYS);
 	ret_ptr(ctx, phys);
 }
 
 static void phys_do_free(struct lsdn_phys *phys)
 {
+	mark_clean(&phys->dirty_entry);
+	lsdn_index_remove(&phys->ctx->phys_ip_index, &phys->ip_entry);
 	lsdn_list_remove(&phys->phys_entry);
 	lsdn_name_free(&phys->name);
 	free(phys->attr_iface);
 	free(phys->attr_ip);
+	lsdn_stats_object_free(phys->ctx, LSDN_OBJ_PHYS);
 	free(phys);
 }
 
@@ -310,6 +674,7 @@ void lsdn_phys_free(struct lsdn_phys *phys)
 		}
 		phys_detach_by_pa(pa);
 	}
+	phys_touch(phys);
 	free_helper(phys, phys_do_free);
 }
 
@@ -334,8 +699,10 @@ struct lsdn_phys* lsdn_phys_by_name(struct lsdn_context *ctx, const char *name)
 static struct lsdn_phys_attachment* find_or_create_attachement(
 	struct lsdn_phys *phys, struct lsdn_net* net)
 {
-	lsdn_foreach(phys->attached_to_list, attached_to_entry, struct lsdn_phys_attachment, a) {
-		if(a->net == net)
+	/* Look through the network, hosts are typically attached to many more networks than a
+	 * network spans hosts */
+	lsdn_foreach(net->attached_list, attached_entry, struct lsdn_phys_attachment, a) {
+		if(a->phys == phys)
 			return a;
 	}
 
@@ -352,7 +719,15 @@ static struct lsdn_phys_attachment* find_or_create_attachement(
 	lsdn_list_init(&a->connected_virt_list);
 	lsdn_list_init(&a->remote_pa_list);
 	lsdn_list_init(&a->pa_view_list);
+	lsdn_list_init(&a->dirty_entry);
+	lsdn_slab_init(&a->remote_pa_slab, sizeof(struct lsdn_remote_pa));
+	lsdn_slab_init(&a->remote_virt_slab, sizeof(struct lsdn_remote_virt));
 	a->explicitely_attached = false;
+	a->shared_block_users = 0;
+	a->rules_leader = NULL;
+	a->rules_reference = NULL;
+	pa_touch(a);
+	lsdn_stats_object_new(net->ctx, LSDN_OBJ_PA);
 	return a;
 }
 
@@ -363,7 +738,7 @@ lsdn_err_t lsdn_phys_attach(struct lsdn_phys *phys, struct lsdn_net* net)
 		ret_err(net->ctx, LSDNE_NOMEM);
 
 	if (!a->explicitely_attached)
-		renew(&phys->state);
+		phys_renew(phys);
 
 	a->explicitely_attached = true;
 	ret_err(net->ctx, LSDNE_OK);
@@ -373,8 +748,13 @@ static void pa_do_free(struct lsdn_phys_attachment *a)
 {
 	assert(lsdn_is_list_empty(&a->connected_virt_list));
 	assert(!a->explicitely_attached);
+	mark_clean(&a->dirty_entry);
 	lsdn_list_remove(&a->attached_entry);
 	lsdn_list_remove(&a->attached_to_entry);
+	assert(lsdn_is_list_empty(&a->remote_pa_list));
+	lsdn_slab_free(&a->remote_pa_slab);
+	lsdn_slab_free(&a->remote_virt_slab);
+	lsdn_stats_object_free(a->net->ctx, LSDN_OBJ_PA);
 	free(a);
 }
 
@@ -386,6 +766,7 @@ static void free_pa_if_possible(struct lsdn_phys_attachment *a)
 	 * the phys if the PA is not explicitely attached.
 	 */
 	if (lsdn_is_list_empty(&a->connected_virt_list) && !a->explicitely_attached) {
+		pa_touch(a);
 		free_helper(a, pa_do_free);
 	}
 }
@@ -412,7 +793,7 @@ lsdn_err_t lsdn_phys_set_iface(struct lsdn_phys *phys, const char *iface){
 		ret_err(phys->ctx, LSDNE_NOMEM);
 
 	if (!phys->attr_iface || strcmp(iface, phys->attr_iface))
-		renew(&phys->state);
+		phys_renew(phys);
 
 	free(phys->attr_iface);
 	phys->attr_iface = iface_dup;
@@ -420,11 +801,30 @@ lsdn_err_t lsdn_phys_set_iface(struct lsdn_phys *phys, const char *iface){
 }
 
 lsdn_err_t lsdn_phys_clear_iface(struct lsdn_phys *phys){
+	/* Not renewed, but validation must notice the missing interface */
+	phys_touch(phys);
 	free(phys->attr_iface);
 	phys->attr_iface = NULL;
 	ret_err(phys->ctx, LSDNE_OK);
 }
 
+/** Can the committed views of a remote phys follow its new IP, instead of being recreated?
+ * \private
+ * Only if the IP version stays the same and all networks it is attached to know how to
+ * update their remote PAs in place (see `update_remote_pa`). */
+static bool can_readdress(struct lsdn_phys *phys, lsdn_ip_t ip)
+{
+	if (phys->state != LSDN_STATE_OK || phys->is_local || phys->committed_as_local)
+		return false;
+	if (!phys->attr_ip || phys->attr_ip->v != ip.v)
+		return false;
+	lsdn_foreach(phys->attached_to_list, attached_to_entry, struct lsdn_phys_attachment, pa) {
+		if (!pa->net->settings->ops->update_remote_pa)
+			return false;
+	}
+	return true;
+}
+
 lsdn_err_t lsdn_phys_set_ip(struct lsdn_phys *phys, lsdn_ip_t ip)
 {
 	lsdn_ip_t *ip_dup = malloc(sizeof(*ip_dup));
@@ -432,18 +832,33 @@ lsdn_err_t lsdn_phys_set_ip(struct lsdn_phys *phys, lsdn_ip_t ip)
 		ret_err(phys->ctx, LSDNE_NOMEM);
 	*ip_dup = ip;
 
-	if (!phys->attr_ip || !lsdn_ip_eq(ip, *phys->attr_ip))
-		renew(&phys->state);
+	if (!phys->attr_ip || !lsdn_ip_eq(ip, *phys->attr_ip)) {
+		if (can_readdress(phys, ip)) {
+			phys->ip_changed = true;
+			phys_touch(phys);
+		} else {
+			phys_renew(phys);
+		}
+	}
 
 	free(phys->attr_ip);
 	phys->attr_ip = ip_dup;
+
+	lsdn_index_remove(&phys->ctx->phys_ip_index, &phys->ip_entry);
+	bzero(&phys->ip_key, sizeof(phys->ip_key));
+	phys->ip_key.v = ip.v;
+	if (ip.v == LSDN_IPv4)
+		phys->ip_key.v4 = ip.v4;
+	else
+		phys->ip_key.v6 = ip.v6;
+	lsdn_index_add(&phys->ctx->phys_ip_index, &phys->ip_entry, &phys->ip_key);
 	ret_err(phys->ctx, LSDNE_OK);
 }
 
 lsdn_err_t lsdn_phys_claim_local(struct lsdn_phys *phys)
 {
 	if (!phys->is_local) {
-		renew(&phys->state);
+		phys_renew(phys);
 		phys->is_local = true;
 	}
 
@@ -453,31 +868,158 @@ lsdn_err_t lsdn_phys_claim_local(struct lsdn_phys *phys)
 lsdn_err_t lsdn_phys_unclaim_local(struct lsdn_phys *phys)
 {
 	if (phys->is_local) {
-		renew(&phys->state);
+		phys_renew(phys);
 		phys->is_local = false;
 	}
 	return LSDNE_OK;
 }
 
-struct lsdn_virt *lsdn_virt_new(struct lsdn_net *net){
-	struct lsdn_virt *virt = malloc(sizeof(*virt));
-	if(!virt)
-		ret_ptr(net->ctx, NULL);
+static void virt_init(struct lsdn_virt *virt, struct lsdn_net *net)
+{
 	virt->network = net;
 	virt->state = LSDN_STATE_NEW;
 	virt->attr_mac = NULL;
+	virt->attr_ip = NULL;
+	lsdn_index_entry_init(&virt->mac_entry);
+	lsdn_index_entry_init(&virt->ip_entry);
 	virt->connected_through = NULL;
 	virt->committed_to = NULL;
 	virt->ht_in_rules = NULL;
 	virt->ht_out_rules = NULL;
+	virt->in_shared_blocks = false;
+	virt->only_moved = false;
 	lsdn_if_init(&virt->connected_if);
 	lsdn_if_init(&virt->committed_if);
 	lsdn_list_init_add(&net->virt_list, &virt->virt_entry);
 	lsdn_list_init(&virt->virt_view_list);
+	lsdn_list_init(&virt->dirty_entry);
 	lsdn_name_init(&virt->name);
+	lsdn_virt_touch(virt);
+	lsdn_stats_object_new(net->ctx, LSDN_OBJ_VIRT);
+}
+
+struct lsdn_virt *lsdn_virt_new(struct lsdn_net *net){
+	struct lsdn_virt *virt = lsdn_slab_alloc(&net->virt_slab);
+	if(!virt)
+		ret_ptr(net->ctx, NULL);
+	virt_init(virt, net);
 	ret_ptr(net->ctx, virt);
 }
 
+static int compare_names(const void *a, const void *b)
+{
+	return strcmp(*(const char * const *) a, *(const char * const *) b);
+}
+
+/* The names of the new virts must be unique among themselves and in the network */
+static lsdn_err_t check_virt_names(
+	struct lsdn_net *net, const struct lsdn_virt_desc *descs, size_t count)
+{
+	const char **names = malloc(count * sizeof(*names));
+	if (!names)
+		return LSDNE_NOMEM;
+	size_t named = 0;
+	lsdn_err_t err = LSDNE_OK;
+	for (size_t i = 0; i < count && err == LSDNE_OK; i++) {
+		if (!descs[i].name)
+			continue;
+		if (lsdn_names_search(&net->virt_names, descs[i].name))
+			err = LSDNE_DUPLICATE;
+		names[named++] = descs[i].name;
+	}
+	if (err == LSDNE_OK) {
+		qsort(names, named, sizeof(*names), compare_names);
+		for (size_t i = 1; i < named; i++) {
+			if (strcmp(names[i - 1], names[i]) == 0)
+				err = LSDNE_DUPLICATE;
+		}
+	}
+	free(names);
+	return err;
+}
+
+static lsdn_err_t virt_setup(
+	struct lsdn_virt *virt, const struct lsdn_virt_desc *desc, bool connect)
+{
+	lsdn_err_t err;
+	if (desc->name) {
+		err = lsdn_name_set(&virt->name, &virt->network->virt_names, desc->name);
+		if (err != LSDNE_OK)
+			return err;
+	}
+	if (desc->mac) {
+		virt->attr_mac = malloc(sizeof(*virt->attr_mac));
+		if (!virt->attr_mac)
+			return LSDNE_NOMEM;
+		*virt->attr_mac = *desc->mac;
+	}
+	if (desc->ip) {
+		virt->attr_ip = malloc(sizeof(*virt->attr_ip));
+		if (!virt->attr_ip)
+			return LSDNE_NOMEM;
+		*virt->attr_ip = *desc->ip;
+	}
+	if (connect && desc->iface) {
+		err = lsdn_if_set_name(&virt->connected_if, desc->iface);
+		if (err != LSDNE_OK)
+			return err;
+	}
+	return LSDNE_OK;
+}
+
+/** Create many virts at once.
+ * The virts are allocated next to each other and set up according to their descriptors. The
+ * names are checked and the virts set up before they are connected, so either all the virts
+ * are created or none, and `virts` is cleared on failure.
+ * @param net Network of the virts.
+ * @param phys Phys to connect the virts through, or `NULL` to leave them unconnected.
+ * @param descs Descriptors of the virts.
+ * @param count Number of the virts, may be zero.
+ * @param[out] virts Filled in with the `count` new virts.
+ * @return #LSDNE_OK if the virts were created.
+ * @return #LSDNE_DUPLICATE if a name is repeated or already used in the network.
+ * @return #LSDNE_NOMEM if memory allocation failed. */
+lsdn_err_t lsdn_virts_new(
+	struct lsdn_net *net, struct lsdn_phys *phys,
+	const struct lsdn_virt_desc *descs, size_t count, struct lsdn_virt **virts)
+{
+	if (count == 0)
+		ret_err(net->ctx, LSDNE_OK);
+	lsdn_err_t err = check_virt_names(net, descs, count);
+	if (err != LSDNE_OK)
+		ret_err(net->ctx, err);
+	if (!lsdn_slab_alloc_array(&net->virt_slab, (void **) virts, count))
+		ret_err(net->ctx, LSDNE_NOMEM);
+
+	for (size_t i = 0; i < count; i++)
+		virt_init(virts[i], net);
+	for (size_t i = 0; i < count && err == LSDNE_OK; i++)
+		err = virt_setup(virts[i], &descs[i], phys != NULL);
+
+	/* The attachment is created last, nothing can fail after it */
+	struct lsdn_phys_attachment *pa = NULL;
+	if (err == LSDNE_OK && phys) {
+		pa = find_or_create_attachement(phys, net);
+		if (!pa)
+			err = LSDNE_NOMEM;
+	}
+	if (err != LSDNE_OK) {
+		for (size_t i = 0; i < count; i++) {
+			lsdn_virt_free(virts[i]);
+			virts[i] = NULL;
+		}
+		ret_err(net->ctx, err);
+	}
+
+	for (size_t i = 0; pa && i < count; i++) {
+		if (!descs[i].iface)
+			continue;
+		virts[i]->connected_through = pa;
+		lsdn_list_init_add(&pa->connected_virt_list, &virts[i]->connected_virt_entry);
+	}
+	ret_err(net->ctx, LSDNE_OK);
+}
+
 static void virt_do_free(struct lsdn_virt *virt)
 {
 	lsdn_vr_do_free_all_rules(virt);
@@ -486,17 +1028,21 @@ static void virt_do_free(struct lsdn_virt *virt)
 		free_pa_if_possible(virt->connected_through);
 		virt->connected_through = NULL;
 	}
+	mark_clean(&virt->dirty_entry);
 	lsdn_list_remove(&virt->virt_entry);
 	lsdn_name_free(&virt->name);
 	lsdn_if_free(&virt->connected_if);
 	lsdn_if_free(&virt->committed_if);
 	free(virt->attr_mac);
-	free(virt);
+	free(virt->attr_ip);
+	lsdn_stats_object_free(virt->network->ctx, LSDN_OBJ_VIRT);
+	lsdn_slab_return(&virt->network->virt_slab, virt);
 }
 
 void lsdn_virt_free(struct lsdn_virt *virt)
 {
 	lsdn_vrs_free_all(virt);
+	lsdn_virt_touch(virt);
 	free_helper(virt, virt_do_free);
 }
 
@@ -528,9 +1074,13 @@ lsdn_err_t lsdn_virt_connect(
 	if(err != LSDNE_OK)
 		ret_err(phys->ctx, err);
 
+	/* A committed virt moving to another phys can be moved in place on the other machines */
+	bool moved = virt->connected_through && virt->connected_through != a
+		&& (virt->state == LSDN_STATE_OK || virt->only_moved);
 	lsdn_virt_disconnect(virt);
 	virt->connected_through = a;
-	renew(&virt->state);
+	virt_renew(virt);
+	virt->only_moved = moved;
 	lsdn_list_init_add(&a->connected_virt_list, &virt->connected_virt_entry);
 
 	ret_err(phys->ctx, LSDNE_OK);
@@ -542,7 +1092,9 @@ void lsdn_virt_disconnect(struct lsdn_virt *virt){
 
 	lsdn_list_remove(&virt->connected_virt_entry);
 	virt->connected_through = NULL;
-	renew(&virt->state);
+	/* Also called for the virts of a freed phys, including those already being freed */
+	if (virt->state != LSDN_STATE_DELETE)
+		virt_renew(virt);
 }
 
 lsdn_err_t lsdn_virt_set_mac(struct lsdn_virt *virt, lsdn_mac_t mac)
@@ -557,46 +1109,39 @@ lsdn_err_t lsdn_virt_set_mac(struct lsdn_virt *virt, lsdn_mac_t mac)
 	ret_err(virt->network->ctx, LSDNE_OK);
 }
 
-static bool should_be_validated(enum lsdn_state state) {
-	return state == LSDN_STATE_NEW || state == LSDN_STATE_RENEW;
+/** Set the IP address of a virt.
+ * Only used by the neighbor suppression, see `lsdn_settings_set_neigh_suppression`. */
+lsdn_err_t lsdn_virt_set_ip(struct lsdn_virt *virt, lsdn_ip_t ip)
+{
+	lsdn_ip_t *ip_dup = malloc(sizeof(*ip_dup));
+	if (ip_dup == NULL)
+		ret_err(virt->network->ctx, LSDNE_NOMEM);
+	*ip_dup = ip;
+
+	if (!virt->attr_ip || !lsdn_ip_eq(ip, *virt->attr_ip))
+		virt_renew(virt);
+
+	free(virt->attr_ip);
+	virt->attr_ip = ip_dup;
+	ret_err(virt->network->ctx, LSDNE_OK);
 }
 
-static bool will_be_deleted(enum lsdn_state state)
+lsdn_err_t lsdn_virt_clear_ip(struct lsdn_virt *virt)
 {
-	return state == LSDN_STATE_DELETE;
+	if (virt->attr_ip)
+		virt_renew(virt);
+	free(virt->attr_ip);
+	virt->attr_ip = NULL;
+	return LSDNE_OK;
 }
 
-static void report_virts(struct lsdn_phys_attachment *pa)
-{
-	lsdn_foreach(pa->connected_virt_list, connected_virt_entry, struct lsdn_virt, v)
-	{
-		if(!should_be_validated(v->state))
-			continue;
-		lsdn_problem_report(pa->net->ctx, LSDNP_PHYS_NOT_ATTACHED,
-			LSDNS_VIRT, v,
-			LSDNS_NET, pa->net,
-			LSDNS_PHYS, pa->phys,
-			LSDNS_END);
-	}
+static bool should_be_validated(enum lsdn_state state) {
+	return state == LSDN_STATE_NEW || state == LSDN_STATE_RENEW;
 }
 
-static void validate_virts_pa(struct lsdn_phys_attachment *pa)
+static bool will_be_deleted(enum lsdn_state state)
 {
-	lsdn_foreach(pa->connected_virt_list, connected_virt_entry, struct lsdn_virt, v){
-		if(!should_be_validated(v->state))
-			continue;
-		if(pa->explicitely_attached && pa->phys->is_local)
-		{
-			lsdn_err_t err = lsdn_if_resolve(&v->connected_if);
-			if(err != LSDNE_OK)
-				lsdn_problem_report(
-					v->network->ctx, LSDNP_VIRT_NOIF,
-					LSDNS_IF, &v->connected_if,
-					LSDNS_VIRT, v, LSDNS_END);
-		}
-		if(pa->net->settings->ops->validate_virt)
-			pa->net->settings->ops->validate_virt(v);
-	}
+	return state == LSDN_STATE_DELETE;
 }
 
 static void validate_rules(struct lsdn_virt *virt, struct vr_prio *ht_prio)
@@ -624,11 +1169,8 @@ static void validate_rules(struct lsdn_virt *virt, struct vr_prio *ht_prio)
 			}
 		}
 
-		/* Optional todo:re use the hash table for commited rules that already exists.
-		 * This will reduce memory usage (we can reuse the hh from the rule) and we can
-		 * get the running time proportional to changed rules, not all rules. */
-
-		/* Then check for conflicting rules */
+		/* Then check for conflicting rules. Only the virts whose rules changed are validated,
+		 * so the table is built from their rules alone. */
 		struct lsdn_vr *rule_ht = NULL;
 		lsdn_foreach(prio->rules_list, rules_entry, struct lsdn_vr, r) {
 			struct lsdn_vr *duplicate;
@@ -649,304 +1191,773 @@ static void validate_rules(struct lsdn_virt *virt, struct vr_prio *ht_prio)
 	}
 }
 
+/** Are the rules of the virt installed in the kernel?
+ * \private
+ * All virts bound to shared blocks have the same rules, so only the rules of the leader are
+ * installed, on behalf of all of them. */
+static bool installs_rules(struct lsdn_virt *virt)
+{
+	return !virt->in_shared_blocks || virt->committed_to->rules_leader == virt;
+}
+
 static void commit_vr(
 	struct lsdn_virt *virt, struct vr_prio *prio,
 	struct lsdn_vr *vr, enum lsdn_direction dir)
 {
-	if (prio->commited_count == 0) {
-		assert(!prio->commited_prio);
+	struct vr_prio *group = prio->merged_to;
+	if (group->group_count == 0) {
+		assert(!group->commited_prio);
 		/* This is not reversed: the egress from the virt is our ingress and vice versa */
-		struct lsdn_ruleset *rs = (dir == LSDN_IN ? &virt->rules_out : &virt->rules_in);
+		struct lsdn_ruleset *rs;
+		if (virt->in_shared_blocks) {
+			struct lsdn_phys_attachment *pa = virt->committed_to;
+			rs = (dir == LSDN_IN ? &pa->shared_rules_out : &pa->shared_rules_in);
+		} else {
+			rs = (dir == LSDN_IN ? &virt->rules_out : &virt->rules_in);
+		}
 		vr->rule.subprio = LSDN_VR_SUBPRIO;
-		prio->commited_prio = lsdn_ruleset_define_prio(rs, prio->prio_num);
-		if (!prio->commited_prio)
+		group->commited_prio = lsdn_ruleset_define_prio(rs, group->prio_num);
+		if (!group->commited_prio)
 			abort();
-		memcpy(prio->commited_prio->targets, vr->targets, sizeof(vr->targets));
-		memcpy(prio->commited_prio->masks, vr->masks, sizeof(vr->masks));
+		memcpy(group->commited_prio->targets, vr->targets, sizeof(vr->targets));
+		memcpy(group->commited_prio->masks, vr->masks, sizeof(vr->masks));
 	}
 
-	lsdn_err_t err = lsdn_ruleset_add(prio->commited_prio, &vr->rule);
+	lsdn_err_t err = lsdn_ruleset_add(group->commited_prio, &vr->rule);
 	if (err != LSDNE_OK)
 		abort();
+	group->group_count++;
 	prio->commited_count++;
+	prio->commited_to = group;
+}
+
+static void decommit_vr(struct vr_prio *prio, struct lsdn_vr *vr)
+{
+	struct vr_prio *group = prio->commited_to;
+	lsdn_ruleset_remove(&vr->rule);
+	prio->commited_count--;
+	if (prio->commited_count == 0)
+		prio->commited_to = NULL;
+	group->group_count--;
+	if (group->group_count == 0) {
+		lsdn_ruleset_remove_prio(group->commited_prio);
+		group->commited_prio = NULL;
+	}
 }
 
-static void commit_rules(struct lsdn_virt *virt, struct vr_prio *ht_prio, enum lsdn_direction dir)
+/** Commit the new rules of a virt.
+ * \private
+ * If `take_over` is set, the virt has just become the leader of its shared blocks and all its
+ * rules are installed. The priorities merged differently than in the last commit (see
+ * `lsdn_vr_compile`) are removed and installed again in their new filter priority. */
+static void commit_rules(
+	struct lsdn_virt *virt, struct vr_prio *ht_prio, enum lsdn_direction dir, bool take_over)
 {
+	bool install = installs_rules(virt);
 	struct vr_prio *prio, *tmp;
+	if (install) {
+		lsdn_vr_compile(ht_prio);
+		/* All of them first, the rules may move to where the matches were taken */
+		HASH_ITER(hh, ht_prio, prio, tmp) {
+			if (!prio->commited_to || prio->commited_to == prio->merged_to)
+				continue;
+			lsdn_foreach(prio->rules_list, rules_entry, struct lsdn_vr, r) {
+				if (r->state == LSDN_STATE_OK)
+					decommit_vr(prio, r);
+			}
+		}
+	}
 	HASH_ITER(hh, ht_prio, prio, tmp) {
+		/* Only the new rules, unless the priority was moved above */
+		bool all = take_over || !prio->commited_to;
 		lsdn_foreach(prio->rules_list, rules_entry, struct lsdn_vr, r) {
-			if (r->state == LSDN_STATE_NEW)
+			if (install && (r->state == LSDN_STATE_NEW
+			    || (all && r->state != LSDN_STATE_DELETE)))
 				commit_vr(virt, prio, r, dir);
 			ack_state(&r->state);
 		}
 	}
 }
 
-static void decommit_vr(
-	struct lsdn_virt *virt, struct vr_prio *prio,
-	struct lsdn_vr *vr, enum lsdn_direction dir)
-{
-	lsdn_ruleset_remove(&vr->rule);
-	prio->commited_count--;
-	if (prio->commited_count == 0) {
-		lsdn_ruleset_remove_prio(prio->commited_prio);
-		prio->commited_prio = NULL;
-	}
-}
-
 static void decommit_rules(struct lsdn_virt *virt, struct vr_prio *ht_prio, enum lsdn_direction dir)
 {
+	bool installed = installs_rules(virt);
 	struct vr_prio *prio, *tmp;
 	HASH_ITER(hh, ht_prio, prio, tmp) {
 		lsdn_foreach(prio->rules_list, rules_entry, struct lsdn_vr, r) {
 			propagate(&virt->state, &r->state);
-			if (ack_uncommit(&r->state))
-				decommit_vr(virt, prio, r, dir);
+			if (ack_uncommit(&r->state) && installed)
+				decommit_vr(prio, r);
+			ack_delete(r, lsdn_vr_do_free);
 		}
 	}
 }
 
-static void validate_virts_net(struct lsdn_net *net)
+/** Get the number of flower filter priorities a packet goes through in the rules of a virt.
+ * Rule priorities with the same targets and masks are merged into a single filter priority by
+ * the commit, when the order of the rules allows it, so this is usually lower than the number
+ * of the priorities used. Only the rules installed by the last commit are counted; for virts in
+ * shared blocks, those of the virt installing the rules of the whole block.
+ * @param virt The virt.
+ * @param dir The direction of the rules.
+ * @return The number of filter priorities. */
+size_t lsdn_vr_count_lookups(struct lsdn_virt *virt, enum lsdn_direction dir)
 {
-	lsdn_foreach(net->virt_list, virt_entry, struct lsdn_virt, v1) {
-		if (!should_be_validated(v1->state) || !v1->attr_mac)
-			continue;
-		validate_rules(v1, v1->ht_in_rules);
-		validate_rules(v1, v1->ht_out_rules);
-		lsdn_foreach(net->virt_list, virt_entry, struct lsdn_virt, v2) {
-			if (v1 == v2 || !should_be_validated(v2->state) || !v2->attr_mac)
-				continue;
-			if (lsdn_mac_eq(*v1->attr_mac, *v2->attr_mac))
-				lsdn_problem_report(
-					net->ctx, LSDNP_VIRT_DUPATTR,
-					LSDNS_ATTR, "mac",
-					LSDNS_VIRT, v1,
-					LSDNS_VIRT, v2,
-					LSDNS_NET, net,
-					LSDNS_END);
-		}
+	if (!virt->committed_to)
+		return 0;
+	if (virt->in_shared_blocks && virt->committed_to->rules_leader)
+		virt = virt->committed_to->rules_leader;
+	struct vr_prio *ht_prio = (dir == LSDN_IN) ? virt->ht_in_rules : virt->ht_out_rules;
+	size_t lookups = 0;
+	struct vr_prio *prio, *tmp;
+	HASH_ITER(hh, ht_prio, prio, tmp) {
+		if (prio->group_count > 0)
+			lookups++;
 	}
+	return lookups;
 }
 
-static void cross_validate_networks(struct lsdn_net *net1, struct lsdn_net *net2)
+static void validate_virt(struct lsdn_virt *v)
 {
-	struct lsdn_settings *s1 = net1->settings;
-	struct lsdn_settings *s2 = net2->settings;
+	struct lsdn_net *net = v->network;
+	struct lsdn_phys_attachment *pa = v->connected_through;
+
+	validate_rules(v, v->ht_in_rules);
+	validate_rules(v, v->ht_out_rules);
 
-	if (s1->nettype == s2->nettype && net1->vnet_id == net2->vnet_id)
+	if (!should_be_validated(v->state))
+		return;
+
+	/* Only validated virts are in the index, see index_virt_macs */
+	lsdn_index_foreach_dup(&v->mac_entry, mac_entry, struct lsdn_virt, v2) {
+		lsdn_problem_report(
+			net->ctx, LSDNP_VIRT_DUPATTR,
+			LSDNS_ATTR, "mac",
+			LSDNS_VIRT, v,
+			LSDNS_VIRT, v2,
+			LSDNS_NET, net,
+			LSDNS_END);
+	}
+	lsdn_index_foreach_dup(&v->ip_entry, ip_entry, struct lsdn_virt, v2) {
 		lsdn_problem_report(
-			s1->ctx, LSDNP_NET_DUPID,
-			LSDNS_NET, net1,
-			LSDNS_NET, net2,
-			LSDNS_NETID, net1->vnet_id,
+			net->ctx, LSDNP_VIRT_DUPATTR,
+			LSDNS_ATTR, "ip",
+			LSDNS_VIRT, v,
+			LSDNS_VIRT, v2,
+			LSDNS_NET, net,
 			LSDNS_END);
+	}
 
-	bool check_nettypes = false;
-	lsdn_foreach(net1->attached_list, attached_entry, struct lsdn_phys_attachment, pa1) {
-		if (!pa1->phys->is_local)
-			continue;
-		lsdn_foreach(net2->attached_list, attached_entry, struct lsdn_phys_attachment, pa2) {
-			if (!pa2->phys->is_local)
-				continue;
-			check_nettypes = true;
-		}
+	if (!pa || will_be_deleted(pa->phys->state))
+		return;
+
+	if (!pa->explicitely_attached) {
+		lsdn_problem_report(net->ctx, LSDNP_PHYS_NOT_ATTACHED,
+			LSDNS_VIRT, v,
+			LSDNS_NET, pa->net,
+			LSDNS_PHYS, pa->phys,
+			LSDNS_END);
+		return;
 	}
 
-	if (check_nettypes) {
-		if (s1->nettype == LSDN_NET_VXLAN && s2->nettype == LSDN_NET_VXLAN) {
-			if (s1->switch_type == LSDN_STATIC_E2E && s2->switch_type != LSDN_STATIC_E2E) {
-				if (s1->vxlan.port == s2->vxlan.port) {
-					lsdn_problem_report(
-						s1->ctx, LSDNP_NET_BAD_NETTYPE,
-						LSDNS_NET, net1,
-						LSDNS_NET, net2,
-						LSDNS_END);
-				}
-			}
-		}
+	if (pa->phys->is_local) {
+		lsdn_err_t err = lsdn_if_resolve(net->ctx->nlsock, &v->connected_if);
+		if (err != LSDNE_OK)
+			lsdn_problem_report(
+				net->ctx, LSDNP_VIRT_NOIF,
+				LSDNS_IF, &v->connected_if,
+				LSDNS_VIRT, v, LSDNS_END);
+	}
+	if (net->settings->ops->validate_virt) {
+		net->ctx->stats.net_ops[LSDN_OP_VALIDATE_VIRT]++;
+		net->settings->ops->validate_virt(v);
 	}
 }
 
-lsdn_err_t lsdn_validate(struct lsdn_context *ctx, lsdn_problem_cb cb, void *user)
+static struct lsdn_vr *next_live_vr(struct vr_prio *prio, struct lsdn_list_entry *entry)
 {
-	ctx->problem_cb = cb;
-	ctx->problem_cb_user = user;
-	ctx->problem_count = 0;
+	for (entry = entry->next; entry != &prio->rules_list; entry = entry->next) {
+		struct lsdn_vr *vr = lsdn_container_of(entry, struct lsdn_vr, rules_entry);
+		if (!will_be_deleted(vr->state))
+			return vr;
+	}
+	return NULL;
+}
 
-	/********* Propagate states (some will be propagated later) *********/
-	lsdn_foreach(ctx->phys_list, phys_entry, struct lsdn_phys, p) {
-		lsdn_foreach(p->attached_to_list, attached_to_entry, struct lsdn_phys_attachment, pa) {
-			propagate(&p->state, &pa->state);
+static bool same_vr(struct lsdn_vr *a, struct lsdn_vr *b)
+{
+	/* The matches are already masked by validate_rules */
+	return memcmp(a->targets, b->targets, sizeof(a->targets)) == 0
+		&& memcmp(a->masks, b->masks, sizeof(a->masks)) == 0
+		&& memcmp(a->rule.matches, b->rule.matches, sizeof(a->rule.matches)) == 0
+		&& memcmp(&a->rule.action, &b->rule.action, sizeof(a->rule.action)) == 0;
+}
+
+/** Check that all the live rules in `ht_a` are also in `ht_b`, in the same order. */
+static bool rules_included(struct vr_prio *ht_a, struct vr_prio *ht_b)
+{
+	struct vr_prio *prio_a, *tmp;
+	HASH_ITER(hh, ht_a, prio_a, tmp) {
+		struct vr_prio *prio_b;
+		HASH_FIND(hh, ht_b, &prio_a->prio_num, sizeof(prio_a->prio_num), prio_b);
+		struct lsdn_vr *a = next_live_vr(prio_a, &prio_a->rules_list);
+		struct lsdn_vr *b = prio_b ? next_live_vr(prio_b, &prio_b->rules_list) : NULL;
+		while (a && b) {
+			if (!same_vr(a, b))
+				return false;
+			a = next_live_vr(prio_a, &a->rules_entry);
+			b = next_live_vr(prio_b, &b->rules_entry);
 		}
+		if (a || b)
+			return false;
 	}
-	lsdn_foreach(ctx->networks_list, networks_entry, struct lsdn_net, n){
-		lsdn_foreach(n->attached_list, attached_entry, struct lsdn_phys_attachment, pa) {
-			propagate(&n->state, &pa->state);
+	return true;
+}
+
+static bool same_rules(struct lsdn_virt *a, struct lsdn_virt *b)
+{
+	return rules_included(a->ht_in_rules, b->ht_in_rules)
+		&& rules_included(b->ht_in_rules, a->ht_in_rules)
+		&& rules_included(a->ht_out_rules, b->ht_out_rules)
+		&& rules_included(b->ht_out_rules, a->ht_out_rules);
+}
+
+static bool uses_shared_blocks(struct lsdn_phys_attachment *pa)
+{
+	return pa->net->settings->shared_blocks && pa->phys->is_local && pa->explicitely_attached
+		&& !will_be_deleted(pa->phys->state);
+}
+
+/** Check that all virts that will be bound to the shared blocks of a PA have the same rules.
+ * \private
+ * The virts are compared to the first one, which is remembered in `rules_reference`, so that the
+ * PA is checked only once. */
+static void validate_shared_rules(struct lsdn_phys_attachment *pa)
+{
+	lsdn_foreach(pa->connected_virt_list, connected_virt_entry, struct lsdn_virt, v) {
+		if (will_be_deleted(v->state))
+			continue;
+		if (!pa->rules_reference) {
+			pa->rules_reference = v;
+			continue;
 		}
+		if (!same_rules(pa->rules_reference, v))
+			lsdn_problem_report(
+				pa->net->ctx, LSDNP_VR_NOT_SHARED,
+				LSDNS_VIRT, v,
+				LSDNS_VIRT, pa->rules_reference,
+				LSDNS_NET, pa->net,
+				LSDNS_PHYS, pa->phys,
+				LSDNS_END);
 	}
-	lsdn_foreach(ctx->networks_list, networks_entry, struct lsdn_net, n){
-		lsdn_foreach(n->virt_list, virt_entry, struct lsdn_virt, v) {
-			/* Does not matter if we use committed_through or connected_through, if they
-			 * have changed, the virt must be renewed anyway */
-			if (v->connected_through)
-				propagate(&v->connected_through->state, &v->state);
-		}
+}
+
+static bool has_local_pa(struct lsdn_net *net)
+{
+	lsdn_foreach(net->attached_list, attached_entry, struct lsdn_phys_attachment, pa) {
+		if (pa->phys->is_local)
+			return true;
 	}
+	return false;
+}
 
-	/******* Do the validation ********/
-	lsdn_foreach(ctx->networks_list, networks_entry, struct lsdn_net, net1) {
-		if (will_be_deleted(net1->state))
+/** Bring the membership of a dirty network in `net_port_index` up to date.
+ * \private
+ * Attaching a local phys touches the network, so the clean networks are already indexed
+ * correctly. */
+static void index_net_port(struct lsdn_net *net)
+{
+	struct lsdn_settings *s = net->settings;
+	lsdn_index_remove(&net->ctx->net_port_index, &net->port_entry);
+	if (will_be_deleted(net->state) || s->nettype != LSDN_NET_VXLAN || !has_local_pa(net))
+		return;
+
+	bzero(&net->port_key, sizeof(net->port_key));
+	net->port_key.port = s->vxlan.port;
+	net->port_key.is_static_e2e = s->switch_type == LSDN_STATIC_E2E;
+	lsdn_index_add(&net->ctx->net_port_index, &net->port_entry, &net->port_key);
+}
+
+static void report_bad_nettype(struct lsdn_net *static_net, struct lsdn_net *other_net)
+{
+	lsdn_problem_report(
+		static_net->ctx, LSDNP_NET_BAD_NETTYPE,
+		LSDNS_NET, static_net,
+		LSDNS_NET, other_net,
+		LSDNS_END);
+}
+
+static void report_dupid(struct lsdn_net *net1, struct lsdn_net *net2)
+{
+	lsdn_problem_report(
+		net1->ctx, LSDNP_NET_DUPID,
+		LSDNS_NET, net1,
+		LSDNS_NET, net2,
+		LSDNS_NETID, net1->vnet_id,
+		LSDNS_END);
+}
+
+/** Check a dirty network against all other networks.
+ * \private
+ * If the other network is clean, the problem is also reported from its side. */
+static void cross_validate_networks(struct lsdn_net *net1)
+{
+	lsdn_index_foreach_dup(&net1->id_entry, id_entry, struct lsdn_net, net2) {
+		if (will_be_deleted(net2->state))
 			continue;
-		validate_virts_net(net1);
-		lsdn_foreach(ctx->networks_list, networks_entry, struct lsdn_net, net2) {
-			if (net1 != net2 && !will_be_deleted(net2->state))
-				cross_validate_networks(net1, net2);
-		}
+		report_dupid(net1, net2);
+		if (!is_dirty(&net2->dirty_entry))
+			report_dupid(net2, net1);
 	}
 
-	lsdn_foreach(ctx->phys_list, phys_entry, struct lsdn_phys, p){
-		if (will_be_deleted(p->state))
+	/* A static VXLAN can not share the UDP port with other VXLANs on the same host */
+	if (!net1->port_entry.indexed)
+		return;
+	struct lsdn_net_port_key key = net1->port_key;
+	key.is_static_e2e = !key.is_static_e2e;
+	struct lsdn_index_entry *head = lsdn_index_search(&net1->ctx->net_port_index, &key);
+	if (!head)
+		return;
+	struct lsdn_net *first = lsdn_container_of(head, struct lsdn_net, port_entry);
+	for (struct lsdn_net *net2 = first;;) {
+		if (net1->port_key.is_static_e2e)
+			report_bad_nettype(net1, net2);
+		else if (!is_dirty(&net2->dirty_entry))
+			report_bad_nettype(net2, net1);
+		net2 = lsdn_container_of(net2->port_entry.dups.next, struct lsdn_net, port_entry.dups);
+		if (net2 == first)
+			break;
+	}
+}
+
+static bool phys_has_ip(struct lsdn_phys *p)
+{
+	return p->attr_ip && !will_be_deleted(p->state);
+}
+
+static void validate_net_ipv(struct lsdn_net *n)
+{
+	/* Count the IP versions first, so that mixed networks, that need to be reported pairwise,
+	 * are the only case that is not linear */
+	size_t v4_count = 0, v6_count = 0;
+	lsdn_foreach(n->attached_list, attached_entry, struct lsdn_phys_attachment, a) {
+		if (!phys_has_ip(a->phys))
 			continue;
-		lsdn_foreach(p->attached_to_list, attached_to_entry, struct lsdn_phys_attachment, a)
-		{
-			if(!a->explicitely_attached){
-				report_virts(a);
-			}else{
-				if (p->is_local && !p->attr_iface)
-					lsdn_problem_report(
-						ctx, LSDNP_PHYS_NOATTR,
-						LSDNS_ATTR, "iface",
-						LSDNS_PHYS, p,
-						LSDNS_NET, a->net,
-						LSDNS_END);
-
-				if(should_be_validated(a->state) && a->net->settings->ops->validate_pa)
-					a->net->settings->ops->validate_pa(a);
-				validate_virts_pa(a);
-			}
-		}
-		lsdn_foreach(ctx->phys_list, phys_entry, struct lsdn_phys, p_other) {
-			if (p == p_other || will_be_deleted(p_other->state))
-				continue;
-			if (p->attr_ip && p_other->attr_ip)
-				if (lsdn_ip_eq(*p->attr_ip, *p_other->attr_ip))
-					lsdn_problem_report(
-						ctx, LSDNP_PHYS_DUPATTR,
-						LSDNS_ATTR, "ip",
-						LSDNS_PHYS, p,
-						LSDNS_PHYS, p_other,
-						LSDNS_END);
-		}
+		if (a->phys->attr_ip->v == LSDN_IPv4)
+			v4_count++;
+		else
+			v6_count++;
 	}
+	if (v4_count == 0 || v6_count == 0)
+		return;
 
-	lsdn_foreach(ctx->networks_list, networks_entry, struct lsdn_net, n) {
+	lsdn_foreach(
+		n->attached_list, attached_entry,
+		struct lsdn_phys_attachment, a) {
+		if (!phys_has_ip(a->phys))
+			continue;
 		lsdn_foreach(
 			n->attached_list, attached_entry,
-			struct lsdn_phys_attachment, a) {
-			if (!a->phys->attr_ip || will_be_deleted(a->phys->state))
+			struct lsdn_phys_attachment, a_other) {
+			if (a == a_other || !phys_has_ip(a_other->phys))
 				continue;
-			lsdn_foreach(
-				n->attached_list, attached_entry,
-				struct lsdn_phys_attachment, a_other) {
-				if (a == a_other)
-					continue;
-				if (!a_other->phys->attr_ip || will_be_deleted(a_other->phys->state))
-					continue;
-				if (!lsdn_ipv_eq(*a->phys->attr_ip, *a_other->phys->attr_ip))
-					lsdn_problem_report(
-						ctx, LSDNP_PHYS_INCOMPATIBLE_IPV,
-						LSDNS_PHYS, a->phys,
-						LSDNS_PHYS, a_other->phys,
-						LSDNS_NET, n,
-						LSDNS_END);
-			}
+			if (!lsdn_ipv_eq(*a->phys->attr_ip, *a_other->phys->attr_ip))
+				lsdn_problem_report(
+					n->ctx, LSDNP_PHYS_INCOMPATIBLE_IPV,
+					LSDNS_PHYS, a->phys,
+					LSDNS_PHYS, a_other->phys,
+					LSDNS_NET, n,
+					LSDNS_END);
 		}
 	}
+}
 
-	return (ctx->problem_count == 0) ? LSDNE_OK : LSDNE_VALIDATE;
+static void validate_phys(struct lsdn_phys *p)
+{
+	struct lsdn_context *ctx = p->ctx;
+	lsdn_foreach(p->attached_to_list, attached_to_entry, struct lsdn_phys_attachment, a)
+	{
+		/* Virts connected through implicit attachments are reported by validate_virt */
+		if (!a->explicitely_attached)
+			continue;
+		if (p->is_local && !p->attr_iface)
+			lsdn_problem_report(
+				ctx, LSDNP_PHYS_NOATTR,
+				LSDNS_ATTR, "iface",
+				LSDNS_PHYS, p,
+				LSDNS_NET, a->net,
+				LSDNS_END);
+
+		if(should_be_validated(a->state) && a->net->settings->ops->validate_pa) {
+			a->net->ctx->stats.net_ops[LSDN_OP_VALIDATE_PA]++;
+			a->net->settings->ops->validate_pa(a);
+		}
+	}
+
+	lsdn_index_foreach_dup(&p->ip_entry, ip_entry, struct lsdn_phys, p_other) {
+		if (will_be_deleted(p_other->state))
+			continue;
+		lsdn_problem_report(
+			ctx, LSDNP_PHYS_DUPATTR,
+			LSDNS_ATTR, "ip",
+			LSDNS_PHYS, p,
+			LSDNS_PHYS, p_other,
+			LSDNS_END);
+		/* Clean physes are not validated, so report from their side too */
+		if (!is_dirty(&p_other->dirty_entry))
+			lsdn_problem_report(
+				ctx, LSDNP_PHYS_DUPATTR,
+				LSDNS_ATTR, "ip",
+				LSDNS_PHYS, p_other,
+				LSDNS_PHYS, p,
+				LSDNS_END);
+	}
 }
 
-static void commit_pa(struct lsdn_phys_attachment *pa, lsdn_problem_cb cb, void *user)
+/** Propagate the RENEW state to dependent objects.
+ * \private
+ * Renewing a phys or a network renews its attachments and renewing an attachment renews the
+ * virts connected through it. Only the dirty objects can be renewed, so we only walk those. */
+static void propagate_states(struct lsdn_context *ctx)
 {
-	LSDN_UNUSED(cb); LSDN_UNUSED(user);
-	struct lsdn_net_ops *ops = pa->net->settings->ops;
-	if (pa->state == LSDN_STATE_NEW) {
-		lsdn_log(LSDNL_NETOPS, "create_pa(net = %s (%p), phys = %s (%p), pa = %p)\n",
-			 lsdn_nullable(pa->net->name.str), pa->net,
-			 lsdn_nullable(pa->phys->name.str), pa->phys,
-			 pa);
-		ops->create_pa(pa);
+	lsdn_foreach(ctx->dirty_phys, dirty_entry, struct lsdn_phys, p) {
+		lsdn_foreach(p->attached_to_list, attached_to_entry, struct lsdn_phys_attachment, pa) {
+			if (propagate(&p->state, &pa->state))
+				pa_touch(pa);
+		}
 	}
+	lsdn_foreach(ctx->dirty_nets, dirty_entry, struct lsdn_net, n){
+		lsdn_foreach(n->attached_list, attached_entry, struct lsdn_phys_attachment, pa) {
+			if (propagate(&n->state, &pa->state))
+				pa_touch(pa);
+		}
+	}
+	lsdn_foreach(ctx->dirty_pas, dirty_entry, struct lsdn_phys_attachment, pa){
+		/* Does not matter if we use committed_through or connected_through, if they
+		 * have changed, the virt must be renewed anyway */
+		lsdn_foreach(pa->connected_virt_list, connected_virt_entry, struct lsdn_virt, v) {
+			if (propagate(&pa->state, &v->state))
+				lsdn_virt_touch(v);
+		}
+	}
+}
 
-	lsdn_foreach(pa->connected_virt_list, connected_virt_entry, struct lsdn_virt, v) {
-		if (v->state == LSDN_STATE_NEW) {
-			v->committed_to = pa;
-			if (lsdn_if_copy(&v->committed_if, &v->connected_if) != LSDNE_OK)
-				abort();
-
-			if (ops->add_virt) {
-				lsdn_log(LSDNL_NETOPS, "add_virt(net = %s (%p), phys = %s (%p), pa = %p, virt = %s (%p)\n",
-					 lsdn_nullable(pa->net->name.str), pa->net,
-					 lsdn_nullable(pa->phys->name.str), pa->phys,
-					 pa,
-					 v->connected_if.ifname, v);
-				ops->add_virt(v);
-			}
+/** Fill `virt_mac_index` with the virts that will be validated.
+ * \private
+ * Only virts in the NEW or RENEW state are checked for duplicate MACs and those are all dirty. */
+static void index_virt_macs(struct lsdn_context *ctx)
+{
+	lsdn_foreach(ctx->dirty_virts, dirty_entry, struct lsdn_virt, v) {
+		if (!should_be_validated(v->state) || !v->attr_mac
+		    || will_be_deleted(v->network->state))
+			continue;
+		bzero(&v->mac_key, sizeof(v->mac_key));
+		v->mac_key.net = v->network;
+		v->mac_key.mac = *v->attr_mac;
+		lsdn_index_add(&ctx->virt_mac_index, &v->mac_entry, &v->mac_key);
+	}
+}
+
+/** Fill `virt_ip_index` with the validated virts of networks with neighbor suppression (which
+ * BPF switching ignores).
+ * \private
+ * For IPv6, only the last 24 bits are indexed -- the solicited-node multicast address, which
+ * the suppression rules match on, is made of them. */
+static void index_virt_ips(struct lsdn_context *ctx)
+{
+	lsdn_foreach(ctx->dirty_virts, dirty_entry, struct lsdn_virt, v) {
+		if (!should_be_validated(v->state) || !v->attr_ip
+		    || !v->network->settings->neigh_suppression || v->network->settings->bpf_switching
+		    || will_be_deleted(v->network->state))
+			continue;
+		bzero(&v->ip_key, sizeof(v->ip_key));
+		v->ip_key.net = v->network;
+		v->ip_key.ip.v = v->attr_ip->v;
+		if (v->attr_ip->v == LSDN_IPv4)
+			v->ip_key.ip.v4 = v->attr_ip->v4;
+		else
+			memcpy(&v->ip_key.ip.v6.bytes[13], &v->attr_ip->v6.bytes[13], 3);
+		lsdn_index_add(&ctx->virt_ip_index, &v->ip_entry, &v->ip_key);
+	}
+}
+
+/** Pick up the interface changes in the kernel.
+ * If the interface of a committed virt is gone, so is everything we have installed on it. The
+ * virt is then recommitted, without trying to remove the state the kernel has already removed.
+ * If the interface does not come back, the validation of the virt fails. */
+static lsdn_err_t sync_interfaces(struct lsdn_context *ctx)
+{
+	struct lsdn_iftable *ifs = &ctx->nlsock->ifs;
+	/* Nothing was resolved yet, so nothing could have been committed */
+	if (!ifs->synced)
+		return LSDNE_OK;
+
+	lsdn_err_t err = lsdn_nl_if_sync(ctx->nlsock);
+	if (err != LSDNE_OK)
+		return err;
+	if (ifs->removed == 0)
+		return LSDNE_OK;
+	ifs->removed = 0;
+
+	lsdn_foreach(ctx->networks_list, networks_entry, struct lsdn_net, net) {
+		lsdn_foreach(net->virt_list, virt_entry, struct lsdn_virt, v) {
+			if (!v->committed_to || v->committed_if.removed
+			    || lsdn_iftable_has(ifs, v->committed_if.ifindex))
+				continue;
+			lsdn_log(LSDNL_NETOPS, "interface %s of virt %p has disappeared\n",
+				 v->committed_if.ifname, v);
+			v->committed_if.removed = true;
+			if (v->state != LSDN_STATE_DELETE)
+				virt_renew(v);
 		}
-		commit_rules(v, v->ht_in_rules, LSDN_IN);
-		commit_rules(v, v->ht_out_rules, LSDN_OUT);
 	}
+	return LSDNE_OK;
+}
 
-	lsdn_foreach(pa->net->attached_list, attached_entry, struct lsdn_phys_attachment, remote) {
-		if (remote == pa)
+lsdn_err_t lsdn_validate(struct lsdn_context *ctx, lsdn_problem_cb cb, void *user)
+{
+	ctx->problem_cb = cb;
+	ctx->problem_cb_user = user;
+	ctx->problem_count = 0;
+
+	lsdn_err_t err = sync_interfaces(ctx);
+	if (err != LSDNE_OK)
+		return err;
+	propagate_states(ctx);
+
+	/******* Do the validation ********/
+	/* Pairwise checks are done between a dirty object and all others. If both are dirty, the
+	 * problem is reported from both sides, just like if all objects were validated. The
+	 * conflicting objects are looked up in the indices. */
+	lsdn_foreach(ctx->dirty_nets, dirty_entry, struct lsdn_net, net) {
+		index_net_port(net);
+	}
+	lsdn_foreach(ctx->dirty_nets, dirty_entry, struct lsdn_net, net) {
+		if (will_be_deleted(net->state))
 			continue;
-		if (pa->state != LSDN_STATE_NEW && remote->state != LSDN_STATE_NEW)
+		cross_validate_networks(net);
+		validate_net_ipv(net);
+	}
+
+	index_virt_macs(ctx);
+	index_virt_ips(ctx);
+	lsdn_foreach(ctx->dirty_virts, dirty_entry, struct lsdn_virt, v) {
+		if (will_be_deleted(v->state) || will_be_deleted(v->network->state))
+			continue;
+		validate_virt(v);
+	}
+	lsdn_index_clear(&ctx->virt_mac_index);
+	lsdn_index_clear(&ctx->virt_ip_index);
+
+	/* Virts sharing tc blocks must agree on their rules, this also covers the clean virts */
+	lsdn_foreach(ctx->dirty_virts, dirty_entry, struct lsdn_virt, v) {
+		struct lsdn_phys_attachment *pa = v->connected_through;
+		if (will_be_deleted(v->state) || will_be_deleted(v->network->state) || !pa
+		    || !uses_shared_blocks(pa) || pa->rules_reference)
 			continue;
+		validate_shared_rules(pa);
+	}
+	lsdn_foreach(ctx->dirty_virts, dirty_entry, struct lsdn_virt, v) {
+		if (v->connected_through)
+			v->connected_through->rules_reference = NULL;
+	}
+
+	lsdn_foreach(ctx->dirty_phys, dirty_entry, struct lsdn_phys, p){
+		if (will_be_deleted(p->state))
+			continue;
+		validate_phys(p);
+	}
+
+	return (ctx->problem_count == 0) ? LSDNE_OK : LSDNE_VALIDATE;
+}
 
-		struct lsdn_remote_pa *rpa = malloc(sizeof(*rpa));
-		if (!rpa)
+static void commit_local_virt(struct lsdn_phys_attachment *pa, struct lsdn_virt *v)
+{
+	struct lsdn_net_ops *ops = pa->net->settings->ops;
+	if (v->state == LSDN_STATE_NEW) {
+		v->committed_to = pa;
+		if (lsdn_if_copy(&v->committed_if, &v->connected_if) != LSDNE_OK)
 			abort();
-		rpa->local = pa;
-		rpa->remote = remote;
-		lsdn_list_init_add(&remote->pa_view_list, &rpa->pa_view_entry);
-		lsdn_list_init_add(&pa->remote_pa_list, &rpa->remote_pa_entry);
-		lsdn_list_init(&rpa->remote_virt_list);
-		if (ops->add_remote_pa) {
-			lsdn_log(LSDNL_NETOPS, "add_remote_pa("
-				 "net = %s (%p), local_phys = %s (%p), remote_phys = %s (%p), "
-				 "local_pa = %p, remote_pa = %p, remote_pa_view = %p)\n",
+
+		if (ops->add_virt) {
+			lsdn_log(LSDNL_NETOPS, "add_virt(net = %s (%p), phys = %s (%p), pa = %p, virt = %s (%p)\n",
 				 lsdn_nullable(pa->net->name.str), pa->net,
 				 lsdn_nullable(pa->phys->name.str), pa->phys,
-				 lsdn_nullable(remote->phys->name.str), remote->phys,
-				 pa, remote, rpa);
-			ops->add_remote_pa(rpa);
+				 pa,
+				 v->connected_if.ifname, v);
+			pa->net->ctx->stats.net_ops[LSDN_OP_ADD_VIRT]++;
+			ops->add_virt(v);
 		}
 	}
+	bool take_over = false;
+	if (v->in_shared_blocks && !pa->rules_leader) {
+		pa->rules_leader = v;
+		take_over = true;
+	}
+	commit_rules(v, v->ht_in_rules, LSDN_IN, take_over);
+	commit_rules(v, v->ht_out_rules, LSDN_OUT, take_over);
+}
+
+static struct lsdn_remote_pa *commit_remote_pa(
+	struct lsdn_phys_attachment *pa, struct lsdn_phys_attachment *remote)
+{
+	struct lsdn_net_ops *ops = pa->net->settings->ops;
+	struct lsdn_remote_pa *rpa = lsdn_slab_alloc(&pa->remote_pa_slab);
+	if (!rpa)
+		abort();
+	lsdn_stats_object_new(pa->net->ctx, LSDN_OBJ_REMOTE_PA);
+	rpa->local = pa;
+	rpa->remote = remote;
+	lsdn_list_init_add(&remote->pa_view_list, &rpa->pa_view_entry);
+	lsdn_list_init_add(&pa->remote_pa_list, &rpa->remote_pa_entry);
+	lsdn_list_init(&rpa->remote_virt_list);
+	if (ops->add_remote_pa) {
+		lsdn_log(LSDNL_NETOPS, "add_remote_pa("
+			 "net = %s (%p), local_phys = %s (%p), remote_phys = %s (%p), "
+			 "local_pa = %p, remote_pa = %p, remote_pa_view = %p)\n",
+			 lsdn_nullable(pa->net->name.str), pa->net,
+			 lsdn_nullable(pa->phys->name.str), pa->phys,
+			 lsdn_nullable(remote->phys->name.str), remote->phys,
+			 pa, remote, rpa);
+		pa->net->ctx->stats.net_ops[LSDN_OP_ADD_REMOTE_PA]++;
+		ops->add_remote_pa(rpa);
+	}
+	return rpa;
+}
+
+static void commit_remote_virt(struct lsdn_remote_pa *remote, struct lsdn_virt *v)
+{
+	struct lsdn_phys_attachment *pa = remote->local;
+	struct lsdn_net_ops *ops = pa->net->settings->ops;
+	struct lsdn_remote_virt *rvirt = lsdn_slab_alloc(&pa->remote_virt_slab);
+	if(!rvirt)
+		abort();
+	lsdn_stats_object_new(pa->net->ctx, LSDN_OBJ_REMOTE_VIRT);
+	rvirt->pa = remote;
+	rvirt->virt = v;
+	lsdn_list_init_add(&v->virt_view_list, &rvirt->virt_view_entry);
+	lsdn_list_init_add(&remote->remote_virt_list, &rvirt->remote_virt_entry);
+	if (ops->add_remote_virt) {
+		lsdn_log(LSDNL_NETOPS, "add_remote_virt("
+			 "net = %s (%p), local_phys = %s (%p), remote_phys = %s (%p), "
+			 "local_pa = %p, remote_pa = %p, remote_pa_view = %p, virt = %p)\n",
+			 lsdn_nullable(pa->net->name.str), pa->net,
+			 lsdn_nullable(pa->phys->name.str), pa->phys,
+			 lsdn_nullable(remote->remote->phys->name.str), remote->remote->phys,
+			 pa, remote->remote, remote, v);
+		pa->net->ctx->stats.net_ops[LSDN_OP_ADD_REMOTE_VIRT]++;
+		ops->add_remote_virt(rvirt);
+	}
+}
+
+/** Commit a new local PA, together with everything it can see in the network. */
+static void commit_pa(struct lsdn_phys_attachment *pa)
+{
+	struct lsdn_net_ops *ops = pa->net->settings->ops;
+	assert(pa->state == LSDN_STATE_NEW);
+	lsdn_log(LSDNL_NETOPS, "create_pa(net = %s (%p), phys = %s (%p), pa = %p)\n",
+		 lsdn_nullable(pa->net->name.str), pa->net,
+		 lsdn_nullable(pa->phys->name.str), pa->phys,
+		 pa);
+	pa->net->ctx->stats.net_ops[LSDN_OP_CREATE_PA]++;
+	ops->create_pa(pa);
+
+	lsdn_foreach(pa->connected_virt_list, connected_virt_entry, struct lsdn_virt, v) {
+		commit_local_virt(pa, v);
+	}
+
+	lsdn_foreach(pa->net->attached_list, attached_entry, struct lsdn_phys_attachment, remote) {
+		if (remote != pa)
+			commit_remote_pa(pa, remote);
+	}
 
 	lsdn_foreach(pa->remote_pa_list, remote_pa_entry, struct lsdn_remote_pa, remote) {
 		lsdn_foreach(remote->remote->connected_virt_list, connected_virt_entry, struct lsdn_virt, v) {
-			if (pa->state != LSDN_STATE_NEW && v->state != LSDN_STATE_NEW)
+			commit_remote_virt(remote, v);
+		}
+	}
+}
+
+static bool is_new_local(struct lsdn_phys_attachment *pa)
+{
+	return pa->phys->is_local && pa->state == LSDN_STATE_NEW;
+}
+
+/* The work unit the PA belongs to. The networks sharing a tunnel must be created one after another,
+ * the rest is independent. */
+static size_t *unit_of(struct lsdn_phys_attachment *pa)
+{
+	struct lsdn_settings *s = pa->net->settings;
+	if (s->nettype == LSDN_NET_VXLAN && s->switch_type == LSDN_STATIC_E2E)
+		return &s->commit_unit;
+	return &pa->net->commit_unit;
+}
+
+/** New local PAs of a parallel commit, grouped into work units. */
+struct commit_units {
+	/** The PAs, ordered by their unit (and by `dirty_pas` within the unit). */
+	struct lsdn_phys_attachment **pas;
+	/** Index of the first PA of each unit, followed by the PA count. */
+	size_t *first;
+};
+
+static void commit_unit(size_t unit, void *user)
+{
+	struct commit_units *units = user;
+	for (size_t i = units->first[unit]; i < units->first[unit + 1]; i++)
+		commit_pa(units->pas[i]);
+}
+
+/** Create the new local PAs, using the threads given by `lsdn_context_set_commit_threads`. */
+static void commit_new_pas(struct lsdn_context *ctx)
+{
+	size_t count = 0, unit_count = 0;
+	if (ctx->commit_threads > 1) {
+		lsdn_foreach(ctx->dirty_pas, dirty_entry, struct lsdn_phys_attachment, pa) {
+			if (!is_new_local(pa))
 				continue;
-			struct lsdn_remote_virt *rvirt = malloc(sizeof(*rvirt));
-			if(!rvirt)
-				abort();
-			rvirt->pa = remote;
-			rvirt->virt = v;
-			lsdn_list_init_add(&v->virt_view_list, &rvirt->virt_view_entry);
-			lsdn_list_init_add(&remote->remote_virt_list, &rvirt->remote_virt_entry);
-			if (ops->add_remote_virt) {
-				lsdn_log(LSDNL_NETOPS, "add_remote_virt("
-					 "net = %s (%p), local_phys = %s (%p), remote_phys = %s (%p), "
-					 "local_pa = %p, remote_pa = %p, remote_pa_view = %p, virt = %p)\n",
-					 lsdn_nullable(pa->net->name.str), pa->net,
-					 lsdn_nullable(pa->phys->name.str), pa->phys,
-					 lsdn_nullable(remote->remote->phys->name.str), remote->remote->phys,
-					 pa, remote->remote, remote, v);
-				ops->add_remote_virt(rvirt);
-			}
+			size_t *unit = unit_of(pa);
+			if (*unit == SIZE_MAX)
+				*unit = unit_count++;
+			count++;
 		}
 	}
+
+	if (unit_count > 1) {
+		struct commit_units units;
+		units.pas = malloc(count * sizeof(*units.pas));
+		units.first = calloc(unit_count + 1, sizeof(*units.first));
+		if (!units.pas || !units.first)
+			abort();
+		/* Count the PAs of each unit, turn the counts into the starts of the units and fill
+		 * them in, which moves each start to the end of its unit */
+		lsdn_foreach(ctx->dirty_pas, dirty_entry, struct lsdn_phys_attachment, pa) {
+			if (is_new_local(pa))
+				units.first[*unit_of(pa) + 1]++;
+		}
+		for (size_t u = 0; u < unit_count; u++)
+			units.first[u + 1] += units.first[u];
+		lsdn_foreach(ctx->dirty_pas, dirty_entry, struct lsdn_phys_attachment, pa) {
+			if (is_new_local(pa))
+				units.pas[units.first[*unit_of(pa)]++] = pa;
+		}
+		for (size_t u = unit_count; u > 0; u--)
+			units.first[u] = units.first[u - 1];
+		units.first[0] = 0;
+
+		lsdn_pool_run(ctx->nlsock, ctx->commit_threads, unit_count, commit_unit, &units);
+		free(units.pas);
+		free(units.first);
+	} else {
+		lsdn_foreach(ctx->dirty_pas, dirty_entry, struct lsdn_phys_attachment, pa) {
+			if (is_new_local(pa))
+				commit_pa(pa);
+		}
+	}
+
+	lsdn_foreach(ctx->dirty_pas, dirty_entry, struct lsdn_phys_attachment, pa) {
+		*unit_of(pa) = SIZE_MAX;
+	}
 }
 
 static void decommit_remote_virt(struct lsdn_remote_virt *rv)
@@ -960,11 +1971,113 @@ static void decommit_remote_virt(struct lsdn_remote_virt *rv)
 				lsdn_nullable(rv->pa->local->phys->name.str), rv->pa->local->phys,
 				lsdn_nullable(rv->pa->remote->phys->name.str), rv->pa->remote->phys,
 				rv->pa->local, rv->pa->local, rv->pa, rv->virt);
+		rv->virt->network->ctx->stats.net_ops[LSDN_OP_REMOVE_REMOTE_VIRT]++;
 		ops->remove_remote_virt(rv);
 	}
 	lsdn_list_remove(&rv->remote_virt_entry);
 	lsdn_list_remove(&rv->virt_view_entry);
-	free(rv);
+	lsdn_stats_object_free(rv->virt->network->ctx, LSDN_OBJ_REMOTE_VIRT);
+	lsdn_slab_return(&rv->pa->local->remote_virt_slab, rv);
+}
+
+/** Pass the leadership of shared blocks to another virt bound to them.
+ * \private
+ * The rules of the old leader are already removed. The new leader is touched, so that it installs
+ * its rules when the virts are committed. */
+static void hand_over_rules(struct lsdn_virt *leader)
+{
+	struct lsdn_phys_attachment *pa = leader->committed_to;
+	pa->rules_leader = NULL;
+	lsdn_foreach(pa->connected_virt_list, connected_virt_entry, struct lsdn_virt, v) {
+		if (v != leader && v->in_shared_blocks && v->committed_to == pa
+		    && !will_be_deleted(v->state)) {
+			lsdn_virt_touch(v);
+			return;
+		}
+	}
+}
+
+static struct lsdn_remote_pa *find_remote_pa(
+	struct lsdn_phys_attachment *local, struct lsdn_phys_attachment *remote)
+{
+	lsdn_foreach(local->remote_pa_list, remote_pa_entry, struct lsdn_remote_pa, rpa) {
+		if (rpa->remote == remote)
+			return rpa;
+	}
+	return NULL;
+}
+
+/** Can the remote views of a migrated virt be moved to its new phys, instead of recreated?
+ * \private
+ * The virt must be remote on this machine both before and after the move and the local PAs
+ * seeing it must already see its new PA. */
+static bool can_move_views(struct lsdn_virt *v)
+{
+	struct lsdn_net_ops *ops = v->network->settings->ops;
+	struct lsdn_phys_attachment *to = v->connected_through;
+	if (!v->only_moved || v->state != LSDN_STATE_RENEW || v->committed_to)
+		return false;
+	if (ops->add_remote_virt && !ops->move_remote_virt)
+		return false;
+	if (!to || to->state != LSDN_STATE_OK || to->phys->is_local)
+		return false;
+	lsdn_foreach(v->virt_view_list, virt_view_entry, struct lsdn_remote_virt, rv) {
+		if (rv->pa->remote == to || !find_remote_pa(rv->pa->local, to))
+			return false;
+	}
+	return true;
+}
+
+/** Move the remote views of a migrated virt to its new phys.
+ * \private
+ * The kernel only sees the forwarding of the virt changed, not removed and added again. */
+static void move_views(struct lsdn_virt *v)
+{
+	struct lsdn_net_ops *ops = v->network->settings->ops;
+	lsdn_foreach(v->virt_view_list, virt_view_entry, struct lsdn_remote_virt, rv) {
+		struct lsdn_remote_pa *from = rv->pa;
+		struct lsdn_remote_pa *to = find_remote_pa(from->local, v->connected_through);
+		lsdn_list_remove(&rv->remote_virt_entry);
+		lsdn_list_init_add(&to->remote_virt_list, &rv->remote_virt_entry);
+		rv->pa = to;
+		if (ops->move_remote_virt) {
+			lsdn_log(LSDNL_NETOPS, "move_remote_virt("
+				 "net = %s (%p), local_phys = %s (%p), remote_phys = %s (%p) -> %s (%p), "
+				 "local_pa = %p, remote_pa_view = %p -> %p, virt = %p)\n",
+				 lsdn_nullable(v->network->name.str), v->network,
+				 lsdn_nullable(from->local->phys->name.str), from->local->phys,
+				 lsdn_nullable(from->remote->phys->name.str), from->remote->phys,
+				 lsdn_nullable(to->remote->phys->name.str), to->remote->phys,
+				 from->local, from, to, v);
+			v->network->ctx->stats.net_ops[LSDN_OP_MOVE_REMOTE_VIRT]++;
+			ops->move_remote_virt(rv, from);
+		}
+	}
+}
+
+/** Tell the existing views of a remote phys about its new IP.
+ * \private
+ * The views being recreated in this commit already use the new IP. */
+static void readdress_remote_pas(struct lsdn_phys *phys)
+{
+	lsdn_foreach(phys->attached_to_list, attached_to_entry, struct lsdn_phys_attachment, remote) {
+		if (remote->state != LSDN_STATE_OK)
+			continue;
+		struct lsdn_net_ops *ops = remote->net->settings->ops;
+		lsdn_foreach(remote->pa_view_list, pa_view_entry, struct lsdn_remote_pa, rpa) {
+			if (rpa->local->state != LSDN_STATE_OK)
+				continue;
+			lsdn_log(LSDNL_NETOPS, "update_remote_pa("
+				 "net = %s (%p), local_phys = %s (%p), remote_phys = %s (%p), "
+				 "local_pa = %p, remote_pa = %p, remote_pa_view = %p)\n",
+				 lsdn_nullable(remote->net->name.str), remote->net,
+				 lsdn_nullable(rpa->local->phys->name.str), rpa->local->phys,
+				 lsdn_nullable(phys->name.str), phys,
+				 rpa->local, remote, rpa);
+			phys->ctx->stats.net_ops[LSDN_OP_UPDATE_REMOTE_PA]++;
+			ops->update_remote_pa(rpa);
+		}
+	}
 }
 
 static void decommit_virt(struct lsdn_virt *v)
@@ -976,6 +2089,9 @@ static void decommit_virt(struct lsdn_virt *v)
 		decommit_remote_virt(rv);
 	}
 
+	if (pa && pa->rules_leader == v)
+		hand_over_rules(v);
+
 	if (pa) {
 		if (ops->remove_virt) {
 			lsdn_log(LSDNL_NETOPS, "remove_virt(net = %s (%p), phys = %s (%p), pa = %p, virt = %s (%p)\n",
@@ -983,6 +2099,7 @@ static void decommit_virt(struct lsdn_virt *v)
 				 lsdn_nullable(pa->phys->name.str), pa->phys,
 				 pa,
 				 v->committed_if.ifname, v);
+			v->network->ctx->stats.net_ops[LSDN_OP_REMOVE_VIRT]++;
 			ops->remove_virt(v);
 		}
 		v->committed_to = NULL;
@@ -1008,12 +2125,14 @@ static void decommit_remote_pa(struct lsdn_remote_pa *rpa)
 			 lsdn_nullable(local->phys->name.str), local->phys,
 			 lsdn_nullable(remote->phys->name.str), remote->phys,
 			 local, remote, rpa);
+		local->net->ctx->stats.net_ops[LSDN_OP_REMOVE_REMOTE_PA]++;
 		ops->remove_remote_pa(rpa);
 	}
 	lsdn_list_remove(&rpa->pa_view_entry);
 	lsdn_list_remove(&rpa->remote_pa_entry);
 	assert(lsdn_is_list_empty(&rpa->remote_virt_list));
-	free(rpa);
+	lsdn_stats_object_free(local->net->ctx, LSDN_OBJ_REMOTE_PA);
+	lsdn_slab_return(&local->remote_pa_slab, rpa);
 }
 
 static void decommit_pa(struct lsdn_phys_attachment *pa)
@@ -1034,6 +2153,7 @@ static void decommit_pa(struct lsdn_phys_attachment *pa)
 				 lsdn_nullable(pa->net->name.str), pa->net,
 				 lsdn_nullable(pa->phys->name.str), pa->phys,
 				 pa);
+			pa->net->ctx->stats.net_ops[LSDN_OP_DESTROY_PA]++;
 			ops->destroy_pa(pa);
 		}
 	}
@@ -1041,98 +2161,163 @@ static void decommit_pa(struct lsdn_phys_attachment *pa)
 
 static void trigger_startup_hooks(struct lsdn_context *ctx)
 {
-	// TODO: only do for new PAs
-	lsdn_foreach(ctx->phys_list, phys_entry, struct lsdn_phys, p) {
-		if (p->is_local) {
-			lsdn_foreach(
-				p->attached_to_list, attached_to_entry,
-				struct lsdn_phys_attachment, a)
-			{
-				struct lsdn_settings *s = a->net->settings;
-				if (s->user_hooks && s->user_hooks->lsdn_startup_hook)
-					s->user_hooks->lsdn_startup_hook(
-						a->net, p, s->user_hooks->lsdn_startup_hook_user);
-			}
-		}
+	/* Only for PAs that are going to be (re)created */
+	lsdn_foreach(ctx->dirty_pas, dirty_entry, struct lsdn_phys_attachment, a) {
+		if (!a->phys->is_local || !should_be_validated(a->state))
+			continue;
+		struct lsdn_settings *s = a->net->settings;
+		if (s->user_hooks && s->user_hooks->lsdn_startup_hook)
+			s->user_hooks->lsdn_startup_hook(
+				a->net, a->phys, s->user_hooks->lsdn_startup_hook_user);
 	}
 }
 
 lsdn_err_t lsdn_commit(struct lsdn_context *ctx, lsdn_problem_cb cb, void *user)
 {
+	uint64_t phase_start = lsdn_stats_now();
+	ctx->stats.commits++;
+
+	propagate_states(ctx);
 	trigger_startup_hooks(ctx);
 
 	lsdn_err_t lerr = lsdn_validate(ctx, cb, user);
+	lsdn_stats_phase_end(ctx, LSDN_PHASE_VALIDATE, &phase_start);
 	if(lerr != LSDNE_OK)
 		return lerr;
 
 	/* List of objects to process:
 	 *	setting, network, phys, physical attachment, virt
 	 * Settings, networks and attachments do not need to be committed in any way, but we must keep them
-	 * alive until PAs and virts are deleted. */
+	 * alive until PAs and virts are deleted.
+	 *
+	 * Only the objects on the dirty lists are processed, everything else is already committed
+	 * and does not need to be touched. */
 
 	/********* Decommit phase **********/
-	lsdn_foreach(ctx->networks_list, networks_entry, struct lsdn_net, n) {
-		lsdn_foreach(n->virt_list, virt_entry, struct lsdn_virt, v) {
-			decommit_rules(v, v->ht_in_rules, LSDN_IN);
-			decommit_rules(v, v->ht_out_rules, LSDN_OUT);
-			if (ack_uncommit(&v->state)) {
-				decommit_virt(v);
-				ack_delete(v, virt_do_free);
-			}
+	lsdn_foreach(ctx->dirty_virts, dirty_entry, struct lsdn_virt, v) {
+		decommit_rules(v, v->ht_in_rules, LSDN_IN);
+		decommit_rules(v, v->ht_out_rules, LSDN_OUT);
+		/* A migrated virt stays in the RENEW state, so that no new views are committed */
+		if (can_move_views(v)) {
+			move_views(v);
+		} else if (ack_uncommit(&v->state)) {
+			decommit_virt(v);
+			ack_delete(v, virt_do_free);
 		}
-		lsdn_foreach(n->attached_list, attached_entry, struct lsdn_phys_attachment, pa) {
-			if (ack_uncommit(&pa->state)) {
-				decommit_pa(pa);
-				ack_delete(pa, pa_do_free);
-			}
+	}
+
+	lsdn_foreach(ctx->dirty_pas, dirty_entry, struct lsdn_phys_attachment, pa) {
+		if (ack_uncommit(&pa->state)) {
+			decommit_pa(pa);
+			ack_delete(pa, pa_do_free);
 		}
+	}
+
+	lsdn_foreach(ctx->dirty_nets, dirty_entry, struct lsdn_net, n) {
 		if (ack_uncommit(&n->state))
 			ack_delete(n, net_do_free);
 	}
 
-	lsdn_foreach(ctx->phys_list, phys_entry, struct lsdn_phys, p){
+	lsdn_foreach(ctx->dirty_phys, dirty_entry, struct lsdn_phys, p){
 		if (ack_uncommit(&p->state))
 			ack_delete(p, phys_do_free)
 	}
 
-	lsdn_foreach(ctx->settings_list, settings_entry, struct lsdn_settings, s) {
+	lsdn_foreach(ctx->dirty_settings, dirty_entry, struct lsdn_settings, s) {
 		if (ack_uncommit(&s->state))
 			ack_delete(s, settings_do_free);
 	}
 
+	lsdn_stats_phase_end(ctx, LSDN_PHASE_DECOMMIT, &phase_start);
+
 	/********* (Re)commit phase **********/
-	/* first create physical attachments for local physes and populate
-	 * them with virts, remote PAs and remote virts */
-	lsdn_foreach(ctx->phys_list, phys_entry, struct lsdn_phys, p){
-		if (p->is_local) {
+	lsdn_foreach(ctx->dirty_phys, dirty_entry, struct lsdn_phys, p){
+		if (p->is_local)
 			p->committed_as_local = p->is_local;
-			lsdn_foreach(
-				p->attached_to_list, attached_to_entry,
-				struct lsdn_phys_attachment, pa)
-			{
-				commit_pa(pa, cb, user);
+	}
+
+	lsdn_foreach(ctx->dirty_phys, dirty_entry, struct lsdn_phys, p){
+		if (p->ip_changed && p->state == LSDN_STATE_OK)
+			readdress_remote_pas(p);
+	}
+
+	/* First create new local PAs and populate them with virts, remote PAs and remote virts */
+	commit_new_pas(ctx);
+
+	/* Then show new PAs to the already existing local PAs */
+	lsdn_foreach(ctx->dirty_pas, dirty_entry, struct lsdn_phys_attachment, remote) {
+		if (remote->state != LSDN_STATE_NEW)
+			continue;
+		lsdn_foreach(remote->net->attached_list, attached_entry, struct lsdn_phys_attachment, pa) {
+			if (pa == remote || !pa->phys->is_local || pa->state == LSDN_STATE_NEW)
+				continue;
+			struct lsdn_remote_pa *rpa = commit_remote_pa(pa, remote);
+			lsdn_foreach(remote->connected_virt_list, connected_virt_entry, struct lsdn_virt, v) {
+				commit_remote_virt(rpa, v);
 			}
 		}
 	}
 
+	/* And finally the changed virts on existing PAs, both local and remote */
+	lsdn_foreach(ctx->dirty_virts, dirty_entry, struct lsdn_virt, v) {
+		struct lsdn_phys_attachment *pa = v->connected_through;
+		/* New PAs have been populated by now */
+		if (!pa || pa->state == LSDN_STATE_NEW)
+			continue;
+		if (pa->phys->is_local)
+			commit_local_virt(pa, v);
+		if (v->state != LSDN_STATE_NEW)
+			continue;
+		lsdn_foreach(pa->pa_view_list, pa_view_entry, struct lsdn_remote_pa, rpa) {
+			if (rpa->local->state != LSDN_STATE_NEW)
+				commit_remote_virt(rpa, v);
+		}
+	}
+
+	/* Before the filters jumping to them */
+	lsdn_bpf_filter_flush(ctx);
+	lsdn_ruleset_flush(ctx);
+	lsdn_broadcast_flush(ctx);
+	/* Only once no filter uses them */
+	lsdn_tunnel_key_flush(ctx);
+
+	/* Most of the kernel changes were only queued up to now, send them and wait for the ACKs */
+	if (lsdn_nl_flush(ctx->nlsock) != LSDNE_OK)
+		abort();
+	/* After a warm restart, remove what the previous context has left and the model has not
+	 * adopted */
+	if (ctx->nlsock->adopt && lsdn_adopt_finish(ctx->nlsock) != LSDNE_OK)
+		abort();
+	lsdn_stats_phase_end(ctx, LSDN_PHASE_COMMIT, &phase_start);
+
 	/********* Ack phase **********/
-	lsdn_foreach(ctx->settings_list, settings_entry, struct lsdn_settings, s) {
+	lsdn_foreach(ctx->dirty_settings, dirty_entry, struct lsdn_settings, s) {
 		ack_state(&s->state);
+		mark_clean(&s->dirty_entry);
 	}
 
-	lsdn_foreach(ctx->phys_list, phys_entry, struct lsdn_phys, p){
+	lsdn_foreach(ctx->dirty_phys, dirty_entry, struct lsdn_phys, p){
 		ack_state(&p->state);
+		p->ip_changed = false;
+		mark_clean(&p->dirty_entry);
 	}
 
-	lsdn_foreach(ctx->networks_list, networks_entry, struct lsdn_net, n){
+	lsdn_foreach(ctx->dirty_nets, dirty_entry, struct lsdn_net, n){
 		ack_state(&n->state);
-		lsdn_foreach(n->attached_list, attached_entry, struct lsdn_phys_attachment, pa) {
-			ack_state(&pa->state);
-		}
-		lsdn_foreach(n->virt_list, virt_entry, struct lsdn_virt, v) {
-			ack_state(&v->state);
-		}
+		mark_clean(&n->dirty_entry);
+	}
+
+	lsdn_foreach(ctx->dirty_pas, dirty_entry, struct lsdn_phys_attachment, pa) {
+		ack_state(&pa->state);
+		mark_clean(&pa->dirty_entry);
+	}
+
+	lsdn_foreach(ctx->dirty_virts, dirty_entry, struct lsdn_virt, v) {
+		ack_state(&v->state);
+		v->only_moved = false;
+		mark_clean(&v->dirty_entry);
 	}
+	lsdn_stats_phase_end(ctx, LSDN_PHASE_ACK, &phase_start);
 
 	return (ctx->problem_count == 0) ? LSDNE_OK : LSDNE_COMMIT;
 }
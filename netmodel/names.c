@@ -5,85 +5,103 @@
 #include <string.h>
 #include <stdlib.h>
 
-/** Set up a list of names.
+/** Set up a table of names.
  * Intended to be called on a member variable of another struct.
- * @param tab The list variable to initialize. */
+ * @param tab The table variable to initialize. */
 void lsdn_names_init(struct lsdn_names *tab)
 {
 	lsdn_list_init(&tab->head);
+	tab->hash = NULL;
 }
 
-/** Free a list of names.
- * Doesn't actually do anything. */
+/** Free a table of names.
+ * The names still in the table are not freed, only detached from it.
+ * @param tab The table to free. */
 void lsdn_names_free(struct lsdn_names *tab)
 {
-	LSDN_UNUSED(tab);
+	lsdn_foreach(tab->head, entry, struct lsdn_name, name) {
+		lsdn_list_remove(&name->entry);
+		name->table = NULL;
+	}
+	HASH_CLEAR(hh, tab->hash);
 }
 
 /** Update an existing name.
  * If the new name is the same as the old name, returns `LSDNE_OK` immediately. 
  * Otherwise checks for uniqueness within `table` and if that succeeds,
- * assigns the new name to the `name` variable.
+ * assigns the new name to the `name` variable. The renamed entry moves to the end of the table.
  * @param name Name struct.
- * @param[in] table List of names.
- * @param[in] str New name.
+ * @param[in] table Table of names.
+ * @param[in] str New name, `NULL` removes the name (see `lsdn_name_clear`).
  * @return `LSDNE_OK` if the update was successful. 
  * @return `LSDNE_DUPLICATE` if the name already exists in `table`. 
  * @return `LSDNE_NOMEM` if memory allocation failed. */
 lsdn_err_t lsdn_name_set(struct lsdn_name *name, struct lsdn_names *table, const char* str)
 {
-	if(name->str == str)
+	if (!str) {
+		lsdn_name_clear(name);
 		return LSDNE_OK;
-	if(str && name->str && strcmp(name->str, str) == 0)
+	}
+	if(name->str && strcmp(name->str, str) == 0)
 		return LSDNE_OK;
 
-	if(str && lsdn_names_search(table, str))
+	if(lsdn_names_search(table, str))
 		return LSDNE_DUPLICATE;
 
 	char *namedup = strdup(str);
-	if(str && !namedup)
+	if(!namedup)
 		return LSDNE_NOMEM;
 
-	free(name->str);
-	if (!lsdn_is_list_empty(&name->entry))
-		lsdn_list_remove(&name->entry);
-
+	lsdn_name_clear(name);
 	name->str = namedup;
-	lsdn_list_add(&table->head, &name->entry);
+	name->table = table;
+	lsdn_list_add(table->head.previous, &name->entry);
+	HASH_ADD_KEYPTR(hh, table->hash, name->str, strlen(name->str), name);
 
 	return LSDNE_OK;
 }
 
+/** Remove a name from its table.
+ * The name can be set again later by `lsdn_name_set`. Does nothing if the name is not set.
+ * @param name Pointer to a name struct. */
+void lsdn_name_clear(struct lsdn_name *name)
+{
+	if (name->table) {
+		HASH_DELETE(hh, name->table->hash, name);
+		name->table = NULL;
+	}
+	if (!lsdn_is_list_empty(&name->entry))
+		lsdn_list_remove(&name->entry);
+	free(name->str);
+	name->str = NULL;
+}
+
 /** Set up an individual name.
  * @param name Pointer to a name struct. */
 void lsdn_name_init(struct lsdn_name *name)
 {
 	lsdn_list_init(&name->entry);
 	name->str = NULL;
+	name->table = NULL;
 }
 
 /** Free a name.
- * Frees the associated string and removes the name from the list.
+ * Frees the associated string and removes the name from its table.
  * @param name Pointer to a name struct. */
 void lsdn_name_free(struct lsdn_name *name)
 {
-	free(name->str);
-	if (!lsdn_is_list_empty(&name->entry))
-		lsdn_list_remove(&name->entry);
+	lsdn_name_clear(name);
 }
 
 /** Find a name struct corresponding to a given string.
- * Walks the list of names and checks whether the string exists in it.
- * @param[in] table List of names.
+ * Looks the string up in the hash of the table.
+ * @param[in] table Table of names.
  * @param[in] key Search string.
  * @return Name struct corresponding to `key`, if found.
- * @return `NULL` if the name is not found in the list. */
+ * @return `NULL` if the name is not found in the table. */
 struct lsdn_name *lsdn_names_search(struct lsdn_names *table, const char* key)
 {
-	lsdn_foreach(table->head, entry, struct lsdn_name, name)
-	{
-		if(strcmp(name->str, key) == 0)
-			return name;
-	}
-	return NULL;
+	struct lsdn_name *name;
+	HASH_FIND(hh, table->hash, key, strlen(key), name);
+	return name;
 }
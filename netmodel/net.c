@@ -22,9 +22,16 @@ void lsdn_settings_init_common(struct lsdn_settings *settings, struct lsdn_conte
 	settings->state = LSDN_STATE_NEW;
 	lsdn_list_init(&settings->setting_users_list);
 	settings->user_hooks = NULL;
+	settings->commit_unit = SIZE_MAX;
+	settings->shared_blocks = false;
+	settings->neigh_suppression = false;
+	settings->chain_switching = false;
+	settings->bpf_switching = false;
 	lsdn_list_init_add(&ctx->settings_list, &settings->settings_entry);
+	lsdn_list_init_add(ctx->dirty_settings.previous, &settings->dirty_entry);
 	settings->ctx = ctx;
 	lsdn_name_init(&settings->name);
+	lsdn_stats_object_new(ctx, LSDN_OBJ_SETTINGS);
 }
 
 /** Initialize ruleset engine.
@@ -33,11 +40,8 @@ lsdn_err_t lsdn_prepare_rulesets(
 	struct lsdn_context *ctx, struct lsdn_if *iface,
 	struct lsdn_ruleset* in, struct lsdn_ruleset* out)
 {
-	lsdn_err_t err;
 	if (out) {
-		err = lsdn_qdisc_egress_create(ctx->nlsock, iface->ifindex);
-		if (err != LSDNE_OK)
-			return err;
+		lsdn_qdisc_egress_create_async(ctx->nlsock, iface->ifindex, lsdn_nl_problem_cb, ctx);
 
 		lsdn_ruleset_init(
 			out, ctx, iface,
@@ -45,9 +49,7 @@ lsdn_err_t lsdn_prepare_rulesets(
 	}
 
 	if (in) {
-		err = lsdn_qdisc_ingress_create(ctx->nlsock, iface->ifindex);
-		if (err != LSDNE_OK)
-			abort();
+		lsdn_qdisc_ingress_create_async(ctx->nlsock, iface->ifindex, lsdn_nl_problem_cb, ctx);
 
 		lsdn_ruleset_init(
 			in, ctx, iface,
@@ -56,3 +58,67 @@ lsdn_err_t lsdn_prepare_rulesets(
 
 	return LSDNE_OK;
 }
+
+/** Set up the rulesets of a local virt.
+ * Usually the virt gets its own rulesets on its interface. If the settings ask for shared blocks,
+ * the virt is instead bound to the blocks of its attachment, which are created for the first
+ * virt. All virts bound to the blocks share the rules installed there.
+ * @return the ruleset for the ingress of the virt interface. */
+struct lsdn_ruleset *lsdn_virt_prepare_rulesets(struct lsdn_virt *virt)
+{
+	struct lsdn_context *ctx = virt->network->ctx;
+	struct lsdn_phys_attachment *pa = virt->committed_to;
+
+	virt->in_shared_blocks = virt->network->settings->shared_blocks;
+	if (!virt->in_shared_blocks) {
+		lsdn_err_t err = lsdn_prepare_rulesets(
+			ctx, &virt->committed_if, &virt->rules_in, &virt->rules_out);
+		if (err != LSDNE_OK)
+			abort();
+		return &virt->rules_in;
+	}
+
+	if (pa->shared_block_users++ == 0) {
+		uint32_t block_in, block_out;
+		if (!lsdn_idalloc_get(&ctx->block_ids, &block_in))
+			abort();
+		if (!lsdn_idalloc_get(&ctx->block_ids, &block_out))
+			abort();
+		lsdn_ruleset_init_block(
+			&pa->shared_rules_in, ctx, block_in, LSDN_DEFAULT_CHAIN, 1, UINT32_MAX);
+		lsdn_ruleset_init_block(
+			&pa->shared_rules_out, ctx, block_out, LSDN_DEFAULT_CHAIN, 1, UINT32_MAX);
+		pa->rules_leader = NULL;
+	}
+	lsdn_qdisc_clsact_create_async(
+		ctx->nlsock, virt->committed_if.ifindex,
+		pa->shared_rules_in.block, pa->shared_rules_out.block, lsdn_nl_problem_cb, ctx);
+	return &pa->shared_rules_in;
+}
+
+/** Free the rulesets set up by `lsdn_virt_prepare_rulesets`.
+ * The shared blocks are removed together with the last virt bound to them. */
+void lsdn_virt_free_rulesets(struct lsdn_virt *virt)
+{
+	struct lsdn_context *ctx = virt->network->ctx;
+	struct lsdn_phys_attachment *pa = virt->committed_to;
+
+	if (!virt->in_shared_blocks) {
+		lsdn_ruleset_free(&virt->rules_in);
+		lsdn_ruleset_free(&virt->rules_out);
+		return;
+	}
+
+	virt->in_shared_blocks = false;
+	assert(pa->rules_leader != virt);
+	if (--pa->shared_block_users == 0) {
+		/* Sends the pending filter changes, must be done while the blocks exist */
+		lsdn_ruleset_free(&pa->shared_rules_in);
+		lsdn_ruleset_free(&pa->shared_rules_out);
+		lsdn_idalloc_return(&ctx->block_ids, pa->shared_rules_in.block);
+		lsdn_idalloc_return(&ctx->block_ids, pa->shared_rules_out.block);
+	}
+	if (!ctx->disable_decommit && !virt->committed_if.removed)
+		lsdn_qdisc_clsact_delete_async(
+			ctx->nlsock, virt->committed_if.ifindex, lsdn_nl_problem_cb, ctx);
+}
@@ -17,7 +17,7 @@ static void direct_create_pa(struct lsdn_phys_attachment *a)
 	err = lsdn_if_set_name(&a->tunnel_if, a->phys->attr_iface);
 	if (err != LSDNE_OK)
 		abort();
-	err = lsdn_if_resolve(&a->tunnel_if);
+	err = lsdn_if_resolve(a->net->ctx->nlsock, &a->tunnel_if);
 	if (err != LSDNE_OK)
 		abort();
 
@@ -13,15 +13,16 @@
  * a Linux Bridge and adds the interface to it. */
 static void vlan_create_pa(struct lsdn_phys_attachment *p)
 {
-	// create the vlan interface
+	lsdn_lbridge_init(p->net->ctx, &p->lbridge);
+
+	// create the vlan interface, already up and in the bridge
 	lsdn_err_t err = lsdn_link_vlan_create(
 		p->net->ctx->nlsock, &p->tunnel_if,
-		p->phys->attr_iface, lsdn_mk_ifname(p->net->ctx), p->net->vnet_id);
+		p->phys->attr_iface, lsdn_mk_ifname(p->net->ctx), p->net->vnet_id,
+		p->lbridge.bridge_if.ifindex, true);
 	if(err != LSDNE_OK)
 		abort();
-
-	lsdn_lbridge_init(p->net->ctx, &p->lbridge);
-	lsdn_lbridge_add(&p->lbridge, &p->lbridge_if, &p->tunnel_if);
+	lsdn_lbridge_add_created(&p->lbridge, &p->lbridge_if, &p->tunnel_if);
 }
 
 /** Remove a machine from VLAN network.
@@ -3,14 +3,17 @@
 #include "private/lbridge.h"
 #include "private/nl.h"
 #include "private/errors.h"
+#include "private/audit.h"
 #include "include/lsdn.h"
 #include "include/nettypes.h"
+#include "include/util.h"
 #include "include/errors.h"
 #include <stdarg.h>
 
 static void vxlan_mcast_create_pa(struct lsdn_phys_attachment *a)
 {
 	struct lsdn_settings *s = a->net->settings;
+	lsdn_lbridge_init(a->net->ctx ,&a->lbridge);
 	lsdn_err_t err = lsdn_link_vxlan_create(
 		a->net->ctx->nlsock,
 		&a->tunnel_if,
@@ -21,12 +24,12 @@ static void vxlan_mcast_create_pa(struct lsdn_phys_attachment *a)
 		s->vxlan.port,
 		true,
 		false,
-		s->vxlan.mcast.mcast_ip.v);
+		s->vxlan.mcast.mcast_ip.v,
+		a->lbridge.bridge_if.ifindex,
+		true);
 	if (err != LSDNE_OK)
 		abort();
-
-	lsdn_lbridge_init(a->net->ctx ,&a->lbridge);
-	lsdn_lbridge_add(&a->lbridge, &a->lbridge_if, &a->tunnel_if);
+	lsdn_lbridge_add_created(&a->lbridge, &a->lbridge_if, &a->tunnel_if);
 }
 
 static void vxlan_mcast_destroy_pa(struct lsdn_phys_attachment *a)
@@ -70,6 +73,7 @@ struct lsdn_settings *lsdn_settings_new_vxlan_mcast(
 
 static void vxlan_e2e_create_pa(struct lsdn_phys_attachment *a)
 {
+	lsdn_lbridge_init(a->net->ctx ,&a->lbridge);
 	lsdn_err_t err = lsdn_link_vxlan_create(
 		a->net->ctx->nlsock,
 		&a->tunnel_if,
@@ -80,12 +84,12 @@ static void vxlan_e2e_create_pa(struct lsdn_phys_attachment *a)
 		a->net->settings->vxlan.port,
 		true,
 		false,
-		a->phys->attr_ip->v);
+		a->phys->attr_ip->v,
+		a->lbridge.bridge_if.ifindex,
+		true);
 	if (err != LSDNE_OK)
 		abort();
-
-	lsdn_lbridge_init(a->net->ctx ,&a->lbridge);
-	lsdn_lbridge_add(&a->lbridge, &a->lbridge_if, &a->tunnel_if);
+	lsdn_lbridge_add_created(&a->lbridge, &a->lbridge_if, &a->tunnel_if);
 }
 
 static void vxlan_e2e_destroy_pa(struct lsdn_phys_attachment *a)
@@ -104,12 +108,11 @@ static void vxlan_e2e_add_remote_pa(struct lsdn_remote_pa *remote)
 {
 	/* Redirect broadcast packets to all remote PAs */
 	struct lsdn_phys_attachment *local = remote->local;
-	lsdn_err_t err = lsdn_fdb_add_entry(
+	lsdn_fdb_add_entry_async(
 		local->net->ctx->nlsock, local->tunnel_if.ifindex,
 		lsdn_all_zeroes_mac,
-		*remote->remote->phys->attr_ip);
-	if (err != LSDNE_OK)
-		abort();
+		*remote->remote->phys->attr_ip,
+		lsdn_nl_problem_cb, local->net->ctx);
 }
 
 static void vxlan_e2e_remove_remote_pa(struct lsdn_remote_pa *remote)
@@ -118,12 +121,17 @@ static void vxlan_e2e_remove_remote_pa(struct lsdn_remote_pa *remote)
 		return;
 
 	struct lsdn_phys_attachment *local = remote->local;
-	lsdn_err_t err = lsdn_fdb_remove_entry(
+	lsdn_fdb_remove_entry_async(
 		local->net->ctx->nlsock, local->tunnel_if.ifindex,
 		lsdn_all_zeroes_mac,
-		*remote->remote->phys->attr_ip);
-	if (err != LSDNE_OK)
-		abort();
+		*remote->remote->phys->attr_ip,
+		lsdn_nl_problem_cb, local->net->ctx);
+}
+
+static void vxlan_e2e_audit_remote_pa(struct lsdn_remote_pa *remote, struct lsdn_audit *audit)
+{
+	lsdn_audit_fdb(audit, &remote->local->tunnel_if,
+		lsdn_all_zeroes_mac, *remote->remote->phys->attr_ip);
 }
 
 static void vxlan_e2e_validate_pa(struct lsdn_phys_attachment *a)
@@ -144,7 +152,8 @@ struct lsdn_net_ops lsdn_net_vxlan_e2e_ops = {
 	.remove_virt = lsdn_lbridge_remove_virt,
 	.add_remote_pa = vxlan_e2e_add_remote_pa,
 	.remove_remote_pa = vxlan_e2e_remove_remote_pa,
-	.validate_pa = vxlan_e2e_validate_pa
+	.validate_pa = vxlan_e2e_validate_pa,
+	.audit_remote_pa = vxlan_e2e_audit_remote_pa
 };
 
 
@@ -181,11 +190,9 @@ static void vxlan_use_stunnel(struct lsdn_phys_attachment *a)
 			s->vxlan.port,
 			false,
 			true,
-			a->phys->attr_ip->v);
-		if (err != LSDNE_OK)
-			abort();
-
-		err = lsdn_link_set(ctx->nlsock, tunnel->ifindex, true);
+			a->phys->attr_ip->v,
+			0,
+			true);
 		if (err != LSDNE_OK)
 			abort();
 
@@ -194,7 +201,7 @@ static void vxlan_use_stunnel(struct lsdn_phys_attachment *a)
 			abort();
 
 		lsdn_sbridge_phys_if_init(
-			ctx, &s->vxlan.e2e_static.tunnel_sbridge, tunnel, true, rules_in);
+			ctx, &s->vxlan.e2e_static.tunnel_sbridge, tunnel, LSDN_MATCH_ENC_KEY_ID, rules_in);
 	}
 }
 
@@ -202,12 +209,12 @@ static void vxlan_release_stunnel(struct lsdn_settings *s)
 {
 	if (--s->vxlan.e2e_static.refcount == 0) {
 		lsdn_sbridge_phys_if_free(&s->vxlan.e2e_static.tunnel_sbridge);
+		lsdn_ruleset_free(&s->vxlan.e2e_static.ruleset_in);
 		if(!s->ctx->disable_decommit) {
 			lsdn_err_t err = lsdn_link_delete(s->ctx->nlsock, &s->vxlan.e2e_static.tunnel);
 			if (err != LSDNE_OK)
 				abort();
 		}
-		lsdn_ruleset_free(&s->vxlan.e2e_static.ruleset_in);
 		lsdn_if_free(&s->vxlan.e2e_static.tunnel);
 	}
 }
@@ -215,7 +222,12 @@ static void vxlan_release_stunnel(struct lsdn_settings *s)
 static void vxlan_static_create_pa(struct lsdn_phys_attachment *pa)
 {
 	vxlan_use_stunnel(pa);
-	lsdn_sbridge_init(pa->net->ctx, &pa->sbridge);
+	if (pa->net->settings->bpf_switching) {
+		lsdn_sbridge_init_bpf(pa->net->ctx, &pa->sbridge);
+	} else {
+		lsdn_sbridge_init(pa->net->ctx, &pa->sbridge, pa->net->settings->chain_switching);
+		pa->sbridge.suppress_neigh = pa->net->settings->neigh_suppression;
+	}
 	lsdn_sbridge_add_stunnel(
 		&pa->sbridge, &pa->sbridge_if,
 		&pa->net->settings->vxlan.e2e_static.tunnel_sbridge, pa->net);
@@ -238,18 +250,30 @@ static void vxlan_static_remove_virt(struct lsdn_virt *virt)
 	lsdn_sbridge_remove_virt(virt);
 }
 
+/* All the filters sending to the remote PA share a single tunnel_key action */
 static void set_vxlan_metadata(struct lsdn_filter *f, uint16_t order, void *user)
 {
 	struct lsdn_remote_pa *pa = user;
-	lsdn_action_set_tunnel_key(f, order,
-		pa->local->net->vnet_id,
-		pa->local->phys->attr_ip,
-		pa->remote->phys->attr_ip);
-
+	lsdn_action_tunnel_key_ref(f, order, pa->tunnel_key);
 }
 
 static void vxlan_static_add_remote_pa (struct lsdn_remote_pa *pa)
 {
+	if (pa->local->sbridge.use_bpf) {
+		/* The program sets the metadata from the routes map */
+		struct lsdn_sbridge_route *route = &pa->sbridge_route;
+		route->tunnel_action.fn = NULL;
+		route->tunnel_action.actions_count = 0;
+		route->has_tunnel = true;
+		route->tunnel_vni = pa->local->net->vnet_id;
+		route->tunnel_dst = *pa->remote->phys->attr_ip;
+		lsdn_sbridge_add_route(&pa->local->sbridge_if, route);
+		return;
+	}
+	pa->tunnel_key = lsdn_tunnel_key_new(pa->local->net->ctx,
+		pa->local->net->vnet_id,
+		pa->local->phys->attr_ip,
+		pa->remote->phys->attr_ip);
 	struct lsdn_action_desc *bra = &pa->sbridge_route.tunnel_action;
 	bra->actions_count = 1;
 	bra->fn = set_vxlan_metadata;
@@ -260,11 +284,28 @@ static void vxlan_static_add_remote_pa (struct lsdn_remote_pa *pa)
 static void vxlan_static_remove_remote_pa (struct lsdn_remote_pa *pa)
 {
 	lsdn_sbridge_remove_route(&pa->sbridge_route);
+	if (!pa->local->sbridge.use_bpf)
+		lsdn_tunnel_key_release(pa->local->net->ctx, pa->tunnel_key);
+}
+
+static void vxlan_static_update_remote_pa(struct lsdn_remote_pa *pa)
+{
+	if (pa->local->sbridge.use_bpf) {
+		pa->sbridge_route.tunnel_dst = *pa->remote->phys->attr_ip;
+		lsdn_sbridge_update_route(&pa->sbridge_route);
+		return;
+	}
+	lsdn_tunnel_key_update(pa->local->net->ctx, pa->tunnel_key,
+		pa->local->net->vnet_id,
+		pa->local->phys->attr_ip,
+		pa->remote->phys->attr_ip);
 }
 
 static void vxlan_static_add_remote_virt(struct lsdn_remote_virt *virt)
 {
-	lsdn_sbridge_add_mac(&virt->pa->sbridge_route, &virt->sbridge_mac, *virt->virt->attr_mac);
+	lsdn_sbridge_add_mac(
+		&virt->pa->sbridge_route, &virt->sbridge_mac,
+		*virt->virt->attr_mac, virt->virt->attr_ip);
 }
 
 static void vxlan_static_remove_remote_virt(struct lsdn_remote_virt *virt)
@@ -272,6 +313,20 @@ static void vxlan_static_remove_remote_virt(struct lsdn_remote_virt *virt)
 	lsdn_sbridge_remove_mac(&virt->sbridge_mac);
 }
 
+static void vxlan_static_move_remote_virt(struct lsdn_remote_virt *virt, struct lsdn_remote_pa *from)
+{
+	LSDN_UNUSED(from);
+	struct lsdn_sbridge_mac *mac = &virt->sbridge_mac;
+	const lsdn_ip_t *ip = virt->virt->attr_ip;
+	bool same_ip = ip ? mac->has_ip && lsdn_ip_eq(mac->ip, *ip) : !mac->has_ip;
+	if (lsdn_mac_eq(mac->mac, *virt->virt->attr_mac) && same_ip) {
+		lsdn_sbridge_move_mac(mac, &virt->pa->sbridge_route);
+	} else {
+		lsdn_sbridge_remove_mac(mac);
+		lsdn_sbridge_add_mac(&virt->pa->sbridge_route, mac, *virt->virt->attr_mac, ip);
+	}
+}
+
 static void vxlan_static_validate_pa(struct lsdn_phys_attachment *a)
 {
 	if (!a->phys->attr_ip)
@@ -292,6 +347,15 @@ static void vxlan_static_validate_virt(struct lsdn_virt *virt)
 			LSDNS_VIRT, virt,
 			LSDNS_NET, virt->network,
 			LSDNS_END);
+	/* The suppression is not used with BPF switching, see vxlan_static_create_pa */
+	struct lsdn_settings *s = virt->network->settings;
+	if (s->neigh_suppression && !s->bpf_switching && !virt->attr_ip)
+		lsdn_problem_report(
+			virt->network->ctx, LSDNP_VIRT_NOATTR,
+			LSDNS_ATTR, "ip",
+			LSDNS_VIRT, virt,
+			LSDNS_NET, virt->network,
+			LSDNS_END);
 }
 
 struct lsdn_net_ops lsdn_net_vxlan_static_ops = {
@@ -301,8 +365,10 @@ struct lsdn_net_ops lsdn_net_vxlan_static_ops = {
 	.remove_virt = vxlan_static_remove_virt,
 	.add_remote_pa = vxlan_static_add_remote_pa,
 	.remove_remote_pa = vxlan_static_remove_remote_pa,
+	.update_remote_pa = vxlan_static_update_remote_pa,
 	.add_remote_virt = vxlan_static_add_remote_virt,
 	.remove_remote_virt = vxlan_static_remove_remote_virt,
+	.move_remote_virt = vxlan_static_move_remote_virt,
 	.validate_pa = vxlan_static_validate_pa,
 	.validate_virt = vxlan_static_validate_virt
 };
@@ -12,6 +12,9 @@ const lsdn_mac_t lsdn_broadcast_mac = LSDN_INITIALIZER_MAC(0xFF, 0xFF, 0xFF, 0xF
 const lsdn_mac_t lsdn_multicast_mac_mask = LSDN_INITIALIZER_MAC(0x01, 0x00, 0x00, 0x00, 0x00, 0x00);
 const lsdn_mac_t lsdn_single_mac_mask = LSDN_INITIALIZER_MAC(0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF);
 const lsdn_mac_t lsdn_all_zeroes_mac = LSDN_INITIALIZER_MAC(0x00, 0x00, 0x00, 0x00, 0x00, 0x00);
+/* Prefix of the solicited-node multicast MACs, the IPv6 neighbor solicitations are sent to */
+const lsdn_mac_t lsdn_nd_solicit_mac = LSDN_INITIALIZER_MAC(0x33, 0x33, 0xFF, 0x00, 0x00, 0x00);
+const lsdn_mac_t lsdn_nd_solicit_mac_mask = LSDN_INITIALIZER_MAC(0xFF, 0xFF, 0xFF, 0x00, 0x00, 0x00);
 
 const lsdn_ip_t lsdn_single_ipv4_mask = LSDN_INITIALIZER_IPV4(0xFF, 0xFF, 0xFF, 0xFF);
 const lsdn_ip_t lsdn_single_ipv6_mask = LSDN_INITIALIZER_IPV6(
@@ -8,20 +8,33 @@
 #include <linux/veth.h>
 #include <assert.h>
 #include <errno.h>
+#include <time.h>
 
-#ifdef NDEBUG
-#define nl_buf(buf) \
-	char buf[MNL_SOCKET_BUFFER_SIZE];
-#else
-#define nl_buf(buf) \
-	char buf[MNL_SOCKET_BUFFER_SIZE]; \
-	bzero(buf, sizeof(buf))
-#endif
+/* Start building a message in place, at the end of the socket's batch buffer */
+#define nl_buf(sock, buf) \
+	char *buf = nl_msg_start(sock)
+
+/* Redirection of the calling thread, see lsdn_nl_worker_bind */
+static __thread struct lsdn_nl_worker *nl_worker;
+
+void lsdn_nl_worker_bind(struct lsdn_nl_worker *worker)
+{
+	nl_worker = worker;
+}
+
+/* The socket whose batch buffer the calling thread should use instead of `sock` */
+static struct lsdn_nlsock *nl_lane(struct lsdn_nlsock *sock)
+{
+	if (nl_worker && sock == nl_worker->parent)
+		return nl_worker->lane;
+	return sock;
+}
 
 void lsdn_if_init(struct lsdn_if *lsdn_if)
 {
 	lsdn_if->ifindex = 0;
 	lsdn_if->ifname = NULL;
+	lsdn_if->removed = false;
 }
 
 lsdn_err_t lsdn_if_copy(struct lsdn_if *dst, struct lsdn_if *src)
@@ -35,6 +48,7 @@ lsdn_err_t lsdn_if_copy(struct lsdn_if *dst, struct lsdn_if *src)
 	lsdn_if_free(dst);
 	dst->ifindex = src->ifindex;
 	dst->ifname = dup;
+	dst->removed = src->removed;
 	return LSDNE_OK;
 }
 
@@ -59,110 +73,641 @@ lsdn_err_t lsdn_if_set_name(struct lsdn_if *lsdn_if, const char* ifname)
 
 	lsdn_if->ifindex = 0;
 	lsdn_if->ifname = dup;
+	lsdn_if->removed = false;
 	return LSDNE_OK;
 }
 
-lsdn_err_t lsdn_if_resolve(struct lsdn_if *lsdn_if)
+/* Look up an interface in the interface table. If it is not there, it might have been just
+ * created, so look again after the table is updated. */
+static unsigned int lookup_ifindex(struct lsdn_nlsock *sock, const char *ifname)
 {
-	if (lsdn_if->ifindex != 0)
-		return LSDNE_OK;
+	unsigned int ifindex = 0;
+	if (sock->ifs.synced)
+		ifindex = lsdn_iftable_find(&sock->ifs, ifname);
+	if (ifindex == 0 && lsdn_nl_if_sync(sock) == LSDNE_OK)
+		ifindex = lsdn_iftable_find(&sock->ifs, ifname);
+	return ifindex;
+}
 
-	int ifindex = if_nametoindex(lsdn_if->ifname);
-	if(ifindex == 0){
-		assert(errno == ENXIO || errno == ENODEV);
+lsdn_err_t lsdn_if_resolve(struct lsdn_nlsock *sock, struct lsdn_if *lsdn_if)
+{
+	assert(lsdn_if->ifname);
+	/* Always look up, the interface might have been replaced since it was last resolved */
+	unsigned int ifindex = lookup_ifindex(sock, lsdn_if->ifname);
+	if(ifindex == 0)
 		return LSDNE_NOIF;
-	}
 
 	lsdn_if->ifindex = ifindex;
 
 	return LSDNE_OK;
 }
 
-struct mnl_socket *lsdn_socket_init()
+lsdn_err_t lsdn_nl_if_sync(struct lsdn_nlsock *sock)
+{
+	if (!sock->ifs.synced)
+		return sock->backend->if_dump(sock);
+	return sock->backend->if_poll(sock);
+}
+
+static lsdn_err_t netlink_transact(struct lsdn_nlsock *sock);
+static lsdn_err_t netlink_dump(
+	struct lsdn_nlsock *sock, const struct nlmsghdr *nlh, mnl_cb_t cb, void *data);
+
+static lsdn_err_t netlink_if_dump(struct lsdn_nlsock *sock);
+static lsdn_err_t netlink_if_poll(struct lsdn_nlsock *sock);
+
+static void netlink_free(struct lsdn_nlsock *sock)
+{
+	mnl_socket_close(sock->sock);
+	if (sock->monitor)
+		mnl_socket_close(sock->monitor);
+}
+
+static struct lsdn_nlsock *netlink_peer(struct lsdn_nlsock *sock)
+{
+	LSDN_UNUSED(sock);
+	return lsdn_socket_init();
+}
+
+static const struct lsdn_nl_backend netlink_backend = {
+	.transact = netlink_transact,
+	.dump = netlink_dump,
+	.if_dump = netlink_if_dump,
+	.if_poll = netlink_if_poll,
+	.free = netlink_free,
+	.peer = netlink_peer,
+	.bpf = lsdn_bpf_kernel,
+	.bpf_close = lsdn_bpf_kernel_close
+};
+
+struct lsdn_nlsock *lsdn_socket_alloc(const struct lsdn_nl_backend *backend)
 {
-	int err;
-	struct mnl_socket *sock = mnl_socket_open(NETLINK_ROUTE);
-	if (!sock)
+	struct lsdn_nlsock *s = malloc(sizeof(*s));
+	if (!s)
 		return NULL;
 
-	err = mnl_socket_bind(sock, 0, MNL_SOCKET_AUTOPID);
-	if (err) {
-		mnl_socket_close(sock);
+	s->buf = malloc(LSDN_NL_BATCH_SIZE);
+	s->recv_buf = malloc(LSDN_NL_RECV_SIZE);
+	if (!s->buf || !s->recv_buf) {
+		free(s->buf);
+		free(s->recv_buf);
+		free(s);
 		return NULL;
 	}
-	return sock;
+
+	s->backend = backend;
+	s->backend_data = NULL;
+	bzero(&s->stats, sizeof(s->stats));
+	lsdn_iftable_init(&s->ifs);
+	s->sock = NULL;
+	s->monitor = NULL;
+	s->portid = 0;
+	s->seq = time(NULL);
+	s->batch_seq = s->seq;
+	s->dump_seq = 0;
+	s->buf_len = 0;
+	s->pending_count = 0;
+	s->filter_busy = false;
+	s->adopt = NULL;
+	return s;
 }
 
-void lsdn_socket_free(struct mnl_socket *s)
+static void socket_free_buffers(struct lsdn_nlsock *s)
 {
-	mnl_socket_close(s);
+	if (s->adopt)
+		lsdn_adopt_free(s->adopt);
+	lsdn_iftable_free(&s->ifs);
+	free(s->buf);
+	free(s->recv_buf);
+	free(s);
 }
 
-static lsdn_err_t process_response(struct nlmsghdr *nlh)
+struct lsdn_nlsock *lsdn_socket_init()
 {
-	int *resp;
-	lsdn_err_t ret;
+	int err, one = 1;
+	struct lsdn_nlsock *s = lsdn_socket_alloc(&netlink_backend);
+	if (!s)
+		return NULL;
 
-	if (nlh->nlmsg_type == NLMSG_ERROR) {
-		resp = mnl_nlmsg_get_payload(nlh);
-		if (*resp)
-			ret = LSDNE_NETLINK;
-		else
-			ret = LSDNE_OK;
-	} else {
-		ret = LSDNE_NETLINK;
+	s->sock = mnl_socket_open(NETLINK_ROUTE);
+	if (!s->sock)
+		goto err_buf;
+
+	err = mnl_socket_bind(s->sock, 0, MNL_SOCKET_AUTOPID);
+	if (err)
+		goto err_sock;
+
+	/* Do not echo whole messages in error ACKs, we keep them in the batch buffer anyway.
+	 * Older kernels do not know the option, in that case we just receive larger ACKs. */
+	mnl_socket_setsockopt(s->sock, NETLINK_CAP_ACK, &one, sizeof(one));
+
+	s->portid = mnl_socket_get_portid(s->sock);
+	return s;
+
+err_sock:
+	mnl_socket_close(s->sock);
+err_buf:
+	socket_free_buffers(s);
+	return NULL;
+}
+
+struct lsdn_nlsock *lsdn_socket_init_peer(struct lsdn_nlsock *sock)
+{
+	return sock->backend->peer(sock);
+}
+
+void lsdn_socket_free(struct lsdn_nlsock *s)
+{
+	lsdn_nl_flush(s);
+	s->backend->free(s);
+	socket_free_buffers(s);
+}
+
+static void fail_pending(struct lsdn_nlsock *sock, int err)
+{
+	for (size_t i = 0; i < sock->pending_count; i++) {
+		struct lsdn_nl_pending *p = &sock->pending[i];
+		if (!p->acked) {
+			p->acked = true;
+			p->err = err;
+		}
 	}
+}
 
+/* Match the ACKs and echoes in the receive buffer to the pending requests */
+static size_t process_acks(struct lsdn_nlsock *sock, int len)
+{
+	size_t acked = 0;
+	struct nlmsghdr *nlh = (struct nlmsghdr *) sock->recv_buf;
+
+	for (; mnl_nlmsg_ok(nlh, len); nlh = mnl_nlmsg_next(nlh, &len)) {
+		if (!mnl_nlmsg_portid_ok(nlh, sock->portid))
+			continue;
+
+		uint32_t index = nlh->nlmsg_seq - sock->batch_seq;
+		if (index >= sock->pending_count)
+			continue;
+		struct lsdn_nl_pending *p = &sock->pending[index];
+		if (p->acked)
+			continue;
+
+		/* The echo of a created link arrives before its ACK */
+		if (nlh->nlmsg_type == RTM_NEWLINK && p->echo_ifindex) {
+			struct ifinfomsg *ifm = mnl_nlmsg_get_payload(nlh);
+			*p->echo_ifindex = ifm->ifi_index;
+			continue;
+		}
+		if (nlh->nlmsg_type != NLMSG_ERROR)
+			continue;
+
+		struct nlmsgerr *resp = mnl_nlmsg_get_payload(nlh);
+		p->acked = true;
+		p->err = resp->error;
+		acked++;
+	}
+	return acked;
+}
+
+static lsdn_err_t netlink_transact(struct lsdn_nlsock *sock)
+{
+	lsdn_err_t ret = LSDNE_OK;
+	size_t acked = 0;
+
+	if (mnl_socket_sendto(sock->sock, sock->buf, sock->buf_len) == -1) {
+		fail_pending(sock, -errno);
+		return LSDNE_NETLINK;
+	}
+
+	while (acked < sock->pending_count) {
+		ssize_t len = mnl_socket_recvfrom(sock->sock, sock->recv_buf, LSDN_NL_RECV_SIZE);
+		if (len == -1) {
+			fail_pending(sock, -errno);
+			ret = LSDNE_NETLINK;
+			break;
+		}
+		acked += process_acks(sock, len);
+	}
 	return ret;
 }
 
-static lsdn_err_t send_await_response(struct mnl_socket *sock, struct nlmsghdr *nlh)
+/* Read the full listing of interfaces into the table, along with any notifications that arrive
+ * in between */
+static lsdn_err_t netlink_if_dump(struct lsdn_nlsock *sock)
 {
-	int ret;
+	if (!sock->monitor) {
+		/* Subscribe before listing, so that no change is missed */
+		sock->monitor = mnl_socket_open(NETLINK_ROUTE);
+		if (!sock->monitor)
+			return LSDNE_NETLINK;
+		if (mnl_socket_bind(sock->monitor, RTMGRP_LINK, MNL_SOCKET_AUTOPID) == -1) {
+			mnl_socket_close(sock->monitor);
+			sock->monitor = NULL;
+			return LSDNE_NETLINK;
+		}
+	}
+
+	char buf[MNL_SOCKET_BUFFER_SIZE];
+	struct nlmsghdr *nlh = mnl_nlmsg_put_header(buf);
+	nlh->nlmsg_type = RTM_GETLINK;
+	nlh->nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+	/* May happen in the middle of a batch, so the batch's sequence numbers must not be used */
+	nlh->nlmsg_seq = ++sock->dump_seq;
+	struct ifinfomsg *ifm = mnl_nlmsg_put_extra_header(nlh, sizeof(*ifm));
+	ifm->ifi_family = AF_UNSPEC;
 
-	ret = mnl_socket_sendto(sock, (void *) nlh, nlh->nlmsg_len);
-	if (ret == -1)
+	if (mnl_socket_sendto(sock->monitor, nlh, nlh->nlmsg_len) == -1)
 		return LSDNE_NETLINK;
 
-	ret = mnl_socket_recvfrom(sock, (void *) nlh, MNL_SOCKET_BUFFER_SIZE);
-	if (ret == -1)
+	uint32_t seq = nlh->nlmsg_seq;
+	unsigned int portid = mnl_socket_get_portid(sock->monitor);
+	lsdn_iftable_resync_start(&sock->ifs);
+	int ret;
+	do {
+		ssize_t len = mnl_socket_recvfrom(sock->monitor, sock->recv_buf, LSDN_NL_RECV_SIZE);
+		if (len == -1)
+			return LSDNE_NETLINK;
+		ret = mnl_cb_run(sock->recv_buf, len, seq, portid, lsdn_iftable_msg_cb, &sock->ifs);
+	} while (ret > MNL_CB_STOP);
+	if (ret == MNL_CB_ERROR)
 		return LSDNE_NETLINK;
 
-	return process_response(nlh);
+	lsdn_iftable_resync_end(&sock->ifs);
+	return LSDNE_OK;
 }
 
-static void link_create_header(
-		struct nlmsghdr* nlh, struct nlattr** linkinfo,
-		const char *if_name, const char *if_type)
+static lsdn_err_t netlink_dump(
+	struct lsdn_nlsock *sock, const struct nlmsghdr *nlh, mnl_cb_t cb, void *data)
+{
+	if (mnl_socket_sendto(sock->sock, nlh, nlh->nlmsg_len) == -1)
+		return LSDNE_NETLINK;
+
+	int ret;
+	do {
+		ssize_t len = mnl_socket_recvfrom(sock->sock, sock->recv_buf, LSDN_NL_RECV_SIZE);
+		if (len == -1)
+			return LSDNE_NETLINK;
+		ret = mnl_cb_run(sock->recv_buf, len, nlh->nlmsg_seq, sock->portid, cb, data);
+	} while (ret > MNL_CB_STOP);
+	return ret == MNL_CB_ERROR ? LSDNE_NETLINK : LSDNE_OK;
+}
+
+lsdn_err_t lsdn_nl_dump(struct lsdn_nlsock *sock, struct nlmsghdr *nlh, mnl_cb_t cb, void *data)
+{
+	sock = nl_lane(sock);
+	/* The ACKs of the queued requests would get mixed with the listing */
+	lsdn_err_t err = lsdn_nl_flush(sock);
+	if (err != LSDNE_OK)
+		return err;
+
+	nlh->nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+	nlh->nlmsg_seq = ++sock->dump_seq;
+	return sock->backend->dump(sock, nlh, cb, data);
+}
+
+/* Apply the link notifications waiting in the monitor socket */
+static lsdn_err_t netlink_if_poll(struct lsdn_nlsock *sock)
+{
+	int fd = mnl_socket_get_fd(sock->monitor);
+	for (;;) {
+		ssize_t len = recv(fd, sock->recv_buf, LSDN_NL_RECV_SIZE, MSG_DONTWAIT);
+		if (len == -1) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return LSDNE_OK;
+			/* The socket has overflown and some notifications were lost */
+			if (errno == ENOBUFS)
+				return netlink_if_dump(sock);
+			return LSDNE_NETLINK;
+		}
+		if (mnl_cb_run(sock->recv_buf, len, 0, 0, lsdn_iftable_msg_cb, &sock->ifs) == MNL_CB_ERROR)
+			return LSDNE_NOMEM;
+	}
+}
+
+/*
+ * Flush the batch buffer. If `yield` is set, a worker lets the other threads run while waiting
+ * (see lsdn_nl_worker). Flushes of a full buffer do not yield, since they may come in the middle
+ * of building a request from arguments the other threads might change.
+ */
+static lsdn_err_t nl_flush(struct lsdn_nlsock *sock, bool yield)
+{
+	sock = nl_lane(sock);
+	if (sock->pending_count == 0)
+		return LSDNE_OK;
+
+	sock->stats.batches++;
+	sock->stats.messages += sock->pending_count;
+	sock->stats.bytes += sock->buf_len;
+	/* The callbacks below are not covered, they may touch anything */
+	struct lsdn_nl_worker *worker =
+		(yield && nl_worker && nl_worker->lane == sock) ? nl_worker : NULL;
+	if (worker)
+		worker->io_begin(worker->user);
+	lsdn_err_t ret = sock->backend->transact(sock);
+	if (worker)
+		worker->io_end(worker->user);
+
+	/* Reset the queue before calling the callbacks, so that they see a consistent state */
+	size_t count = sock->pending_count;
+	sock->pending_count = 0;
+	sock->buf_len = 0;
+	sock->batch_seq = sock->seq;
+
+	for (size_t i = 0; i < count; i++) {
+		struct lsdn_nl_pending *p = &sock->pending[i];
+		if (!p->err)
+			continue;
+		sock->stats.errors++;
+		if (p->cb)
+			p->cb((struct nlmsghdr *) (sock->buf + p->offset), p->err, p->user);
+	}
+
+	return ret;
+}
+
+lsdn_err_t lsdn_nl_flush(struct lsdn_nlsock *sock)
+{
+	return nl_flush(sock, true);
+}
+
+/**
+ * Reserve space for a new message at the end of the batch buffer.
+ *
+ * The message may be built directly in the returned buffer and then queued by nl_queue without
+ * copying. The space is only claimed by nl_queue, so an abandoned message costs nothing. Only one
+ * message may be under construction at a time.
+ * @return Buffer of at least MNL_SOCKET_BUFFER_SIZE bytes.
+ */
+static char *nl_msg_start(struct lsdn_nlsock *sock)
+{
+	sock = nl_lane(sock);
+	assert(!sock->filter_busy);
+	if (LSDN_NL_BATCH_SIZE - sock->buf_len < MNL_SOCKET_BUFFER_SIZE
+	    || sock->pending_count == LSDN_NL_BATCH_MSGS)
+		nl_flush(sock, false);
+
+	return sock->buf + sock->buf_len;
+}
+
+static enum lsdn_nl_msg_kind msg_kind(uint16_t type)
+{
+	switch (type) {
+	case RTM_NEWLINK:
+	case RTM_DELLINK:
+	case RTM_SETLINK:
+		return LSDN_NL_LINK;
+	case RTM_NEWADDR:
+	case RTM_DELADDR:
+		return LSDN_NL_ADDR;
+	case RTM_NEWQDISC:
+	case RTM_DELQDISC:
+		return LSDN_NL_QDISC;
+	case RTM_NEWTFILTER:
+	case RTM_DELTFILTER:
+		return LSDN_NL_FILTER;
+	case RTM_NEWNEIGH:
+	case RTM_DELNEIGH:
+		return LSDN_NL_NEIGH;
+	case RTM_NEWACTION:
+	case RTM_DELACTION:
+		return LSDN_NL_ACTION;
+	default:
+		return LSDN_NL_OTHER;
+	}
+}
+
+void lsdn_nl_stats_add(struct lsdn_nl_stats *dst, const struct lsdn_nl_stats *src)
+{
+	dst->batches += src->batches;
+	dst->messages += src->messages;
+	dst->bytes += src->bytes;
+	dst->errors += src->errors;
+	for (size_t i = 0; i < LSDN_NL_KIND_COUNT; i++) {
+		dst->kinds[i].messages += src->kinds[i].messages;
+		dst->kinds[i].bytes += src->kinds[i].bytes;
+	}
+}
+
+/**
+ * Put a request into the batch buffer.
+ *
+ * Messages built by nl_msg_start are already in place, other messages are copied, so the caller
+ * may reuse the buffer. If the batch buffer is full, it is flushed first. The message gets a new
+ * sequence number and will be acknowledged.
+ * @param cb Error callback, may be NULL if the errors should be ignored.
+ */
+static void nl_queue(struct lsdn_nlsock *sock, struct nlmsghdr *nlh, lsdn_nl_err_cb cb, void *user)
+{
+	sock = nl_lane(sock);
+	size_t len = MNL_ALIGN(nlh->nlmsg_len);
+	bool in_place = (char *) nlh == sock->buf + sock->buf_len;
+	assert(len <= LSDN_NL_BATCH_SIZE);
+	assert(!in_place || len <= MNL_SOCKET_BUFFER_SIZE);
+
+	if (!in_place
+	    && (sock->buf_len + len > LSDN_NL_BATCH_SIZE || sock->pending_count == LSDN_NL_BATCH_MSGS))
+		nl_flush(sock, false);
+
+	nlh->nlmsg_flags |= NLM_F_ACK;
+	nlh->nlmsg_seq = sock->seq++;
+	nlh->nlmsg_pid = 0;
+
+	enum lsdn_nl_msg_kind kind = msg_kind(nlh->nlmsg_type);
+	sock->stats.kinds[kind].messages++;
+	sock->stats.kinds[kind].bytes += len;
+
+	struct lsdn_nl_pending *p = &sock->pending[sock->pending_count++];
+	p->offset = sock->buf_len;
+	p->cb = cb;
+	p->user = user;
+	p->echo_ifindex = NULL;
+	p->acked = false;
+	p->err = 0;
+
+	if (!in_place)
+		memcpy(sock->buf + sock->buf_len, nlh, nlh->nlmsg_len);
+	sock->buf_len += len;
+}
+
+static void record_err(const struct nlmsghdr *nlh, int err, void *user)
+{
+	LSDN_UNUSED(nlh);
+	*((int *) user) = err;
+}
+
+static lsdn_err_t send_await_response(struct lsdn_nlsock *sock, struct nlmsghdr *nlh)
+{
+	int err = 0;
+	lsdn_err_t ret;
+
+	nl_queue(sock, nlh, record_err, &err);
+	ret = lsdn_nl_flush(sock);
+	if (ret != LSDNE_OK)
+		return ret;
+
+	return err ? LSDNE_NETLINK : LSDNE_OK;
+}
+
+/**
+ * Like send_await_response, but also asks for an echo of the request and stores the ifindex of
+ * the link it has created. The ifindex is left alone by kernels not honouring NLM_F_ECHO for
+ * links.
+ */
+static lsdn_err_t send_await_echo(
+		struct lsdn_nlsock *sock, struct nlmsghdr *nlh, unsigned int *ifindex)
+{
+	int err = 0;
+	lsdn_err_t ret;
+
+	sock = nl_lane(sock);
+	nlh->nlmsg_flags |= NLM_F_ECHO;
+	nl_queue(sock, nlh, record_err, &err);
+	sock->pending[sock->pending_count - 1].echo_ifindex = ifindex;
+	ret = lsdn_nl_flush(sock);
+	if (ret != LSDNE_OK)
+		return ret;
+
+	return err ? LSDNE_NETLINK : LSDNE_OK;
+}
+
+static const char *msg_type_name(uint16_t type)
+{
+	switch (type) {
+	case RTM_NEWLINK:
+		return "RTM_NEWLINK";
+	case RTM_DELLINK:
+		return "RTM_DELLINK";
+	case RTM_NEWQDISC:
+		return "RTM_NEWQDISC";
+	case RTM_DELQDISC:
+		return "RTM_DELQDISC";
+	case RTM_NEWTFILTER:
+		return "RTM_NEWTFILTER";
+	case RTM_DELTFILTER:
+		return "RTM_DELTFILTER";
+	case RTM_NEWNEIGH:
+		return "RTM_NEWNEIGH";
+	case RTM_DELNEIGH:
+		return "RTM_DELNEIGH";
+	case RTM_NEWADDR:
+		return "RTM_NEWADDR";
+	case RTM_NEWACTION:
+		return "RTM_NEWACTION";
+	case RTM_DELACTION:
+		return "RTM_DELACTION";
+	default:
+		return "unknown";
+	}
+}
+
+void lsdn_nl_describe(const struct nlmsghdr *nlh, char *buf, size_t size)
+{
+	struct tcmsg *tcm;
+	struct ifinfomsg *ifm;
+	struct ndmsg *nd;
+	const char *type = msg_type_name(nlh->nlmsg_type);
+
+	switch (nlh->nlmsg_type) {
+	case RTM_NEWQDISC:
+	case RTM_DELQDISC:
+	case RTM_NEWTFILTER:
+	case RTM_DELTFILTER:
+		tcm = mnl_nlmsg_get_payload(nlh);
+		if (tcm->tcm_ifindex == TCM_IFINDEX_MAGIC_BLOCK)
+			snprintf(buf, size, "%s (block %u, handle 0x%x, prio %d)", type,
+				tcm->tcm_parent, tcm->tcm_handle, TC_H_MAJ(tcm->tcm_info) >> 16);
+		else
+			snprintf(buf, size, "%s (ifindex %d, handle 0x%x, parent 0x%x, prio %d)", type,
+				tcm->tcm_ifindex, tcm->tcm_handle, tcm->tcm_parent,
+				TC_H_MAJ(tcm->tcm_info) >> 16);
+		break;
+	case RTM_NEWLINK:
+	case RTM_DELLINK:
+		ifm = mnl_nlmsg_get_payload(nlh);
+		snprintf(buf, size, "%s (ifindex %d)", type, ifm->ifi_index);
+		break;
+	case RTM_NEWNEIGH:
+	case RTM_DELNEIGH:
+		nd = mnl_nlmsg_get_payload(nlh);
+		snprintf(buf, size, "%s (ifindex %d)", type, nd->ndm_ifindex);
+		break;
+	case RTM_NEWACTION:
+	case RTM_DELACTION:
+		snprintf(buf, size, "%s (index %u)", type, lsdn_tunnel_key_index(nlh));
+		break;
+	default:
+		snprintf(buf, size, "%s", type);
+		break;
+	}
+}
+
+static lsdn_err_t link_delete_ifindex(struct lsdn_nlsock *sock, unsigned int ifindex);
+
+/* Put the RTM_NEWLINK header for a new link, already up and enslaved to the master (if given) */
+static void link_new_msg(
+		struct nlmsghdr* nlh, unsigned int link, const char *if_name,
+		unsigned int master, bool up)
 {
 	assert(if_name != NULL);
-	unsigned int seq = 0;
 
 	nlh->nlmsg_type = RTM_NEWLINK;
 	nlh->nlmsg_flags = NLM_F_CREATE | NLM_F_REQUEST | NLM_F_ACK;
-	nlh->nlmsg_seq = seq;
 
 	struct ifinfomsg *ifm = mnl_nlmsg_put_extra_header(nlh, sizeof(*ifm));
 	ifm->ifi_family = AF_UNSPEC;
-	ifm->ifi_change = 0;
-	ifm->ifi_flags = 0;
+	ifm->ifi_change = up ? IFF_UP : 0;
+	ifm->ifi_flags = up ? IFF_UP : 0;
+
+	if (link)
+		mnl_attr_put_u32(nlh, IFLA_LINK, link);
+	mnl_attr_put_strz(nlh, IFLA_IFNAME, if_name);
+	if (master)
+		mnl_attr_put_u32(nlh, IFLA_MASTER, master);
+}
 
-	mnl_attr_put_str(nlh, IFLA_IFNAME, if_name);
+static void link_create_header(
+		struct nlmsghdr* nlh, struct nlattr** linkinfo,
+		const char *if_name, const char *if_type,
+		unsigned int master, bool up)
+{
+	link_new_msg(nlh, 0, if_name, master, up);
 
 	*linkinfo = mnl_attr_nest_start(nlh, IFLA_LINKINFO);
-	mnl_attr_put_str(nlh, IFLA_INFO_KIND, if_type);
+	mnl_attr_put_strz(nlh, IFLA_INFO_KIND, if_type);
 }
 
 static lsdn_err_t link_create_send(
-		struct mnl_socket *sock, char* buf, struct nlmsghdr *nlh,
-		struct nlattr* linkinfo,
-		const char *if_name, struct lsdn_if* dst_if)
+		struct lsdn_nlsock *sock, char* buf, struct nlmsghdr *nlh,
+		const char *if_name, struct lsdn_if* dst_if,
+		unsigned int master, bool up)
 {
 	lsdn_err_t err;
-
-	mnl_attr_nest_end(nlh, linkinfo);
-
-	err = send_await_response(sock, nlh);
+	unsigned int ifindex = 0;
+	char saved[MNL_SOCKET_BUFFER_SIZE];
+	char name[IF_NAMESIZE + 1];
+
+	/* The name is often a shared buffer (lsdn_mk_ifname) and other workers may run while the
+	 * request is waited for */
+	snprintf(name, sizeof(name), "%s", if_name);
+	if_name = name;
+
+	switch (sock->adopt ? lsdn_adopt_link(sock->adopt, nlh, &ifindex) : LSDN_ADOPT_MISSING) {
+	case LSDN_ADOPT_SAME:
+		/* Keep the link, only move it under the right master if needed */
+		err = lsdn_link_set_master(sock, master, ifindex, up);
+		break;
+	case LSDN_ADOPT_DIFFERENT:
+		/* The delete request would overwrite the message in the batch buffer */
+		memcpy(saved, nlh, nlh->nlmsg_len);
+		nlh = (struct nlmsghdr *) saved;
+		err = link_delete_ifindex(sock, ifindex);
+		ifindex = 0;
+		if (err == LSDNE_OK)
+			err = send_await_echo(sock, nlh, &ifindex);
+		break;
+	default:
+		err = send_await_echo(sock, nlh, &ifindex);
+		break;
+	}
 	if (err != LSDNE_OK)
 		return err;
 
@@ -172,47 +717,42 @@ static lsdn_err_t link_create_send(
 	if (err != LSDNE_OK)
 		return err;
 
-	err = lsdn_if_resolve(dst_if);
+	/* Without the echo, look the new link up the usual way */
+	if (!ifindex)
+		return lsdn_if_resolve(sock, dst_if);
 
-	return err;
+	dst_if->ifindex = ifindex;
+	/* Spare the lookups of the new link until its notification arrives */
+	return lsdn_iftable_set(&sock->ifs, ifindex, if_name);
 }
 
 // ip link add name <if_name> type dummy
-lsdn_err_t lsdn_link_dummy_create(struct mnl_socket *sock, struct lsdn_if* dst_if, const char *if_name)
+lsdn_err_t lsdn_link_dummy_create(struct lsdn_nlsock *sock, struct lsdn_if* dst_if, const char *if_name,
+		unsigned int master, bool up)
 {
-	nl_buf(buf);
+	nl_buf(sock, buf);
 	struct nlmsghdr *nlh = mnl_nlmsg_put_header(buf);
 	struct nlattr *linkinfo;
 
-	link_create_header(nlh, &linkinfo, if_name, "dummy");
-	return link_create_send(sock, buf, nlh, linkinfo, if_name, dst_if);
+	link_create_header(nlh, &linkinfo, if_name, "dummy", master, up);
+	mnl_attr_nest_end(nlh, linkinfo);
+	return link_create_send(sock, buf, nlh, if_name, dst_if, master, up);
 }
 
 //ip link add link <if_name> name <vlan_name> type vlan id <vlanid>
-lsdn_err_t lsdn_link_vlan_create(struct mnl_socket *sock, struct lsdn_if* dst_if, const char *if_name,
-		const char *vlan_name, uint16_t vlanid)
+lsdn_err_t lsdn_link_vlan_create(struct lsdn_nlsock *sock, struct lsdn_if* dst_if, const char *if_name,
+		const char *vlan_name, uint16_t vlanid, unsigned int master, bool up)
 {
-	unsigned int seq = 0;
-	nl_buf(buf);
+	nl_buf(sock, buf);
 	struct nlmsghdr *nlh = mnl_nlmsg_put_header(buf);
 	struct nlattr *linkinfo;
 
-	unsigned int ifindex = if_nametoindex(if_name);
+	unsigned int ifindex = lookup_ifindex(sock, if_name);
 
-	nlh->nlmsg_type = RTM_NEWLINK;
-	nlh->nlmsg_flags = NLM_F_CREATE | NLM_F_REQUEST | NLM_F_ACK;
-	nlh->nlmsg_seq = seq;
-
-	struct ifinfomsg *ifm = mnl_nlmsg_put_extra_header(nlh, sizeof(*ifm));
-	ifm->ifi_family = AF_UNSPEC;
-	ifm->ifi_change = 0;
-	ifm->ifi_flags = 0;
-
-	mnl_attr_put_u32(nlh, IFLA_LINK, ifindex);
-	mnl_attr_put_str(nlh, IFLA_IFNAME, vlan_name);
+	link_new_msg(nlh, ifindex, vlan_name, master, up);
 
 	linkinfo = mnl_attr_nest_start(nlh, IFLA_LINKINFO);
-	mnl_attr_put_str(nlh, IFLA_INFO_KIND, "vlan");
+	mnl_attr_put_strz(nlh, IFLA_INFO_KIND, "vlan");
 
 	struct nlattr *vlanid_linkinfo = mnl_attr_nest_start(nlh, IFLA_INFO_DATA);
 	mnl_attr_put_u16(nlh, IFLA_VLAN_ID, vlanid);
@@ -220,43 +760,36 @@ lsdn_err_t lsdn_link_vlan_create(struct mnl_socket *sock, struct lsdn_if* dst_if
 
 	mnl_attr_nest_end(nlh, linkinfo);
 
-	return link_create_send(sock, buf, nlh, linkinfo, vlan_name, dst_if);
+	return link_create_send(sock, buf, nlh, vlan_name, dst_if, master, up);
 }
 
 //ip link add <vxlan_name> type vxlan id <vxlanid> [group <mcast_group>] dstport <port> dev <if_name>
 lsdn_err_t lsdn_link_vxlan_create(
-	struct mnl_socket *sock, struct lsdn_if* dst_if,
+	struct lsdn_nlsock *sock, struct lsdn_if* dst_if,
 	const char *if_name, const char *vxlan_name,
 	lsdn_ip_t *mcast_group, uint32_t vxlanid, uint16_t port,
-	bool learning, bool collect_metadata, enum lsdn_ipv ipv)
+	bool learning, bool collect_metadata, enum lsdn_ipv ipv,
+	unsigned int master, bool up)
 {
-	unsigned int seq = 0;
-	nl_buf(buf);
+	nl_buf(sock, buf);
 	struct nlmsghdr *nlh = mnl_nlmsg_put_header(buf);
 	struct nlattr *linkinfo;
 	lsdn_ip_t dummy_ip;
+	bzero(&dummy_ip, sizeof(dummy_ip));
 
 	unsigned int ifindex = 0;
 	if (if_name)
-		ifindex = if_nametoindex(if_name);
+		ifindex = lookup_ifindex(sock, if_name);
 
-	nlh->nlmsg_type = RTM_NEWLINK;
-	nlh->nlmsg_flags = NLM_F_CREATE | NLM_F_REQUEST | NLM_F_ACK;
-	nlh->nlmsg_seq = seq;
-
-	struct ifinfomsg *ifm = mnl_nlmsg_put_extra_header(nlh, sizeof(*ifm));
-	ifm->ifi_family = AF_UNSPEC;
-	ifm->ifi_change = 0;
-	ifm->ifi_flags = 0;
-	if (if_name)
-		mnl_attr_put_u32(nlh, IFLA_LINK, ifindex);
-	mnl_attr_put_str(nlh, IFLA_IFNAME, vxlan_name);
+	/* The lower link is given only in the vxlan attributes, like the kernel reports it back */
+	link_new_msg(nlh, 0, vxlan_name, master, up);
 
 	linkinfo = mnl_attr_nest_start(nlh, IFLA_LINKINFO);
-	mnl_attr_put_str(nlh, IFLA_INFO_KIND, "vxlan");
+	mnl_attr_put_strz(nlh, IFLA_INFO_KIND, "vxlan");
 
 	struct nlattr *vxlanid_linkinfo = mnl_attr_nest_start(nlh, IFLA_INFO_DATA);
-	mnl_attr_put_u32(nlh, IFLA_VXLAN_LINK, ifindex);
+	if (ifindex)
+		mnl_attr_put_u32(nlh, IFLA_VXLAN_LINK, ifindex);
 	mnl_attr_put_u32(nlh, IFLA_VXLAN_ID, vxlanid);
 	mnl_attr_put_u16(nlh, IFLA_VXLAN_PORT, htons(port));
 	mnl_attr_put_u8(nlh, IFLA_VXLAN_LEARNING, learning);
@@ -278,39 +811,61 @@ lsdn_err_t lsdn_link_vxlan_create(
 	mnl_attr_nest_end(nlh, vxlanid_linkinfo);
 	mnl_attr_nest_end(nlh, linkinfo);
 
-	return link_create_send(sock, buf, nlh, linkinfo, vxlan_name, dst_if);
+	return link_create_send(sock, buf, nlh, vxlan_name, dst_if, master, up);
 }
 
-lsdn_err_t lsdn_link_bridge_create(struct mnl_socket *sock, struct lsdn_if* dst_if, const char *if_name)
+lsdn_err_t lsdn_link_bridge_create(struct lsdn_nlsock *sock, struct lsdn_if* dst_if, const char *if_name,
+		unsigned int master, bool up)
 {
-	nl_buf(buf);
+	nl_buf(sock, buf);
 	struct nlmsghdr *nlh = mnl_nlmsg_put_header(buf);
 	struct nlattr *linkinfo;
 
-	link_create_header(nlh, &linkinfo, if_name, "bridge");
-	return link_create_send(sock, buf, nlh, linkinfo, if_name, dst_if);
+	link_create_header(nlh, &linkinfo, if_name, "bridge", master, up);
+	mnl_attr_nest_end(nlh, linkinfo);
+	return link_create_send(sock, buf, nlh, if_name, dst_if, master, up);
 }
 
-lsdn_err_t lsdn_link_set_master(struct mnl_socket *sock,
-		unsigned int master, unsigned int slave)
+static struct nlmsghdr *link_set_master_msg(
+		char *buf, unsigned int master, unsigned int slave, bool up)
 {
-	unsigned int seq = 0, change = 0;
-	nl_buf(buf);
+	unsigned int change = 0, flags = 0;
+
+	if (up)
+		change = flags = IFF_UP;
 
 	struct nlmsghdr *nlh = mnl_nlmsg_put_header(buf);
 	nlh->nlmsg_type = RTM_NEWLINK;
 	nlh->nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK;
-	nlh->nlmsg_seq = seq;
 
 	struct ifinfomsg *ifm = mnl_nlmsg_put_extra_header(nlh, sizeof(*ifm));
 	ifm->ifi_family = AF_UNSPEC;
 	ifm->ifi_change = change;
-	ifm->ifi_flags = 0;
+	ifm->ifi_flags = flags;
 	ifm->ifi_index = slave;
 
 	mnl_attr_put_u32(nlh, IFLA_MASTER, master);
+	return nlh;
+}
 
-	return send_await_response(sock, nlh);
+lsdn_err_t lsdn_link_set_master(struct lsdn_nlsock *sock,
+		unsigned int master, unsigned int slave, bool up)
+{
+	if (sock->adopt && lsdn_adopt_link_attach(sock->adopt, slave, master, up))
+		return LSDNE_OK;
+
+	nl_buf(sock, buf);
+	return send_await_response(sock, link_set_master_msg(buf, master, slave, up));
+}
+
+void lsdn_link_set_master_async(struct lsdn_nlsock *sock,
+		unsigned int master, unsigned int slave, bool up, lsdn_nl_err_cb cb, void *user)
+{
+	if (sock->adopt && lsdn_adopt_link_attach(sock->adopt, slave, master, up))
+		return;
+
+	nl_buf(sock, buf);
+	nl_queue(sock, link_set_master_msg(buf, master, slave, up), cb, user);
 }
 
 static void fdb_set_keys(struct nlmsghdr *nlh, lsdn_mac_t mac, lsdn_ip_t ip)
@@ -323,16 +878,17 @@ static void fdb_set_keys(struct nlmsghdr *nlh, lsdn_mac_t mac, lsdn_ip_t ip)
 		mnl_attr_put(nlh, NDA_DST, sizeof(ip.v6.bytes), ip.v6.bytes);
 }
 
-lsdn_err_t lsdn_fdb_add_entry(struct mnl_socket *sock, unsigned int ifindex,
+static struct nlmsghdr *fdb_entry_msg(char *buf, bool add, unsigned int ifindex,
 		lsdn_mac_t mac, lsdn_ip_t ip)
 {
-	unsigned int seq = 0;
-	nl_buf(buf);
-
 	struct nlmsghdr *nlh = mnl_nlmsg_put_header(buf);
-	nlh->nlmsg_type = RTM_NEWNEIGH;
-	nlh->nlmsg_flags = NLM_F_REQUEST | NLM_F_CREATE | NLM_F_APPEND | NLM_F_ACK;
-	nlh->nlmsg_seq = seq;
+	if (add) {
+		nlh->nlmsg_type = RTM_NEWNEIGH;
+		nlh->nlmsg_flags = NLM_F_REQUEST | NLM_F_CREATE | NLM_F_APPEND | NLM_F_ACK;
+	} else {
+		nlh->nlmsg_type = RTM_DELNEIGH;
+		nlh->nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK;
+	}
 
 	struct ndmsg *nd = mnl_nlmsg_put_extra_header(nlh, sizeof(*nd));
 	nd->ndm_family = PF_BRIDGE;
@@ -341,44 +897,47 @@ lsdn_err_t lsdn_fdb_add_entry(struct mnl_socket *sock, unsigned int ifindex,
 	nd->ndm_flags = NTF_SELF;
 
 	fdb_set_keys(nlh, mac, ip);
-
-	return send_await_response(sock, nlh);
+	return nlh;
 }
 
-lsdn_err_t lsdn_fdb_remove_entry(struct mnl_socket *sock, unsigned int ifindex,
-			  lsdn_mac_t mac, lsdn_ip_t ip)
+lsdn_err_t lsdn_fdb_add_entry(struct lsdn_nlsock *sock, unsigned int ifindex,
+		lsdn_mac_t mac, lsdn_ip_t ip)
 {
-	unsigned int seq = 0;
-	nl_buf(buf);
-
-	struct nlmsghdr *nlh = mnl_nlmsg_put_header(buf);
-	nlh->nlmsg_type = RTM_DELNEIGH;
-	nlh->nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK;
-	nlh->nlmsg_seq = seq;
+	nl_buf(sock, buf);
+	return send_await_response(sock, fdb_entry_msg(buf, true, ifindex, mac, ip));
+}
 
-	struct ndmsg *nd = mnl_nlmsg_put_extra_header(nlh, sizeof(*nd));
-	nd->ndm_family = PF_BRIDGE;
-	nd->ndm_state = NUD_NOARP | NUD_PERMANENT;
-	nd->ndm_ifindex = ifindex;
-	nd->ndm_flags = NTF_SELF;
+void lsdn_fdb_add_entry_async(struct lsdn_nlsock *sock, unsigned int ifindex,
+		lsdn_mac_t mac, lsdn_ip_t ip, lsdn_nl_err_cb cb, void *user)
+{
+	nl_buf(sock, buf);
+	nl_queue(sock, fdb_entry_msg(buf, true, ifindex, mac, ip), cb, user);
+}
 
-	fdb_set_keys(nlh, mac, ip);
+lsdn_err_t lsdn_fdb_remove_entry(struct lsdn_nlsock *sock, unsigned int ifindex,
+			  lsdn_mac_t mac, lsdn_ip_t ip)
+{
+	nl_buf(sock, buf);
+	return send_await_response(sock, fdb_entry_msg(buf, false, ifindex, mac, ip));
+}
 
-	return send_await_response(sock, nlh);
+void lsdn_fdb_remove_entry_async(struct lsdn_nlsock *sock, unsigned int ifindex,
+		lsdn_mac_t mac, lsdn_ip_t ip, lsdn_nl_err_cb cb, void *user)
+{
+	nl_buf(sock, buf);
+	nl_queue(sock, fdb_entry_msg(buf, false, ifindex, mac, ip), cb, user);
 }
 
-lsdn_err_t lsdn_link_set_ip(struct mnl_socket *sock,
+lsdn_err_t lsdn_link_set_ip(struct lsdn_nlsock *sock,
 		const char *iface, lsdn_ip_t ip)
 {
-	unsigned int seq = 0;
-	nl_buf(buf);
+	nl_buf(sock, buf);
 
-	int ifindex = if_nametoindex(iface);
+	unsigned int ifindex = lookup_ifindex(sock, iface);
 
 	struct nlmsghdr *nlh = mnl_nlmsg_put_header(buf);
 	nlh->nlmsg_type = RTM_NEWADDR;
 	nlh->nlmsg_flags = NLM_F_REPLACE | NLM_F_REQUEST | NLM_F_ACK;
-	nlh->nlmsg_seq = seq;
 
 	struct ifaddrmsg *ifm = mnl_nlmsg_put_extra_header(nlh, sizeof(*ifm));
 	if (ip.v == LSDN_IPv4)
@@ -399,17 +958,17 @@ lsdn_err_t lsdn_link_set_ip(struct mnl_socket *sock,
 }
 
 lsdn_err_t lsdn_link_veth_create(
-		struct mnl_socket *sock,
+		struct lsdn_nlsock *sock,
 		struct lsdn_if* if1, const char *if_name1,
 		struct lsdn_if* if2, const char *if_name2)
 {
 	lsdn_err_t err;
-	nl_buf(buf);
+	nl_buf(sock, buf);
 
 	struct nlmsghdr *nlh = mnl_nlmsg_put_header(buf);
 	struct nlattr *linkinfo;
 
-	link_create_header(nlh, &linkinfo, if_name1, "veth");
+	link_create_header(nlh, &linkinfo, if_name1, "veth", 0, false);
 
 	/* peer data */
 	struct nlattr* info_data = mnl_attr_nest_start(nlh, IFLA_INFO_DATA);
@@ -423,75 +982,124 @@ lsdn_err_t lsdn_link_veth_create(
 	ifm->ifi_change = 0;
 	ifm->ifi_flags = 0;
 
-	mnl_attr_put_str(nlh, IFLA_IFNAME, if_name2);
+	mnl_attr_put_strz(nlh, IFLA_IFNAME, if_name2);
 
 	struct nlattr* peer_linkinfo = mnl_attr_nest_start(nlh, IFLA_LINKINFO);
-	mnl_attr_put_str(nlh, IFLA_INFO_KIND, "veth");
+	mnl_attr_put_strz(nlh, IFLA_INFO_KIND, "veth");
 	mnl_attr_nest_end(nlh, peer_linkinfo);
 
 	mnl_attr_nest_end(nlh, peer);
 	mnl_attr_nest_end(nlh, info_data);
+	mnl_attr_nest_end(nlh, linkinfo);
 
-	err = link_create_send(sock, buf, nlh, linkinfo, if_name1, if1);
+	err = link_create_send(sock, buf, nlh, if_name1, if1, 0, false);
 	if (err == LSDNE_OK) {
 		err = lsdn_if_set_name(if2, if_name2);
 		if (err == LSDNE_OK)
-			err = lsdn_if_resolve(if2);
+			err = lsdn_if_resolve(sock, if2);
 	}
 
 	return err;
 }
 
-lsdn_err_t lsdn_link_delete(struct mnl_socket *sock, struct lsdn_if *iface)
+static struct nlmsghdr *link_delete_msg(char *buf, unsigned int ifindex)
 {
-	unsigned int seq = 0;
-	nl_buf(buf);
 	struct nlmsghdr *nlh = mnl_nlmsg_put_header(buf);
 
 	nlh->nlmsg_type = RTM_DELLINK;
 	nlh->nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK;
-	nlh->nlmsg_seq = seq;
 
 	struct ifinfomsg *ifm = mnl_nlmsg_put_extra_header(nlh, sizeof(*ifm));
 	ifm->ifi_family = AF_UNSPEC;
 	ifm->ifi_change = 0;
 	ifm->ifi_flags = 0;
-	ifm->ifi_index = iface->ifindex;
+	ifm->ifi_index = ifindex;
+	return nlh;
+}
 
-	return send_await_response(sock, nlh);
+static lsdn_err_t link_delete_ifindex(struct lsdn_nlsock *sock, unsigned int ifindex)
+{
+	nl_buf(sock, buf);
+	return send_await_response(sock, link_delete_msg(buf, ifindex));
 }
 
-lsdn_err_t lsdn_link_set(struct mnl_socket *sock, unsigned int ifindex, bool up)
+lsdn_err_t lsdn_link_delete(struct lsdn_nlsock *sock, struct lsdn_if *iface)
 {
-	unsigned int seq = 0, change = IFF_UP, flags = 0;
-	nl_buf(buf);
+	return link_delete_ifindex(sock, iface->ifindex);
+}
+
+void lsdn_link_delete_async(struct lsdn_nlsock *sock, unsigned int ifindex,
+		lsdn_nl_err_cb cb, void *user)
+{
+	nl_buf(sock, buf);
+	nl_queue(sock, link_delete_msg(buf, ifindex), cb, user);
+}
+
+static struct nlmsghdr *link_set_msg(char *buf, unsigned int ifindex, bool up)
+{
+	unsigned int change = IFF_UP, flags = 0;
 
 	if (up)
 		flags = IFF_UP;
-	
+
 	struct nlmsghdr *nlh = mnl_nlmsg_put_header(buf);
 	nlh->nlmsg_type = RTM_NEWLINK;
 	nlh->nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK;
-	nlh->nlmsg_seq = seq;
 
 	struct ifinfomsg *ifm = mnl_nlmsg_put_extra_header(nlh, sizeof(*ifm));
 	ifm->ifi_family = AF_UNSPEC;
 	ifm->ifi_change = change;
 	ifm->ifi_flags = flags;
 	ifm->ifi_index = ifindex;
+	return nlh;
+}
 
-	return send_await_response(sock, nlh);
+lsdn_err_t lsdn_link_set(struct lsdn_nlsock *sock, unsigned int ifindex, bool up)
+{
+	nl_buf(sock, buf);
+	return send_await_response(sock, link_set_msg(buf, ifindex, up));
 }
 
-lsdn_err_t lsdn_qdisc_ingress_create(struct mnl_socket *sock, unsigned int ifindex)
+void lsdn_link_set_async(struct lsdn_nlsock *sock, unsigned int ifindex, bool up,
+		lsdn_nl_err_cb cb, void *user)
 {
-	unsigned int seq = 0;
-	nl_buf(buf);
+	nl_buf(sock, buf);
+	nl_queue(sock, link_set_msg(buf, ifindex, up), cb, user);
+}
 
+/**
+ * Check a new qdisc against the kernel state being adopted.
+ *
+ * A different qdisc in its place is deleted first and the request is moved to `saved`, because
+ * the delete request is built over it.
+ * @return false if the same qdisc is already in place and the request must be dropped.
+ */
+static bool qdisc_adopt(struct lsdn_nlsock *sock, struct nlmsghdr **nlh, char *saved)
+{
+	if (!sock->adopt)
+		return true;
+
+	switch (lsdn_adopt_qdisc(sock->adopt, *nlh)) {
+	case LSDN_ADOPT_SAME:
+		return false;
+	case LSDN_ADOPT_DIFFERENT:
+		memcpy(saved, *nlh, (*nlh)->nlmsg_len);
+		(*nlh)->nlmsg_type = RTM_DELQDISC;
+		(*nlh)->nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK;
+		(*nlh)->nlmsg_len = mnl_nlmsg_size(sizeof(struct tcmsg));
+		nl_queue(sock, *nlh, NULL, NULL);
+		*nlh = (struct nlmsghdr *) saved;
+		return true;
+	default:
+		return true;
+	}
+}
+
+static struct nlmsghdr *qdisc_ingress_msg(char *buf, unsigned int ifindex)
+{
 	struct nlmsghdr *nlh = mnl_nlmsg_put_header(buf);
 	nlh->nlmsg_type = RTM_NEWQDISC;
 	nlh->nlmsg_flags = NLM_F_CREATE | NLM_F_REQUEST | NLM_F_ACK;
-	nlh->nlmsg_seq = seq;
 
 	struct tcmsg *tcm = mnl_nlmsg_put_extra_header(nlh, sizeof(*tcm));
 	tcm->tcm_family = AF_UNSPEC;
@@ -499,20 +1107,35 @@ lsdn_err_t lsdn_qdisc_ingress_create(struct mnl_socket *sock, unsigned int ifind
 	tcm->tcm_handle = LSDN_INGRESS_HANDLE;
 	tcm->tcm_parent = TC_H_INGRESS;
 
-	mnl_attr_put_str(nlh, TCA_KIND, "ingress");
+	mnl_attr_put_strz(nlh, TCA_KIND, "ingress");
+	return nlh;
+}
 
+lsdn_err_t lsdn_qdisc_ingress_create(struct lsdn_nlsock *sock, unsigned int ifindex)
+{
+	nl_buf(sock, buf);
+	char saved[MNL_SOCKET_BUFFER_SIZE];
+	struct nlmsghdr *nlh = qdisc_ingress_msg(buf, ifindex);
+	if (!qdisc_adopt(sock, &nlh, saved))
+		return LSDNE_OK;
 	return send_await_response(sock, nlh);
 }
 
-lsdn_err_t lsdn_qdisc_egress_create(struct mnl_socket *sock, unsigned int ifindex)
+void lsdn_qdisc_ingress_create_async(struct lsdn_nlsock *sock, unsigned int ifindex,
+		lsdn_nl_err_cb cb, void *user)
 {
-	unsigned int seq = 0;
-	nl_buf(buf);
+	nl_buf(sock, buf);
+	char saved[MNL_SOCKET_BUFFER_SIZE];
+	struct nlmsghdr *nlh = qdisc_ingress_msg(buf, ifindex);
+	if (qdisc_adopt(sock, &nlh, saved))
+		nl_queue(sock, nlh, cb, user);
+}
 
+static struct nlmsghdr *qdisc_egress_msg(char *buf, unsigned int ifindex)
+{
 	struct nlmsghdr *nlh = mnl_nlmsg_put_header(buf);
 	nlh->nlmsg_type = RTM_NEWQDISC;
 	nlh->nlmsg_flags = NLM_F_CREATE | NLM_F_REQUEST | NLM_F_ACK;
-	nlh->nlmsg_seq = seq;
 
 	struct tcmsg *tcm = mnl_nlmsg_put_extra_header(nlh, sizeof(*tcm));
 	tcm->tcm_family = AF_UNSPEC;
@@ -520,18 +1143,83 @@ lsdn_err_t lsdn_qdisc_egress_create(struct mnl_socket *sock, unsigned int ifinde
 	tcm->tcm_handle = LSDN_ROOT_HANDLE;
 	tcm->tcm_parent = TC_H_ROOT;
 
-	mnl_attr_put_str(nlh, TCA_KIND, "prio");
+	mnl_attr_put_strz(nlh, TCA_KIND, "prio");
 
 	struct tc_prio_qopt qopt;
 	qopt.bands = 2;
 	bzero(qopt.priomap, sizeof(qopt.priomap));
 	mnl_attr_put(nlh, TCA_OPTIONS, sizeof(qopt), &qopt);
+	return nlh;
+}
 
+lsdn_err_t lsdn_qdisc_egress_create(struct lsdn_nlsock *sock, unsigned int ifindex)
+{
+	nl_buf(sock, buf);
+	char saved[MNL_SOCKET_BUFFER_SIZE];
+	struct nlmsghdr *nlh = qdisc_egress_msg(buf, ifindex);
+	if (!qdisc_adopt(sock, &nlh, saved))
+		return LSDNE_OK;
 	return send_await_response(sock, nlh);
 }
 
+void lsdn_qdisc_egress_create_async(struct lsdn_nlsock *sock, unsigned int ifindex,
+		lsdn_nl_err_cb cb, void *user)
+{
+	nl_buf(sock, buf);
+	char saved[MNL_SOCKET_BUFFER_SIZE];
+	struct nlmsghdr *nlh = qdisc_egress_msg(buf, ifindex);
+	if (qdisc_adopt(sock, &nlh, saved))
+		nl_queue(sock, nlh, cb, user);
+}
+
+static struct nlmsghdr *qdisc_clsact_msg(
+	char *buf, uint16_t type, uint16_t flags, unsigned int ifindex)
+{
+	struct nlmsghdr *nlh = mnl_nlmsg_put_header(buf);
+	nlh->nlmsg_type = type;
+	nlh->nlmsg_flags = flags | NLM_F_REQUEST | NLM_F_ACK;
+
+	struct tcmsg *tcm = mnl_nlmsg_put_extra_header(nlh, sizeof(*tcm));
+	tcm->tcm_family = AF_UNSPEC;
+	tcm->tcm_ifindex = ifindex;
+	tcm->tcm_handle = LSDN_INGRESS_HANDLE;
+	tcm->tcm_parent = TC_H_CLSACT;
+
+	mnl_attr_put_strz(nlh, TCA_KIND, "clsact");
+	return nlh;
+}
+
+/** Create a clsact qdisc bound to shared filter blocks.
+ * The filters for both directions are then taken from the blocks (addressed by
+ * `TCM_IFINDEX_MAGIC_BLOCK` and the block index in place of the parent), instead of the
+ * interface. A block is created along with the first qdisc referring to it and destroyed
+ * together with its filters when the last such qdisc goes away. */
+void lsdn_qdisc_clsact_create_async(struct lsdn_nlsock *sock, unsigned int ifindex,
+		uint32_t block_in, uint32_t block_out, lsdn_nl_err_cb cb, void *user)
+{
+	nl_buf(sock, buf);
+	struct nlmsghdr *nlh = qdisc_clsact_msg(buf, RTM_NEWQDISC, NLM_F_CREATE, ifindex);
+	mnl_attr_put_u32(nlh, TCA_INGRESS_BLOCK, block_in);
+	mnl_attr_put_u32(nlh, TCA_EGRESS_BLOCK, block_out);
+	char saved[MNL_SOCKET_BUFFER_SIZE];
+	if (qdisc_adopt(sock, &nlh, saved))
+		nl_queue(sock, nlh, cb, user);
+}
+
+/** Delete the clsact qdisc, unbinding the interface from its blocks. */
+void lsdn_qdisc_clsact_delete_async(struct lsdn_nlsock *sock, unsigned int ifindex,
+		lsdn_nl_err_cb cb, void *user)
+{
+	nl_buf(sock, buf);
+	nl_queue(sock, qdisc_clsact_msg(buf, RTM_DELQDISC, 0, ifindex), cb, user);
+}
+
 /**
  * @brief lsdn_filter_init
+ *
+ * The filter is built in place in the socket's batch buffer, so no allocation is needed. Only one
+ * filter may be built at a time and no other requests may be made until it is freed.
+ * @param sock Socket the filter will be sent through.
  * @param kind Type of filter (e.g. "flower" or "u32")
  * @param if_index Interface index.
  * @param handle Identification of the filter. Assigned by kernel when handle = 0
@@ -540,19 +1228,16 @@ lsdn_err_t lsdn_qdisc_egress_create(struct mnl_socket *sock, unsigned int ifinde
  * @param protocol Ethertype of the filter.
  * @return Pre-prepared nl message headers and options that can be further modified.
  */
-static struct lsdn_filter *filter_init(const char *kind, uint32_t if_index, uint32_t handle,
+static struct lsdn_filter *filter_init(
+		struct lsdn_nlsock *sock, const char *kind, uint32_t if_index, uint32_t handle,
 		uint32_t parent, uint32_t chain, uint16_t priority)
 {
-	struct lsdn_filter *f = malloc(sizeof(*f));
-	if (!f)
-		return NULL;
+	sock = nl_lane(sock);
+	nl_buf(sock, buf);
+	struct lsdn_filter *f = &sock->filter;
+	sock->filter_busy = true;
+	f->sock = sock;
 	f->update = false;
-	char *buf = calloc(MNL_SOCKET_BUFFER_SIZE, sizeof(char));
-	if (!buf) {
-		free(f);
-		return NULL;
-	}
-
 	f->nlh = mnl_nlmsg_put_header(buf);
 
 	struct tcmsg *tcm = mnl_nlmsg_put_extra_header(f->nlh, sizeof(*tcm));
@@ -562,7 +1247,7 @@ static struct lsdn_filter *filter_init(const char *kind, uint32_t if_index, uint
 	tcm->tcm_parent = parent;
 	tcm->tcm_info = TC_H_MAKE(priority << 16, ETH_P_ALL << 8);
 
-	mnl_attr_put_str(f->nlh, TCA_KIND, kind);
+	mnl_attr_put_strz(f->nlh, TCA_KIND, kind);
 	mnl_attr_put_u32(f->nlh, TCA_CHAIN, chain);
 	f->nested_opts = mnl_attr_nest_start(f->nlh, TCA_OPTIONS);
 	f->nested_acts = NULL;
@@ -570,16 +1255,30 @@ static struct lsdn_filter *filter_init(const char *kind, uint32_t if_index, uint
 	return f;
 }
 
-struct lsdn_filter *lsdn_filter_flower_init(uint32_t if_index, uint32_t handle, uint32_t parent, uint32_t chain, uint16_t prio)
+struct lsdn_filter *lsdn_filter_flower_init(
+	struct lsdn_nlsock *sock, uint32_t if_index, uint32_t handle,
+	uint32_t parent, uint32_t chain, uint16_t prio)
+{
+	return filter_init(sock, "flower", if_index, handle, parent, chain, prio);
+}
+
+/** A cls_bpf filter running the program in direct-action mode, its return value is the verdict.
+ * The kernel reports the name instead of the file descriptor in dumps. */
+struct lsdn_filter *lsdn_filter_bpf_init(
+	struct lsdn_nlsock *sock, uint32_t if_index, uint32_t handle,
+	uint32_t parent, uint32_t chain, uint16_t prio, int prog_fd, const char *name)
 {
-	return filter_init("flower", if_index, handle, parent, chain, prio);
+	struct lsdn_filter *f = filter_init(sock, "bpf", if_index, handle, parent, chain, prio);
+	mnl_attr_put_u32(f->nlh, TCA_BPF_FD, prog_fd);
+	mnl_attr_put_strz(f->nlh, TCA_BPF_NAME, name);
+	mnl_attr_put_u32(f->nlh, TCA_BPF_FLAGS, TCA_BPF_FLAG_ACT_DIRECT);
+	return f;
 }
 
 
 void lsdn_filter_free(struct lsdn_filter *f)
 {
-	free(f->nlh);
-	free(f);
+	f->sock->filter_busy = false;
 }
 
 static void filter_actions_start(struct lsdn_filter *f, uint16_t type)
@@ -606,7 +1305,7 @@ static void action_mirred_add(struct lsdn_filter *f, uint16_t order,
 		int action, int eaction, uint32_t ifindex)
 {
 	struct nlattr* nested_attr = mnl_attr_nest_start(f->nlh, order);
-	mnl_attr_put_str(f->nlh, TCA_ACT_KIND, "mirred");
+	mnl_attr_put_strz(f->nlh, TCA_ACT_KIND, "mirred");
 
 	struct nlattr* nested_attr2 = mnl_attr_nest_start(f->nlh, TCA_ACT_OPTIONS);
 
@@ -646,39 +1345,141 @@ void lsdn_action_mirror_egress_add(
 	action_mirred_add(f, order, TC_ACT_PIPE, TCA_EGRESS_REDIR, ifindex);
 }
 
-void lsdn_action_set_tunnel_key(
-		struct lsdn_filter *f, uint16_t order,
-		uint32_t vni, lsdn_ip_t *src_ip, lsdn_ip_t *dst_ip)
+/* Put a tunnel_key action into a filter or an action request. With a non-zero index and no
+ * IPs, the action refers to an existing standalone action. The owner is stored in the cookie of
+ * standalone actions, truncated to TC_COOKIE_MAX_SIZE. */
+static void put_tunnel_key(struct nlmsghdr *nlh, uint16_t order, uint32_t index,
+		uint32_t vni, lsdn_ip_t *src_ip, lsdn_ip_t *dst_ip, const char *owner)
 {
-	struct nlattr* nested_attr = mnl_attr_nest_start(f->nlh, order);
-	mnl_attr_put_str(f->nlh, TCA_ACT_KIND, "tunnel_key");
+	struct nlattr* nested_attr = mnl_attr_nest_start(nlh, order);
+	mnl_attr_put_strz(nlh, TCA_ACT_KIND, "tunnel_key");
+	if (owner)
+		mnl_attr_put(nlh, TCA_ACT_COOKIE, strnlen(owner, TC_COOKIE_MAX_SIZE), owner);
 
-	struct nlattr* nested_attr2 = mnl_attr_nest_start(f->nlh, TCA_ACT_OPTIONS);
+	struct nlattr* nested_attr2 = mnl_attr_nest_start(nlh, TCA_ACT_OPTIONS);
 
 	struct tc_tunnel_key tunnel_key;
 	bzero(&tunnel_key, sizeof(tunnel_key));
+	tunnel_key.index = index;
 	tunnel_key.action = TC_ACT_PIPE;
 	tunnel_key.t_action = TCA_TUNNEL_KEY_ACT_SET;
 
-	mnl_attr_put_u32(f->nlh, TCA_TUNNEL_KEY_ENC_KEY_ID, htonl(vni));
-	if (src_ip->v == LSDN_IPv4 && dst_ip->v == LSDN_IPv4) {
-		mnl_attr_put_u32(f->nlh, TCA_TUNNEL_KEY_ENC_IPV4_SRC, htonl(lsdn_ip4_u32(&src_ip->v4)));
-		mnl_attr_put_u32(f->nlh, TCA_TUNNEL_KEY_ENC_IPV4_DST, htonl(lsdn_ip4_u32(&dst_ip->v4)));
-	} else {
-		mnl_attr_put(f->nlh, TCA_TUNNEL_KEY_ENC_IPV6_SRC, sizeof(src_ip->v6.bytes), src_ip->v6.bytes);
-		mnl_attr_put(f->nlh, TCA_TUNNEL_KEY_ENC_IPV6_DST, sizeof(dst_ip->v6.bytes), dst_ip->v6.bytes);
+	if (src_ip && dst_ip) {
+		mnl_attr_put_u32(nlh, TCA_TUNNEL_KEY_ENC_KEY_ID, htonl(vni));
+		if (src_ip->v == LSDN_IPv4 && dst_ip->v == LSDN_IPv4) {
+			mnl_attr_put_u32(nlh, TCA_TUNNEL_KEY_ENC_IPV4_SRC, htonl(lsdn_ip4_u32(&src_ip->v4)));
+			mnl_attr_put_u32(nlh, TCA_TUNNEL_KEY_ENC_IPV4_DST, htonl(lsdn_ip4_u32(&dst_ip->v4)));
+		} else {
+			mnl_attr_put(nlh, TCA_TUNNEL_KEY_ENC_IPV6_SRC, sizeof(src_ip->v6.bytes), src_ip->v6.bytes);
+			mnl_attr_put(nlh, TCA_TUNNEL_KEY_ENC_IPV6_DST, sizeof(dst_ip->v6.bytes), dst_ip->v6.bytes);
+		}
 	}
 
-	mnl_attr_put(f->nlh, TCA_TUNNEL_KEY_PARMS, sizeof(tunnel_key), &tunnel_key);
+	mnl_attr_put(nlh, TCA_TUNNEL_KEY_PARMS, sizeof(tunnel_key), &tunnel_key);
 
-	mnl_attr_nest_end(f->nlh, nested_attr2);
-	mnl_attr_nest_end(f->nlh, nested_attr);
+	mnl_attr_nest_end(nlh, nested_attr2);
+	mnl_attr_nest_end(nlh, nested_attr);
+}
+
+void lsdn_action_set_tunnel_key(
+		struct lsdn_filter *f, uint16_t order,
+		uint32_t vni, lsdn_ip_t *src_ip, lsdn_ip_t *dst_ip)
+{
+	put_tunnel_key(f->nlh, order, 0, vni, src_ip, dst_ip, NULL);
+}
+
+void lsdn_action_tunnel_key_ref(struct lsdn_filter *f, uint16_t order, uint32_t index)
+{
+	/* The kernel binds the existing action and ignores the rest of the parameters */
+	put_tunnel_key(f->nlh, order, index, 0, NULL, NULL, NULL);
+}
+
+static struct nlmsghdr *action_msg(char *buf, uint16_t type, uint16_t flags)
+{
+	struct nlmsghdr *nlh = mnl_nlmsg_put_header(buf);
+	nlh->nlmsg_type = type;
+	nlh->nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK | flags;
+
+	struct tcamsg *tca = mnl_nlmsg_put_extra_header(nlh, sizeof(*tca));
+	tca->tca_family = AF_UNSPEC;
+	return nlh;
+}
+
+static bool action_adopt(struct lsdn_nlsock *sock, struct nlmsghdr *nlh)
+{
+	if (!sock->adopt)
+		return true;
+
+	switch (lsdn_adopt_action(sock->adopt, nlh)) {
+	case LSDN_ADOPT_SAME:
+		return false;
+	case LSDN_ADOPT_DIFFERENT:
+		/* Our own action from the previous context, take it over */
+		nlh->nlmsg_flags &= ~NLM_F_EXCL;
+		nlh->nlmsg_flags |= NLM_F_REPLACE;
+		return true;
+	default:
+		return true;
+	}
+}
+
+void lsdn_tunnel_key_create_async(struct lsdn_nlsock *sock, uint32_t index, const char *owner,
+		uint32_t vni, lsdn_ip_t *src_ip, lsdn_ip_t *dst_ip, bool replace,
+		lsdn_nl_err_cb cb, void *user)
+{
+	nl_buf(sock, buf);
+	struct nlmsghdr *nlh = action_msg(
+		buf, RTM_NEWACTION, NLM_F_CREATE | (replace ? NLM_F_REPLACE : NLM_F_EXCL));
+	struct nlattr *tab = mnl_attr_nest_start(nlh, TCA_ACT_TAB);
+	put_tunnel_key(nlh, 1, index, vni, src_ip, dst_ip, owner);
+	mnl_attr_nest_end(nlh, tab);
+	if (action_adopt(sock, nlh))
+		nl_queue(sock, nlh, cb, user);
+}
+
+uint32_t lsdn_tunnel_key_index(const struct nlmsghdr *nlh)
+{
+	const struct nlattr *tab, *act, *attr, *opt;
+	mnl_attr_for_each(tab, nlh, sizeof(struct tcamsg)) {
+		if (mnl_attr_get_type(tab) != TCA_ACT_TAB)
+			continue;
+		mnl_attr_for_each_nested(act, tab) {
+			mnl_attr_for_each_nested(attr, act) {
+				/* Deletions only carry the index */
+				if (mnl_attr_get_type(attr) == TCA_ACT_INDEX)
+					return mnl_attr_get_u32(attr);
+				if (mnl_attr_get_type(attr) != TCA_ACT_OPTIONS)
+					continue;
+				mnl_attr_for_each_nested(opt, attr) {
+					if (mnl_attr_get_type(opt) != TCA_TUNNEL_KEY_PARMS)
+						continue;
+					const struct tc_tunnel_key *parms = mnl_attr_get_payload(opt);
+					return parms->index;
+				}
+			}
+		}
+	}
+	return 0;
+}
+
+void lsdn_tunnel_key_delete_async(struct lsdn_nlsock *sock, uint32_t index,
+		lsdn_nl_err_cb cb, void *user)
+{
+	nl_buf(sock, buf);
+	struct nlmsghdr *nlh = action_msg(buf, RTM_DELACTION, 0);
+	struct nlattr *tab = mnl_attr_nest_start(nlh, TCA_ACT_TAB);
+	struct nlattr *act = mnl_attr_nest_start(nlh, 1);
+	mnl_attr_put_strz(nlh, TCA_ACT_KIND, "tunnel_key");
+	mnl_attr_put_u32(nlh, TCA_ACT_INDEX, index);
+	mnl_attr_nest_end(nlh, act);
+	mnl_attr_nest_end(nlh, tab);
+	nl_queue(sock, nlh, cb, user);
 }
 
 void lsdn_action_drop(struct lsdn_filter *f, uint16_t order)
 {
 	struct nlattr* nested_attr = mnl_attr_nest_start(f->nlh, order);
-	mnl_attr_put_str(f->nlh, TCA_ACT_KIND, "gact");
+	mnl_attr_put_strz(f->nlh, TCA_ACT_KIND, "gact");
 
 	struct nlattr *nested_attr2 = mnl_attr_nest_start(f->nlh, TCA_ACT_OPTIONS);
 	struct tc_gact gact_act;
@@ -694,7 +1495,7 @@ void lsdn_action_drop(struct lsdn_filter *f, uint16_t order)
 void lsdn_action_continue(struct lsdn_filter *f, uint16_t order)
 {
 	struct nlattr* nested_attr = mnl_attr_nest_start(f->nlh, order);
-	mnl_attr_put_str(f->nlh, TCA_ACT_KIND, "gact");
+	mnl_attr_put_strz(f->nlh, TCA_ACT_KIND, "gact");
 
 	struct nlattr *nested_attr2 = mnl_attr_nest_start(f->nlh, TCA_ACT_OPTIONS);
 	struct tc_gact gact_act;
@@ -710,7 +1511,7 @@ void lsdn_action_continue(struct lsdn_filter *f, uint16_t order)
 void lsdn_action_goto_chain(struct lsdn_filter *f, uint16_t order, uint32_t chain)
 {
 	struct nlattr* nested_attr = mnl_attr_nest_start(f->nlh, order);
-	mnl_attr_put_str(f->nlh, TCA_ACT_KIND, "gact");
+	mnl_attr_put_strz(f->nlh, TCA_ACT_KIND, "gact");
 
 	struct nlattr *nested_attr2 = mnl_attr_nest_start(f->nlh, TCA_ACT_OPTIONS);
 	struct tc_gact gact_act;
@@ -770,42 +1571,81 @@ void lsdn_flower_set_enc_key_id(struct lsdn_filter *f, uint32_t vni)
 	mnl_attr_put_u32(f->nlh, TCA_FLOWER_KEY_ENC_KEY_ID, htonl(vni));
 }
 
+void lsdn_flower_set_arp_tip(struct lsdn_filter *f, const char *addr,
+		const char *addr_mask)
+{
+	mnl_attr_put(f->nlh, TCA_FLOWER_KEY_ARP_TIP, 4, addr);
+	mnl_attr_put(f->nlh, TCA_FLOWER_KEY_ARP_TIP_MASK, 4, addr_mask);
+}
+
 void lsdn_flower_set_eth_type(struct lsdn_filter *f, uint16_t eth_type)
 {
 	mnl_attr_put_u16(f->nlh, TCA_FLOWER_KEY_ETH_TYPE, eth_type);
 }
 
-lsdn_err_t lsdn_filter_create(struct mnl_socket *sock, struct lsdn_filter *f)
+static void filter_create_finish(struct lsdn_filter *f)
 {
-	unsigned int seq = 0;
 	f->nlh->nlmsg_type = RTM_NEWTFILTER;
 	f->nlh->nlmsg_flags = NLM_F_REQUEST | NLM_F_CREATE | NLM_F_ACK;
 	if (!f->update)
 		f->nlh->nlmsg_flags |= NLM_F_EXCL;
-	f->nlh->nlmsg_seq = seq;
 
 	mnl_attr_nest_end(f->nlh, f->nested_opts);
+}
 
+/* Check the filter against the kernel state being adopted, false if it is already in place */
+static bool filter_adopt(struct lsdn_nlsock *sock, struct lsdn_filter *f)
+{
+	if (!sock->adopt)
+		return true;
+
+	switch (lsdn_adopt_filter(sock->adopt, f->nlh)) {
+	case LSDN_ADOPT_SAME:
+		return false;
+	case LSDN_ADOPT_DIFFERENT:
+		/* Replace the filter in place */
+		f->nlh->nlmsg_flags &= ~NLM_F_EXCL;
+		return true;
+	default:
+		return true;
+	}
+}
+
+lsdn_err_t lsdn_filter_create(struct lsdn_nlsock *sock, struct lsdn_filter *f)
+{
+	filter_create_finish(f);
+	if (!filter_adopt(sock, f))
+		return LSDNE_OK;
 	return send_await_response(sock, f->nlh);
 }
 
+void lsdn_filter_create_async(struct lsdn_nlsock *sock, struct lsdn_filter *f,
+		lsdn_nl_err_cb cb, void *user)
+{
+	filter_create_finish(f);
+	if (filter_adopt(sock, f))
+		nl_queue(sock, f->nlh, cb, user);
+}
+
+enum lsdn_adopt_match lsdn_filter_match(struct lsdn_filter *f, struct lsdn_adopt *a)
+{
+	filter_create_finish(f);
+	return lsdn_adopt_filter(a, f->nlh);
+}
+
 /* Allow an existing TC filter to be updated. Unless this called, the filter must not exist */
 void lsdn_filter_set_update(struct lsdn_filter *f)
 {
 	f->update = true;
 }
 
-lsdn_err_t lsdn_filter_delete(
-	struct mnl_socket *sock, uint32_t ifindex, uint32_t handle,
+static struct nlmsghdr *filter_delete_msg(
+	char *buf, uint32_t ifindex, uint32_t handle,
 	uint32_t parent, uint32_t chain, uint16_t prio)
 {
-	nl_buf(buf);
-	unsigned int seq = 0;
-
 	struct nlmsghdr *nlh = mnl_nlmsg_put_header(buf);
 	nlh->nlmsg_type = RTM_DELTFILTER;
 	nlh->nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK;
-	nlh->nlmsg_seq = seq;
 
 	struct tcmsg *tcm = mnl_nlmsg_put_extra_header(nlh, sizeof(*tcm));
 	tcm->tcm_family = AF_UNSPEC;
@@ -815,6 +1655,23 @@ lsdn_err_t lsdn_filter_delete(
 	tcm->tcm_info = TC_H_MAKE(prio << 16, ETH_P_ALL << 8);
 
 	mnl_attr_put_u32(nlh, TCA_CHAIN, chain);
+	return nlh;
+}
 
-	return send_await_response(sock, nlh);
+lsdn_err_t lsdn_filter_delete(
+	struct lsdn_nlsock *sock, uint32_t ifindex, uint32_t handle,
+	uint32_t parent, uint32_t chain, uint16_t prio)
+{
+	nl_buf(sock, buf);
+	return send_await_response(sock,
+		filter_delete_msg(buf, ifindex, handle, parent, chain, prio));
+}
+
+void lsdn_filter_delete_async(
+	struct lsdn_nlsock *sock, uint32_t ifindex, uint32_t handle,
+	uint32_t parent, uint32_t chain, uint16_t prio, lsdn_nl_err_cb cb, void *user)
+{
+	nl_buf(sock, buf);
+	nl_queue(sock,
+		filter_delete_msg(buf, ifindex, handle, parent, chain, prio), cb, user);
 }
@@ -0,0 +1,2007 @@
+/** \file
+ * In-process simulation of the kernel, as seen through netlink.
+ *
+ * The simulator is a backend for `lsdn_nlsock`. It takes the batches of requests exactly as they
+ * would be sent to the kernel, applies them to its own tables of links, qdiscs, shared blocks,
+ * filter chains, filters, standalone actions and fdb entries and answers them with the errors the
+ * kernel would report. The bpf(2) commands for eBPF maps and programs are handled alike. This
+ * allows the whole commit path to be exercised and measured without privileges and
+ * without a kernel supporting all the features LSDN needs.
+ *
+ * Only the requests LSDN makes are understood and only the rules LSDN might violate are checked
+ * (e.g. duplicate names, filters for missing qdiscs, filters of different kinds sharing a
+ * priority). The packet forwarding itself is not simulated. */
+#include "private/nl.h"
+#include "private/list.h"
+#include "include/util.h"
+#include <uthash.h>
+#include <linux/pkt_sched.h>
+#include <linux/pkt_cls.h>
+#include <linux/tc_act/tc_tunnel_key.h>
+#include <linux/neighbour.h>
+#include <linux/veth.h>
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+
+#define SIM_KIND_SIZE 16
+
+/** Something filter chains are attached to -- a qdisc (or one direction of clsact) or a block. */
+struct sim_tcf {
+	/** List of `sim_chain`s. */
+	struct lsdn_list_entry chains;
+};
+
+struct sim_block {
+	uint32_t index;
+	/** Number of qdisc directions bound to the block. */
+	size_t refs;
+	struct sim_tcf tcf;
+	UT_hash_handle hh;
+};
+
+struct sim_qdisc {
+	uint32_t handle;
+	char kind[SIM_KIND_SIZE];
+	/** Copy of the TCA_OPTIONS attribute the qdisc was created with, or NULL. */
+	struct nlattr *options;
+	/** Filters attached directly to the qdisc, for clsact the ingress and egress separately. */
+	struct sim_tcf tcf[2];
+	/** Blocks bound to clsact, for ingress and egress. */
+	struct sim_block *blocks[2];
+};
+
+struct sim_link {
+	unsigned int ifindex;
+	char name[IFNAMSIZ];
+	char kind[SIM_KIND_SIZE];
+	bool up;
+	/** The lower link of a vlan, or 0. */
+	unsigned int lower;
+	/** Copy of the IFLA_INFO_DATA attribute of vlans and vxlans, or NULL. */
+	struct nlattr *info_data;
+	/** The other end of a veth pair. */
+	struct sim_link *peer;
+	struct sim_link *master;
+	/** Links enslaved to this link, by `slave_entry`. */
+	struct lsdn_list_entry slaves;
+	struct lsdn_list_entry slave_entry;
+	/** fdb entries on this link. */
+	struct lsdn_list_entry fdb;
+	/** The ingress or clsact qdisc. */
+	struct sim_qdisc *ingress;
+	/** The root (egress) qdisc. */
+	struct sim_qdisc *root;
+	UT_hash_handle hh_index;
+	UT_hash_handle hh_name;
+};
+
+struct sim_chain_key {
+	struct sim_tcf *tcf;
+	uint32_t chain;
+};
+
+struct sim_prio {
+	uint32_t prio;
+	uint16_t protocol;
+	char kind[SIM_KIND_SIZE];
+	/** Filters with this priority, by handle. */
+	struct sim_filter *filters;
+	UT_hash_handle hh;
+};
+
+/** A filter chain. Chains are created implicitly with their first filter and destroyed with the
+ * last one. */
+struct sim_chain {
+	struct sim_chain_key key;
+	struct lsdn_list_entry tcf_entry;
+	struct sim_prio *prios;
+	UT_hash_handle hh;
+};
+
+struct sim_filter {
+	uint32_t handle;
+	/** Copy of the TCA_OPTIONS attribute the filter was created with. */
+	struct nlattr *options;
+	/** Program run by a cls_bpf filter. */
+	struct sim_bpf *prog;
+	UT_hash_handle hh;
+};
+
+struct sim_action_key {
+	char kind[SIM_KIND_SIZE];
+	uint32_t index;
+};
+
+/** A standalone action, created by RTM_NEWACTION and shared by the filters referring to its
+ * index. */
+struct sim_action {
+	struct sim_action_key key;
+	/** Number of filters using the action, it can not be deleted while it is used. */
+	size_t binds;
+	/** Copy of the TCA_ACT_OPTIONS attribute the action was created with. */
+	struct nlattr *options;
+	/** Copy of the TCA_ACT_COOKIE attribute, if any. */
+	struct nlattr *cookie;
+	UT_hash_handle hh;
+};
+
+/** An eBPF map or program, alive while a file descriptor, a filter or a program refers to it. */
+struct sim_bpf {
+	bool is_prog;
+	size_t refs;
+	/* Maps only */
+	uint32_t map_type;
+	uint32_t key_size;
+	uint32_t value_size;
+	uint32_t max_entries;
+	/** All the values of an array. */
+	uint8_t *values;
+	/** Elements of a hash. */
+	struct sim_bpf_elem *elems;
+	/* Programs only */
+	uint32_t id;
+	/** Maps the program refers to. */
+	struct sim_bpf **maps;
+	size_t map_count;
+};
+
+struct sim_bpf_elem {
+	UT_hash_handle hh;
+	/** The key followed by the value. */
+	uint8_t data[];
+};
+
+struct sim_bpf_fd {
+	int fd;
+	struct sim_bpf *obj;
+	UT_hash_handle hh;
+};
+
+struct sim_fdb_key {
+	unsigned int ifindex;
+	uint8_t mac[6];
+	uint8_t dst_len;
+	uint8_t dst[16];
+};
+
+struct sim_fdb {
+	struct sim_fdb_key key;
+	struct lsdn_list_entry link_entry;
+	UT_hash_handle hh;
+};
+
+/** Link notification, kept until the socket polls for it. */
+struct sim_link_event {
+	unsigned int ifindex;
+	char name[IFNAMSIZ];
+	bool removed;
+};
+
+/** A socket talking to the simulator. Several sockets may share a simulator, like the processes
+ * of a single machine share its kernel. */
+struct sim_conn {
+	struct lsdn_nlsim *sim;
+	struct lsdn_list_entry conn_entry;
+	/** Are link notifications collected? */
+	bool subscribed;
+	/** Some notifications could not be collected, the interface table must be filled again. */
+	bool events_lost;
+	struct sim_link_event *events;
+	size_t events_count;
+	size_t events_size;
+};
+
+struct lsdn_nlsim {
+	/** Held while a request or dump is processed, the sockets may be used by different threads
+	 * (see lsdn_nl_worker_bind). Connecting and disconnecting is left to the users. */
+	pthread_mutex_t lock;
+	/** Connected sockets, by `sim_conn.conn_entry`. The simulator goes away with the last one. */
+	struct lsdn_list_entry conns;
+	struct sim_link *links_by_index;
+	struct sim_link *links_by_name;
+	struct sim_block *blocks;
+	struct sim_chain *chains;
+	struct sim_action *actions;
+	struct sim_fdb *fdb;
+	/** Open eBPF file descriptors, shared by all the sockets like by the threads of a
+	 * process. */
+	struct sim_bpf_fd *bpf_fds;
+	int next_bpf_fd;
+	uint32_t next_prog_id;
+	unsigned int next_ifindex;
+	/** Link created by the request being processed, for NLM_F_ECHO. */
+	unsigned int created_ifindex;
+	uint32_t next_handle;
+	struct lsdn_sim_state state;
+};
+
+struct attr_table {
+	const struct nlattr **tb;
+	uint16_t max;
+};
+
+static int attr_cb(const struct nlattr *attr, void *data)
+{
+	struct attr_table *t = data;
+	uint16_t type = mnl_attr_get_type(attr);
+	if (type <= t->max)
+		t->tb[type] = attr;
+	return MNL_CB_OK;
+}
+
+/* Collect the attributes following the fixed header of the message into `tb`, by type */
+static void parse_msg(const struct nlmsghdr *nlh, size_t hdrlen,
+	const struct nlattr **tb, uint16_t max)
+{
+	struct attr_table t = {tb, max};
+	bzero(tb, (max + 1) * sizeof(*tb));
+	mnl_attr_parse(nlh, hdrlen, attr_cb, &t);
+}
+
+static void parse_nested(const struct nlattr *nest, const struct nlattr **tb, uint16_t max)
+{
+	struct attr_table t = {tb, max};
+	bzero(tb, (max + 1) * sizeof(*tb));
+	if (nest)
+		mnl_attr_parse_nested(nest, attr_cb, &t);
+}
+
+/* Copy a string attribute, which may or may not include the NUL (like nla_strscpy) */
+static int attr_strscpy(char *dst, const struct nlattr *attr, size_t size)
+{
+	const char *src = mnl_attr_get_payload(attr);
+	size_t len = strnlen(src, mnl_attr_get_payload_len(attr));
+	if (len >= size)
+		return -E2BIG;
+	memcpy(dst, src, len);
+	dst[len] = '\0';
+	return 0;
+}
+
+/* Copy an attribute, e.g. to be reported back in dumps */
+static struct nlattr *attr_dup(const struct nlattr *attr)
+{
+	struct nlattr *copy = malloc(attr->nla_len);
+	if (copy)
+		memcpy(copy, attr, attr->nla_len);
+	return copy;
+}
+
+static struct sim_conn *get_conn(struct lsdn_nlsock *sock)
+{
+	return sock->backend_data;
+}
+
+static struct lsdn_nlsim *get_sim(struct lsdn_nlsock *sock)
+{
+	return get_conn(sock)->sim;
+}
+
+/* Links */
+
+static void conn_event(struct sim_conn *conn, struct sim_link *link, bool removed)
+{
+	if (!conn->subscribed || conn->events_lost)
+		return;
+	if (conn->events_count == conn->events_size) {
+		size_t size = conn->events_size ? 2 * conn->events_size : 64;
+		struct sim_link_event *events = realloc(conn->events, size * sizeof(*events));
+		if (!events) {
+			conn->events_lost = true;
+			return;
+		}
+		conn->events = events;
+		conn->events_size = size;
+	}
+	struct sim_link_event *ev = &conn->events[conn->events_count++];
+	ev->ifindex = link->ifindex;
+	strcpy(ev->name, link->name);
+	ev->removed = removed;
+}
+
+/* Notify all sockets about a link change */
+static void link_event(struct lsdn_nlsim *sim, struct sim_link *link, bool removed)
+{
+	lsdn_foreach(sim->conns, conn_entry, struct sim_conn, conn)
+		conn_event(conn, link, removed);
+}
+
+static struct sim_link *find_link(struct lsdn_nlsim *sim, unsigned int ifindex)
+{
+	struct sim_link *link;
+	HASH_FIND(hh_index, sim->links_by_index, &ifindex, sizeof(ifindex), link);
+	return link;
+}
+
+static struct sim_link *find_link_by_name(struct lsdn_nlsim *sim, const char *name)
+{
+	struct sim_link *link;
+	HASH_FIND(hh_name, sim->links_by_name, name, strlen(name), link);
+	return link;
+}
+
+static int link_new(struct lsdn_nlsim *sim, const char *name, const char *kind,
+	struct sim_link **new_link)
+{
+	if (strlen(name) >= IFNAMSIZ || strlen(kind) >= SIM_KIND_SIZE)
+		return -EINVAL;
+	if (find_link_by_name(sim, name))
+		return -EEXIST;
+
+	struct sim_link *link = malloc(sizeof(*link));
+	if (!link)
+		return -ENOMEM;
+	link->ifindex = sim->next_ifindex++;
+	strcpy(link->name, name);
+	strcpy(link->kind, kind);
+	link->up = false;
+	link->lower = 0;
+	link->info_data = NULL;
+	link->peer = NULL;
+	link->master = NULL;
+	lsdn_list_init(&link->slaves);
+	lsdn_list_init(&link->slave_entry);
+	lsdn_list_init(&link->fdb);
+	link->ingress = NULL;
+	link->root = NULL;
+	HASH_ADD(hh_index, sim->links_by_index, ifindex, sizeof(link->ifindex), link);
+	HASH_ADD_KEYPTR(hh_name, sim->links_by_name, link->name, strlen(link->name), link);
+	sim->state.links++;
+	link_event(sim, link, false);
+	*new_link = link;
+	return 0;
+}
+
+static void link_set_master(struct sim_link *link, struct sim_link *master)
+{
+	if (link->master)
+		lsdn_list_remove(&link->slave_entry);
+	link->master = master;
+	if (master)
+		lsdn_list_add(&master->slaves, &link->slave_entry);
+}
+
+static void qdisc_free(struct lsdn_nlsim *sim, struct sim_qdisc *qdisc);
+static void fdb_free(struct lsdn_nlsim *sim, struct sim_fdb *fdb);
+
+static void link_free(struct lsdn_nlsim *sim, struct sim_link *link)
+{
+	if (link->ingress)
+		qdisc_free(sim, link->ingress);
+	if (link->root)
+		qdisc_free(sim, link->root);
+	lsdn_foreach(link->fdb, link_entry, struct sim_fdb, fdb)
+		fdb_free(sim, fdb);
+	lsdn_foreach(link->slaves, slave_entry, struct sim_link, slave)
+		link_set_master(slave, NULL);
+	link_set_master(link, NULL);
+
+	HASH_DELETE(hh_index, sim->links_by_index, link);
+	HASH_DELETE(hh_name, sim->links_by_name, link);
+	sim->state.links--;
+	link_event(sim, link, true);
+
+	/* Deleting either end of a veth pair deletes both */
+	struct sim_link *peer = link->peer;
+	free(link->info_data);
+	free(link);
+	if (peer) {
+		peer->peer = NULL;
+		link_free(sim, peer);
+	}
+}
+
+/* Apply the master and flags from an RTM_NEWLINK request */
+static int link_change(struct lsdn_nlsim *sim, struct sim_link *link,
+	const struct ifinfomsg *ifm, const struct nlattr **tb)
+{
+	if (tb[IFLA_MASTER]) {
+		unsigned int master_index = mnl_attr_get_u32(tb[IFLA_MASTER]);
+		struct sim_link *master = NULL;
+		if (master_index) {
+			master = find_link(sim, master_index);
+			if (!master)
+				return -EINVAL;
+			if (strcmp(master->kind, "bridge") != 0 || master == link)
+				return -EOPNOTSUPP;
+		}
+		link_set_master(link, master);
+	}
+
+	/* Zero change mask means all flags are given */
+	if (ifm->ifi_change || ifm->ifi_flags) {
+		unsigned int change = ifm->ifi_change ? ifm->ifi_change : ~0u;
+		if (change & IFF_UP)
+			link->up = ifm->ifi_flags & IFF_UP;
+	}
+	return 0;
+}
+
+static int link_create(struct lsdn_nlsim *sim,
+	const struct ifinfomsg *ifm, const struct nlattr **tb)
+{
+	const struct nlattr *info[IFLA_INFO_MAX + 1];
+	struct sim_link *link, *peer = NULL;
+	int err;
+
+	if (!tb[IFLA_IFNAME] || !tb[IFLA_LINKINFO])
+		return -EINVAL;
+	parse_nested(tb[IFLA_LINKINFO], info, IFLA_INFO_MAX);
+	if (!info[IFLA_INFO_KIND])
+		return -EINVAL;
+
+	char name[IFNAMSIZ], kind[SIM_KIND_SIZE];
+	if (attr_strscpy(name, tb[IFLA_IFNAME], sizeof(name)) != 0
+	    || attr_strscpy(kind, info[IFLA_INFO_KIND], sizeof(kind)) != 0)
+		return -EINVAL;
+	unsigned int lower = tb[IFLA_LINK] ? mnl_attr_get_u32(tb[IFLA_LINK]) : 0;
+
+	if (strcmp(kind, "vlan") == 0) {
+		if (!lower)
+			return -EINVAL;
+		if (!find_link(sim, lower))
+			return -ENODEV;
+	} else if (strcmp(kind, "vxlan") == 0) {
+		if (lower && !find_link(sim, lower))
+			return -ENODEV;
+	} else if (strcmp(kind, "veth") == 0) {
+		/* The peer is described by a nested ifinfomsg followed by attributes */
+		const struct nlattr *data[VETH_INFO_MAX + 1];
+		const struct nlattr *peer_tb[IFLA_MAX + 1];
+		struct attr_table t = {peer_tb, IFLA_MAX};
+
+		parse_nested(info[IFLA_INFO_DATA], data, VETH_INFO_MAX);
+		if (!data[VETH_INFO_PEER])
+			return -EINVAL;
+		bzero(peer_tb, sizeof(peer_tb));
+		mnl_attr_parse_payload(
+			(char *) mnl_attr_get_payload(data[VETH_INFO_PEER]) + sizeof(struct ifinfomsg),
+			mnl_attr_get_payload_len(data[VETH_INFO_PEER]) - sizeof(struct ifinfomsg),
+			attr_cb, &t);
+		if (!peer_tb[IFLA_IFNAME])
+			return -EINVAL;
+		char peer_name[IFNAMSIZ];
+		if (attr_strscpy(peer_name, peer_tb[IFLA_IFNAME], sizeof(peer_name)) != 0)
+			return -EINVAL;
+		if (strcmp(peer_name, name) == 0)
+			return -EEXIST;
+		err = link_new(sim, peer_name, kind, &peer);
+		if (err)
+			return err;
+	} else if (strcmp(kind, "dummy") != 0 && strcmp(kind, "bridge") != 0) {
+		return -EOPNOTSUPP;
+	}
+
+	err = link_new(sim, name, kind, &link);
+	if (err) {
+		if (peer)
+			link_free(sim, peer);
+		return err;
+	}
+	if (peer) {
+		link->peer = peer;
+		peer->peer = link;
+	}
+	if (strcmp(kind, "vlan") == 0)
+		link->lower = lower;
+	if (info[IFLA_INFO_DATA] && strcmp(kind, "veth") != 0) {
+		link->info_data = attr_dup(info[IFLA_INFO_DATA]);
+		if (!link->info_data) {
+			link_free(sim, link);
+			return -ENOMEM;
+		}
+	}
+
+	err = link_change(sim, link, ifm, tb);
+	if (err) {
+		link_free(sim, link);
+		return err;
+	}
+	sim->created_ifindex = link->ifindex;
+	return 0;
+}
+
+static int sim_newlink(struct lsdn_nlsim *sim, const struct nlmsghdr *nlh)
+{
+	const struct ifinfomsg *ifm = mnl_nlmsg_get_payload(nlh);
+	const struct nlattr *tb[IFLA_MAX + 1];
+	struct sim_link *link = NULL;
+
+	parse_msg(nlh, sizeof(*ifm), tb, IFLA_MAX);
+	if (ifm->ifi_index) {
+		link = find_link(sim, ifm->ifi_index);
+		if (!link)
+			return -ENODEV;
+	} else if (tb[IFLA_IFNAME]) {
+		char name[IFNAMSIZ];
+		if (attr_strscpy(name, tb[IFLA_IFNAME], sizeof(name)) != 0)
+			return -EINVAL;
+		link = find_link_by_name(sim, name);
+	}
+
+	if (link) {
+		if (nlh->nlmsg_flags & NLM_F_EXCL)
+			return -EEXIST;
+		return link_change(sim, link, ifm, tb);
+	}
+	if (!(nlh->nlmsg_flags & NLM_F_CREATE))
+		return -ENODEV;
+	return link_create(sim, ifm, tb);
+}
+
+static int sim_dellink(struct lsdn_nlsim *sim, const struct nlmsghdr *nlh)
+{
+	const struct ifinfomsg *ifm = mnl_nlmsg_get_payload(nlh);
+	const struct nlattr *tb[IFLA_MAX + 1];
+	struct sim_link *link = NULL;
+
+	parse_msg(nlh, sizeof(*ifm), tb, IFLA_MAX);
+	if (ifm->ifi_index) {
+		link = find_link(sim, ifm->ifi_index);
+	} else if (tb[IFLA_IFNAME]) {
+		char name[IFNAMSIZ];
+		if (attr_strscpy(name, tb[IFLA_IFNAME], sizeof(name)) != 0)
+			return -EINVAL;
+		link = find_link_by_name(sim, name);
+	}
+	if (!link)
+		return -ENODEV;
+
+	link_free(sim, link);
+	return 0;
+}
+
+static int sim_newaddr(struct lsdn_nlsim *sim, const struct nlmsghdr *nlh)
+{
+	const struct ifaddrmsg *ifa = mnl_nlmsg_get_payload(nlh);
+	/* Addresses are not tracked, they do not influence anything we simulate */
+	return find_link(sim, ifa->ifa_index) ? 0 : -ENODEV;
+}
+
+/* Standalone actions */
+
+static struct sim_action *find_action(struct lsdn_nlsim *sim, const char *kind, uint32_t index)
+{
+	struct sim_action_key key;
+	struct sim_action *action;
+	bzero(&key, sizeof(key));
+	if (strlen(kind) >= SIM_KIND_SIZE)
+		return NULL;
+	strcpy(key.kind, kind);
+	key.index = index;
+	HASH_FIND(hh, sim->actions, &key, sizeof(key), action);
+	return action;
+}
+
+/* The index of a tunnel_key action, or 0 if it is not a tunnel_key or does not refer to a
+ * standalone action. Other kinds are always created inline by LSDN. */
+static uint32_t action_ref(const struct nlattr *act)
+{
+	const struct nlattr *tb[TCA_ACT_MAX + 1];
+	const struct nlattr *opts[TCA_TUNNEL_KEY_MAX + 1];
+	char kind[SIM_KIND_SIZE];
+	parse_nested(act, tb, TCA_ACT_MAX);
+	if (!tb[TCA_ACT_KIND] || attr_strscpy(kind, tb[TCA_ACT_KIND], sizeof(kind)) != 0
+	    || strcmp(kind, "tunnel_key") != 0)
+		return 0;
+	parse_nested(tb[TCA_ACT_OPTIONS], opts, TCA_TUNNEL_KEY_MAX);
+	if (!opts[TCA_TUNNEL_KEY_PARMS]
+	    || mnl_attr_get_payload_len(opts[TCA_TUNNEL_KEY_PARMS]) < sizeof(struct tc_tunnel_key))
+		return 0;
+	const struct tc_tunnel_key *parms = mnl_attr_get_payload(opts[TCA_TUNNEL_KEY_PARMS]);
+	return parms->index;
+}
+
+/* Add `delta` to the bind counts of the standalone actions the filter options refer to. With
+ * zero `delta`, only check that they all exist. */
+static int bind_actions(struct lsdn_nlsim *sim, const char *kind, const struct nlattr *options,
+	int delta)
+{
+	const struct nlattr *tb[TCA_FLOWER_MAX + 1];
+	const struct nlattr *acts[TCA_ACT_MAX_PRIO + 1];
+	if (!options || strcmp(kind, "flower") != 0)
+		return 0;
+	parse_nested(options, tb, TCA_FLOWER_MAX);
+	parse_nested(tb[TCA_FLOWER_ACT], acts, TCA_ACT_MAX_PRIO);
+	for (size_t i = 1; i <= TCA_ACT_MAX_PRIO; i++) {
+		uint32_t index = acts[i] ? action_ref(acts[i]) : 0;
+		if (!index)
+			continue;
+		struct sim_action *action = find_action(sim, "tunnel_key", index);
+		if (!action)
+			return -EINVAL;
+		action->binds += delta;
+	}
+	return 0;
+}
+
+static void action_free(struct lsdn_nlsim *sim, struct sim_action *action)
+{
+	HASH_DEL(sim->actions, action);
+	sim->state.actions--;
+	free(action->options);
+	free(action->cookie);
+	free(action);
+}
+
+/* Find the single action of a RTM_NEWACTION or RTM_DELACTION request. LSDN only manages
+ * standalone tunnel_key actions. */
+static int parse_action(const struct nlmsghdr *nlh, const struct nlattr **act,
+	const struct nlattr **act_tb)
+{
+	const struct nlattr *tb[TCA_ROOT_MAX + 1];
+	const struct nlattr *acts[TCA_ACT_MAX_PRIO + 1];
+	parse_msg(nlh, sizeof(struct tcamsg), tb, TCA_ROOT_MAX);
+	parse_nested(tb[TCA_ACT_TAB], acts, TCA_ACT_MAX_PRIO);
+	*act = acts[1];
+	if (!*act)
+		return -EINVAL;
+	parse_nested(*act, act_tb, TCA_ACT_MAX);
+	char kind[SIM_KIND_SIZE];
+	if (!act_tb[TCA_ACT_KIND] || attr_strscpy(kind, act_tb[TCA_ACT_KIND], sizeof(kind)) != 0)
+		return -EINVAL;
+	if (strcmp(kind, "tunnel_key") != 0)
+		return -EOPNOTSUPP;
+	return 0;
+}
+
+static int sim_newaction(struct lsdn_nlsim *sim, const struct nlmsghdr *nlh)
+{
+	const struct nlattr *act;
+	const struct nlattr *tb[TCA_ACT_MAX + 1];
+	int err = parse_action(nlh, &act, tb);
+	if (err)
+		return err;
+
+	/* LSDN always chooses the index itself */
+	uint32_t index = action_ref(act);
+	if (!index || !tb[TCA_ACT_OPTIONS])
+		return -EINVAL;
+	struct sim_action *action = find_action(sim, "tunnel_key", index);
+	if (action && !(nlh->nlmsg_flags & NLM_F_REPLACE))
+		return -EEXIST;
+	if (!action && !(nlh->nlmsg_flags & NLM_F_CREATE))
+		return -ENOENT;
+
+	struct nlattr *options = attr_dup(tb[TCA_ACT_OPTIONS]);
+	if (!options)
+		return -ENOMEM;
+	struct nlattr *cookie = NULL;
+	if (tb[TCA_ACT_COOKIE]) {
+		cookie = attr_dup(tb[TCA_ACT_COOKIE]);
+		if (!cookie) {
+			free(options);
+			return -ENOMEM;
+		}
+	}
+	if (action) {
+		/* The filters bound to the action see the change right away. Like the kernel, keep
+		 * the cookie unless a new one is given. */
+		free(action->options);
+		action->options = options;
+		if (cookie) {
+			free(action->cookie);
+			action->cookie = cookie;
+		}
+		return 0;
+	}
+
+	action = malloc(sizeof(*action));
+	if (!action) {
+		free(options);
+		free(cookie);
+		return -ENOMEM;
+	}
+	bzero(&action->key, sizeof(action->key));
+	strcpy(action->key.kind, "tunnel_key");
+	action->key.index = index;
+	action->binds = 0;
+	action->options = options;
+	action->cookie = cookie;
+	HASH_ADD(hh, sim->actions, key, sizeof(action->key), action);
+	sim->state.actions++;
+	return 0;
+}
+
+static int sim_delaction(struct lsdn_nlsim *sim, const struct nlmsghdr *nlh)
+{
+	const struct nlattr *act;
+	const struct nlattr *tb[TCA_ACT_MAX + 1];
+	int err = parse_action(nlh, &act, tb);
+	if (err)
+		return err;
+	if (!tb[TCA_ACT_INDEX])
+		return -EINVAL;
+
+	struct sim_action *action = find_action(sim, "tunnel_key", mnl_attr_get_u32(tb[TCA_ACT_INDEX]));
+	if (!action)
+		return -ENOENT;
+	if (action->binds > 0)
+		return -EPERM;
+	action_free(sim, action);
+	return 0;
+}
+
+/* eBPF maps and programs */
+
+static struct sim_bpf *bpf_get(struct lsdn_nlsim *sim, uint32_t fd, bool prog)
+{
+	struct sim_bpf_fd *f;
+	int key = fd;
+	HASH_FIND(hh, sim->bpf_fds, &key, sizeof(key), f);
+	if (!f || f->obj->is_prog != prog)
+		return NULL;
+	return f->obj;
+}
+
+static void bpf_put(struct lsdn_nlsim *sim, struct sim_bpf *obj)
+{
+	if (--obj->refs > 0)
+		return;
+	if (obj->is_prog) {
+		for (size_t i = 0; i < obj->map_count; i++)
+			bpf_put(sim, obj->maps[i]);
+		free(obj->maps);
+		sim->state.bpf_progs--;
+	} else {
+		struct sim_bpf_elem *elem, *tmp;
+		HASH_ITER(hh, obj->elems, elem, tmp) {
+			HASH_DEL(obj->elems, elem);
+			sim->state.bpf_map_entries--;
+			free(elem);
+		}
+		free(obj->values);
+		sim->state.bpf_maps--;
+	}
+	free(obj);
+}
+
+/* Give the new object a file descriptor, which holds the first reference */
+static int bpf_fd_new(struct lsdn_nlsim *sim, struct sim_bpf *obj)
+{
+	struct sim_bpf_fd *f = malloc(sizeof(*f));
+	if (!f)
+		return -ENOMEM;
+	f->fd = sim->next_bpf_fd++;
+	f->obj = obj;
+	obj->refs = 1;
+	HASH_ADD(hh, sim->bpf_fds, fd, sizeof(f->fd), f);
+	return f->fd;
+}
+
+static const void *bpf_ptr(uint64_t ptr)
+{
+	return (const void *) (uintptr_t) ptr;
+}
+
+static int bpf_map_create(struct lsdn_nlsim *sim, const union bpf_attr *attr)
+{
+	if (attr->key_size == 0 || attr->value_size == 0 || attr->max_entries == 0)
+		return -EINVAL;
+	if (attr->map_type == BPF_MAP_TYPE_ARRAY) {
+		if (attr->key_size != sizeof(uint32_t))
+			return -EINVAL;
+	} else if (attr->map_type != BPF_MAP_TYPE_HASH) {
+		return -EINVAL;
+	}
+
+	struct sim_bpf *map = calloc(1, sizeof(*map));
+	if (!map)
+		return -ENOMEM;
+	map->map_type = attr->map_type;
+	map->key_size = attr->key_size;
+	map->value_size = attr->value_size;
+	map->max_entries = attr->max_entries;
+	if (map->map_type == BPF_MAP_TYPE_ARRAY) {
+		/* Array elements always exist, zeroed */
+		map->values = calloc(map->max_entries, map->value_size);
+		if (!map->values) {
+			free(map);
+			return -ENOMEM;
+		}
+	}
+	int fd = bpf_fd_new(sim, map);
+	if (fd < 0) {
+		free(map->values);
+		free(map);
+		return fd;
+	}
+	sim->state.bpf_maps++;
+	return fd;
+}
+
+static int bpf_map_update(struct lsdn_nlsim *sim, const union bpf_attr *attr)
+{
+	struct sim_bpf *map = bpf_get(sim, attr->map_fd, false);
+	if (!map)
+		return -EBADF;
+	const uint8_t *key = bpf_ptr(attr->key);
+	const uint8_t *value = bpf_ptr(attr->value);
+
+	if (map->map_type == BPF_MAP_TYPE_ARRAY) {
+		uint32_t index;
+		memcpy(&index, key, sizeof(index));
+		if (index >= map->max_entries)
+			return -E2BIG;
+		memcpy(map->values + (size_t) index * map->value_size, value, map->value_size);
+		return 0;
+	}
+
+	struct sim_bpf_elem *elem;
+	HASH_FIND(hh, map->elems, key, map->key_size, elem);
+	if (!elem) {
+		if (HASH_COUNT(map->elems) >= map->max_entries)
+			return -E2BIG;
+		elem = malloc(sizeof(*elem) + map->key_size + map->value_size);
+		if (!elem)
+			return -ENOMEM;
+		memcpy(elem->data, key, map->key_size);
+		HASH_ADD(hh, map->elems, data, map->key_size, elem);
+		sim->state.bpf_map_entries++;
+	}
+	memcpy(elem->data + map->key_size, value, map->value_size);
+	return 0;
+}
+
+static int bpf_map_delete(struct lsdn_nlsim *sim, const union bpf_attr *attr)
+{
+	struct sim_bpf *map = bpf_get(sim, attr->map_fd, false);
+	if (!map)
+		return -EBADF;
+	/* Like in the kernel, the elements of arrays can only be overwritten */
+	if (map->map_type == BPF_MAP_TYPE_ARRAY)
+		return -EINVAL;
+
+	struct sim_bpf_elem *elem;
+	HASH_FIND(hh, map->elems, bpf_ptr(attr->key), map->key_size, elem);
+	if (!elem)
+		return -ENOENT;
+	HASH_DEL(map->elems, elem);
+	sim->state.bpf_map_entries--;
+	free(elem);
+	return 0;
+}
+
+/* Take a reference of a map used by the program, once for every map */
+static int prog_use_map(struct lsdn_nlsim *sim, struct sim_bpf *prog, uint32_t fd)
+{
+	struct sim_bpf *map = bpf_get(sim, fd, false);
+	if (!map)
+		return -EBADF;
+	for (size_t i = 0; i < prog->map_count; i++) {
+		if (prog->maps[i] == map)
+			return 0;
+	}
+	struct sim_bpf **maps = realloc(prog->maps, (prog->map_count + 1) * sizeof(*maps));
+	if (!maps)
+		return -ENOMEM;
+	prog->maps = maps;
+	prog->maps[prog->map_count++] = map;
+	map->refs++;
+	return 0;
+}
+
+/* There is no verifier, only the map references and the jump targets are checked */
+static int bpf_prog_load(struct lsdn_nlsim *sim, const union bpf_attr *attr)
+{
+	const struct bpf_insn *insns = bpf_ptr(attr->insns);
+	size_t count = attr->insn_cnt;
+	if (attr->prog_type != BPF_PROG_TYPE_SCHED_CLS || count == 0
+	    || insns[count - 1].code != (BPF_JMP | BPF_EXIT))
+		return -EINVAL;
+
+	struct sim_bpf *prog = calloc(1, sizeof(*prog));
+	if (!prog)
+		return -ENOMEM;
+	prog->is_prog = true;
+	/* Dropped if the program is rejected */
+	prog->refs = 1;
+	int err = 0;
+	for (size_t i = 0; i < count && !err; i++) {
+		const struct bpf_insn *insn = &insns[i];
+		if (insn->code == (BPF_LD | BPF_DW | BPF_IMM)) {
+			if (i + 1 >= count)
+				err = -EINVAL;
+			else if (insn->src_reg == BPF_PSEUDO_MAP_FD)
+				err = prog_use_map(sim, prog, insn->imm);
+			i++;
+		} else if (BPF_CLASS(insn->code) == BPF_JMP
+			   && BPF_OP(insn->code) != BPF_CALL && BPF_OP(insn->code) != BPF_EXIT) {
+			ptrdiff_t target = (ptrdiff_t) i + insn->off + 1;
+			if (target < 0 || (size_t) target >= count)
+				err = -EINVAL;
+		}
+	}
+	sim->state.bpf_progs++;
+	if (err) {
+		bpf_put(sim, prog);
+		return err;
+	}
+
+	prog->id = sim->next_prog_id++;
+	int fd = bpf_fd_new(sim, prog);
+	if (fd < 0)
+		bpf_put(sim, prog);
+	return fd;
+}
+
+static int bpf_obj_get_info(struct lsdn_nlsim *sim, const union bpf_attr *attr)
+{
+	struct sim_bpf *prog = bpf_get(sim, attr->info.bpf_fd, true);
+	if (!prog)
+		return -EBADF;
+	struct bpf_prog_info info;
+	bzero(&info, sizeof(info));
+	info.type = BPF_PROG_TYPE_SCHED_CLS;
+	info.id = prog->id;
+	size_t len = attr->info.info_len < sizeof(info) ? attr->info.info_len : sizeof(info);
+	memcpy((void *) (uintptr_t) attr->info.info, &info, len);
+	return 0;
+}
+
+static long sim_bpf(struct lsdn_nlsock *sock, int cmd, union bpf_attr *attr, unsigned int size)
+{
+	struct lsdn_nlsim *sim = get_sim(sock);
+	int ret;
+	if (size < sizeof(*attr)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	pthread_mutex_lock(&sim->lock);
+	switch (cmd) {
+	case BPF_MAP_CREATE:
+		ret = bpf_map_create(sim, attr);
+		break;
+	case BPF_MAP_UPDATE_ELEM:
+		ret = bpf_map_update(sim, attr);
+		break;
+	case BPF_MAP_DELETE_ELEM:
+		ret = bpf_map_delete(sim, attr);
+		break;
+	case BPF_PROG_LOAD:
+		ret = bpf_prog_load(sim, attr);
+		break;
+	case BPF_OBJ_GET_INFO_BY_FD:
+		ret = bpf_obj_get_info(sim, attr);
+		break;
+	default:
+		ret = -EINVAL;
+		break;
+	}
+	pthread_mutex_unlock(&sim->lock);
+
+	if (ret < 0) {
+		errno = -ret;
+		return -1;
+	}
+	return ret;
+}
+
+static void bpf_fd_free(struct lsdn_nlsim *sim, struct sim_bpf_fd *f)
+{
+	HASH_DEL(sim->bpf_fds, f);
+	bpf_put(sim, f->obj);
+	free(f);
+}
+
+static void sim_bpf_close(struct lsdn_nlsock *sock, int fd)
+{
+	struct lsdn_nlsim *sim = get_sim(sock);
+	struct sim_bpf_fd *f;
+	pthread_mutex_lock(&sim->lock);
+	HASH_FIND(hh, sim->bpf_fds, &fd, sizeof(fd), f);
+	if (f)
+		bpf_fd_free(sim, f);
+	pthread_mutex_unlock(&sim->lock);
+}
+
+/* The program of a cls_bpf filter, NULL for other kinds */
+static int filter_prog(struct lsdn_nlsim *sim, const char *kind, const struct nlattr *options,
+	struct sim_bpf **prog)
+{
+	const struct nlattr *tb[TCA_BPF_MAX + 1];
+	*prog = NULL;
+	if (strcmp(kind, "bpf") != 0)
+		return 0;
+	if (!options)
+		return -EINVAL;
+	parse_nested(options, tb, TCA_BPF_MAX);
+	/* Classic BPF is not used by LSDN */
+	if (!tb[TCA_BPF_FD])
+		return -EINVAL;
+	*prog = bpf_get(sim, mnl_attr_get_u32(tb[TCA_BPF_FD]), true);
+	return *prog ? 0 : -EBADF;
+}
+
+/* Filters */
+
+static void tcf_init(struct sim_tcf *tcf)
+{
+	lsdn_list_init(&tcf->chains);
+}
+
+static struct sim_chain *find_chain(struct lsdn_nlsim *sim, struct sim_tcf *tcf, uint32_t index)
+{
+	struct sim_chain_key key;
+	struct sim_chain *chain;
+	bzero(&key, sizeof(key));
+	key.tcf = tcf;
+	key.chain = index;
+	HASH_FIND(hh, sim->chains, &key, sizeof(key), chain);
+	return chain;
+}
+
+static struct sim_chain *chain_new(struct lsdn_nlsim *sim, struct sim_tcf *tcf, uint32_t index)
+{
+	struct sim_chain *chain = malloc(sizeof(*chain));
+	if (!chain)
+		return NULL;
+	bzero(&chain->key, sizeof(chain->key));
+	chain->key.tcf = tcf;
+	chain->key.chain = index;
+	chain->prios = NULL;
+	lsdn_list_init_add(&tcf->chains, &chain->tcf_entry);
+	HASH_ADD(hh, sim->chains, key, sizeof(chain->key), chain);
+	sim->state.chains++;
+	return chain;
+}
+
+static void filter_free(struct lsdn_nlsim *sim, struct sim_prio *prio, struct sim_filter *filter)
+{
+	bind_actions(sim, prio->kind, filter->options, -1);
+	if (filter->prog)
+		bpf_put(sim, filter->prog);
+	HASH_DEL(prio->filters, filter);
+	sim->state.filters--;
+	free(filter->options);
+	free(filter);
+}
+
+static void prio_free(struct lsdn_nlsim *sim, struct sim_chain *chain, struct sim_prio *prio)
+{
+	struct sim_filter *filter, *tmp;
+	HASH_ITER(hh, prio->filters, filter, tmp) {
+		filter_free(sim, prio, filter);
+	}
+	HASH_DEL(chain->prios, prio);
+	free(prio);
+}
+
+static void chain_free(struct lsdn_nlsim *sim, struct sim_chain *chain)
+{
+	struct sim_prio *prio, *tmp;
+	HASH_ITER(hh, chain->prios, prio, tmp) {
+		prio_free(sim, chain, prio);
+	}
+	lsdn_list_remove(&chain->tcf_entry);
+	HASH_DEL(sim->chains, chain);
+	sim->state.chains--;
+	free(chain);
+}
+
+/* Drop the prio and the chain if they have no filters left */
+static void chain_gc(struct lsdn_nlsim *sim, struct sim_chain *chain, struct sim_prio *prio)
+{
+	if (prio && HASH_COUNT(prio->filters) == 0)
+		prio_free(sim, chain, prio);
+	if (HASH_COUNT(chain->prios) == 0)
+		chain_free(sim, chain);
+}
+
+static void tcf_flush(struct lsdn_nlsim *sim, struct sim_tcf *tcf)
+{
+	lsdn_foreach(tcf->chains, tcf_entry, struct sim_chain, chain)
+		chain_free(sim, chain);
+}
+
+/* Find where the filters of a RTM_NEWTFILTER or RTM_DELTFILTER request belong */
+static int find_tcf(struct lsdn_nlsim *sim, const struct tcmsg *tcm, struct sim_tcf **tcf)
+{
+	if (tcm->tcm_ifindex == TCM_IFINDEX_MAGIC_BLOCK) {
+		struct sim_block *block;
+		uint32_t index = tcm->tcm_block_index;
+		HASH_FIND(hh, sim->blocks, &index, sizeof(index), block);
+		if (!block)
+			return -EINVAL;
+		*tcf = &block->tcf;
+		return 0;
+	}
+
+	struct sim_link *link = find_link(sim, tcm->tcm_ifindex);
+	if (!link)
+		return -ENODEV;
+
+	struct sim_qdisc *qdisc = NULL;
+	if (link->ingress && TC_H_MAJ(tcm->tcm_parent) == TC_H_MAJ(link->ingress->handle))
+		qdisc = link->ingress;
+	else if (link->root && TC_H_MAJ(tcm->tcm_parent) == TC_H_MAJ(link->root->handle))
+		qdisc = link->root;
+	if (!qdisc)
+		return -EINVAL;
+
+	int dir = 0;
+	if (strcmp(qdisc->kind, "clsact") == 0 && TC_H_MIN(tcm->tcm_parent) == TC_H_MIN_EGRESS)
+		dir = 1;
+	/* Filters of shared blocks may only be manipulated through the block index */
+	if (qdisc->blocks[dir])
+		return -EOPNOTSUPP;
+	*tcf = &qdisc->tcf[dir];
+	return 0;
+}
+
+static int sim_newtfilter(struct lsdn_nlsim *sim, const struct nlmsghdr *nlh)
+{
+	const struct tcmsg *tcm = mnl_nlmsg_get_payload(nlh);
+	const struct nlattr *tb[TCA_MAX + 1];
+	struct sim_tcf *tcf;
+	struct sim_prio *prio;
+	struct sim_filter *filter;
+
+	parse_msg(nlh, sizeof(*tcm), tb, TCA_MAX);
+	int err = find_tcf(sim, tcm, &tcf);
+	if (err)
+		return err;
+
+	uint32_t prio_num = TC_H_MAJ(tcm->tcm_info) >> 16;
+	uint32_t chain_index = tb[TCA_CHAIN] ? mnl_attr_get_u32(tb[TCA_CHAIN]) : 0;
+	uint32_t handle = tcm->tcm_handle;
+	/* LSDN always chooses the priorities itself */
+	if (prio_num == 0 || !tb[TCA_KIND])
+		return -EINVAL;
+	char kind[SIM_KIND_SIZE];
+	if (attr_strscpy(kind, tb[TCA_KIND], sizeof(kind)) != 0)
+		return -EINVAL;
+
+	struct sim_chain *chain = find_chain(sim, tcf, chain_index);
+	prio = NULL;
+	filter = NULL;
+	if (chain)
+		HASH_FIND(hh, chain->prios, &prio_num, sizeof(prio_num), prio);
+	if (prio) {
+		if (strcmp(prio->kind, kind) != 0)
+			return -EINVAL;
+		if (handle)
+			HASH_FIND(hh, prio->filters, &handle, sizeof(handle), filter);
+	}
+	if (filter && (nlh->nlmsg_flags & NLM_F_EXCL))
+		return -EEXIST;
+	if (!filter && !(nlh->nlmsg_flags & NLM_F_CREATE))
+		return -ENOENT;
+
+	struct nlattr *options = NULL;
+	if (tb[TCA_OPTIONS]) {
+		options = attr_dup(tb[TCA_OPTIONS]);
+		if (!options)
+			return -ENOMEM;
+	}
+
+	struct sim_bpf *prog;
+	err = bind_actions(sim, kind, options, 0);
+	if (!err)
+		err = filter_prog(sim, kind, options, &prog);
+	if (err) {
+		free(options);
+		return err;
+	}
+	bind_actions(sim, kind, options, 1);
+	if (prog)
+		prog->refs++;
+
+	if (filter) {
+		bind_actions(sim, kind, filter->options, -1);
+		if (filter->prog)
+			bpf_put(sim, filter->prog);
+		free(filter->options);
+		filter->options = options;
+		filter->prog = prog;
+		return 0;
+	}
+
+	if (!chain) {
+		chain = chain_new(sim, tcf, chain_index);
+		if (!chain)
+			goto err_nomem;
+	}
+	if (!prio) {
+		prio = malloc(sizeof(*prio));
+		if (!prio)
+			goto err_nomem;
+		prio->prio = prio_num;
+		prio->protocol = TC_H_MIN(tcm->tcm_info);
+		strcpy(prio->kind, kind);
+		prio->filters = NULL;
+		HASH_ADD(hh, chain->prios, prio, sizeof(prio->prio), prio);
+	}
+	filter = malloc(sizeof(*filter));
+	if (!filter)
+		goto err_nomem;
+	filter->handle = handle ? handle : sim->next_handle++;
+	filter->options = options;
+	filter->prog = prog;
+	HASH_ADD(hh, prio->filters, handle, sizeof(filter->handle), filter);
+	sim->state.filters++;
+	return 0;
+
+err_nomem:
+	bind_actions(sim, kind, options, -1);
+	if (prog)
+		bpf_put(sim, prog);
+	free(options);
+	if (chain)
+		chain_gc(sim, chain, prio);
+	return -ENOMEM;
+}
+
+static int sim_deltfilter(struct lsdn_nlsim *sim, const struct nlmsghdr *nlh)
+{
+	const struct tcmsg *tcm = mnl_nlmsg_get_payload(nlh);
+	const struct nlattr *tb[TCA_MAX + 1];
+	struct sim_tcf *tcf;
+	struct sim_prio *prio = NULL;
+	struct sim_filter *filter = NULL;
+
+	parse_msg(nlh, sizeof(*tcm), tb, TCA_MAX);
+	int err = find_tcf(sim, tcm, &tcf);
+	if (err)
+		return err;
+
+	uint32_t prio_num = TC_H_MAJ(tcm->tcm_info) >> 16;
+	uint32_t chain_index = tb[TCA_CHAIN] ? mnl_attr_get_u32(tb[TCA_CHAIN]) : 0;
+	uint32_t handle = tcm->tcm_handle;
+	struct sim_chain *chain = find_chain(sim, tcf, chain_index);
+	if (!chain)
+		return -ENOENT;
+
+	/* Without priority, the whole chain is flushed, without handle the whole priority */
+	if (prio_num == 0) {
+		chain_free(sim, chain);
+		return 0;
+	}
+	HASH_FIND(hh, chain->prios, &prio_num, sizeof(prio_num), prio);
+	if (!prio)
+		return -ENOENT;
+	if (handle == 0) {
+		prio_free(sim, chain, prio);
+		chain_gc(sim, chain, NULL);
+		return 0;
+	}
+	HASH_FIND(hh, prio->filters, &handle, sizeof(handle), filter);
+	if (!filter)
+		return -ENOENT;
+	filter_free(sim, prio, filter);
+	chain_gc(sim, chain, prio);
+	return 0;
+}
+
+/* Qdiscs and blocks */
+
+static int block_get(struct lsdn_nlsim *sim, uint32_t index, struct sim_block **result)
+{
+	struct sim_block *block;
+	HASH_FIND(hh, sim->blocks, &index, sizeof(index), block);
+	if (!block) {
+		block = malloc(sizeof(*block));
+		if (!block)
+			return -ENOMEM;
+		block->index = index;
+		block->refs = 0;
+		tcf_init(&block->tcf);
+		HASH_ADD(hh, sim->blocks, index, sizeof(block->index), block);
+		sim->state.blocks++;
+	}
+	block->refs++;
+	*result = block;
+	return 0;
+}
+
+static void block_put(struct lsdn_nlsim *sim, struct sim_block *block)
+{
+	if (--block->refs)
+		return;
+	tcf_flush(sim, &block->tcf);
+	HASH_DEL(sim->blocks, block);
+	sim->state.blocks--;
+	free(block);
+}
+
+static void qdisc_free(struct lsdn_nlsim *sim, struct sim_qdisc *qdisc)
+{
+	for (size_t i = 0; i < 2; i++) {
+		tcf_flush(sim, &qdisc->tcf[i]);
+		if (qdisc->blocks[i])
+			block_put(sim, qdisc->blocks[i]);
+	}
+	sim->state.qdiscs--;
+	free(qdisc->options);
+	free(qdisc);
+}
+
+/* Find the slot on the link the qdisc request refers to */
+static struct sim_qdisc **qdisc_slot(struct sim_link *link, uint32_t parent)
+{
+	switch (parent) {
+	case TC_H_INGRESS:
+		/* TC_H_CLSACT has the same value */
+		return &link->ingress;
+	case TC_H_ROOT:
+		return &link->root;
+	default:
+		/* Classes are not simulated */
+		return NULL;
+	}
+}
+
+static int sim_newqdisc(struct lsdn_nlsim *sim, const struct nlmsghdr *nlh)
+{
+	const struct tcmsg *tcm = mnl_nlmsg_get_payload(nlh);
+	const struct nlattr *tb[TCA_MAX + 1];
+
+	parse_msg(nlh, sizeof(*tcm), tb, TCA_MAX);
+	struct sim_link *link = find_link(sim, tcm->tcm_ifindex);
+	if (!link)
+		return -ENODEV;
+	struct sim_qdisc **slot = qdisc_slot(link, tcm->tcm_parent);
+	if (!slot || !tb[TCA_KIND])
+		return -EINVAL;
+	char kind[SIM_KIND_SIZE];
+	if (attr_strscpy(kind, tb[TCA_KIND], sizeof(kind)) != 0)
+		return -EINVAL;
+	bool clsact = strcmp(kind, "clsact") == 0;
+	bool ingress = clsact || strcmp(kind, "ingress") == 0;
+	if ((slot == &link->ingress) != ingress)
+		return -EINVAL;
+	const struct nlattr *block_attrs[2] = {tb[TCA_INGRESS_BLOCK], tb[TCA_EGRESS_BLOCK]};
+	if (!clsact && (block_attrs[0] || block_attrs[1]))
+		return -EINVAL;
+
+	if (*slot) {
+		/* An existing qdisc may be changed, but not replaced by a different one and the
+		 * blocks it is bound to can not be changed at all */
+		if (nlh->nlmsg_flags & NLM_F_EXCL)
+			return -EEXIST;
+		if (strcmp((*slot)->kind, kind) != 0)
+			return -EINVAL;
+		if (block_attrs[0] || block_attrs[1])
+			return -EOPNOTSUPP;
+		return 0;
+	}
+	if (!(nlh->nlmsg_flags & NLM_F_CREATE))
+		return -ENOENT;
+
+	struct sim_qdisc *qdisc = malloc(sizeof(*qdisc));
+	if (!qdisc)
+		return -ENOMEM;
+	qdisc->handle = slot == &link->ingress ? LSDN_INGRESS_HANDLE : tcm->tcm_handle;
+	strcpy(qdisc->kind, kind);
+	qdisc->options = NULL;
+	sim->state.qdiscs++;
+	for (size_t i = 0; i < 2; i++) {
+		tcf_init(&qdisc->tcf[i]);
+		qdisc->blocks[i] = NULL;
+	}
+	if (tb[TCA_OPTIONS]) {
+		qdisc->options = attr_dup(tb[TCA_OPTIONS]);
+		if (!qdisc->options) {
+			qdisc_free(sim, qdisc);
+			return -ENOMEM;
+		}
+	}
+	for (size_t i = 0; i < 2; i++) {
+		uint32_t index = block_attrs[i] ? mnl_attr_get_u32(block_attrs[i]) : 0;
+		if (!index)
+			continue;
+		int err = block_get(sim, index, &qdisc->blocks[i]);
+		if (err) {
+			qdisc_free(sim, qdisc);
+			return err;
+		}
+	}
+	*slot = qdisc;
+	return 0;
+}
+
+static int sim_delqdisc(struct lsdn_nlsim *sim, const struct nlmsghdr *nlh)
+{
+	const struct tcmsg *tcm = mnl_nlmsg_get_payload(nlh);
+
+	struct sim_link *link = find_link(sim, tcm->tcm_ifindex);
+	if (!link)
+		return -ENODEV;
+	struct sim_qdisc **slot = qdisc_slot(link, tcm->tcm_parent);
+	if (!slot)
+		return -EINVAL;
+	if (!*slot)
+		return -ENOENT;
+	qdisc_free(sim, *slot);
+	*slot = NULL;
+	return 0;
+}
+
+/* fdb */
+
+static int fdb_key(struct lsdn_nlsim *sim, const struct nlmsghdr *nlh, struct sim_fdb_key *key)
+{
+	const struct ndmsg *nd = mnl_nlmsg_get_payload(nlh);
+	const struct nlattr *tb[NDA_MAX + 1];
+
+	parse_msg(nlh, sizeof(*nd), tb, NDA_MAX);
+	if (nd->ndm_family != PF_BRIDGE || !tb[NDA_LLADDR])
+		return -EINVAL;
+	if (!find_link(sim, nd->ndm_ifindex))
+		return -ENODEV;
+	if (mnl_attr_get_payload_len(tb[NDA_LLADDR]) != sizeof(key->mac))
+		return -EINVAL;
+
+	bzero(key, sizeof(*key));
+	key->ifindex = nd->ndm_ifindex;
+	memcpy(key->mac, mnl_attr_get_payload(tb[NDA_LLADDR]), sizeof(key->mac));
+	if (tb[NDA_DST]) {
+		size_t len = mnl_attr_get_payload_len(tb[NDA_DST]);
+		if (len > sizeof(key->dst))
+			return -EINVAL;
+		key->dst_len = len;
+		memcpy(key->dst, mnl_attr_get_payload(tb[NDA_DST]), len);
+	}
+	return 0;
+}
+
+static void fdb_free(struct lsdn_nlsim *sim, struct sim_fdb *fdb)
+{
+	lsdn_list_remove(&fdb->link_entry);
+	HASH_DEL(sim->fdb, fdb);
+	sim->state.fdb_entries--;
+	free(fdb);
+}
+
+static int sim_newneigh(struct lsdn_nlsim *sim, const struct nlmsghdr *nlh)
+{
+	struct sim_fdb_key key;
+	struct sim_fdb *fdb;
+	int err = fdb_key(sim, nlh, &key);
+	if (err)
+		return err;
+
+	HASH_FIND(hh, sim->fdb, &key, sizeof(key), fdb);
+	if (fdb)
+		return (nlh->nlmsg_flags & NLM_F_EXCL) ? -EEXIST : 0;
+	if (!(nlh->nlmsg_flags & NLM_F_CREATE))
+		return -ENOENT;
+
+	fdb = malloc(sizeof(*fdb));
+	if (!fdb)
+		return -ENOMEM;
+	fdb->key = key;
+	lsdn_list_init_add(&find_link(sim, key.ifindex)->fdb, &fdb->link_entry);
+	HASH_ADD(hh, sim->fdb, key, sizeof(fdb->key), fdb);
+	sim->state.fdb_entries++;
+	return 0;
+}
+
+static int sim_delneigh(struct lsdn_nlsim *sim, const struct nlmsghdr *nlh)
+{
+	struct sim_fdb_key key;
+	struct sim_fdb *fdb;
+	int err = fdb_key(sim, nlh, &key);
+	if (err)
+		return err;
+
+	HASH_FIND(hh, sim->fdb, &key, sizeof(key), fdb);
+	if (!fdb)
+		return -ENOENT;
+	fdb_free(sim, fdb);
+	return 0;
+}
+
+/* Backend */
+
+static int sim_request(struct lsdn_nlsim *sim, const struct nlmsghdr *nlh)
+{
+	switch (nlh->nlmsg_type) {
+	case RTM_NEWLINK:
+		return sim_newlink(sim, nlh);
+	case RTM_DELLINK:
+		return sim_dellink(sim, nlh);
+	case RTM_NEWADDR:
+		return sim_newaddr(sim, nlh);
+	case RTM_NEWQDISC:
+		return sim_newqdisc(sim, nlh);
+	case RTM_DELQDISC:
+		return sim_delqdisc(sim, nlh);
+	case RTM_NEWTFILTER:
+		return sim_newtfilter(sim, nlh);
+	case RTM_DELTFILTER:
+		return sim_deltfilter(sim, nlh);
+	case RTM_NEWNEIGH:
+		return sim_newneigh(sim, nlh);
+	case RTM_DELNEIGH:
+		return sim_delneigh(sim, nlh);
+	case RTM_NEWACTION:
+		return sim_newaction(sim, nlh);
+	case RTM_DELACTION:
+		return sim_delaction(sim, nlh);
+	default:
+		return -EOPNOTSUPP;
+	}
+}
+
+static lsdn_err_t sim_transact(struct lsdn_nlsock *sock)
+{
+	struct lsdn_nlsim *sim = get_sim(sock);
+	pthread_mutex_lock(&sim->lock);
+	for (size_t i = 0; i < sock->pending_count; i++) {
+		struct lsdn_nl_pending *p = &sock->pending[i];
+		struct nlmsghdr *nlh = (struct nlmsghdr *) (sock->buf + p->offset);
+		sim->created_ifindex = 0;
+		p->err = sim_request(sim, nlh);
+		p->acked = true;
+		if (!p->err && p->echo_ifindex && sim->created_ifindex
+		    && (nlh->nlmsg_flags & NLM_F_ECHO))
+			*p->echo_ifindex = sim->created_ifindex;
+	}
+	pthread_mutex_unlock(&sim->lock);
+	return LSDNE_OK;
+}
+
+/* Dumps */
+
+/* Put a copy of a stored attribute into a message */
+static void put_copy(struct nlmsghdr *nlh, uint16_t type, const struct nlattr *attr)
+{
+	mnl_attr_put(nlh, type, mnl_attr_get_payload_len(attr), mnl_attr_get_payload(attr));
+}
+
+static lsdn_err_t dump_links(struct lsdn_nlsim *sim, mnl_cb_t cb, void *data)
+{
+	struct sim_link *link, *tmp;
+	char buf[MNL_SOCKET_BUFFER_SIZE];
+
+	HASH_ITER(hh_index, sim->links_by_index, link, tmp) {
+		struct nlmsghdr *nlh = mnl_nlmsg_put_header(buf);
+		nlh->nlmsg_type = RTM_NEWLINK;
+		struct ifinfomsg *ifm = mnl_nlmsg_put_extra_header(nlh, sizeof(*ifm));
+		ifm->ifi_family = AF_UNSPEC;
+		ifm->ifi_index = link->ifindex;
+		ifm->ifi_flags = link->up ? IFF_UP : 0;
+
+		mnl_attr_put_strz(nlh, IFLA_IFNAME, link->name);
+		if (link->master)
+			mnl_attr_put_u32(nlh, IFLA_MASTER, link->master->ifindex);
+		if (link->lower)
+			mnl_attr_put_u32(nlh, IFLA_LINK, link->lower);
+		struct nlattr *linkinfo = mnl_attr_nest_start(nlh, IFLA_LINKINFO);
+		mnl_attr_put_strz(nlh, IFLA_INFO_KIND, link->kind);
+		if (link->info_data)
+			put_copy(nlh, IFLA_INFO_DATA, link->info_data);
+		mnl_attr_nest_end(nlh, linkinfo);
+
+		if (cb(nlh, data) == MNL_CB_ERROR)
+			return LSDNE_NETLINK;
+	}
+	return LSDNE_OK;
+}
+
+static lsdn_err_t dump_qdisc(
+	struct sim_link *link, struct sim_qdisc *qdisc, uint32_t parent, mnl_cb_t cb, void *data)
+{
+	char buf[MNL_SOCKET_BUFFER_SIZE];
+	struct nlmsghdr *nlh = mnl_nlmsg_put_header(buf);
+	nlh->nlmsg_type = RTM_NEWQDISC;
+	struct tcmsg *tcm = mnl_nlmsg_put_extra_header(nlh, sizeof(*tcm));
+	tcm->tcm_family = AF_UNSPEC;
+	tcm->tcm_ifindex = link->ifindex;
+	tcm->tcm_handle = qdisc->handle;
+	tcm->tcm_parent = parent;
+
+	mnl_attr_put_strz(nlh, TCA_KIND, qdisc->kind);
+	if (qdisc->options)
+		put_copy(nlh, TCA_OPTIONS, qdisc->options);
+	if (qdisc->blocks[0])
+		mnl_attr_put_u32(nlh, TCA_INGRESS_BLOCK, qdisc->blocks[0]->index);
+	if (qdisc->blocks[1])
+		mnl_attr_put_u32(nlh, TCA_EGRESS_BLOCK, qdisc->blocks[1]->index);
+
+	return cb(nlh, data) == MNL_CB_ERROR ? LSDNE_NETLINK : LSDNE_OK;
+}
+
+static lsdn_err_t dump_qdiscs(struct lsdn_nlsim *sim, mnl_cb_t cb, void *data)
+{
+	struct sim_link *link, *tmp;
+	lsdn_err_t err = LSDNE_OK;
+
+	HASH_ITER(hh_index, sim->links_by_index, link, tmp) {
+		if (link->ingress)
+			err = dump_qdisc(link, link->ingress, TC_H_INGRESS, cb, data);
+		if (err == LSDNE_OK && link->root)
+			err = dump_qdisc(link, link->root, TC_H_ROOT, cb, data);
+		if (err != LSDNE_OK)
+			return err;
+	}
+	return LSDNE_OK;
+}
+
+/* List the filters of the qdisc or block the request is addressed to, in all chains */
+static lsdn_err_t dump_filters(struct lsdn_nlsim *sim, const struct tcmsg *req, mnl_cb_t cb, void *data)
+{
+	struct sim_tcf *tcf;
+	struct sim_prio *prio, *tmp_prio;
+	struct sim_filter *filter, *tmp_filter;
+	char buf[MNL_SOCKET_BUFFER_SIZE];
+
+	if (find_tcf(sim, req, &tcf))
+		return LSDNE_NETLINK;
+
+	lsdn_foreach(tcf->chains, tcf_entry, struct sim_chain, chain) {
+		HASH_ITER(hh, chain->prios, prio, tmp_prio) {
+			HASH_ITER(hh, prio->filters, filter, tmp_filter) {
+				struct nlmsghdr *nlh = mnl_nlmsg_put_header(buf);
+				nlh->nlmsg_type = RTM_NEWTFILTER;
+				struct tcmsg *tcm = mnl_nlmsg_put_extra_header(nlh, sizeof(*tcm));
+				tcm->tcm_family = AF_UNSPEC;
+				tcm->tcm_ifindex = req->tcm_ifindex;
+				tcm->tcm_handle = filter->handle;
+				tcm->tcm_parent = req->tcm_parent;
+				tcm->tcm_info = TC_H_MAKE(prio->prio << 16, prio->protocol);
+
+				mnl_attr_put_strz(nlh, TCA_KIND, prio->kind);
+				mnl_attr_put_u32(nlh, TCA_CHAIN, chain->key.chain);
+				if (filter->options)
+					put_copy(nlh, TCA_OPTIONS, filter->options);
+
+				if (cb(nlh, data) == MNL_CB_ERROR)
+					return LSDNE_NETLINK;
+			}
+		}
+	}
+	return LSDNE_OK;
+}
+
+static lsdn_err_t dump_fdb(struct lsdn_nlsim *sim, mnl_cb_t cb, void *data)
+{
+	struct sim_fdb *fdb, *tmp;
+	char buf[MNL_SOCKET_BUFFER_SIZE];
+
+	HASH_ITER(hh, sim->fdb, fdb, tmp) {
+		struct nlmsghdr *nlh = mnl_nlmsg_put_header(buf);
+		nlh->nlmsg_type = RTM_NEWNEIGH;
+		struct ndmsg *nd = mnl_nlmsg_put_extra_header(nlh, sizeof(*nd));
+		nd->ndm_family = PF_BRIDGE;
+		nd->ndm_state = NUD_NOARP | NUD_PERMANENT;
+		nd->ndm_ifindex = fdb->key.ifindex;
+		nd->ndm_flags = NTF_SELF;
+
+		mnl_attr_put(nlh, NDA_LLADDR, sizeof(fdb->key.mac), fdb->key.mac);
+		if (fdb->key.dst_len)
+			mnl_attr_put(nlh, NDA_DST, fdb->key.dst_len, fdb->key.dst);
+
+		if (cb(nlh, data) == MNL_CB_ERROR)
+			return LSDNE_NETLINK;
+	}
+	return LSDNE_OK;
+}
+
+/* List the standalone actions, one per message. Only tunnel_key actions exist. */
+static lsdn_err_t dump_actions(struct lsdn_nlsim *sim, mnl_cb_t cb, void *data)
+{
+	struct sim_action *action, *tmp;
+	char buf[MNL_SOCKET_BUFFER_SIZE];
+
+	HASH_ITER(hh, sim->actions, action, tmp) {
+		struct nlmsghdr *nlh = mnl_nlmsg_put_header(buf);
+		nlh->nlmsg_type = RTM_NEWACTION;
+		struct tcamsg *tca = mnl_nlmsg_put_extra_header(nlh, sizeof(*tca));
+		tca->tca_family = AF_UNSPEC;
+
+		mnl_attr_put_u32(nlh, TCA_ROOT_COUNT, 1);
+		struct nlattr *tab = mnl_attr_nest_start(nlh, TCA_ACT_TAB);
+		struct nlattr *act = mnl_attr_nest_start(nlh, 1);
+		mnl_attr_put_strz(nlh, TCA_ACT_KIND, action->key.kind);
+		mnl_attr_put_u32(nlh, TCA_ACT_INDEX, action->key.index);
+		put_copy(nlh, TCA_ACT_OPTIONS, action->options);
+		if (action->cookie)
+			put_copy(nlh, TCA_ACT_COOKIE, action->cookie);
+		mnl_attr_nest_end(nlh, act);
+		mnl_attr_nest_end(nlh, tab);
+
+		if (cb(nlh, data) == MNL_CB_ERROR)
+			return LSDNE_NETLINK;
+	}
+	return LSDNE_OK;
+}
+
+static lsdn_err_t sim_dump_locked(
+	struct lsdn_nlsim *sim, const struct nlmsghdr *nlh, mnl_cb_t cb, void *data)
+{
+	switch (nlh->nlmsg_type) {
+	case RTM_GETLINK:
+		return dump_links(sim, cb, data);
+	case RTM_GETQDISC:
+		return dump_qdiscs(sim, cb, data);
+	case RTM_GETTFILTER:
+		return dump_filters(sim, mnl_nlmsg_get_payload(nlh), cb, data);
+	case RTM_GETNEIGH:
+		return dump_fdb(sim, cb, data);
+	case RTM_GETACTION:
+		return dump_actions(sim, cb, data);
+	default:
+		return LSDNE_NETLINK;
+	}
+}
+
+static lsdn_err_t sim_dump(
+	struct lsdn_nlsock *sock, const struct nlmsghdr *nlh, mnl_cb_t cb, void *data)
+{
+	struct lsdn_nlsim *sim = get_sim(sock);
+	pthread_mutex_lock(&sim->lock);
+	lsdn_err_t err = sim_dump_locked(sim, nlh, cb, data);
+	pthread_mutex_unlock(&sim->lock);
+	return err;
+}
+
+static lsdn_err_t if_dump_locked(struct lsdn_nlsock *sock)
+{
+	struct sim_conn *conn = get_conn(sock);
+	struct lsdn_nlsim *sim = conn->sim;
+	struct sim_link *link, *tmp;
+
+	conn->subscribed = true;
+	conn->events_lost = false;
+	conn->events_count = 0;
+	lsdn_iftable_resync_start(&sock->ifs);
+	HASH_ITER(hh_index, sim->links_by_index, link, tmp) {
+		lsdn_err_t err = lsdn_iftable_set(&sock->ifs, link->ifindex, link->name);
+		if (err != LSDNE_OK)
+			return err;
+	}
+	lsdn_iftable_resync_end(&sock->ifs);
+	return LSDNE_OK;
+}
+
+static lsdn_err_t sim_if_dump(struct lsdn_nlsock *sock)
+{
+	struct lsdn_nlsim *sim = get_sim(sock);
+	pthread_mutex_lock(&sim->lock);
+	lsdn_err_t err = if_dump_locked(sock);
+	pthread_mutex_unlock(&sim->lock);
+	return err;
+}
+
+static lsdn_err_t if_poll_locked(struct lsdn_nlsock *sock)
+{
+	struct sim_conn *conn = get_conn(sock);
+	if (conn->events_lost)
+		return if_dump_locked(sock);
+
+	for (size_t i = 0; i < conn->events_count; i++) {
+		struct sim_link_event *ev = &conn->events[i];
+		if (ev->removed) {
+			lsdn_iftable_remove(&sock->ifs, ev->ifindex);
+		} else {
+			lsdn_err_t err = lsdn_iftable_set(&sock->ifs, ev->ifindex, ev->name);
+			if (err != LSDNE_OK) {
+				/* Start over next time */
+				conn->events_lost = true;
+				return err;
+			}
+		}
+	}
+	conn->events_count = 0;
+	return LSDNE_OK;
+}
+
+static lsdn_err_t sim_if_poll(struct lsdn_nlsock *sock)
+{
+	struct lsdn_nlsim *sim = get_sim(sock);
+	pthread_mutex_lock(&sim->lock);
+	lsdn_err_t err = if_poll_locked(sock);
+	pthread_mutex_unlock(&sim->lock);
+	return err;
+}
+
+static void sim_free(struct lsdn_nlsock *sock)
+{
+	struct sim_conn *conn = get_conn(sock);
+	struct lsdn_nlsim *sim = conn->sim;
+	struct sim_link *link;
+	struct sim_action *action, *tmp;
+	struct sim_bpf_fd *bpf_fd, *tmp_fd;
+
+	lsdn_list_remove(&conn->conn_entry);
+	free(conn->events);
+	free(conn);
+	if (!lsdn_is_list_empty(&sim->conns))
+		return;
+
+	/* Deleting a link may delete its veth peer too, so always start over */
+	while ((link = sim->links_by_index) != NULL)
+		link_free(sim, link);
+	assert(!sim->blocks && !sim->chains && !sim->fdb);
+	/* Standalone actions are not owned by any link, like in the kernel */
+	HASH_ITER(hh, sim->actions, action, tmp) {
+		action_free(sim, action);
+	}
+	/* Like at the exit of the process */
+	HASH_ITER(hh, sim->bpf_fds, bpf_fd, tmp_fd) {
+		bpf_fd_free(sim, bpf_fd);
+	}
+	pthread_mutex_destroy(&sim->lock);
+	free(sim);
+}
+
+static const struct lsdn_nl_backend sim_backend = {
+	.transact = sim_transact,
+	.dump = sim_dump,
+	.if_dump = sim_if_dump,
+	.if_poll = sim_if_poll,
+	.free = sim_free,
+	.peer = lsdn_socket_init_sim_peer,
+	.bpf = sim_bpf,
+	.bpf_close = sim_bpf_close
+};
+
+/* Connect a new socket to the simulator */
+static struct lsdn_nlsock *sim_connect(struct lsdn_nlsim *sim)
+{
+	struct sim_conn *conn = malloc(sizeof(*conn));
+	if (!conn)
+		return NULL;
+	struct lsdn_nlsock *s = lsdn_socket_alloc(&sim_backend);
+	if (!s) {
+		free(conn);
+		return NULL;
+	}
+	conn->sim = sim;
+	conn->subscribed = false;
+	conn->events_lost = false;
+	conn->events = NULL;
+	conn->events_count = 0;
+	conn->events_size = 0;
+	lsdn_list_init_add(&sim->conns, &conn->conn_entry);
+	s->backend_data = conn;
+	return s;
+}
+
+struct lsdn_nlsock *lsdn_socket_init_sim()
+{
+	struct lsdn_nlsim *sim = malloc(sizeof(*sim));
+	if (!sim)
+		return NULL;
+	pthread_mutex_init(&sim->lock, NULL);
+	lsdn_list_init(&sim->conns);
+	sim->links_by_index = NULL;
+	sim->links_by_name = NULL;
+	sim->blocks = NULL;
+	sim->chains = NULL;
+	sim->actions = NULL;
+	sim->fdb = NULL;
+	sim->bpf_fds = NULL;
+	/* Out of the way of the real ones, for easier debugging */
+	sim->next_bpf_fd = 1000;
+	sim->next_prog_id = 1;
+	sim->next_ifindex = 1;
+	sim->next_handle = 0x80000000;
+	bzero(&sim->state, sizeof(sim->state));
+
+	struct lsdn_nlsock *s = sim_connect(sim);
+	if (!s) {
+		pthread_mutex_destroy(&sim->lock);
+		free(sim);
+	}
+	return s;
+}
+
+struct lsdn_nlsock *lsdn_socket_init_sim_peer(struct lsdn_nlsock *peer)
+{
+	assert(peer->backend == &sim_backend);
+	return sim_connect(get_sim(peer));
+}
+
+lsdn_err_t lsdn_nlsim_add_link(struct lsdn_nlsock *sock, const char *ifname)
+{
+	struct sim_link *link;
+	assert(sock->backend == &sim_backend);
+	/* Keep the ordering with the requests already queued */
+	lsdn_nl_flush(sock);
+	switch (link_new(get_sim(sock), ifname, "dummy", &link)) {
+	case 0:
+		return LSDNE_OK;
+	case -ENOMEM:
+		return LSDNE_NOMEM;
+	case -EEXIST:
+		return LSDNE_DUPLICATE;
+	default:
+		return LSDNE_NOIF;
+	}
+}
+
+lsdn_err_t lsdn_nlsim_del_link(struct lsdn_nlsock *sock, const char *ifname)
+{
+	assert(sock->backend == &sim_backend);
+	lsdn_nl_flush(sock);
+	struct sim_link *link = find_link_by_name(get_sim(sock), ifname);
+	if (!link)
+		return LSDNE_NOIF;
+	link_free(get_sim(sock), link);
+	return LSDNE_OK;
+}
+
+lsdn_err_t lsdn_nlsim_del_qdiscs(struct lsdn_nlsock *sock, const char *ifname)
+{
+	assert(sock->backend == &sim_backend);
+	lsdn_nl_flush(sock);
+	struct lsdn_nlsim *sim = get_sim(sock);
+	struct sim_link *link = find_link_by_name(sim, ifname);
+	if (!link)
+		return LSDNE_NOIF;
+	if (link->ingress)
+		qdisc_free(sim, link->ingress);
+	if (link->root)
+		qdisc_free(sim, link->root);
+	link->ingress = NULL;
+	link->root = NULL;
+	return LSDNE_OK;
+}
+
+void lsdn_nlsim_get_state(struct lsdn_nlsock *sock, struct lsdn_sim_state *state)
+{
+	assert(sock->backend == &sim_backend);
+	lsdn_nl_flush(sock);
+	*state = get_sim(sock)->state;
+}
+
+static size_t count_actions(const char *kind, const struct nlattr *options)
+{
+	const struct nlattr *tb[TCA_FLOWER_MAX + 1];
+	const struct nlattr *acts[TCA_ACT_MAX_PRIO + 1];
+	size_t count = 0;
+	if (!options || strcmp(kind, "flower") != 0)
+		return 0;
+	parse_nested(options, tb, TCA_FLOWER_MAX);
+	parse_nested(tb[TCA_FLOWER_ACT], acts, TCA_ACT_MAX_PRIO);
+	for (size_t i = 1; i <= TCA_ACT_MAX_PRIO; i++) {
+		if (acts[i])
+			count++;
+	}
+	return count;
+}
+
+static int cmp_sim_filter(const void *a, const void *b)
+{
+	const struct lsdn_sim_filter *fa = a, *fb = b;
+	if (fa->chain != fb->chain)
+		return fa->chain < fb->chain ? -1 : 1;
+	if (fa->prio != fb->prio)
+		return fa->prio < fb->prio ? -1 : 1;
+	return 0;
+}
+
+size_t lsdn_nlsim_get_filters(struct lsdn_nlsock *sock, const char *ifname,
+	struct lsdn_sim_filter *filters, size_t max)
+{
+	assert(sock->backend == &sim_backend);
+	lsdn_nl_flush(sock);
+	struct sim_link *link = find_link_by_name(get_sim(sock), ifname);
+	if (!link || !link->ingress)
+		return 0;
+	struct sim_qdisc *qdisc = link->ingress;
+	struct sim_tcf *tcf = qdisc->blocks[0] ? &qdisc->blocks[0]->tcf : &qdisc->tcf[0];
+
+	size_t count = 0;
+	lsdn_foreach(tcf->chains, tcf_entry, struct sim_chain, chain) {
+		struct sim_prio *prio, *tmp_prio;
+		HASH_ITER(hh, chain->prios, prio, tmp_prio) {
+			struct sim_filter *filter, *tmp_filter;
+			HASH_ITER(hh, prio->filters, filter, tmp_filter) {
+				if (count < max) {
+					filters[count].chain = chain->key.chain;
+					filters[count].prio = prio->prio;
+					filters[count].actions = count_actions(prio->kind, filter->options);
+				}
+				count++;
+			}
+		}
+	}
+	qsort(filters, count < max ? count : max, sizeof(*filters), cmp_sim_filter);
+	return count;
+}
@@ -0,0 +1,170 @@
+/** \file
+ * Running independent parts of a commit on several threads, see `lsdn_pool_run`.
+ *
+ * Most of a commit is spent waiting for the kernel to create links, one round trip at a time.
+ * The threads of a pool take turns running the model code -- only the thread holding the turn
+ * may touch it. A thread passes the turn to the next one (in a fixed round-robin order) when it
+ * sends a batch to the kernel and waits for the turn again before processing the answers. The
+ * waiting is thus overlapped, while the model is mutated in a deterministic order as before. */
+#include "private/pool.h"
+#include "private/nl.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+struct pool_slot;
+
+struct pool {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	/** Slot holding the turn. */
+	size_t turn;
+	/** Set once all the threads are created. */
+	bool started;
+	struct pool_slot *slots;
+	size_t slot_count;
+	/** Next unit to hand out, only accessed with the turn held. */
+	size_t next_unit;
+	size_t units;
+	lsdn_pool_work_cb work;
+	void *user;
+};
+
+struct pool_slot {
+	struct pool *pool;
+	size_t index;
+	/** The thread is running and still wants turns. */
+	bool active;
+	pthread_t thread;
+	struct lsdn_nl_worker worker;
+};
+
+/* Called with the lock held */
+static void pass_turn(struct pool *pool, size_t from)
+{
+	for (size_t i = 1; i <= pool->slot_count; i++) {
+		size_t next = (from + i) % pool->slot_count;
+		if (pool->slots[next].active) {
+			pool->turn = next;
+			break;
+		}
+	}
+	pthread_cond_broadcast(&pool->cond);
+}
+
+static void turn_release(void *user)
+{
+	struct pool_slot *slot = user;
+	pthread_mutex_lock(&slot->pool->lock);
+	pass_turn(slot->pool, slot->index);
+	pthread_mutex_unlock(&slot->pool->lock);
+}
+
+static void turn_acquire(void *user)
+{
+	struct pool_slot *slot = user;
+	struct pool *pool = slot->pool;
+	pthread_mutex_lock(&pool->lock);
+	while (!pool->started || pool->turn != slot->index)
+		pthread_cond_wait(&pool->cond, &pool->lock);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+static void *pool_thread(void *arg)
+{
+	struct pool_slot *slot = arg;
+	struct pool *pool = slot->pool;
+
+	lsdn_nl_worker_bind(&slot->worker);
+	turn_acquire(slot);
+	while (pool->next_unit < pool->units)
+		pool->work(pool->next_unit++, pool->user);
+	/* Whatever the last unit has left queued */
+	if (lsdn_nl_flush(slot->worker.parent) != LSDNE_OK)
+		abort();
+	lsdn_nl_worker_bind(NULL);
+
+	pthread_mutex_lock(&pool->lock);
+	slot->active = false;
+	pass_turn(pool, slot->index);
+	pthread_mutex_unlock(&pool->lock);
+	return NULL;
+}
+
+static void run_serial(size_t units, lsdn_pool_work_cb work, void *user)
+{
+	for (size_t i = 0; i < units; i++)
+		work(i, user);
+}
+
+void lsdn_pool_run(struct lsdn_nlsock *sock, size_t threads, size_t units,
+	lsdn_pool_work_cb work, void *user)
+{
+	if (threads > units)
+		threads = units;
+	if (threads <= 1) {
+		run_serial(units, work, user);
+		return;
+	}
+
+	struct pool pool;
+	pool.slots = calloc(threads, sizeof(*pool.slots));
+	if (!pool.slots) {
+		run_serial(units, work, user);
+		return;
+	}
+	pthread_mutex_init(&pool.lock, NULL);
+	pthread_cond_init(&pool.cond, NULL);
+	pool.turn = 0;
+	pool.started = false;
+	pool.slot_count = 0;
+	pool.next_unit = 0;
+	pool.units = units;
+	pool.work = work;
+	pool.user = user;
+
+	/* Make the parent's queue empty, the lanes must not overtake it */
+	if (lsdn_nl_flush(sock) != LSDNE_OK)
+		abort();
+
+	/* As many slots as we can get, the work is only spread over fewer threads otherwise */
+	for (size_t i = 0; i < threads; i++) {
+		struct pool_slot *slot = &pool.slots[i];
+		slot->worker.lane = lsdn_socket_init_peer(sock);
+		if (!slot->worker.lane)
+			break;
+		slot->pool = &pool;
+		slot->index = i;
+		slot->active = true;
+		slot->worker.parent = sock;
+		slot->worker.io_begin = turn_release;
+		slot->worker.io_end = turn_acquire;
+		slot->worker.user = slot;
+		pool.slot_count++;
+		if (pthread_create(&slot->thread, NULL, pool_thread, slot) != 0) {
+			lsdn_socket_free(slot->worker.lane);
+			pool.slot_count--;
+			break;
+		}
+	}
+
+	pthread_mutex_lock(&pool.lock);
+	pool.started = true;
+	pthread_cond_broadcast(&pool.cond);
+	pthread_mutex_unlock(&pool.lock);
+
+	for (size_t i = 0; i < pool.slot_count; i++) {
+		struct pool_slot *slot = &pool.slots[i];
+		pthread_join(slot->thread, NULL);
+		/* Account the traffic of the lanes to the parent, in a fixed order */
+		lsdn_nl_stats_add(&sock->stats, &slot->worker.lane->stats);
+		lsdn_socket_free(slot->worker.lane);
+	}
+	/* No thread could be started */
+	for (size_t i = pool.next_unit; i < units; i++)
+		work(i, user);
+
+	pthread_cond_destroy(&pool.cond);
+	pthread_mutex_destroy(&pool.lock);
+	free(pool.slots);
+}
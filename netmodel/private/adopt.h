@@ -0,0 +1,78 @@
+/** \file
+ * Adopting the kernel state left behind by a previous context (warm restart). */
+#pragma once
+
+#include "../include/errors.h"
+#include <stdint.h>
+#include <stdbool.h>
+
+struct nlmsghdr;
+struct lsdn_nlsock;
+struct lsdn_adopt;
+
+/** How a request relates to the kernel state found by `lsdn_adopt_start`. */
+enum lsdn_adopt_match {
+	/** There is nothing in place of the object, the request must be sent. */
+	LSDN_ADOPT_MISSING,
+	/** The same object is already there, the request can be dropped. */
+	LSDN_ADOPT_SAME,
+	/** A different object is in its place. */
+	LSDN_ADOPT_DIFFERENT
+};
+
+/** Identification of a tc filter. */
+struct lsdn_adopt_filter_key {
+	/** Interface index or `TCM_IFINDEX_MAGIC_BLOCK`. */
+	uint32_t ifindex;
+	/** Parent qdisc handle or the block index. */
+	uint32_t parent;
+	uint32_t chain;
+	uint32_t prio;
+	uint32_t handle;
+};
+
+/** Take a snapshot of the links, qdiscs, filters and tunnel_key actions in the kernel. */
+lsdn_err_t lsdn_adopt_new(struct lsdn_nlsock *sock, const char *prefix, struct lsdn_adopt **a);
+/** Take a snapshot of the links, qdiscs and filters and start matching the requests against it.
+ * Links named `<prefix>-<number>` and actions with the `<prefix>` cookie not adopted by the model
+ * are deleted by `lsdn_adopt_finish`. */
+lsdn_err_t lsdn_adopt_start(struct lsdn_nlsock *sock, const char *prefix);
+/** Delete everything the model did not adopt and stop adopting. */
+lsdn_err_t lsdn_adopt_finish(struct lsdn_nlsock *sock);
+void lsdn_adopt_free(struct lsdn_adopt *a);
+
+/** Match a RTM_NEWLINK request by the link name. Sets `ifindex` unless MISSING. */
+enum lsdn_adopt_match lsdn_adopt_link(
+	struct lsdn_adopt *a, const struct nlmsghdr *req, unsigned int *ifindex);
+/** Record the link as enslaved to `master` (and up, if asked).
+ * @return true if the link was already in that state. */
+bool lsdn_adopt_link_attach(
+	struct lsdn_adopt *a, unsigned int ifindex, unsigned int master, bool up);
+/** Match a RTM_NEWQDISC request by the interface and handle. */
+enum lsdn_adopt_match lsdn_adopt_qdisc(struct lsdn_adopt *a, const struct nlmsghdr *req);
+/** Match a RTM_NEWTFILTER request by the parent, chain, priority and handle. */
+enum lsdn_adopt_match lsdn_adopt_filter(struct lsdn_adopt *a, const struct nlmsghdr *req);
+/** Match a RTM_NEWACTION request by the action index. Only the actions whose cookie names the
+ * context are adopted, the others are reported missing. */
+enum lsdn_adopt_match lsdn_adopt_action(struct lsdn_adopt *a, const struct nlmsghdr *req);
+
+/** Mark the qdisc (given by the handle) or block (given by `TCM_IFINDEX_MAGIC_BLOCK` and the
+ * index) the filters are attached to as used by the model.
+ * @return false if there is no such qdisc or block. */
+bool lsdn_adopt_claim_tcf(struct lsdn_adopt *a, uint32_t ifindex, uint32_t parent);
+/** Mark the ingress or clsact qdisc of the interface as used by the model.
+ * @return false if there is no such qdisc, otherwise `blocks` are set to the ingress and egress
+ * blocks bound by the qdisc (zero if none). */
+bool lsdn_adopt_claim_clsact(struct lsdn_adopt *a, uint32_t ifindex, uint32_t blocks[2]);
+/** Mark the link as used by the model.
+ * @return Name of the link or NULL if there is no such link. `master` is set if not NULL. */
+const char *lsdn_adopt_claim_link(struct lsdn_adopt *a, unsigned int ifindex, unsigned int *master);
+/** Name of the link in the snapshot, NULL if unknown. */
+const char *lsdn_adopt_link_name(struct lsdn_adopt *a, unsigned int ifindex);
+
+typedef void (*lsdn_adopt_filter_cb)(const struct lsdn_adopt_filter_key *key, void *user);
+typedef void (*lsdn_adopt_link_cb)(unsigned int ifindex, const char *name, void *user);
+/** Walk the filters of the claimed qdiscs and blocks that no request has matched. */
+void lsdn_adopt_foreach_extra_filter(struct lsdn_adopt *a, lsdn_adopt_filter_cb cb, void *user);
+/** Walk the links named like the context's own that were neither adopted nor claimed. */
+void lsdn_adopt_foreach_extra_link(struct lsdn_adopt *a, lsdn_adopt_link_cb cb, void *user);
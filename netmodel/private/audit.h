@@ -0,0 +1,56 @@
+/** \file
+ * Comparing the kernel state with the committed model, see `lsdn_audit`. */
+#pragma once
+
+#include "adopt.h"
+#include "../include/nettypes.h"
+#include <stdbool.h>
+
+struct lsdn_context;
+struct lsdn_if;
+struct lsdn_filter;
+struct audit_fdb;
+struct audit_missing;
+
+/** A running audit.
+ * The parts of the model compare themselves with the snapshot and report the differences. When
+ * repairing, they also queue the requests fixing them. */
+struct lsdn_audit {
+	struct lsdn_context *ctx;
+	/** Snapshot of the links, qdiscs and filters. The objects found by the model are claimed,
+	 * the rest is reported as extra. */
+	struct lsdn_adopt *snapshot;
+	/** Snapshot of the fdb entries. */
+	struct audit_fdb *fdb;
+	/** Interfaces, qdiscs and blocks already reported as missing. */
+	struct audit_missing *missing;
+	bool repair;
+	bool nomem;
+};
+
+/** What to do with the filters of a qdisc or block, see `lsdn_audit_tcf`. */
+enum lsdn_audit_tcf {
+	/** The qdisc or block is there, compare the filters with the kernel. */
+	LSDN_AUDIT_CHECK,
+	/** The qdisc is being recreated, send all the filters again. */
+	LSDN_AUDIT_RESEND,
+	/** The filters are gone and can not be repaired. */
+	LSDN_AUDIT_SKIP
+};
+
+/** Check that the qdisc (or block) holding a ruleset exists and recreate a missing qdisc.
+ * Each missing object is reported only once, no matter how many rulesets it holds.
+ * @param iface Interface of the qdisc, NULL for a block.
+ * @param parent Handle of the qdisc or the block index. */
+enum lsdn_audit_tcf lsdn_audit_tcf(struct lsdn_audit *audit, struct lsdn_if *iface, uint32_t parent);
+/** Check that the clsact qdisc of the interface exists and binds the given shared blocks,
+ * recreating it if not. A missing block is then created again and its filters resent. */
+void lsdn_audit_clsact(struct lsdn_audit *audit, struct lsdn_if *iface,
+	uint32_t block_in, uint32_t block_out);
+/** Compare a built filter (not sent yet) with the kernel.
+ * @return true if the filter should be sent again. */
+bool lsdn_audit_filter(struct lsdn_audit *audit, struct lsdn_filter *filter);
+/** Check that the interface exists and is enslaved to `master` (if not NULL), fixing the latter. */
+void lsdn_audit_link(struct lsdn_audit *audit, struct lsdn_if *iface, struct lsdn_if *master);
+/** Check the fdb entry of the interface and add it again if missing. */
+void lsdn_audit_fdb(struct lsdn_audit *audit, struct lsdn_if *iface, lsdn_mac_t mac, lsdn_ip_t ip);
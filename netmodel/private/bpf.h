@@ -0,0 +1,50 @@
+#pragma once
+
+#include <linux/bpf.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct lsdn_nlsock;
+
+/* Helpers for building eBPF programs, named like their counterparts in the kernel sources */
+#define BPF_MOV64_REG(DST, SRC) \
+	((struct bpf_insn) {BPF_ALU64 | BPF_MOV | BPF_X, DST, SRC, 0, 0})
+#define BPF_MOV64_IMM(DST, IMM) \
+	((struct bpf_insn) {BPF_ALU64 | BPF_MOV | BPF_K, DST, 0, 0, IMM})
+#define BPF_ALU64_IMM(OP, DST, IMM) \
+	((struct bpf_insn) {BPF_ALU64 | BPF_OP(OP) | BPF_K, DST, 0, 0, IMM})
+#define BPF_LDX_MEM(SIZE, DST, SRC, OFF) \
+	((struct bpf_insn) {BPF_LDX | BPF_SIZE(SIZE) | BPF_MEM, DST, SRC, OFF, 0})
+#define BPF_STX_MEM(SIZE, DST, SRC, OFF) \
+	((struct bpf_insn) {BPF_STX | BPF_SIZE(SIZE) | BPF_MEM, DST, SRC, OFF, 0})
+#define BPF_ST_MEM(SIZE, DST, OFF, IMM) \
+	((struct bpf_insn) {BPF_ST | BPF_SIZE(SIZE) | BPF_MEM, DST, 0, OFF, IMM})
+#define BPF_JMP_IMM(OP, DST, IMM, OFF) \
+	((struct bpf_insn) {BPF_JMP | BPF_OP(OP) | BPF_K, DST, 0, OFF, IMM})
+#define BPF_JMP_REG(OP, DST, SRC, OFF) \
+	((struct bpf_insn) {BPF_JMP | BPF_OP(OP) | BPF_X, DST, SRC, OFF, 0})
+#define BPF_CALL_HELPER(FUNC) \
+	((struct bpf_insn) {BPF_JMP | BPF_CALL, 0, 0, 0, FUNC})
+#define BPF_EXIT_INSN() \
+	((struct bpf_insn) {BPF_JMP | BPF_EXIT, 0, 0, 0, 0})
+/* Takes two instructions, the second one is BPF_LD_IMM64_HIGH */
+#define BPF_LD_MAP_FD(DST, FD) \
+	((struct bpf_insn) {BPF_LD | BPF_DW | BPF_IMM, DST, BPF_PSEUDO_MAP_FD, 0, FD})
+#define BPF_LD_IMM64_HIGH() \
+	((struct bpf_insn) {0, 0, 0, 0, 0})
+
+/* The eBPF maps and programs are created through the backend of the socket, so that the
+ * simulator can stand in for the kernel. The functions return a file descriptor (or zero) on
+ * success and a negative errno on failure. */
+int lsdn_bpf_map_create(struct lsdn_nlsock *sock, enum bpf_map_type type,
+	uint32_t key_size, uint32_t value_size, uint32_t max_entries, uint32_t flags);
+int lsdn_bpf_map_update(struct lsdn_nlsock *sock, int fd, const void *key, const void *value);
+int lsdn_bpf_map_delete(struct lsdn_nlsock *sock, int fd, const void *key);
+/* Load a program for cls_bpf, `id` is set to its kernel-wide ID */
+int lsdn_bpf_prog_load(struct lsdn_nlsock *sock, const struct bpf_insn *insns, size_t count,
+	uint32_t *id);
+void lsdn_bpf_close(struct lsdn_nlsock *sock, int fd);
+
+/* The bpf(2) syscall, for the netlink backend */
+long lsdn_bpf_kernel(struct lsdn_nlsock *sock, int cmd, union bpf_attr *attr, unsigned int size);
+void lsdn_bpf_kernel_close(struct lsdn_nlsock *sock, int fd);
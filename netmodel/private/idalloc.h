@@ -2,14 +2,42 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <stddef.h>
 
+/** Statistics of an ID allocator.
+ * Since the lowest free ID is always allocated, the IDs in use are compact unless they were
+ * freed out of order. `span - allocated` is the number of holes below the highest used ID. */
+struct lsdn_idalloc_stats {
+	/** Number of IDs currently allocated. */
+	uint32_t allocated;
+	/** Highest number of IDs allocated at the same time. */
+	uint32_t peak;
+	/** Number of IDs from `min` up to the highest allocated ID (inclusive). */
+	uint32_t span;
+	/** Number of IDs the bitmap can currently hold without growing. */
+	uint32_t capacity;
+};
+
+/** Allocator of IDs in the range [`min`, `max`).
+ * The IDs are tracked in a bitmap with one bit per ID and a second bitmap with one bit per full
+ * word of the first one. The lowest free ID is found by a find-first-zero scan of the second
+ * bitmap, which is only 16 words for a 16-bit range, followed by a single word of the first.
+ * The bitmaps grow on demand, so an allocator that only gives out a few IDs stays small. */
 struct lsdn_idalloc{
 	uint32_t min;
 	uint32_t max;
-	uint32_t next;
+	/** Bitmap of used IDs, bit `i` of word `w` is the ID `min + 64 * w + i`. */
+	uint64_t *used;
+	/** Bitmap of full words in `used`. */
+	uint64_t *full;
+	/** Number of words in `used`. */
+	size_t words;
+	uint32_t allocated;
+	uint32_t peak;
 };
 
 void lsdn_idalloc_init(struct lsdn_idalloc *idalloc, uint32_t min, uint32_t max);
 bool lsdn_idalloc_get(struct lsdn_idalloc *idalloc, uint32_t *result);
 void lsdn_idalloc_return(struct lsdn_idalloc *idalloc, uint32_t id);
+void lsdn_idalloc_get_stats(struct lsdn_idalloc *idalloc, struct lsdn_idalloc_stats *stats);
 void lsdn_idalloc_free(struct lsdn_idalloc *idalloc);
@@ -0,0 +1,47 @@
+/** \file
+ * Table of the network interfaces present in the kernel. */
+#pragma once
+
+#include "../include/errors.h"
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <net/if.h>
+#include <uthash.h>
+
+struct nlmsghdr;
+
+struct lsdn_ifentry {
+	unsigned int ifindex;
+	char name[IFNAMSIZ];
+	/** Generation of the table in which the interface was last seen. */
+	uint32_t generation;
+	UT_hash_handle hh_index;
+	UT_hash_handle hh_name;
+};
+
+/** Interfaces in the kernel, by name and by ifindex.
+ * The table is filled by a full listing of the interfaces (`RTM_GETLINK` dump) and then kept up to
+ * date by the link notifications, so that resolving an interface name does not need to ask the
+ * kernel. If the notifications are lost, the table is filled again from a new listing: the
+ * interfaces present are refreshed between `lsdn_iftable_resync_start` and
+ * `lsdn_iftable_resync_end`, the rest is dropped. */
+struct lsdn_iftable {
+	struct lsdn_ifentry *by_index;
+	struct lsdn_ifentry *by_name;
+	uint32_t generation;
+	/** Has the table been filled? */
+	bool synced;
+	/** Number of interfaces removed since the counter was last reset by the table user. */
+	size_t removed;
+};
+
+void lsdn_iftable_init(struct lsdn_iftable *t);
+void lsdn_iftable_free(struct lsdn_iftable *t);
+lsdn_err_t lsdn_iftable_set(struct lsdn_iftable *t, unsigned int ifindex, const char *name);
+void lsdn_iftable_remove(struct lsdn_iftable *t, unsigned int ifindex);
+void lsdn_iftable_resync_start(struct lsdn_iftable *t);
+void lsdn_iftable_resync_end(struct lsdn_iftable *t);
+unsigned int lsdn_iftable_find(struct lsdn_iftable *t, const char *name);
+bool lsdn_iftable_has(struct lsdn_iftable *t, unsigned int ifindex);
+int lsdn_iftable_msg_cb(const struct nlmsghdr *nlh, void *data);
@@ -0,0 +1,52 @@
+/** \file
+ * Index of objects by a binary key. */
+#pragma once
+
+#include "list.h"
+#include <stdbool.h>
+#include <uthash.h>
+
+/** Index of objects by a fixed-size binary key.
+ * Unlike a plain hash table, several objects may share a key -- finding such duplicates is the
+ * main purpose of the index, since it is used by validation. Only the first object with a given
+ * key is in the hash table, the others are chained to it. The index entries are embedded in the
+ * indexed objects and the keys are owned by them, so the index does not allocate them.
+ *
+ * The keys are compared as raw memory, so any padding in them must be zeroed. */
+struct lsdn_index {
+	/** Hash table of the first entries for each key. */
+	struct lsdn_index_entry *head;
+	/** Size of the key in bytes. */
+	size_t key_size;
+};
+
+/** Index membership, embedded in the indexed object. */
+struct lsdn_index_entry {
+	/** Hash table membership (only valid for the first entry with a given key). */
+	UT_hash_handle hh;
+	/** Circular list of all entries with the same key. */
+	struct lsdn_list_entry dups;
+	/** Key of the entry, points into the indexed object. */
+	const void *key;
+	/** Is the entry in an index? */
+	bool indexed;
+	/** Is the entry the one in the hash table? */
+	bool is_head;
+};
+
+/** Iterate over the other objects with the same key as `entry`.
+ * @param entry the index entry to start with.
+ * @param member name of the `lsdn_index_entry` member in `type`.
+ * @param type type of the indexed objects.
+ * @param name name of the iteration variable. */
+#define lsdn_index_foreach_dup(entry, member, type, name) \
+	for(type *name = lsdn_container_of((entry)->dups.next, type, member.dups); \
+	    &name->member.dups != &(entry)->dups; \
+	    name = lsdn_container_of(name->member.dups.next, type, member.dups))
+
+void lsdn_index_init(struct lsdn_index *idx, size_t key_size);
+void lsdn_index_clear(struct lsdn_index *idx);
+void lsdn_index_entry_init(struct lsdn_index_entry *entry);
+void lsdn_index_add(struct lsdn_index *idx, struct lsdn_index_entry *entry, const void *key);
+void lsdn_index_remove(struct lsdn_index *idx, struct lsdn_index_entry *entry);
+struct lsdn_index_entry *lsdn_index_search(struct lsdn_index *idx, const void *key);
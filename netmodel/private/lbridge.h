@@ -3,8 +3,10 @@
 #pragma once
 
 #include "nl.h"
+#include "list.h"
 
 struct lsdn_virt;
+struct lsdn_audit;
 
 /** Linux Bridge.
  * Currently only holds a reference to the context
@@ -14,6 +16,10 @@ struct lsdn_lbridge {
 	struct lsdn_context *ctx;
 	/** Underlying bridge interface */
 	struct lsdn_if bridge_if;
+	/** Connected interfaces (`lsdn_lbridge_if`). */
+	struct lsdn_list_entry ports_list;
+	/** Membership in `lsdn_context.lbridges_list`. */
+	struct lsdn_list_entry lbridges_entry;
 };
 
 /** Linux Bridge interface.
@@ -24,12 +30,16 @@ struct lsdn_lbridge_if {
 	struct lsdn_lbridge *br;
 	/** Connected interface. */
 	struct lsdn_if *iface;
+	/** Membership in `lsdn_lbridge.ports_list`. */
+	struct lsdn_list_entry ports_entry;
 };
 
 void lsdn_lbridge_init(struct lsdn_context *ctx, struct lsdn_lbridge *br);
 void lsdn_lbridge_free(struct lsdn_lbridge *br);
 void lsdn_lbridge_add(struct lsdn_lbridge *br, struct lsdn_lbridge_if *br_if, struct lsdn_if *iface);
+void lsdn_lbridge_add_created(struct lsdn_lbridge *br, struct lsdn_lbridge_if *br_if, struct lsdn_if *iface);
 void lsdn_lbridge_remove(struct lsdn_lbridge_if *iface);
+void lsdn_lbridge_audit(struct lsdn_context *ctx, struct lsdn_audit *audit);
 
 void lsdn_lbridge_add_virt(struct lsdn_virt *v);
 void lsdn_lbridge_remove_virt(struct lsdn_virt *v);
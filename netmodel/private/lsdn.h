@@ -6,6 +6,8 @@
 #include "rules.h"
 #include "nl.h"
 #include "idalloc.h"
+#include "slab.h"
+#include "index.h"
 #include "sbridge.h"
 #include "lbridge.h"
 #include "state.h"
@@ -24,7 +26,51 @@ struct lsdn_context{
 	struct lsdn_list_entry networks_list;
 	struct lsdn_list_entry settings_list;
 	struct lsdn_list_entry phys_list;
-	struct mnl_socket *nlsock;
+	/* Objects changed since the last successful commit, in the order they were changed.
+	 * Only these (and objects they depend on) are processed by validate and commit. */
+	struct lsdn_list_entry dirty_settings;
+	struct lsdn_list_entry dirty_phys;
+	struct lsdn_list_entry dirty_nets;
+	struct lsdn_list_entry dirty_pas;
+	struct lsdn_list_entry dirty_virts;
+	/* Flower filters changed by the ruleset engine, see lsdn_ruleset_flush */
+	struct lsdn_list_entry dirty_fl_rules;
+	/* Broadcast filters changed by the ruleset engine, see lsdn_broadcast_flush */
+	struct lsdn_list_entry dirty_br_filters;
+	/* Shared tunnel_key actions waiting for their filters to go away, see lsdn_tunnel_key_flush */
+	struct lsdn_list_entry released_tunnel_keys;
+	/* Indices of the tunnel_key actions found to belong to someone else, see
+	 * lsdn_tunnel_key_new. They are never touched or handed out again. */
+	struct lsdn_list_entry foreign_tunnel_keys;
+	/* cls_bpf filters to be sent, see lsdn_bpf_filter_flush */
+	struct lsdn_list_entry dirty_bpf_filters;
+	/* Kernel objects set up by the commits, walked by lsdn_audit */
+	struct lsdn_list_entry rulesets_list;
+	struct lsdn_list_entry broadcasts_list;
+	struct lsdn_list_entry bpf_filters_list;
+	struct lsdn_list_entry lbridges_list;
+	/* Indices used to find conflicting objects during validation without comparing all pairs */
+	/** Physes with an IP, by `lsdn_phys.ip_key`. */
+	struct lsdn_index phys_ip_index;
+	/** All networks, by `lsdn_net.id_key`. */
+	struct lsdn_index net_id_index;
+	/** VXLAN networks with a local phys attached, by `lsdn_net.port_key`.
+	 * Updated for dirty networks during validation. */
+	struct lsdn_index net_port_index;
+	/** Validated virts with a MAC, by `lsdn_virt.mac_key`. Only filled during validation. */
+	struct lsdn_index virt_mac_index;
+	/** Validated virts with an IP answered by neighbor suppression, by `lsdn_virt.ip_key`.
+	 * Only filled during validation. */
+	struct lsdn_index virt_ip_index;
+	/** Indices of the shared tc blocks, see `lsdn_settings_set_shared_blocks`. */
+	struct lsdn_idalloc block_ids;
+	/** Indices of the shared tunnel_key actions, see `lsdn_tunnel_key_new`. */
+	struct lsdn_idalloc tunnel_key_ids;
+	struct lsdn_nlsock *nlsock;
+	/** Threads creating the new PAs, see `lsdn_context_set_commit_threads`. */
+	unsigned int commit_threads;
+	/** Work done by the commits, see stats.c. The netlink counters are kept by the socket. */
+	struct lsdn_commit_stats stats;
 
 	// error handling -- only valid during validation and commit
 	struct lsdn_problem problem;
@@ -40,6 +86,7 @@ struct lsdn_context{
 
 struct lsdn_settings {
 	enum lsdn_state state;
+	struct lsdn_list_entry dirty_entry;
 	struct lsdn_list_entry settings_entry;
 	struct lsdn_list_entry setting_users_list;
 	struct lsdn_context *ctx;
@@ -66,10 +113,21 @@ struct lsdn_settings {
 	};
 
 	struct lsdn_user_hooks *user_hooks;
+	/** Work unit of the networks sharing the settings' tunnel during a parallel commit. */
+	size_t commit_unit;
+	/** Bind the virts to shared tc blocks, see `lsdn_settings_set_shared_blocks`. */
+	bool shared_blocks;
+	/** Answer ARP and ND locally, see `lsdn_settings_set_neigh_suppression`. */
+	bool neigh_suppression;
+	/** Switch in tc chains, see `lsdn_settings_set_chain_switching`. */
+	bool chain_switching;
+	/** Switch by an eBPF program, see `lsdn_settings_set_bpf_switching`. */
+	bool bpf_switching;
 };
 
 struct lsdn_phys {
 	enum lsdn_state state;
+	struct lsdn_list_entry dirty_entry;
 	struct lsdn_name name;
 	struct lsdn_list_entry phys_entry;
 	struct lsdn_list_entry attached_to_list;
@@ -77,12 +135,28 @@ struct lsdn_phys {
 	struct lsdn_context* ctx;
 	bool is_local;
 	bool committed_as_local;
+	/** Only the IP has changed, the views are updated in place (see `can_readdress`). */
+	bool ip_changed;
 	char *attr_iface;
 	lsdn_ip_t *attr_ip;
+	/* Copy of attr_ip with the unused bytes zeroed */
+	lsdn_ip_t ip_key;
+	struct lsdn_index_entry ip_entry;
+};
+
+struct lsdn_net_id_key {
+	enum lsdn_nettype nettype;
+	uint32_t vnet_id;
+};
+
+struct lsdn_net_port_key {
+	uint16_t port;
+	bool is_static_e2e;
 };
 
 struct lsdn_net {
 	enum lsdn_state state;
+	struct lsdn_list_entry dirty_entry;
 	struct lsdn_list_entry networks_entry;
 	struct lsdn_list_entry settings_users_entry;
 	struct lsdn_context *ctx;
@@ -94,10 +168,20 @@ struct lsdn_net {
 	/* List of lsdn_phys_attachement attached to this network */
 	struct lsdn_list_entry attached_list;
 	struct lsdn_names virt_names;
+	/* Storage of the virts, bulk created virts are allocated next to each other */
+	struct lsdn_slab virt_slab;
+
+	struct lsdn_net_id_key id_key;
+	struct lsdn_index_entry id_entry;
+	struct lsdn_net_port_key port_key;
+	struct lsdn_index_entry port_entry;
+	/** Work unit of the network during a parallel commit, `SIZE_MAX` outside of it. */
+	size_t commit_unit;
 };
 
 struct lsdn_phys_attachment {
 	enum lsdn_state state;
+	struct lsdn_list_entry dirty_entry;
 	/* list held by net */
 	struct lsdn_list_entry attached_entry;
 	/* list held by phys */
@@ -107,6 +191,10 @@ struct lsdn_phys_attachment {
 	struct lsdn_list_entry pa_view_list;
 	/* List of remote PAs that this PA can see in the network */
 	struct lsdn_list_entry remote_pa_list;
+	/* Storage for the remote PAs and remote virts this PA can see, so that the views of a
+	 * PA stay together in memory */
+	struct lsdn_slab remote_pa_slab;
+	struct lsdn_slab remote_virt_slab;
 
 	struct lsdn_net *net;
 	struct lsdn_phys *phys;
@@ -123,11 +211,27 @@ struct lsdn_phys_attachment {
 
 	struct lsdn_sbridge sbridge;
 	struct lsdn_sbridge_if sbridge_if;
+
+	/* Shared tc blocks of the local virts, if the settings ask for them */
+	/** Number of virts bound to the blocks, the rulesets are valid if nonzero. */
+	size_t shared_block_users;
+	struct lsdn_ruleset shared_rules_in;
+	struct lsdn_ruleset shared_rules_out;
+	/** Broadcast classification in `shared_rules_in`, for static switching networks. */
+	struct lsdn_sbridge_phys_if shared_phys_if;
+	/** Virt whose rules are installed in the blocks. All virts bound to the blocks have the
+	 * same rules (this is checked by validation), so the rules of only one of them are
+	 * installed on behalf of all. */
+	struct lsdn_virt *rules_leader;
+	/** Virt the others are compared to when validating their rules, only valid during
+	 * validation. */
+	struct lsdn_virt *rules_reference;
 };
 
 struct lsdn_virt {
 	/* Tracks the state of local virts */
 	enum lsdn_state state;
+	struct lsdn_list_entry dirty_entry;
 	struct lsdn_name name;
 	struct lsdn_list_entry virt_entry;
 	struct lsdn_list_entry connected_virt_entry;
@@ -140,7 +244,18 @@ struct lsdn_virt {
 	struct lsdn_if committed_if;
 
 	lsdn_mac_t *attr_mac;
-	/*lsdn_ip_t *attr_ip; */
+	lsdn_ip_t *attr_ip;
+	struct lsdn_virt_mac_key {
+		struct lsdn_net *net;
+		lsdn_mac_t mac;
+	} mac_key;
+	struct lsdn_index_entry mac_entry;
+	/* The part of the IP the neighbor suppression rules match on, see index_virt_ips */
+	struct lsdn_virt_ip_key {
+		struct lsdn_net *net;
+		lsdn_ip_t ip;
+	} ip_key;
+	struct lsdn_index_entry ip_entry;
 
 	union {
 		struct {
@@ -157,6 +272,24 @@ struct lsdn_virt {
 
 	struct lsdn_ruleset rules_in;
 	struct lsdn_ruleset rules_out;
+	/** Is the virt bound to the shared blocks of `committed_to`? If so, `rules_in` and
+	 * `rules_out` are not used. */
+	bool in_shared_blocks;
+	/** Has the virt only been connected through another phys since it was committed? Its
+	 * remote views can then be moved instead of recreated. */
+	bool only_moved;
 	struct vr_prio *ht_in_rules;
 	struct vr_prio *ht_out_rules;
 };
+
+/** Mark the virt as changed, so that its rules get validated and committed. */
+void lsdn_virt_touch(struct lsdn_virt *virt);
+
+/** Error callback of the queued netlink requests, reporting the rejected request as a problem of
+ * the commit. The user pointer is the context. */
+void lsdn_nl_problem_cb(const struct nlmsghdr *nlh, int err, void *user);
+
+void lsdn_stats_object_new(struct lsdn_context *ctx, enum lsdn_object_class cls);
+void lsdn_stats_object_free(struct lsdn_context *ctx, enum lsdn_object_class cls);
+uint64_t lsdn_stats_now(void);
+void lsdn_stats_phase_end(struct lsdn_context *ctx, enum lsdn_commit_phase phase, uint64_t *start);
@@ -2,29 +2,37 @@
  * Name-related structs and definitions. */
 #pragma once
 
+#include <uthash.h>
 #include "list.h"
 #include "../include/errors.h"
 
-/** List of names.
+/** Table of names.
  * Contains a collection of names that should be unique over their domain.
- * E.g., names of all networks (physes, virts) in a context. */
+ * E.g., names of all networks (physes, virts) in a context. The names are hashed for lookup
+ * and also kept in the order they were set. */
 struct lsdn_names {
-	/** Head of the list. */
+	/** Head of the list, in the order the names were set. */
 	struct lsdn_list_entry head;
+	/** Hash of the names, keyed by the string. */
+	struct lsdn_name *hash;
 };
 
 /** Individual name entry. */
 struct lsdn_name {
 	/** Name. */
 	char* str;
+	/** Table the name is in, `NULL` if the name is not set. */
+	struct lsdn_names *table;
 	/** List membership. */
 	struct lsdn_list_entry entry;
+	/** Hash membership. */
+	UT_hash_handle hh;
 };
 
 void lsdn_names_init(struct lsdn_names *tab);
 void lsdn_names_free(struct lsdn_names *tab);
 lsdn_err_t lsdn_name_set(struct lsdn_name *name, struct lsdn_names *table, const char* str);
+void lsdn_name_clear(struct lsdn_name *name);
 void lsdn_name_init(struct lsdn_name *name);
 void lsdn_name_free(struct lsdn_name *name);
 struct lsdn_name * lsdn_names_search(struct lsdn_names *tab, const char* key);
-// TODO: allow names removal
@@ -5,10 +5,14 @@
 #include "../include/lsdn.h"
 #include "lsdn.h"
 
+struct lsdn_audit;
+
 const char *lsdn_mk_ifname(struct lsdn_context* ctx);
 lsdn_err_t lsdn_prepare_rulesets(
 	struct lsdn_context *ctx, struct lsdn_if *iface,
 	struct lsdn_ruleset* in, struct lsdn_ruleset* out);
+struct lsdn_ruleset *lsdn_virt_prepare_rulesets(struct lsdn_virt *virt);
+void lsdn_virt_free_rulesets(struct lsdn_virt *virt);
 void lsdn_settings_init_common(struct lsdn_settings *settings, struct lsdn_context *ctx);
 
 /** Per-local PA view of a remote PA. TODO
@@ -23,6 +27,8 @@ struct lsdn_remote_pa {
 	struct lsdn_phys_attachment *remote;
 
 	struct lsdn_sbridge_route sbridge_route;
+	/* Index of the shared tunnel_key action, for static switching */
+	uint32_t tunnel_key;
 };
 
 /** Per-local PA view of a remote virt. TODO
@@ -94,6 +100,21 @@ struct lsdn_net_ops {
 	/** Clean up after a remote virt. */
 	void (*remove_remote_virt) (struct lsdn_remote_virt *virt);
 
+	/** Move a remote virt to another remote machine.
+	 * Called when a remote virt has migrated between two remote machines, instead of
+	 * `remove_remote_virt` and `add_remote_virt`. The virt is already in the list of its new
+	 * remote machine `virt->pa`, `from` is the old one. Update what `add_remote_virt` has
+	 * created in place, e.g. point the sbridge_mac to the new route. If not given (and
+	 * `add_remote_virt` is), the remote virt is removed and added again. */
+	void (*move_remote_virt) (struct lsdn_remote_virt *virt, struct lsdn_remote_pa *from);
+
+	/** Update a remote machine whose IP has changed.
+	 * Called instead of `remove_remote_pa` and `add_remote_pa` (and all the remote virts)
+	 * when only the IP of the remote phys has changed and stays of the same version. Update
+	 * what `add_remote_pa` has created in place. If not given, the remote machine is removed
+	 * and added again. */
+	void (*update_remote_pa) (struct lsdn_remote_pa *pa);
+
 	/** Validate a machine.
 	 * Called when adding local or remote machine.
 	 * You can validate attributes relevant to the network implementation
@@ -105,4 +126,10 @@ struct lsdn_net_ops {
 	 * You can validate attributes relevant to the network implementation
 	 * and use `lsdn_problem_report` to indicate problems. */
 	void (*validate_virt) (struct lsdn_virt *virt);
+
+	/** Check the state created by `add_remote_pa`.
+	 * Called by `lsdn_audit` for committed remote machines. The rulesets and bridges are
+	 * checked by the audit itself, check (and repair) only what is not kept in them, using
+	 * the helpers in `audit.h`. */
+	void (*audit_remote_pa) (struct lsdn_remote_pa *pa, struct lsdn_audit *audit);
 };
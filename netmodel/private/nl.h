@@ -2,6 +2,10 @@
 
 #include "../include/errors.h"
 #include "../include/nettypes.h"
+#include "../include/lsdn.h"
+#include "iftable.h"
+#include "adopt.h"
+#include "bpf.h"
 
 #include <string.h>
 #include <stdlib.h>
@@ -37,6 +41,8 @@
 struct lsdn_if{
 	unsigned int ifindex;
 	char* ifname;
+	/** The interface has disappeared from the kernel, along with everything attached to it. */
+	bool removed;
 };
 
 /**
@@ -65,70 +71,310 @@ static inline bool lsdn_if_is_set(const struct lsdn_if *lsdn_if)
 {
 	return lsdn_if->ifname != NULL;
 }
+struct lsdn_nlsock;
 /**
  * Make sure the ifindex is valid, if possible.
  *
- * If sucesfull, fills in the ifindex and moves the lsdn_if into *resolved* state.
+ * The interface is looked up in the kernel (or simulator) the socket talks to. If sucesfull, fills
+ * in the ifindex and moves the lsdn_if into *resolved* state.
  */
-lsdn_err_t lsdn_if_resolve(struct lsdn_if *lsdn_if);
+lsdn_err_t lsdn_if_resolve(struct lsdn_nlsock *sock, struct lsdn_if *lsdn_if);
 
-struct mnl_socket *lsdn_socket_init();
+/**
+ * Callback for reporting errors of queued (asynchronous) netlink requests.
+ *
+ * Called during lsdn_nl_flush for each queued message the kernel has rejected. The callback must
+ * not issue any further netlink requests.
+ * @param nlh The rejected message, as it was sent.
+ * @param err Negative errno value reported by the kernel.
+ * @param user User pointer given when the message was queued.
+ */
+typedef void (*lsdn_nl_err_cb)(const struct nlmsghdr *nlh, int err, void *user);
+
+/* Size of the buffer for queued messages. Must be able to hold the largest message we send. */
+#define LSDN_NL_BATCH_SIZE (64 * 1024)
+/* Maximum number of messages sent at once. Limits the number of ACKs waiting in the socket. */
+#define LSDN_NL_BATCH_MSGS 1024
+/* Size of the buffer for receiving ACKs */
+#define LSDN_NL_RECV_SIZE (32 * 1024)
+
+struct lsdn_nl_pending {
+	/** Offset of the message in the batch buffer. */
+	size_t offset;
+	lsdn_nl_err_cb cb;
+	void *user;
+	/** Where to store the ifindex from the echo of a link creation, or NULL. */
+	unsigned int *echo_ifindex;
+	bool acked;
+	int err;
+};
 
-void lsdn_socket_free(struct mnl_socket *s);
+struct lsdn_filter {
+	/** setting this flag will replace the existing filter (if any) */
+	bool update;
+	struct lsdn_nlsock *sock;
+	struct nlmsghdr *nlh;
+	struct nlattr *nested_opts;
+	struct nlattr *nested_acts;
+};
+
+/**
+ * The other end of a netlink socket -- either the running kernel, or a simulation of it.
+ *
+ * The socket itself takes care of building and batching the requests, the backend only delivers
+ * the batches and reports the results.
+ */
+struct lsdn_nl_backend {
+	/**
+	 * Process all requests in the batch buffer, in order.
+	 *
+	 * Must set `acked` and `err` of all pending requests, and `echo_ifindex` (if given) of the
+	 * successful link creations asking for NLM_F_ECHO.
+	 * @return LSDNE_NETLINK if the communication has failed.
+	 */
+	lsdn_err_t (*transact)(struct lsdn_nlsock *sock);
+	/**
+	 * Run a dump request (RTM_GETLINK, RTM_GETQDISC, RTM_GETTFILTER or RTM_GETNEIGH for the
+	 * bridge fdb) and pass each message of the listing to the callback. The batch buffer is
+	 * empty at that point.
+	 * @return LSDNE_NETLINK if the dump has failed or the callback returned MNL_CB_ERROR.
+	 */
+	lsdn_err_t (*dump)(struct lsdn_nlsock *sock, const struct nlmsghdr *nlh, mnl_cb_t cb, void *data);
+	/**
+	 * Fill the socket's interface table with all interfaces and start watching for changes.
+	 *
+	 * Also used to refill the table when the changes could not be followed, see
+	 * lsdn_iftable_resync_start.
+	 */
+	lsdn_err_t (*if_dump)(struct lsdn_nlsock *sock);
+	/** Apply the interface changes since the last dump or poll to the interface table. */
+	lsdn_err_t (*if_poll)(struct lsdn_nlsock *sock);
+	/** Release the backend's resources (not the socket itself). */
+	void (*free)(struct lsdn_nlsock *sock);
+	/** Open another socket talking to the same kernel, see lsdn_socket_init_peer. */
+	struct lsdn_nlsock *(*peer)(struct lsdn_nlsock *sock);
+	/**
+	 * Run a bpf(2) command, see lsdn_bpf_map_create and friends.
+	 * @return The result of the command, or -1 with errno set.
+	 */
+	long (*bpf)(struct lsdn_nlsock *sock, int cmd, union bpf_attr *attr, unsigned int size);
+	/** Close a file descriptor returned by `bpf`. */
+	void (*bpf_close)(struct lsdn_nlsock *sock, int fd);
+};
+
+/**
+ * A netlink socket with support for batching.
+ *
+ * Requests are queued into a large buffer, each with its own sequence number, and sent to the
+ * kernel at once. The ACKs are then collected and matched back to the queued requests by their
+ * sequence numbers, so that the errors can be reported to whoever made the request.
+ *
+ * Synchronous requests are also put into the queue and then the queue is flushed, so the relative
+ * ordering of all requests is always kept.
+ */
+struct lsdn_nlsock {
+	const struct lsdn_nl_backend *backend;
+	/** Backend-specific data. */
+	void *backend_data;
+	/** Counters of all traffic sent through the socket. */
+	struct lsdn_nl_stats stats;
+
+	/** Interfaces in the kernel, see lsdn_nl_if_sync. */
+	struct lsdn_iftable ifs;
+
+	struct mnl_socket *sock;
+	/** Socket subscribed to the link notifications, opened by the first dump. */
+	struct mnl_socket *monitor;
+	unsigned int portid;
+	/** Sequence number of the next queued message. */
+	uint32_t seq;
+	/** Sequence number of the first message in the batch buffer. */
+	uint32_t batch_seq;
+	/** Sequence number of the last dump, kept apart from the queued requests. */
+	uint32_t dump_seq;
+
+	char *buf;
+	size_t buf_len;
+	char *recv_buf;
+	struct lsdn_nl_pending pending[LSDN_NL_BATCH_MSGS];
+	size_t pending_count;
+
+	/** Builder for the filter currently being constructed in the batch buffer. */
+	struct lsdn_filter filter;
+	bool filter_busy;
+
+	/** Kernel state being adopted by a warm restart, see adopt.c. While set, the requests
+	 * creating links, qdiscs and filters are first matched against it. */
+	struct lsdn_adopt *adopt;
+};
+
+/** Create a socket talking to the running kernel. */
+struct lsdn_nlsock *lsdn_socket_init();
+/** Create a socket talking to an in-process kernel simulator (see nlsim.c). */
+struct lsdn_nlsock *lsdn_socket_init_sim();
+/** Create a socket talking to the same simulator as `peer`. */
+struct lsdn_nlsock *lsdn_socket_init_sim_peer(struct lsdn_nlsock *peer);
+/** Create another socket talking to the same kernel (or simulator) as `sock`. */
+struct lsdn_nlsock *lsdn_socket_init_peer(struct lsdn_nlsock *sock);
+/** Create a link with the given name in the simulator (not the kernel) behind the socket. */
+lsdn_err_t lsdn_nlsim_add_link(struct lsdn_nlsock *sock, const char *ifname);
+/** Delete a link from the simulator behind the socket. */
+lsdn_err_t lsdn_nlsim_del_link(struct lsdn_nlsock *sock, const char *ifname);
+/* Delete the ingress and root qdiscs of an interface in the simulated kernel */
+lsdn_err_t lsdn_nlsim_del_qdiscs(struct lsdn_nlsock *sock, const char *ifname);
+/** Count the objects in the simulator behind the socket. */
+void lsdn_nlsim_get_state(struct lsdn_nlsock *sock, struct lsdn_sim_state *state);
+/** List the ingress filters of an interface in the simulator behind the socket. */
+size_t lsdn_nlsim_get_filters(struct lsdn_nlsock *sock, const char *ifname,
+	struct lsdn_sim_filter *filters, size_t max);
+/**
+ * Allocate a socket and its buffers, for use by the backends.
+ * The backend's own initialization is left to the caller.
+ */
+struct lsdn_nlsock *lsdn_socket_alloc(const struct lsdn_nl_backend *backend);
+
+void lsdn_socket_free(struct lsdn_nlsock *s);
+
+/**
+ * Send all queued requests and wait for their ACKs.
+ *
+ * Errors of the individual requests are reported through their callbacks.
+ * @return LSDNE_NETLINK if the communication with kernel has failed, LSDNE_OK otherwise.
+ */
+lsdn_err_t lsdn_nl_flush(struct lsdn_nlsock *sock);
+
+/**
+ * List objects in the kernel, passing each message of the listing to the callback.
+ *
+ * The queued requests are flushed first.
+ * @param nlh Dump request, the flags and sequence number are filled in.
+ * @return LSDNE_NETLINK if the dump has failed or the callback returned MNL_CB_ERROR.
+ */
+lsdn_err_t lsdn_nl_dump(struct lsdn_nlsock *sock, struct nlmsghdr *nlh, mnl_cb_t cb, void *data);
+
+/** Add the counters of `src` to `dst`. */
+void lsdn_nl_stats_add(struct lsdn_nl_stats *dst, const struct lsdn_nl_stats *src);
+
+/**
+ * Redirection of a socket for a single thread, see lsdn_nl_worker_bind.
+ *
+ * Lets a worker thread run code written for a single socket while sending its requests through
+ * a socket of its own.
+ */
+struct lsdn_nl_worker {
+	/** Socket the code keeps passing around. */
+	struct lsdn_nlsock *parent;
+	/** Socket the requests are really queued in and sent through, see lsdn_socket_init_peer. */
+	struct lsdn_nlsock *lane;
+	/** Called around the wait for a batch sent by lsdn_nl_flush or a synchronous request. The
+	 * thread touches nothing but the lane in between. Flushes of a full buffer do not call
+	 * them. */
+	void (*io_begin)(void *user);
+	void (*io_end)(void *user);
+	void *user;
+};
+
+/**
+ * Make the calling thread use `worker->lane` whenever `worker->parent` is passed to the socket
+ * functions. NULL ends the redirection. The interface table and the adopted state are still
+ * those of the parent.
+ */
+void lsdn_nl_worker_bind(struct lsdn_nl_worker *worker);
+
+/**
+ * Bring the socket's interface table up to date.
+ *
+ * The first call lists all interfaces, the later ones only apply the changes the kernel has
+ * notified about since.
+ */
+lsdn_err_t lsdn_nl_if_sync(struct lsdn_nlsock *sock);
+
+/* Size of the buffer for lsdn_nl_describe, enough for any request */
+#define LSDN_NL_DESC_LEN 96
+
+/**
+ * Describe a request for an error message, by its type and the object it is addressed to.
+ */
+void lsdn_nl_describe(const struct nlmsghdr *nlh, char *buf, size_t size);
+
+/*
+ * The link builders create the link in a single request. The `master` (an ifindex, or 0 for none)
+ * and `up` arguments are applied as a part of the creation, instead of separate requests
+ * afterwards.
+ */
 
 lsdn_err_t lsdn_link_dummy_create(
-		struct mnl_socket *sock,
+		struct lsdn_nlsock *sock,
 		struct lsdn_if *dst_if,
-		const char *if_name);
+		const char *if_name,
+		unsigned int master, bool up);
 
 lsdn_err_t lsdn_link_vlan_create(
-		struct mnl_socket *sock,
+		struct lsdn_nlsock *sock,
 		struct lsdn_if *dst_if, const char *if_name,
-		const char *vlan_name, uint16_t vlanid);
+		const char *vlan_name, uint16_t vlanid,
+		unsigned int master, bool up);
 
-lsdn_err_t lsdn_link_vxlan_create(struct mnl_socket *sock, struct lsdn_if* dst_if,
+lsdn_err_t lsdn_link_vxlan_create(struct lsdn_nlsock *sock, struct lsdn_if* dst_if,
 		const char *if_name, const char *vxlan_name,
 		lsdn_ip_t *mcast_group, uint32_t vxlanid, uint16_t port,
-		bool learning, bool collect_metadata, enum lsdn_ipv ipv);
+		bool learning, bool collect_metadata, enum lsdn_ipv ipv,
+		unsigned int master, bool up);
 
-lsdn_err_t lsdn_link_veth_create(struct mnl_socket *sock,
+lsdn_err_t lsdn_link_veth_create(struct lsdn_nlsock *sock,
 		struct lsdn_if *if1, const char *if_name1,
 		struct lsdn_if *if2, const char *if_name2);
 
 lsdn_err_t lsdn_link_bridge_create(
-		struct mnl_socket *sock,
+		struct lsdn_nlsock *sock,
 		struct lsdn_if *dst_id,
-		const char *if_name);
+		const char *if_name,
+		unsigned int master, bool up);
 
-lsdn_err_t lsdn_link_delete(struct mnl_socket *sock, struct lsdn_if *iface);
+lsdn_err_t lsdn_link_delete(struct lsdn_nlsock *sock, struct lsdn_if *iface);
+void lsdn_link_delete_async(struct lsdn_nlsock *sock, unsigned int ifindex,
+		lsdn_nl_err_cb cb, void *user);
 
-lsdn_err_t lsdn_link_set_master(struct mnl_socket *sock,
-		unsigned int master, unsigned int slave);
+/* Set the master of the slave (0 to release it) and, if `up` is set, bring the slave up in the same
+ * request */
+lsdn_err_t lsdn_link_set_master(struct lsdn_nlsock *sock,
+		unsigned int master, unsigned int slave, bool up);
+void lsdn_link_set_master_async(struct lsdn_nlsock *sock,
+		unsigned int master, unsigned int slave, bool up, lsdn_nl_err_cb cb, void *user);
 
-lsdn_err_t lsdn_link_set_ip(struct mnl_socket *sock,
+lsdn_err_t lsdn_link_set_ip(struct lsdn_nlsock *sock,
 		const char *iface, lsdn_ip_t ip);
 
-lsdn_err_t lsdn_link_set(struct mnl_socket *sock, unsigned int ifindex, bool up);
-
-lsdn_err_t lsdn_qdisc_ingress_create(struct mnl_socket *sock, unsigned int ifindex);
-lsdn_err_t lsdn_qdisc_egress_create(struct mnl_socket *sock, unsigned int ifindex);
-
-lsdn_err_t lsdn_fdb_add_entry(struct mnl_socket *sock, unsigned int ifindex,
+lsdn_err_t lsdn_link_set(struct lsdn_nlsock *sock, unsigned int ifindex, bool up);
+void lsdn_link_set_async(struct lsdn_nlsock *sock, unsigned int ifindex, bool up,
+		lsdn_nl_err_cb cb, void *user);
+
+lsdn_err_t lsdn_qdisc_ingress_create(struct lsdn_nlsock *sock, unsigned int ifindex);
+lsdn_err_t lsdn_qdisc_egress_create(struct lsdn_nlsock *sock, unsigned int ifindex);
+void lsdn_qdisc_ingress_create_async(struct lsdn_nlsock *sock, unsigned int ifindex,
+		lsdn_nl_err_cb cb, void *user);
+void lsdn_qdisc_egress_create_async(struct lsdn_nlsock *sock, unsigned int ifindex,
+		lsdn_nl_err_cb cb, void *user);
+void lsdn_qdisc_clsact_create_async(struct lsdn_nlsock *sock, unsigned int ifindex,
+		uint32_t block_in, uint32_t block_out, lsdn_nl_err_cb cb, void *user);
+void lsdn_qdisc_clsact_delete_async(struct lsdn_nlsock *sock, unsigned int ifindex,
+		lsdn_nl_err_cb cb, void *user);
+
+lsdn_err_t lsdn_fdb_add_entry(struct lsdn_nlsock *sock, unsigned int ifindex,
 		lsdn_mac_t mac, lsdn_ip_t ip);
+void lsdn_fdb_add_entry_async(struct lsdn_nlsock *sock, unsigned int ifindex,
+		lsdn_mac_t mac, lsdn_ip_t ip, lsdn_nl_err_cb cb, void *user);
 
-lsdn_err_t lsdn_fdb_remove_entry(struct mnl_socket *sock, unsigned int ifindex,
+lsdn_err_t lsdn_fdb_remove_entry(struct lsdn_nlsock *sock, unsigned int ifindex,
 		lsdn_mac_t mac, lsdn_ip_t ip);
-
-struct lsdn_filter {
-	/** setting this flag will replace the existing filter (if any) */
-	bool update;
-	struct nlmsghdr *nlh;
-	struct nlattr *nested_opts;
-	struct nlattr *nested_acts;
-};
+void lsdn_fdb_remove_entry_async(struct lsdn_nlsock *sock, unsigned int ifindex,
+		lsdn_mac_t mac, lsdn_ip_t ip, lsdn_nl_err_cb cb, void *user);
 
 struct lsdn_filter *lsdn_filter_flower_init(
-		uint32_t if_index, uint32_t handle, uint32_t parent, uint32_t chain, uint16_t prio);
+		struct lsdn_nlsock *sock, uint32_t if_index, uint32_t handle, uint32_t parent, uint32_t chain, uint16_t prio);
+struct lsdn_filter *lsdn_filter_bpf_init(
+		struct lsdn_nlsock *sock, uint32_t if_index, uint32_t handle, uint32_t parent, uint32_t chain, uint16_t prio,
+		int prog_fd, const char *name);
 
 void lsdn_filter_set_update(struct lsdn_filter *f);
 
@@ -153,6 +399,8 @@ void lsdn_action_mirror_egress_add(
 void lsdn_action_set_tunnel_key(
 		struct lsdn_filter *f, uint16_t order,
 		uint32_t vni, lsdn_ip_t *src_ip, lsdn_ip_t *dst_ip);
+/* Use the standalone tunnel_key action with the given index, see lsdn_tunnel_key_create_async */
+void lsdn_action_tunnel_key_ref(struct lsdn_filter *f, uint16_t order, uint32_t index);
 
 void lsdn_action_drop(struct lsdn_filter *f, uint16_t order);
 
@@ -180,9 +428,33 @@ void lsdn_flower_set_dst_ipv6(struct lsdn_filter *f, const char *addr,
 
 void lsdn_flower_set_enc_key_id(struct lsdn_filter *f, uint32_t vni);
 
+void lsdn_flower_set_arp_tip(struct lsdn_filter *f, const char *addr,
+		const char *addr_mask);
+
 void lsdn_flower_set_eth_type(struct lsdn_filter *f, uint16_t eth_type);
 
-lsdn_err_t lsdn_filter_create(struct mnl_socket *sock, struct lsdn_filter *f);
+lsdn_err_t lsdn_filter_create(struct lsdn_nlsock *sock, struct lsdn_filter *f);
+/* The filter may be freed right after the call, it is copied to the queue */
+void lsdn_filter_create_async(struct lsdn_nlsock *sock, struct lsdn_filter *f,
+		lsdn_nl_err_cb cb, void *user);
+/* Compare the filter with a kernel snapshot instead of sending it */
+enum lsdn_adopt_match lsdn_filter_match(struct lsdn_filter *f, struct lsdn_adopt *a);
 
-lsdn_err_t lsdn_filter_delete(struct mnl_socket *sock, uint32_t ifindex, uint32_t handle,
+lsdn_err_t lsdn_filter_delete(struct lsdn_nlsock *sock, uint32_t ifindex, uint32_t handle,
 		uint32_t parent, uint32_t chain, uint16_t prio);
+void lsdn_filter_delete_async(struct lsdn_nlsock *sock, uint32_t ifindex, uint32_t handle,
+		uint32_t parent, uint32_t chain, uint16_t prio, lsdn_nl_err_cb cb, void *user);
+
+/* Create a standalone tunnel_key action, which filters can share by its index. The index space is
+ * shared by everyone in the netns, so without `replace` the request fails with EEXIST if the
+ * action exists already. Only replace the actions known to be our own. The `owner` (the context
+ * name) is kept in the action cookie, so that a warm restart recognizes the action. */
+void lsdn_tunnel_key_create_async(struct lsdn_nlsock *sock, uint32_t index, const char *owner,
+		uint32_t vni, lsdn_ip_t *src_ip, lsdn_ip_t *dst_ip, bool replace,
+		lsdn_nl_err_cb cb, void *user);
+/* The index of the action created or deleted by a request of lsdn_tunnel_key_create_async or
+ * lsdn_tunnel_key_delete_async */
+uint32_t lsdn_tunnel_key_index(const struct nlmsghdr *nlh);
+/* Delete a standalone tunnel_key action, no filter may use it anymore */
+void lsdn_tunnel_key_delete_async(struct lsdn_nlsock *sock, uint32_t index,
+		lsdn_nl_err_cb cb, void *user);
@@ -0,0 +1,17 @@
+#pragma once
+
+#include <stddef.h>
+
+struct lsdn_nlsock;
+
+/** Process a single unit of work, see `lsdn_pool_run`. */
+typedef void (*lsdn_pool_work_cb)(size_t unit, void *user);
+
+/** Run `units` units of work on up to `threads` threads, each with its own netlink socket.
+ * The units run as if they were called one after another with `sock`, but while a thread waits
+ * for the kernel, the others go on with their units. The model is only touched by one thread at
+ * a time and the threads take turns in a fixed order, so the results (interface names, order of
+ * the problems etc.) do not depend on the timing. If the threads or the sockets can not be
+ * created, the units run on the calling thread. */
+void lsdn_pool_run(struct lsdn_nlsock *sock, size_t threads, size_t units,
+	lsdn_pool_work_cb work, void *user);
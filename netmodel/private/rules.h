@@ -10,6 +10,8 @@
 #include "list.h"
 #include "state.h"
 
+struct lsdn_audit;
+
 typedef void (*lsdn_mkaction_fn)(struct lsdn_filter *filter, uint16_t order, void *user);
 /* Describes a sequence of TC actions constructed by a callback when needed */
 struct lsdn_action_desc {
@@ -73,9 +75,13 @@ struct lsdn_ruleset {
 	struct lsdn_if *iface;
 	struct lsdn_context *ctx;
 	uint32_t parent_handle;
+	/* Index of the shared block holding the filters instead of iface, or 0 */
+	uint32_t block;
 	uint32_t chain;
 	int prio_start;
 	int prio_count;
+	/* Membership in lsdn_context.rulesets_list */
+	struct lsdn_list_entry rulesets_entry;
 
 	struct lsdn_ruleset_prio *hash_prios;
 };
@@ -94,14 +100,25 @@ struct lsdn_ruleset_prio {
 struct lsdn_flower_rule {
 	union lsdn_matchdata matches[LSDN_MAX_MATCHES];
 	uint32_t fl_handle;
+	struct lsdn_ruleset_prio *prio;
 	/* List of rules that are combined into these flower rules */
 	struct lsdn_list_entry sources_list;
 	UT_hash_handle hh;
+	/* Does the filter exist in the kernel? */
+	bool committed;
+	/* Membership in lsdn_context.dirty_fl_rules, the filter needs to be sent to the kernel */
+	struct lsdn_list_entry dirty_entry;
 };
 
 void lsdn_ruleset_init(
 	struct lsdn_ruleset *ruleset, struct lsdn_context *ctx,
 	struct lsdn_if *iface, uint32_t parent_handle, uint32_t chain, uint32_t prio_start, uint32_t prio_count);
+void lsdn_ruleset_init_block(
+	struct lsdn_ruleset *ruleset, struct lsdn_context *ctx,
+	uint32_t block, uint32_t chain, uint32_t prio_start, uint32_t prio_count);
+void lsdn_ruleset_init_chain(
+	struct lsdn_ruleset *ruleset, struct lsdn_ruleset *other,
+	uint32_t chain, uint32_t prio_start, uint32_t prio_count);
 
 struct lsdn_ruleset_prio* lsdn_ruleset_define_prio(struct lsdn_ruleset *rs, uint16_t prio);
 struct lsdn_ruleset_prio* lsdn_ruleset_get_prio(struct lsdn_ruleset *rs, uint16_t main);
@@ -114,7 +131,18 @@ lsdn_err_t lsdn_ruleset_add(struct lsdn_ruleset_prio *prio, struct lsdn_rule *ru
 void lsdn_rule_apply_mask(
 	struct lsdn_rule *r, enum lsdn_rule_target targets[], union lsdn_matchdata masks[]);
 void lsdn_ruleset_remove(struct lsdn_rule *rule);
+/* Send the rule again after its action has changed (the match must stay the same). The flower
+ * filter is replaced in place at the next flush, so the traffic is not interrupted. */
+void lsdn_ruleset_update(struct lsdn_rule *rule);
 void lsdn_ruleset_free(struct lsdn_ruleset *ruleset);
+/* Send the changes of all rulesets in the context to the kernel.
+ *
+ * Adding and removing rules only marks the flower filters they belong to, so that a filter
+ * combining many rules is sent only once. */
+void lsdn_ruleset_flush(struct lsdn_context *ctx);
+/* Compare the committed filters of all rulesets in the context with the kernel, see lsdn_audit.
+ * When repairing, the differing filters are marked to be sent again by lsdn_ruleset_flush. */
+void lsdn_ruleset_audit(struct lsdn_context *ctx, struct lsdn_audit *audit);
 
 #define LSDN_MAX_ACT_PRIO 32
 
@@ -128,11 +156,17 @@ void lsdn_ruleset_free(struct lsdn_ruleset *ruleset);
  */
 struct lsdn_broadcast {
 	struct lsdn_context *ctx;
-	struct lsdn_if *iface;
-	/* First priority usable for our filter chain */
+	/* The chain is created next to the ruleset, on the same interface or block */
+	struct lsdn_ruleset *ruleset;
 	uint32_t chain;
-	uint16_t free_prio;
+	/* Priorities of the filters, the lowest free one is reused for a new filter */
+	struct lsdn_idalloc prios;
+	/* All filters, ordered by prio */
 	struct lsdn_list_entry filters_list;
+	/* Filters with some free actions */
+	struct lsdn_list_entry free_list;
+	/* Membership in lsdn_context.broadcasts_list */
+	struct lsdn_list_entry broadcasts_entry;
 };
 
 struct lsdn_broadcast_action {
@@ -143,23 +177,76 @@ struct lsdn_broadcast_action {
 
 struct lsdn_broadcast_filter {
 	struct lsdn_broadcast *broadcast;
+	/* Ordered by prio */
 	struct lsdn_list_entry filters_entry;
+	/* Membership in lsdn_context.dirty_br_filters, the filter needs to be sent to the kernel */
+	struct lsdn_list_entry dirty_entry;
+	/* Membership in lsdn_broadcast.free_list, valid if free_actions > 0 */
+	struct lsdn_list_entry free_entry;
 	int prio;
 	size_t free_actions;
+	/* Bitmap of the used entries in actions */
+	uint32_t used_slots;
+	/* Does the filter exist in the kernel? */
+	bool committed;
 	/* The last action is reserved for the potential continue action,
 	 * that is why we keep track of at most LSDN_MAX_PRIO - 1 actions.
 	 */
 	struct lsdn_broadcast_action *actions[LSDN_MAX_ACT_PRIO - 1];
 };
 
-void lsdn_broadcast_init(struct lsdn_broadcast *br, struct lsdn_context *ctx, struct lsdn_if *iface, int chain);
+void lsdn_broadcast_init(struct lsdn_broadcast *br, struct lsdn_context *ctx, struct lsdn_ruleset *ruleset, int chain);
 void lsdn_broadcast_add(struct lsdn_broadcast *br, struct lsdn_broadcast_action *action, struct lsdn_action_desc desc);
 void lsdn_broadcast_remove(struct lsdn_broadcast_action *action);
 void lsdn_broadcast_free(struct lsdn_broadcast *br);
+/* Send the changed broadcast filters of all broadcasts in the context to the kernel */
+void lsdn_broadcast_flush(struct lsdn_context *ctx);
+/* Like lsdn_ruleset_audit, for the broadcast filters. */
+void lsdn_broadcast_audit(struct lsdn_context *ctx, struct lsdn_audit *audit);
+
+/* A cls_bpf filter running an eBPF program, alone at the first priority of the ruleset's
+ * chain. Sent by lsdn_bpf_filter_flush, before the flower filters that may jump to it. */
+struct lsdn_bpf_filter {
+	struct lsdn_ruleset *ruleset;
+	/* Kept open by the owner, the filter is sent again when repaired by lsdn_audit */
+	int prog_fd;
+	/* Used to name the filter, so that a filter running another program differs */
+	uint32_t prog_id;
+	/* Does the filter exist in the kernel? */
+	bool committed;
+	/* Membership in lsdn_context.dirty_bpf_filters */
+	struct lsdn_list_entry dirty_entry;
+	/* Membership in lsdn_context.bpf_filters_list */
+	struct lsdn_list_entry bpf_filters_entry;
+};
+
+void lsdn_bpf_filter_init(
+	struct lsdn_bpf_filter *f, struct lsdn_ruleset *ruleset, int prog_fd, uint32_t prog_id);
+/* Run another program, the filter is replaced in place at the next flush */
+void lsdn_bpf_filter_set_prog(struct lsdn_bpf_filter *f, int prog_fd, uint32_t prog_id);
+void lsdn_bpf_filter_free(struct lsdn_bpf_filter *f);
+void lsdn_bpf_filter_flush(struct lsdn_context *ctx);
+/* Like lsdn_ruleset_audit, for the cls_bpf filters. */
+void lsdn_bpf_filter_audit(struct lsdn_context *ctx, struct lsdn_audit *audit);
+
+/* Standalone tunnel_key actions, referenced by index from all the filters sending packets to
+ * the same place (see lsdn_action_tunnel_key_ref). Created right away, so that they exist before
+ * the filters are flushed. An index already taken by someone else is reported as a problem of
+ * the commit and never used again. */
+uint32_t lsdn_tunnel_key_new(
+	struct lsdn_context *ctx, uint32_t vni, lsdn_ip_t *src_ip, lsdn_ip_t *dst_ip);
+/* Change the tunnel metadata, the filters using the action are not touched */
+void lsdn_tunnel_key_update(
+	struct lsdn_context *ctx, uint32_t index, uint32_t vni, lsdn_ip_t *src_ip, lsdn_ip_t *dst_ip);
+/* The action is deleted by lsdn_tunnel_key_flush, after the filters using it */
+void lsdn_tunnel_key_release(struct lsdn_context *ctx, uint32_t index);
+void lsdn_tunnel_key_flush(struct lsdn_context *ctx);
+void lsdn_tunnel_keys_free(struct lsdn_context *ctx);
 
 #define LSDN_VR_SUBPRIO 0
 struct lsdn_vr {
 	struct lsdn_list_entry rules_entry;
+	struct lsdn_virt *virt;
 	uint8_t pos;
 	enum lsdn_state state;
 	enum lsdn_rule_target targets[LSDN_MAX_MATCHES];
@@ -172,9 +259,19 @@ struct lsdn_vr {
 struct vr_prio {
 	UT_hash_handle hh;
 	uint16_t prio_num;
+	struct lsdn_list_entry rules_list;
+	/* The priority whose filter priority the rules go to, set by lsdn_vr_compile. Either this
+	 * one, or an earlier one with the same targets and masks. */
+	struct vr_prio *merged_to;
+	/* Rules of all the priorities merged to this one, only used by lsdn_vr_compile */
+	struct lsdn_vr *merged_rules;
+	/* The rules of this priority in the kernel and the priority they were merged to */
 	size_t commited_count;
+	struct vr_prio *commited_to;
+	/* Only if the others are merged to this priority: its filter priority and the number of
+	 * the rules in it, including the merged ones */
 	struct lsdn_ruleset_prio *commited_prio;
-	struct lsdn_list_entry rules_list;
+	size_t group_count;
 };
 
 struct lsdn_vr_action {
@@ -182,3 +279,7 @@ struct lsdn_vr_action {
 };
 
 void lsdn_vr_do_free_all_rules(struct lsdn_virt *virt);
+void lsdn_vr_do_free(struct lsdn_vr *vr);
+/* Decide which priorities of the rules share a filter priority (see vr_prio.merged_to) and return
+ * the number of filter priorities, i.e. the flower lookups of a packet going through all of them. */
+size_t lsdn_vr_compile(struct vr_prio *ht_prio);
@@ -13,14 +13,66 @@ struct lsdn_sbridge;
 struct lsdn_sbridge_if;
 struct lsdn_sbridge_if_route;
 
+/* The forwarding rules of a bridge, by destination MAC. Either on the ingress of the bridge's
+ * dummy interface, or (with use_chains) in a chain of the interfaces' ruleset. */
+struct lsdn_sbridge_table {
+	struct lsdn_list_entry table_entry;
+	struct lsdn_ruleset ruleset;
+	struct lsdn_ruleset_prio *rules_mac;
+	/* ARP requests by the target IP, see suppress_neigh */
+	struct lsdn_ruleset_prio *rules_arp;
+	/* Only with use_chains: drops the packets for unknown MACs */
+	struct lsdn_ruleset_prio *rules_drop;
+	struct lsdn_rule rule_drop;
+	/* The forwarding rules in the table */
+	struct lsdn_clist cl_owner;
+
+	/* Only with use_bpf: runs the program of the bridge, instead of the rules above */
+	struct lsdn_bpf_filter bpf_filter;
+
+	/* Only with use_chains: the ruleset the interfaces jump from and the chain */
+	struct lsdn_ruleset *parent;
+	struct lsdn_idalloc *chain_ids;
+	uint32_t chain;
+	size_t users;
+};
+
+/* The forwarding state of a bridge switching by an eBPF program */
+struct lsdn_sbridge_bpf {
+	/* Destination MAC -> route ID */
+	int fdb_fd;
+	/* Route ID -> the interface and tunnel metadata. Also the list the broadcasts are sent to. */
+	int routes_fd;
+	int prog_fd;
+	uint32_t prog_id;
+	/* The program sends the broadcasts to the route IDs below, it is reloaded with a longer
+	 * list once a higher ID is given out */
+	uint32_t flood_slots;
+	struct lsdn_idalloc route_ids;
+};
+
 /* A single static bridge */
 struct lsdn_sbridge {
 	struct lsdn_list_entry if_list;
 	struct lsdn_context *ctx;
 
+	/* Jump to a chain with the forwarding table directly from the ingress of the
+	 * interfaces, instead of redirecting the packets to the dummy bridge interface. This saves
+	 * a pass through the network stack for every packet, but the table is installed once for
+	 * every ruleset of the interfaces (once for every interface, unless shared blocks are used). */
+	bool use_chains;
+	/* Look the MACs up in eBPF maps, by a cls_bpf filter in the chain of every table. Implies
+	 * use_chains. Adding a MAC or a route only writes a map element, no filters are changed. */
+	bool use_bpf;
+	struct lsdn_sbridge_bpf bpf;
+	/* Only without use_chains */
 	struct lsdn_if bridge_if;
-	struct lsdn_ruleset bridge_ruleset_main;
-	struct lsdn_ruleset_prio *bridge_ruleset;
+	struct lsdn_sbridge_table bridge_table;
+	/* All the forwarding tables */
+	struct lsdn_list_entry table_list;
+	/* Send the ARP requests and neighbor solicitations only to the owner of the address,
+	 * instead of broadcasting them. Set before adding the interfaces. */
+	bool suppress_neigh;
 };
 
 typedef void (*lsdn_mkmatch_cb)(struct lsdn_filter *f, void *user);
@@ -41,22 +93,34 @@ struct lsdn_sbridge_if {
 	/* Private part starts here */
 	struct lsdn_broadcast broadcast;
 	struct lsdn_sbridge *bridge;
+	/* The forwarding table the unicast packets are looked up in */
+	struct lsdn_sbridge_table *table;
 	struct lsdn_list_entry if_entry;
 	struct lsdn_list_entry route_list;
 	struct lsdn_clist cl_owner;
 
 	struct lsdn_rule rule_match_br;
 	struct lsdn_rule rule_fallback;
+	/* Only used if the bridge suppresses the neighbor discovery */
+	struct lsdn_rule rule_suppress_arp;
+	struct lsdn_rule rule_suppress_nd;
 };
 
+#define LSDN_SBRIDGE_IF_PRIO_SUPPRESS_ARP 0xFEFE
+#define LSDN_SBRIDGE_IF_PRIO_SUPPRESS_ND (LSDN_SBRIDGE_IF_PRIO_SUPPRESS_ARP + 1)
 #define LSDN_SBRIDGE_IF_PRIO_MATCH 0xFF00
 #define LSDN_SBRIDGE_IF_PRIO_FALLBACK (LSDN_SBRIDGE_IF_PRIO_MATCH + 1)
 #define LSDN_SBRIDGE_IF_SUBPRIO 0xFFFFFF00
 struct lsdn_sbridge_phys_if {
 	struct lsdn_if *iface;
 	struct lsdn_idalloc br_chain_ids;
+	/* Allocator of the broadcast chains, br_chain_ids unless initialized by
+	 * lsdn_sbridge_phys_if_init_shared */
+	struct lsdn_idalloc *chain_ids;
 	struct lsdn_ruleset_prio *rules_match_mac;
 	struct lsdn_ruleset_prio *rules_fallback;
+	struct lsdn_ruleset_prio *rules_suppress_arp;
+	struct lsdn_ruleset_prio *rules_suppress_nd;
 };
 
 /* Outgoing route from a bridge. because data outgoing from the bridge sometimes need a tunneling metadata,
@@ -65,37 +129,66 @@ struct lsdn_sbridge_phys_if {
 struct lsdn_sbridge_route {
 	/* Callback to add an action setting the tunnel metadata.*/
 	struct lsdn_action_desc tunnel_action;
+	/* The tunnel metadata for use_bpf, which does not use tunnel_action */
+	bool has_tunnel;
+	uint32_t tunnel_vni;
+	lsdn_ip_t tunnel_dst;
 
 	/* Private part starts here */
 	struct lsdn_list_entry route_entry;
 	struct lsdn_sbridge_if *iface;
 	struct lsdn_list_entry mac_list;
 	struct lsdn_clist cl_dest;
+	/* Only with use_bpf: the index in the routes map */
+	uint32_t bpf_id;
 };
 
+struct br_forward_rule;
+
 struct lsdn_sbridge_mac {
 	struct lsdn_sbridge_route *route;
 	struct lsdn_list_entry mac_entry;
 	lsdn_mac_t mac;
 	struct lsdn_clist cl_dest;
+	/* The forwarding rules in all the tables of the bridge, owned by cl_dest. Including the
+	 * rules forwarding the ARP requests or neighbor solicitations for the IP, if the bridge
+	 * suppresses them and the IP is known. */
+	struct lsdn_list_entry forward_list;
+	bool has_ip;
+	lsdn_ip_t ip;
 };
 
 /* Create a bridge using tc rules to route the packets between it's interfaces. Since the bridge
  * is not learning, each interface must have its associated mac addresses. */
-void lsdn_sbridge_init(struct lsdn_context *ctx, struct lsdn_sbridge *br);
+void lsdn_sbridge_init(struct lsdn_context *ctx, struct lsdn_sbridge *br, bool use_chains);
+/* Create a bridge switching by an eBPF program, see use_bpf */
+void lsdn_sbridge_init_bpf(struct lsdn_context *ctx, struct lsdn_sbridge *br);
 void lsdn_sbridge_free(struct lsdn_sbridge *br);
 void lsdn_sbridge_add_if(struct lsdn_sbridge *br, struct lsdn_sbridge_if *iface);
 void lsdn_sbridge_remove_if(struct lsdn_sbridge_if *iface);
 void lsdn_sbridge_add_route(struct lsdn_sbridge_if *iface, struct lsdn_sbridge_route *route);
 void lsdn_sbridge_add_route_default(struct lsdn_sbridge_if *iface, struct lsdn_sbridge_route *route);
 void lsdn_sbridge_remove_route(struct lsdn_sbridge_route *route);
+/* Only with use_bpf: send the changed tunnel metadata of the route. The route keeps its place
+ * in the maps, so the packets are not dropped in the meantime. */
+void lsdn_sbridge_update_route(struct lsdn_sbridge_route *route);
+/* The IP (may be NULL) is only used if the bridge suppresses the neighbor discovery */
 void lsdn_sbridge_add_mac(
-	struct lsdn_sbridge_route* route, struct lsdn_sbridge_mac *mac_entry, lsdn_mac_t mac);
+	struct lsdn_sbridge_route* route, struct lsdn_sbridge_mac *mac_entry, lsdn_mac_t mac,
+	const lsdn_ip_t *ip);
 void lsdn_sbridge_remove_mac(struct lsdn_sbridge_mac *mac);
+/* Forward the MAC address through another route of the same bridge. The forwarding rule is
+ * updated in place, so the packets for the MAC are not dropped in the meantime. */
+void lsdn_sbridge_move_mac(struct lsdn_sbridge_mac *mac, struct lsdn_sbridge_route *route);
 void lsdn_sbridge_phys_if_init(
 	struct lsdn_context *ctx, struct lsdn_sbridge_phys_if *sbridge_if,
-	struct lsdn_if* iface, bool match_vni,
+	struct lsdn_if* iface, enum lsdn_rule_target additional_match,
 	struct lsdn_ruleset *rules_in);
+/* Use the rules and broadcast chains of another phys_if, for interfaces bound to the same tc
+ * block. Only the iface (where the packets are sent) is different. */
+void lsdn_sbridge_phys_if_init_shared(
+	struct lsdn_sbridge_phys_if *sbridge_if, struct lsdn_if* iface,
+	struct lsdn_sbridge_phys_if *shared);
 void lsdn_sbridge_phys_if_free(struct lsdn_sbridge_phys_if *iface);
 
 struct lsdn_virt;
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/** Statistics of a slab allocator. */
+struct lsdn_slab_stats {
+	/** Number of objects currently allocated. */
+	size_t allocated;
+	/** Highest number of objects allocated at the same time. */
+	size_t peak;
+	/** Number of objects the chunks can hold. */
+	size_t capacity;
+	/** Number of chunks. */
+	size_t chunks;
+};
+
+struct lsdn_slab_chunk;
+
+/** Allocator of objects of a single size.
+ * The objects are carved out of chunks, each as large as all the previous ones together (up to a limit),
+ * so that the objects allocated together are also close in memory. Freed objects are kept on a
+ * free list and reused first. When the last object is freed, the chunks are released. */
+struct lsdn_slab {
+	/** Size of an object, rounded up for alignment. */
+	size_t size;
+	/** Chunks, the newest first. */
+	struct lsdn_slab_chunk *chunks;
+	/** Objects in the newest chunk that were never handed out. */
+	char *fresh;
+	size_t fresh_count;
+	/** Freed objects, linked through their first word. */
+	void *free_list;
+	size_t capacity;
+	size_t chunk_count;
+	size_t allocated;
+	size_t peak;
+};
+
+void lsdn_slab_init(struct lsdn_slab *slab, size_t size);
+void *lsdn_slab_alloc(struct lsdn_slab *slab);
+bool lsdn_slab_alloc_array(struct lsdn_slab *slab, void **objs, size_t count);
+void lsdn_slab_return(struct lsdn_slab *slab, void *obj);
+void lsdn_slab_get_stats(struct lsdn_slab *slab, struct lsdn_slab_stats *stats);
+void lsdn_slab_free(struct lsdn_slab *slab);
@@ -3,12 +3,18 @@
 #include "private/log.h"
 #include "private/lsdn.h"
 #include "private/errors.h"
+#include "private/audit.h"
 #include "include/util.h"
 #include <uthash.h>
+#include <stdio.h>
 #include <string.h>
+#include <errno.h>
 
 /* TODO: convert Uthash OOM to something "safe" */
 
+static void flush_prio(struct lsdn_ruleset_prio *prio);
+static uint16_t key_ethtype(enum lsdn_rule_target t);
+
 #define rule_target_name(y, z) #z
 
 static const char *match_target_names[] = {
@@ -51,22 +57,28 @@ struct lsdn_vr *lsdn_vr_new(struct lsdn_virt *virt, uint16_t prio_num, enum lsdn
 		}
 		prio->commited_prio = NULL;
 		prio->commited_count = 0;
+		prio->commited_to = NULL;
+		prio->group_count = 0;
+		prio->merged_to = prio;
+		prio->merged_rules = NULL;
 		prio->prio_num = prio_num;
 		lsdn_list_init(&prio->rules_list);
 		HASH_ADD(hh, *ht, prio_num, sizeof(prio->prio_num), prio);
 	}
 
 	vr->pos = 0;
+	vr->virt = virt;
 	vr->state = LSDN_STATE_NEW;
 	for(size_t i = 0; i<LSDN_MAX_MATCHES; i++) {
 		vr->targets[i] = LSDN_MATCH_NONE;
 		bzero(vr->masks[i].bytes, sizeof(vr->masks[i].bytes));
 	}
 	lsdn_list_init_add(&prio->rules_list, &vr->rules_entry);
+	lsdn_virt_touch(virt);
 	return vr;
 }
 
-static void do_free_vr(struct lsdn_vr *vr)
+void lsdn_vr_do_free(struct lsdn_vr *vr)
 {
 	lsdn_list_remove(&vr->rules_entry);
 	free(vr);
@@ -75,7 +87,7 @@ static void do_free_vr(struct lsdn_vr *vr)
 static void do_free_vr_prio(struct vr_prio **ht, struct vr_prio *prio)
 {
 	lsdn_foreach(prio->rules_list, rules_entry, struct lsdn_vr, r) {
-		do_free_vr(r);
+		lsdn_vr_do_free(r);
 	}
 	HASH_DELETE(hh, *ht, prio);
 	free(prio);
@@ -95,7 +107,8 @@ void lsdn_vr_do_free_all_rules(struct lsdn_virt *virt)
 
 void lsdn_vr_free(struct lsdn_vr *vr)
 {
-	free_helper(vr, do_free_vr);
+	lsdn_virt_touch(vr->virt);
+	free_helper(vr, lsdn_vr_do_free);
 }
 
 void lsdn_vrs_free_all(struct lsdn_virt *virt)
@@ -172,6 +185,152 @@ void lsdn_vr_add_masked_dst_ip(struct lsdn_vr *rule, lsdn_ip_t mask, lsdn_ip_t v
 	rule->rule.action = action->desc;
 }
 
+/* Compiling the virt rules.
+ *
+ * Every priority of the rules is a flower filter priority of its own, with a hash lookup for its
+ * mask, so a packet is looked up once for every priority. The rules of a priority can go to the
+ * filter priority of the nearest earlier one with the same targets and masks, as long as none of
+ * them match the same packets as a rule of a priority they are moved ahead of, unless both rules
+ * have the same action. Their matches then differ from the rules already there, since a packet
+ * can match only one rule of a flower filter priority. */
+
+static uint16_t vr_ethtype(struct lsdn_vr *vr)
+{
+	for (int i = 0; i < LSDN_MAX_MATCHES; i++) {
+		uint16_t eth = key_ethtype(vr->targets[i]);
+		if (eth != ETH_P_ALL)
+			return eth;
+	}
+	return ETH_P_ALL;
+}
+
+static bool same_match_key(struct lsdn_vr *a, struct lsdn_vr *b)
+{
+	return memcmp(a->targets, b->targets, sizeof(a->targets)) == 0
+		&& memcmp(a->masks, b->masks, sizeof(a->masks)) == 0;
+}
+
+/* Is there no packet matched by both rules? The matches are already masked by validate_rules. */
+static bool vrs_disjoint(struct lsdn_vr *a, struct lsdn_vr *b)
+{
+	uint16_t eth_a = vr_ethtype(a), eth_b = vr_ethtype(b);
+	if (eth_a != ETH_P_ALL && eth_b != ETH_P_ALL && eth_a != eth_b)
+		return true;
+	for (int i = 0; i < LSDN_MAX_MATCHES; i++) {
+		if (!lsdn_target_supports_masking(a->targets[i]))
+			continue;
+		for (int j = 0; j < LSDN_MAX_MATCHES; j++) {
+			if (a->targets[i] != b->targets[j])
+				continue;
+			for (int k = 0; k < LSDN_MAX_MATCH_LEN; k++) {
+				if ((a->rule.matches[i].bytes[k] ^ b->rule.matches[j].bytes[k])
+				    & a->masks[i].bytes[k] & b->masks[j].bytes[k])
+					return true;
+			}
+		}
+	}
+	return false;
+}
+
+static struct lsdn_vr *first_vr(struct vr_prio *prio)
+{
+	return lsdn_container_of(prio->rules_list.next, struct lsdn_vr, rules_entry);
+}
+
+/* Can the rules of `moved` be evaluated before the rules of `over`? */
+static bool can_move_over(struct vr_prio *moved, struct vr_prio *over)
+{
+	/* All the rules of a priority have the same targets, see validate_rules */
+	uint16_t eth_moved = vr_ethtype(first_vr(moved)), eth_over = vr_ethtype(first_vr(over));
+	if (eth_moved != ETH_P_ALL && eth_over != ETH_P_ALL && eth_moved != eth_over)
+		return true;
+	lsdn_foreach(moved->rules_list, rules_entry, struct lsdn_vr, m) {
+		lsdn_foreach(over->rules_list, rules_entry, struct lsdn_vr, o) {
+			if (memcmp(&m->rule.action, &o->rule.action, sizeof(m->rule.action)) != 0
+			    && !vrs_disjoint(m, o))
+				return false;
+		}
+	}
+	return true;
+}
+
+static bool merge_fits(struct vr_prio *group, struct vr_prio *prio)
+{
+	lsdn_foreach(prio->rules_list, rules_entry, struct lsdn_vr, r) {
+		struct lsdn_vr *duplicate;
+		HASH_FIND(hh, group->merged_rules, r->rule.matches, sizeof(r->rule.matches), duplicate);
+		if (duplicate)
+			return false;
+	}
+	return true;
+}
+
+static void merge(struct vr_prio *group, struct vr_prio *prio)
+{
+	prio->merged_to = group;
+	lsdn_foreach(prio->rules_list, rules_entry, struct lsdn_vr, r) {
+		HASH_ADD(hh, group->merged_rules, rule.matches, sizeof(r->rule.matches), r);
+	}
+}
+
+static int cmp_vr_prio(const void *a, const void *b)
+{
+	const struct vr_prio *pa = *(struct vr_prio * const *) a;
+	const struct vr_prio *pb = *(struct vr_prio * const *) b;
+	return (int) pa->prio_num - (int) pb->prio_num;
+}
+
+size_t lsdn_vr_compile(struct vr_prio *ht_prio)
+{
+	size_t count = HASH_COUNT(ht_prio);
+	if (count == 0)
+		return 0;
+	struct vr_prio **sorted = malloc(count * sizeof(*sorted));
+	if (!sorted)
+		abort();
+
+	size_t n = 0;
+	struct vr_prio *prio, *tmp;
+	HASH_ITER(hh, ht_prio, prio, tmp) {
+		prio->merged_to = prio;
+		prio->merged_rules = NULL;
+		if (!lsdn_is_list_empty(&prio->rules_list))
+			sorted[n++] = prio;
+	}
+	qsort(sorted, n, sizeof(*sorted), cmp_vr_prio);
+
+	size_t filters = 0;
+	for (size_t i = 0; i < n; i++) {
+		prio = sorted[i];
+		struct vr_prio *group = NULL;
+		size_t j = i;
+		while (j-- > 0) {
+			if (same_match_key(first_vr(sorted[j]), first_vr(prio))) {
+				group = sorted[j]->merged_to;
+				break;
+			}
+		}
+		if (group && !merge_fits(group, prio))
+			group = NULL;
+		/* The rules are moved ahead of everything between the group and them */
+		for (j = i; group && sorted[--j] != group;) {
+			if (sorted[j]->merged_to != group && !can_move_over(prio, sorted[j]))
+				group = NULL;
+		}
+		if (!group) {
+			group = prio;
+			filters++;
+		}
+		merge(group, prio);
+	}
+
+	for (size_t i = 0; i < n; i++)
+		HASH_CLEAR(hh, sorted[i]->merged_rules);
+	free(sorted);
+	lsdn_log(LSDNL_RULES, "vr_compile(prios=%zu, filter_prios=%zu)\n", n, filters);
+	return filters;
+}
+
 void lsdn_action_init(struct lsdn_action_desc *action, size_t count, lsdn_mkaction_fn fn, void *user)
 {
 	action->actions_count = count;
@@ -184,11 +343,54 @@ void lsdn_ruleset_init(struct lsdn_ruleset *ruleset, struct lsdn_context *ctx,
 {
 	ruleset->iface = iface;
 	ruleset->parent_handle = parent_handle;
+	ruleset->block = 0;
 	ruleset->chain = chain;
 	ruleset->prio_start = prio_start;
 	ruleset->prio_count = prio_count;
 	ruleset->ctx = ctx;
 	ruleset->hash_prios = NULL;
+	lsdn_list_init_add(&ctx->rulesets_list, &ruleset->rulesets_entry);
+}
+
+/* Like lsdn_ruleset_init, but the filters are installed to a shared block. The rules then apply
+ * to all interfaces bound to the block. */
+void lsdn_ruleset_init_block(struct lsdn_ruleset *ruleset, struct lsdn_context *ctx,
+	uint32_t block, uint32_t chain, uint32_t prio_start, uint32_t prio_count)
+{
+	lsdn_ruleset_init(ruleset, ctx, NULL, 0, chain, prio_start, prio_count);
+	ruleset->block = block;
+}
+
+/* Like lsdn_ruleset_init, but on another chain of the interface or block of `other`. */
+void lsdn_ruleset_init_chain(struct lsdn_ruleset *ruleset, struct lsdn_ruleset *other,
+	uint32_t chain, uint32_t prio_start, uint32_t prio_count)
+{
+	lsdn_ruleset_init(ruleset, other->ctx, other->iface, other->parent_handle,
+		chain, prio_start, prio_count);
+	ruleset->block = other->block;
+}
+
+/* Shared blocks are addressed by a magic ifindex, with the block index in place of the parent */
+static uint32_t ruleset_ifindex(struct lsdn_ruleset *rs)
+{
+	return rs->block ? TCM_IFINDEX_MAGIC_BLOCK : rs->iface->ifindex;
+}
+
+static uint32_t ruleset_parent(struct lsdn_ruleset *rs)
+{
+	return rs->block ? rs->block : rs->parent_handle;
+}
+
+/* Is there anything to remove from the kernel? Not if the interface has disappeared, the kernel
+ * has removed the filters by itself. */
+static bool ruleset_decommit(struct lsdn_ruleset *rs)
+{
+	return !rs->ctx->disable_decommit && !(rs->iface && rs->iface->removed);
+}
+
+static const char *ruleset_name(struct lsdn_ruleset *rs)
+{
+	return rs->block ? "(block)" : rs->iface->ifname;
 }
 
 static char hexdigit(uint8_t val)
@@ -263,10 +465,13 @@ void lsdn_ruleset_free(struct lsdn_ruleset *ruleset)
 {
 	struct lsdn_ruleset_prio *prio, *prio_tmp;
 	HASH_ITER(hh, ruleset->hash_prios, prio, prio_tmp) {
+		flush_prio(prio);
 		assert(HASH_COUNT(prio->hash_fl_rules) == 0);
 		HASH_DEL(ruleset->hash_prios, prio);
+		lsdn_idalloc_free(&prio->handle_alloc);
 		free(prio);
 	}
+	lsdn_list_remove(&ruleset->rulesets_entry);
 }
 
 static uint16_t key_ethtype(enum lsdn_rule_target t)
@@ -286,6 +491,8 @@ static uint16_t key_ethtype(enum lsdn_rule_target t)
 		return ETH_P_IPV6;
 	case LSDN_MATCH_ENC_KEY_ID:
 		return ETH_P_ALL;
+	case LSDN_MATCH_ARP_TIP:
+		return ETH_P_ARP;
 	case LSDN_MATCH_NONE:
 		return ETH_P_ALL;
 	default:
@@ -307,22 +514,17 @@ static bool find_common_ethtype(struct lsdn_flower_rule *fl, struct lsdn_ruleset
 	return true;
 }
 
-/* Update the flower rule in TC */
-static lsdn_err_t flush_fl_rule(struct lsdn_flower_rule *fl, struct lsdn_ruleset_prio *prio, bool update)
+/* Build the TC filter for the flower rule, to be sent or compared with the kernel */
+static struct lsdn_filter *build_fl_rule(struct lsdn_flower_rule *fl)
 {
+	struct lsdn_ruleset_prio *prio = fl->prio;
 	struct lsdn_ruleset *ruleset = prio->parent;
 	struct lsdn_filter *filter = lsdn_filter_flower_init(
-		ruleset->iface->ifindex, fl->fl_handle, ruleset->parent_handle,
+		ruleset->ctx->nlsock, ruleset_ifindex(ruleset), fl->fl_handle, ruleset_parent(ruleset),
 		ruleset->chain, prio->prio + ruleset->prio_start);
-	if (update)
+	if (fl->committed)
 		lsdn_filter_set_update(filter);
 
-	lsdn_log(LSDNL_RULES, "fl_%s(handle=0x%x)\n", update ? "update" : "create", fl->fl_handle);
-
-	if (!filter) {
-		return LSDNE_NETLINK;
-	}
-
 	uint16_t ethtype;
 	if (!find_common_ethtype(fl, prio, &ethtype))
 		// TODO: also do the validation on VR layer and report the problem correctly there
@@ -356,6 +558,9 @@ static lsdn_err_t flush_fl_rule(struct lsdn_flower_rule *fl, struct lsdn_ruleset
 		case LSDN_MATCH_ENC_KEY_ID:
 			lsdn_flower_set_enc_key_id(filter, fl->matches[i].enc_key_id);
 			break;
+		case LSDN_MATCH_ARP_TIP:
+			lsdn_flower_set_arp_tip(filter, match->ipv4.chr, mask->ipv4.chr);
+			break;
 		case LSDN_MATCH_NONE:
 			break;
 		default:
@@ -372,51 +577,103 @@ static lsdn_err_t flush_fl_rule(struct lsdn_flower_rule *fl, struct lsdn_ruleset
 	}
 
 	lsdn_flower_actions_end(filter);
-	lsdn_err_t err = lsdn_filter_create(ruleset->ctx->nlsock, filter);
-	if (err != LSDNE_OK) {
-		lsdn_filter_free(filter);
-		return err;
-	}
+	return filter;
+}
 
+/* Create or update the flower rule in TC */
+static void commit_fl_rule(struct lsdn_flower_rule *fl)
+{
+	struct lsdn_nlsock *sock = fl->prio->parent->ctx->nlsock;
+	lsdn_log(LSDNL_RULES, "fl_%s(handle=0x%x)\n",
+		 fl->committed ? "update" : "create", fl->fl_handle);
+	if (fl->committed)
+		fl->prio->parent->ctx->stats.filters_updated++;
+	else
+		fl->prio->parent->ctx->stats.filters_created++;
+
+	struct lsdn_filter *filter = build_fl_rule(fl);
+	lsdn_filter_create_async(sock, filter, lsdn_nl_problem_cb, fl->prio->parent->ctx);
 	lsdn_filter_free(filter);
-
-	return LSDNE_OK;
+	fl->committed = true;
 }
 
-static void free_fl_rule(struct lsdn_flower_rule *fl, struct lsdn_ruleset_prio *prio, bool may_fail)
+static void free_fl_rule(struct lsdn_flower_rule *fl)
 {
+	struct lsdn_ruleset_prio *prio = fl->prio;
 	struct lsdn_ruleset *rs = prio->parent;
-	lsdn_log(LSDNL_RULES, "fl_delete(handle=0x%x)\n", fl->fl_handle);
-	if (!prio->parent->ctx->disable_decommit) {
-		lsdn_err_t err = lsdn_filter_delete(
-			rs->ctx->nlsock, rs->iface->ifindex, fl->fl_handle,
-			rs->parent_handle, rs->chain, prio->prio + rs->prio_start);
-		if (err != LSDNE_OK && !may_fail)
-			abort();
+	if (fl->committed && ruleset_decommit(rs)) {
+		lsdn_log(LSDNL_RULES, "fl_delete(handle=0x%x)\n", fl->fl_handle);
+		rs->ctx->stats.filters_deleted++;
+		lsdn_filter_delete_async(
+			rs->ctx->nlsock, ruleset_ifindex(rs), fl->fl_handle,
+			ruleset_parent(rs), rs->chain, prio->prio + rs->prio_start,
+			lsdn_nl_problem_cb, rs->ctx);
 	}
 
 	HASH_DEL(prio->hash_fl_rules, fl);
+	lsdn_idalloc_return(&prio->handle_alloc, fl->fl_handle);
 	free(fl);
 }
 
+static void mark_fl_rule_dirty(struct lsdn_flower_rule *fl)
+{
+	if (lsdn_is_list_empty(&fl->dirty_entry))
+		lsdn_list_init_add(
+			fl->prio->parent->ctx->dirty_fl_rules.previous, &fl->dirty_entry);
+}
+
+/* Send a changed flower rule to the kernel. Filters that lost all their rules are deleted. */
+static void flush_fl_rule(struct lsdn_flower_rule *fl)
+{
+	lsdn_list_remove(&fl->dirty_entry);
+	if (lsdn_is_list_empty(&fl->sources_list))
+		free_fl_rule(fl);
+	else
+		commit_fl_rule(fl);
+}
+
+/* Flush the changes of a single priority, before it goes away */
+static void flush_prio(struct lsdn_ruleset_prio *prio)
+{
+	struct lsdn_flower_rule *fl, *tmp;
+	HASH_ITER(hh, prio->hash_fl_rules, fl, tmp) {
+		if (!lsdn_is_list_empty(&fl->dirty_entry))
+			flush_fl_rule(fl);
+	}
+}
+
+void lsdn_ruleset_flush(struct lsdn_context *ctx)
+{
+	lsdn_foreach(ctx->dirty_fl_rules, dirty_entry, struct lsdn_flower_rule, fl) {
+		flush_fl_rule(fl);
+	}
+}
+
 void lsdn_ruleset_remove(struct lsdn_rule *rule)
 {
 	lsdn_log(LSDNL_RULES, "ruleset_remove(iface=%s, chain=%d, prio=0x%x, handle=0x%x)\n",
-		rule->ruleset->iface->ifname, rule->ruleset->chain, rule->prio->prio,
+		ruleset_name(rule->ruleset), rule->ruleset->chain, rule->prio->prio,
 		rule->fl_rule->fl_handle);
 	lsdn_list_remove(&rule->sources_entry);
-	if (lsdn_is_list_empty(&rule->fl_rule->sources_list)) {
-		free_fl_rule(rule->fl_rule, rule->prio, false);
-	} else {
-		flush_fl_rule(rule->fl_rule, rule->prio, true);
-	}
+	/* Keep the flower rule until the flush, a rule with the same match may be added again */
+	mark_fl_rule_dirty(rule->fl_rule);
 	rule->fl_rule = NULL;
 }
 
+void lsdn_ruleset_update(struct lsdn_rule *rule)
+{
+	lsdn_log(LSDNL_RULES, "ruleset_update(iface=%s, chain=%d, prio=0x%x, handle=0x%x)\n",
+		ruleset_name(rule->ruleset), rule->ruleset->chain, rule->prio->prio,
+		rule->fl_rule->fl_handle);
+	mark_fl_rule_dirty(rule->fl_rule);
+}
+
 void lsdn_ruleset_remove_prio(struct lsdn_ruleset_prio *prio)
 {
+	flush_prio(prio);
 	assert(HASH_COUNT(prio->hash_fl_rules) == 0);
 	HASH_DELETE(hh, prio->parent->hash_prios, prio);
+	lsdn_idalloc_free(&prio->handle_alloc);
 	free(prio);
 }
 
@@ -451,13 +708,11 @@ void lsdn_rule_apply_mask(
 
 lsdn_err_t lsdn_ruleset_add(struct lsdn_ruleset_prio *prio, struct lsdn_rule *rule)
 {
-	bool update = true;
-	lsdn_err_t err = LSDNE_OK;
 	rule->prio = prio;
 	rule->ruleset = prio->parent;
 	lsdn_rule_apply_mask(rule, prio->targets, prio->masks);
 	lsdn_log(LSDNL_RULES, "ruleset_add(iface=%s, chain=%d, prio=0x%x)\n",
-		rule->ruleset->iface->ifname, rule->ruleset->chain, prio->prio);
+		ruleset_name(rule->ruleset), rule->ruleset->chain, prio->prio);
 	dump_rule(rule);
 
 	struct lsdn_flower_rule *fl;
@@ -474,9 +729,11 @@ lsdn_err_t lsdn_ruleset_add(struct lsdn_ruleset_prio *prio, struct lsdn_rule *ru
 		}
 		memcpy(fl->matches, rule->matches, sizeof(fl->matches));
 		lsdn_list_init(&fl->sources_list);
+		lsdn_list_init(&fl->dirty_entry);
 		fl->fl_handle = handle;
+		fl->prio = prio;
+		fl->committed = false;
 		HASH_ADD(hh, rule->prio->hash_fl_rules, matches, sizeof(fl->matches), fl);
-		update = false;
 	}
 	rule->fl_rule = fl;
 
@@ -492,127 +749,490 @@ lsdn_err_t lsdn_ruleset_add(struct lsdn_ruleset_prio *prio, struct lsdn_rule *ru
 		nearest_lower = &r->sources_entry;
 	}
 	lsdn_list_init_add(nearest_lower, &rule->sources_entry);
+	mark_fl_rule_dirty(fl);
 
-	err = flush_fl_rule(fl, prio, update);
-	if (err != LSDNE_OK) {
-		lsdn_list_remove(&rule->sources_entry);
-		free_fl_rule(fl, prio, true);
-		return err;
-	}
-
-	return err;
+	return LSDNE_OK;
 }
 
-void lsdn_broadcast_init(struct lsdn_broadcast *br, struct lsdn_context *ctx, struct lsdn_if *iface, int chain)
+void lsdn_broadcast_init(struct lsdn_broadcast *br, struct lsdn_context *ctx, struct lsdn_ruleset *ruleset, int chain)
 {
 	br->ctx = ctx;
-	br->iface = iface;
+	br->ruleset = ruleset;
 	br->chain = chain;
-	br->free_prio = 1;
+	lsdn_idalloc_init(&br->prios, 1, 0xFFFF);
 	lsdn_list_init(&br->filters_list);
+	lsdn_list_init(&br->free_list);
+	lsdn_list_init_add(&ctx->broadcasts_list, &br->broadcasts_entry);
+}
+
+static void mark_br_filter_dirty(struct lsdn_broadcast_filter *f)
+{
+	if (lsdn_is_list_empty(&f->dirty_entry))
+		lsdn_list_init_add(f->broadcast->ctx->dirty_br_filters.previous, &f->dirty_entry);
+}
+
+/* Keep the free list ordered by prio, like the filters, so that the first filter with room is
+ * filled first. The actions are packed (see pack_actions), so the list is short. */
+static void add_free_filter(struct lsdn_broadcast_filter *f)
+{
+	struct lsdn_broadcast *br = f->broadcast;
+	struct lsdn_list_entry *before = &br->free_list;
+	lsdn_foreach(br->free_list, free_entry, struct lsdn_broadcast_filter, other) {
+		if (other->prio > f->prio)
+			break;
+		before = &other->free_entry;
+	}
+	lsdn_list_init_add(before, &f->free_entry);
+}
+
+static struct lsdn_broadcast_filter *new_br_filter(struct lsdn_broadcast *br)
+{
+	uint32_t prio;
+	if (!lsdn_idalloc_get(&br->prios, &prio))
+		return NULL;
+	struct lsdn_broadcast_filter *f = malloc(sizeof(*f));
+	if (!f) {
+		lsdn_idalloc_return(&br->prios, prio);
+		return NULL;
+	}
+
+	f->broadcast = br;
+	f->prio = prio;
+	f->free_actions = LSDN_MAX_ACT_PRIO - 1;
+	f->used_slots = 0;
+	f->committed = false;
+	lsdn_list_init(&f->dirty_entry);
+	add_free_filter(f);
+
+	/* Keep the list ordered, the first filters are filled first. Priorities are recycled, so
+	 * the new filter is not necessarily the last one, but it usually is. */
+	struct lsdn_list_entry *before = &br->filters_list;
+	while (before->previous != &br->filters_list) {
+		struct lsdn_broadcast_filter *other = lsdn_container_of(
+			before->previous, struct lsdn_broadcast_filter, filters_entry);
+		if (other->prio < f->prio)
+			break;
+		before = before->previous;
+	}
+	lsdn_list_init_add(before->previous, &f->filters_entry);
+	return f;
 }
 
 static bool lsdn_find_free_action(
-	struct lsdn_broadcast *br, size_t actions,
-	struct lsdn_broadcast_filter** out_filter, size_t* out_action_index)
+	struct lsdn_broadcast *br, size_t actions, struct lsdn_broadcast_filter** out_filter)
 {
-	lsdn_foreach(br->filters_list, filters_entry, struct lsdn_broadcast_filter, f) {
+	/* The free list is ordered by prio and the actions take one or two slots, so this is
+	 * almost always the first filter */
+	lsdn_foreach(br->free_list, free_entry, struct lsdn_broadcast_filter, f) {
 		if (f->free_actions >= actions) {
-			for(size_t i = 0; i<LSDN_MAX_ACT_PRIO - 1; i++) {
-				struct lsdn_broadcast_action **a = &f->actions[i];
-				if(!*a) {
-					*out_filter = f;
-					*out_action_index = i;
-					return true;
-				}
-			}
-			/* should not happen if there are free actions */
-			abort();
+			*out_filter = f;
+			return true;
 		}
 	}
 
-	// create new filter
+	*out_filter = new_br_filter(br);
+	return *out_filter != NULL;
+}
 
-	struct lsdn_broadcast_filter *f = malloc(sizeof(*f));
-	if(!f)
-		return false;
+/* Put the action to a free slot of the filter, the filter must have enough free actions */
+static void put_action(struct lsdn_broadcast_filter *f, struct lsdn_broadcast_action *action)
+{
+	assert(f->free_actions >= action->action.actions_count);
+	/* Every action takes at least one of the free actions, so there must be a free slot */
+	unsigned slot = __builtin_ctz(~f->used_slots);
+	assert(slot < LSDN_MAX_ACT_PRIO - 1);
+	f->used_slots |= 1u << slot;
+	f->actions[slot] = action;
+	f->free_actions -= action->action.actions_count;
+	if (f->free_actions == 0)
+		lsdn_list_remove(&f->free_entry);
+	action->filter = f;
+	action->filter_entry_index = slot;
+	mark_br_filter_dirty(f);
+}
 
-	lsdn_list_init_add(&br->filters_list, &f->filters_entry);
-	f->broadcast = br;
-	f->free_actions = LSDN_MAX_ACT_PRIO - 1;
-	f->prio = br->free_prio++;
-	for(size_t i = 0; i<LSDN_MAX_ACT_PRIO - 1; i++) {
-		f->actions[i] = NULL;
+static void take_action(struct lsdn_broadcast_action *action)
+{
+	struct lsdn_broadcast_filter *f = action->filter;
+	if (f->free_actions == 0)
+		add_free_filter(f);
+	f->free_actions += action->action.actions_count;
+	f->used_slots &= ~(1u << action->filter_entry_index);
+	f->actions[action->filter_entry_index] = NULL;
+	mark_br_filter_dirty(f);
+}
+
+/* Fill the space freed in a filter by actions from the last non-empty filter.
+ * This keeps the actions packed in the first filters, even as routes come and go. Both filters
+ * are sent only once in the flush, no matter how many actions were moved, and the drained
+ * filters are deleted. */
+static void pack_actions(struct lsdn_broadcast_filter *f)
+{
+	struct lsdn_broadcast *br = f->broadcast;
+	struct lsdn_broadcast_filter *last = NULL;
+	for (struct lsdn_list_entry *e = br->filters_list.previous; e != &f->filters_entry;
+	     e = e->previous) {
+		last = lsdn_container_of(e, struct lsdn_broadcast_filter, filters_entry);
+		if (last->used_slots)
+			break;
+		last = NULL;
 	}
-	*out_filter = f;
-	*out_action_index = 0;
+	if (!last)
+		return;
 
-	return true;
+	uint32_t slots = last->used_slots;
+	while (slots && f->free_actions > 0) {
+		unsigned slot = __builtin_ctz(slots);
+		slots &= ~(1u << slot);
+		struct lsdn_broadcast_action *action = last->actions[slot];
+		if (action->action.actions_count > f->free_actions)
+			continue;
+		take_action(action);
+		put_action(f, action);
+	}
 }
 
 #define MAIN_RULE_HANDLE 1
 
-/** Update the broadcast filter and all it's actions. */
-static void lsdn_flush_action_list(struct lsdn_broadcast_filter* br_filter)
+/* Build the TC filter holding all actions of the broadcast filter */
+static struct lsdn_filter *build_br_filter(struct lsdn_broadcast_filter* br_filter)
 {
 	struct lsdn_broadcast *br = br_filter->broadcast;
 	struct lsdn_filter *filter = lsdn_filter_flower_init(
-		br->iface->ifindex,
-		MAIN_RULE_HANDLE, LSDN_INGRESS_HANDLE, br->chain, br_filter->prio);
+		br->ctx->nlsock, ruleset_ifindex(br->ruleset),
+		MAIN_RULE_HANDLE, ruleset_parent(br->ruleset), br->chain, br_filter->prio);
 	lsdn_filter_set_update(filter);
 	size_t order = 1;
-	int err;
 
 	lsdn_flower_actions_start(filter);
-	for(size_t i = 0; i < LSDN_MAX_ACT_PRIO - 1; i++) {
-		struct lsdn_broadcast_action *action = br_filter->actions[i];
-		if (!action)
-			continue;
-		//printf("Adding action to filter at %d if %s\n", order, iface->ifname);
+	uint32_t slots = br_filter->used_slots;
+	while (slots) {
+		unsigned slot = __builtin_ctz(slots);
+		slots &= ~(1u << slot);
+		struct lsdn_broadcast_action *action = br_filter->actions[slot];
 		action->action.fn(filter, order, action->action.user);
 		order += action->action.actions_count;
 	}
 	lsdn_action_continue(filter, order);
 	lsdn_flower_actions_end(filter);
-	err = lsdn_filter_create(br->ctx->nlsock, filter);
-	if (err != LSDNE_OK)
-		abort();
+	return filter;
+}
+
+/** Update the broadcast filter and all it's actions. */
+static void lsdn_flush_action_list(struct lsdn_broadcast_filter* br_filter)
+{
+	struct lsdn_filter *filter = build_br_filter(br_filter);
+	br_filter->broadcast->ctx->stats.broadcast_rewrites++;
+	lsdn_filter_create_async(br_filter->broadcast->ctx->nlsock, filter, lsdn_nl_problem_cb, br_filter->broadcast->ctx);
 	lsdn_filter_free(filter);
+	br_filter->committed = true;
+}
+
+static void free_br_filter(struct lsdn_broadcast_filter *f)
+{
+	struct lsdn_broadcast *br = f->broadcast;
+	if (f->committed && ruleset_decommit(br->ruleset)) {
+		br->ctx->stats.broadcast_deletes++;
+		lsdn_filter_delete_async(
+			br->ctx->nlsock, ruleset_ifindex(br->ruleset),
+			MAIN_RULE_HANDLE, ruleset_parent(br->ruleset), br->chain, f->prio,
+			lsdn_nl_problem_cb, br->ctx);
+	}
+	if (!lsdn_is_list_empty(&f->dirty_entry))
+		lsdn_list_remove(&f->dirty_entry);
+	if (f->free_actions != 0)
+		lsdn_list_remove(&f->free_entry);
+	lsdn_list_remove(&f->filters_entry);
+	lsdn_idalloc_return(&br->prios, f->prio);
+	free(f);
 }
 
 void lsdn_broadcast_add(struct lsdn_broadcast *br, struct lsdn_broadcast_action *action, struct lsdn_action_desc desc)
 {
 	struct lsdn_broadcast_filter *f;
-	size_t i;
-	if (!lsdn_find_free_action(br, desc.actions_count, &f, &i))
+	if (!lsdn_find_free_action(br, desc.actions_count, &f))
 		abort();
-	f->free_actions -= desc.actions_count;
-	f->actions[i] = action;
 	action->action = desc;
-	action->filter = f;
-	action->filter_entry_index = i;
-	lsdn_flush_action_list(f);
+	put_action(f, action);
 }
 
 void lsdn_broadcast_remove(struct lsdn_broadcast_action *action)
 {
-	action->filter->free_actions += action->action.actions_count;
-	action->filter->actions[action->filter_entry_index] = NULL;
-	if(!action->filter->broadcast->ctx->disable_decommit)
-		lsdn_flush_action_list(action->filter);
+	struct lsdn_broadcast_filter *f = action->filter;
+	take_action(action);
+	if(f->broadcast->ctx->disable_decommit)
+		lsdn_list_remove(&f->dirty_entry);
+	else
+		pack_actions(f);
 }
 
-void lsdn_broadcast_free(struct lsdn_broadcast *br)
+void lsdn_broadcast_flush(struct lsdn_context *ctx)
 {
-	lsdn_foreach(br->filters_list, filters_entry, struct lsdn_broadcast_filter, f)
-	{
-		if(!br->ctx->disable_decommit) {
-			lsdn_err_t err = lsdn_filter_delete(
-				br->ctx->nlsock, br->iface->ifindex,
-				MAIN_RULE_HANDLE, LSDN_INGRESS_HANDLE, br->chain, f->prio);
-			if (err != LSDNE_OK)
-				abort();
+	lsdn_foreach(ctx->dirty_br_filters, dirty_entry, struct lsdn_broadcast_filter, f) {
+		lsdn_list_remove(&f->dirty_entry);
+		/* Drained filters are deleted, so that broadcast packets do not traverse them */
+		if (f->used_slots)
+			lsdn_flush_action_list(f);
+		else
+			free_br_filter(f);
+	}
+}
+
+struct released_tunnel_key {
+	struct lsdn_list_entry released_entry;
+	uint32_t index;
+};
+
+struct foreign_tunnel_key {
+	struct lsdn_list_entry foreign_entry;
+	uint32_t index;
+};
+
+static bool is_foreign_tunnel_key(struct lsdn_context *ctx, uint32_t index)
+{
+	lsdn_foreach(ctx->foreign_tunnel_keys, foreign_entry, struct foreign_tunnel_key, f) {
+		if (f->index == index)
+			return true;
+	}
+	return false;
+}
+
+/* The action index is used by another tc user (or another context) in the same netns. The
+ * filters sent in the same batch are bound to their action, which is left alone, and the
+ * index is kept allocated so that it is not tried again. */
+static void tunnel_key_create_cb(const struct nlmsghdr *nlh, int err, void *user)
+{
+	struct lsdn_context *ctx = user;
+	if (err != -EEXIST) {
+		lsdn_nl_problem_cb(nlh, err, ctx);
+		return;
+	}
+	struct foreign_tunnel_key *f = malloc(sizeof(*f));
+	if (!f)
+		abort();
+	f->index = lsdn_tunnel_key_index(nlh);
+	lsdn_list_init_add(&ctx->foreign_tunnel_keys, &f->foreign_entry);
+
+	char desc[32];
+	snprintf(desc, sizeof(desc), "tunnel_key %u", f->index);
+	lsdn_problem_report(ctx, LSDNP_KERNEL_FOREIGN_ACTION, LSDNS_ATTR, desc, LSDNS_END);
+}
+
+uint32_t lsdn_tunnel_key_new(
+	struct lsdn_context *ctx, uint32_t vni, lsdn_ip_t *src_ip, lsdn_ip_t *dst_ip)
+{
+	uint32_t index;
+	if (!lsdn_idalloc_get(&ctx->tunnel_key_ids, &index))
+		abort();
+	lsdn_log(LSDNL_RULES, "tunnel_key_new(index=%u, vni=%u)\n", index, vni);
+	/* During a warm restart, the socket takes over the action of the previous context */
+	lsdn_tunnel_key_create_async(
+		ctx->nlsock, index, ctx->name, vni, src_ip, dst_ip, false, tunnel_key_create_cb, ctx);
+	return index;
+}
+
+void lsdn_tunnel_key_update(
+	struct lsdn_context *ctx, uint32_t index, uint32_t vni, lsdn_ip_t *src_ip, lsdn_ip_t *dst_ip)
+{
+	if (is_foreign_tunnel_key(ctx, index))
+		return;
+	lsdn_log(LSDNL_RULES, "tunnel_key_set(index=%u, vni=%u)\n", index, vni);
+	lsdn_tunnel_key_create_async(
+		ctx->nlsock, index, ctx->name, vni, src_ip, dst_ip, true, lsdn_nl_problem_cb, ctx);
+}
+
+void lsdn_tunnel_key_release(struct lsdn_context *ctx, uint32_t index)
+{
+	struct released_tunnel_key *r = malloc(sizeof(*r));
+	if (!r)
+		abort();
+	r->index = index;
+	lsdn_list_init_add(ctx->released_tunnel_keys.previous, &r->released_entry);
+}
+
+void lsdn_tunnel_key_flush(struct lsdn_context *ctx)
+{
+	lsdn_foreach(ctx->released_tunnel_keys, released_entry, struct released_tunnel_key, r) {
+		lsdn_list_remove(&r->released_entry);
+		if (is_foreign_tunnel_key(ctx, r->index)) {
+			free(r);
+			continue;
 		}
+		if (!ctx->disable_decommit) {
+			lsdn_log(LSDNL_RULES, "tunnel_key_delete(index=%u)\n", r->index);
+			lsdn_tunnel_key_delete_async(ctx->nlsock, r->index, lsdn_nl_problem_cb, ctx);
+		}
+		lsdn_idalloc_return(&ctx->tunnel_key_ids, r->index);
+		free(r);
+	}
+}
+
+void lsdn_tunnel_keys_free(struct lsdn_context *ctx)
+{
+	lsdn_foreach(ctx->foreign_tunnel_keys, foreign_entry, struct foreign_tunnel_key, f) {
+		lsdn_list_remove(&f->foreign_entry);
 		free(f);
 	}
 }
+
+void lsdn_broadcast_free(struct lsdn_broadcast *br)
+{
+	lsdn_foreach(br->filters_list, filters_entry, struct lsdn_broadcast_filter, f) {
+		free_br_filter(f);
+	}
+	lsdn_idalloc_free(&br->prios);
+	lsdn_list_remove(&br->broadcasts_entry);
+}
+
+static void mark_bpf_filter_dirty(struct lsdn_bpf_filter *f)
+{
+	if (lsdn_is_list_empty(&f->dirty_entry))
+		lsdn_list_init_add(f->ruleset->ctx->dirty_bpf_filters.previous, &f->dirty_entry);
+}
+
+void lsdn_bpf_filter_init(
+	struct lsdn_bpf_filter *f, struct lsdn_ruleset *ruleset, int prog_fd, uint32_t prog_id)
+{
+	f->ruleset = ruleset;
+	f->prog_fd = prog_fd;
+	f->prog_id = prog_id;
+	f->committed = false;
+	lsdn_list_init(&f->dirty_entry);
+	lsdn_list_init_add(&ruleset->ctx->bpf_filters_list, &f->bpf_filters_entry);
+	mark_bpf_filter_dirty(f);
+}
+
+void lsdn_bpf_filter_set_prog(struct lsdn_bpf_filter *f, int prog_fd, uint32_t prog_id)
+{
+	f->prog_fd = prog_fd;
+	f->prog_id = prog_id;
+	mark_bpf_filter_dirty(f);
+}
+
+static struct lsdn_filter *build_bpf_filter(struct lsdn_bpf_filter *f)
+{
+	struct lsdn_ruleset *rs = f->ruleset;
+	char name[32];
+	snprintf(name, sizeof(name), "lsdn-sbridge-%u", f->prog_id);
+	struct lsdn_filter *filter = lsdn_filter_bpf_init(
+		rs->ctx->nlsock, ruleset_ifindex(rs), MAIN_RULE_HANDLE, ruleset_parent(rs),
+		rs->chain, rs->prio_start, f->prog_fd, name);
+	if (f->committed)
+		lsdn_filter_set_update(filter);
+	return filter;
+}
+
+void lsdn_bpf_filter_free(struct lsdn_bpf_filter *f)
+{
+	struct lsdn_ruleset *rs = f->ruleset;
+	if (f->committed && ruleset_decommit(rs)) {
+		lsdn_log(LSDNL_RULES, "bpf_delete(chain=%u)\n", rs->chain);
+		rs->ctx->stats.filters_deleted++;
+		lsdn_filter_delete_async(
+			rs->ctx->nlsock, ruleset_ifindex(rs), MAIN_RULE_HANDLE,
+			ruleset_parent(rs), rs->chain, rs->prio_start,
+			lsdn_nl_problem_cb, rs->ctx);
+	}
+	if (!lsdn_is_list_empty(&f->dirty_entry))
+		lsdn_list_remove(&f->dirty_entry);
+	lsdn_list_remove(&f->bpf_filters_entry);
+}
+
+void lsdn_bpf_filter_flush(struct lsdn_context *ctx)
+{
+	lsdn_foreach(ctx->dirty_bpf_filters, dirty_entry, struct lsdn_bpf_filter, f) {
+		lsdn_list_remove(&f->dirty_entry);
+		lsdn_log(LSDNL_RULES, "bpf_%s(chain=%u, prog=%u)\n",
+			 f->committed ? "update" : "create", f->ruleset->chain, f->prog_id);
+		if (f->committed)
+			ctx->stats.filters_updated++;
+		else
+			ctx->stats.filters_created++;
+		struct lsdn_filter *filter = build_bpf_filter(f);
+		lsdn_filter_create_async(ctx->nlsock, filter, lsdn_nl_problem_cb, ctx);
+		lsdn_filter_free(filter);
+		f->committed = true;
+	}
+}
+
+/* Auditing */
+
+/* Is the committed filter to be sent again? */
+static bool audit_filter(
+	struct lsdn_audit *audit, enum lsdn_audit_tcf how, bool committed,
+	struct lsdn_list_entry *dirty, struct lsdn_filter *(*build)(void *obj), void *obj)
+{
+	/* Filters waiting for the next commit are not in the kernel yet */
+	if (!committed || !lsdn_is_list_empty(dirty))
+		return false;
+	if (how != LSDN_AUDIT_CHECK)
+		return how == LSDN_AUDIT_RESEND;
+
+	struct lsdn_filter *filter = build(obj);
+	bool resend = lsdn_audit_filter(audit, filter);
+	lsdn_filter_free(filter);
+	return resend;
+}
+
+static struct lsdn_filter *build_fl_rule_obj(void *fl)
+{
+	return build_fl_rule(fl);
+}
+
+static struct lsdn_filter *build_br_filter_obj(void *f)
+{
+	return build_br_filter(f);
+}
+
+void lsdn_ruleset_audit(struct lsdn_context *ctx, struct lsdn_audit *audit)
+{
+	lsdn_foreach(ctx->rulesets_list, rulesets_entry, struct lsdn_ruleset, rs) {
+		/* Interfaces known to be gone are handled by the next commit */
+		if (rs->iface && rs->iface->removed)
+			continue;
+		enum lsdn_audit_tcf how = lsdn_audit_tcf(audit, rs->iface, ruleset_parent(rs));
+
+		struct lsdn_ruleset_prio *prio, *tmp_prio;
+		HASH_ITER(hh, rs->hash_prios, prio, tmp_prio) {
+			struct lsdn_flower_rule *fl, *tmp_fl;
+			HASH_ITER(hh, prio->hash_fl_rules, fl, tmp_fl) {
+				if (audit_filter(audit, how, fl->committed, &fl->dirty_entry,
+						 build_fl_rule_obj, fl))
+					mark_fl_rule_dirty(fl);
+			}
+		}
+	}
+}
+
+static struct lsdn_filter *build_bpf_filter_obj(void *f)
+{
+	return build_bpf_filter(f);
+}
+
+void lsdn_bpf_filter_audit(struct lsdn_context *ctx, struct lsdn_audit *audit)
+{
+	lsdn_foreach(ctx->bpf_filters_list, bpf_filters_entry, struct lsdn_bpf_filter, f) {
+		struct lsdn_ruleset *rs = f->ruleset;
+		if (rs->iface && rs->iface->removed)
+			continue;
+		enum lsdn_audit_tcf how = lsdn_audit_tcf(audit, rs->iface, ruleset_parent(rs));
+		if (audit_filter(audit, how, f->committed, &f->dirty_entry, build_bpf_filter_obj, f))
+			mark_bpf_filter_dirty(f);
+	}
+}
+
+void lsdn_broadcast_audit(struct lsdn_context *ctx, struct lsdn_audit *audit)
+{
+	lsdn_foreach(ctx->broadcasts_list, broadcasts_entry, struct lsdn_broadcast, br) {
+		struct lsdn_ruleset *rs = br->ruleset;
+		if (rs->iface && rs->iface->removed)
+			continue;
+		enum lsdn_audit_tcf how = lsdn_audit_tcf(audit, rs->iface, ruleset_parent(rs));
+
+		lsdn_foreach(br->filters_list, filters_entry, struct lsdn_broadcast_filter, f) {
+			if (audit_filter(audit, how, f->committed, &f->dirty_entry,
+					 build_br_filter_obj, f))
+				mark_br_filter_dirty(f);
+		}
+	}
+}
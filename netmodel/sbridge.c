@@ -1,5 +1,9 @@
 #include "private/sbridge.h"
 #include "private/net.h"
+#include "include/util.h"
+#include "private/log.h"
+#include <linux/pkt_cls.h>
+#include <stddef.h>
 
 enum {CL_OWNER, CL_DEST};
 
@@ -46,9 +50,10 @@ static void if_br_make(struct lsdn_sbridge_if *from, struct lsdn_sbridge_route *
 	lsdn_clist_add(&from->cl_owner, &bra->clist);
 }
 
-/* Routing rule on the dummy bridging interface */
+/* Routing rule in a forwarding table of the bridge */
 struct br_forward_rule {
 	struct lsdn_clist_entry clist;
+	struct lsdn_list_entry forward_entry;
 	struct lsdn_sbridge_mac *mac;
 	struct lsdn_rule rule;
 };
@@ -56,6 +61,7 @@ struct br_forward_rule {
 static void br_forward_rule_free(void *user)
 {
 	struct br_forward_rule *fwdr = user;
+	lsdn_list_remove(&fwdr->forward_entry);
 	lsdn_ruleset_remove(&fwdr->rule);
 	free(fwdr);
 }
@@ -71,10 +77,11 @@ static void br_forward_mkaction(struct lsdn_filter *f, uint16_t order, void *use
 	lsdn_action_redir_egress_add(f, order, mac->route->iface->phys_if->iface->ifindex);
 }
 
-static void br_forward_make(struct lsdn_sbridge_mac *mac)
+static void br_forward_make(
+	struct lsdn_sbridge_mac *mac, struct lsdn_sbridge_table *table,
+	struct lsdn_ruleset_prio *prio, union lsdn_matchdata match)
 {
 	lsdn_err_t err;
-	struct lsdn_sbridge *br = mac->route->iface->bridge;
 	struct br_forward_rule *fwdr = malloc(sizeof(*fwdr));
 	if (!fwdr)
 		abort();
@@ -82,52 +89,489 @@ static void br_forward_make(struct lsdn_sbridge_mac *mac)
 	fwdr->mac = mac;
 	lsdn_action_init(&fwdr->rule.action, 1 +  mac->route->tunnel_action.actions_count, br_forward_mkaction, fwdr);
 	fwdr->rule.subprio = 0;
-	fwdr->rule.matches[0].mac = mac->mac;
-	err = lsdn_ruleset_add(br->bridge_ruleset, &fwdr->rule);
+	fwdr->rule.matches[0] = match;
+	err = lsdn_ruleset_add(prio, &fwdr->rule);
 	if (err != LSDNE_OK)
 		abort();
 	lsdn_clist_add(&mac->cl_dest, &fwdr->clist);
+	lsdn_clist_add(&table->cl_owner, &fwdr->clist);
+	lsdn_list_init_add(&mac->forward_list, &fwdr->forward_entry);
 }
 
-void lsdn_sbridge_init(struct lsdn_context *ctx, struct lsdn_sbridge *br)
+static void br_forward_retarget(struct br_forward_rule *fwdr, struct lsdn_sbridge_route *route)
 {
-	struct lsdn_if sbridge_if;
-	lsdn_if_init(&sbridge_if);
-	lsdn_err_t err = lsdn_link_dummy_create(ctx->nlsock, &sbridge_if, lsdn_mk_ifname(ctx));
-	if (err != LSDNE_OK)
+	/* br_forward_mkaction picks up the new route */
+	fwdr->rule.action.actions_count = 1 + route->tunnel_action.actions_count;
+	lsdn_ruleset_update(&fwdr->rule);
+}
+
+/* Solicited-node multicast MAC of an IPv6 address, 33:33:ff followed by its last 24 bits */
+static lsdn_mac_t solicited_node_mac(const lsdn_ipv6_t *ip)
+{
+	lsdn_mac_t mac = lsdn_nd_solicit_mac;
+	memcpy(&mac.bytes[3], &ip->bytes[13], 3);
+	return mac;
+}
+
+static void br_forward_make_table(struct lsdn_sbridge_mac *mac, struct lsdn_sbridge_table *table)
+{
+	struct lsdn_sbridge *br = mac->route->iface->bridge;
+	union lsdn_matchdata match;
+	bzero(&match, sizeof(match));
+	match.mac = mac->mac;
+	br_forward_make(mac, table, table->rules_mac, match);
+
+	if (!br->suppress_neigh || !mac->has_ip)
+		return;
+	bzero(&match, sizeof(match));
+	if (mac->ip.v == LSDN_IPv4) {
+		match.ipv4 = mac->ip.v4;
+		br_forward_make(mac, table, table->rules_arp, match);
+	} else {
+		match.mac = solicited_node_mac(&mac->ip.v6);
+		br_forward_make(mac, table, table->rules_mac, match);
+	}
+}
+
+static void br_forward_make_all(struct lsdn_sbridge_mac *mac)
+{
+	struct lsdn_sbridge *br = mac->route->iface->bridge;
+	lsdn_foreach(br->table_list, table_entry, struct lsdn_sbridge_table, table) {
+		br_forward_make_table(mac, table);
+	}
+}
+
+static void mkaction_drop(struct lsdn_filter *filter, uint16_t order, void *user)
+{
+	LSDN_UNUSED(user);
+	lsdn_action_drop(filter, order);
+}
+
+/* BPF switching, see lsdn_sbridge.use_bpf */
+
+/* The program lives in a single filter, so at most this many routes are reachable by the
+ * broadcasts. The kernel only allows larger programs since Linux 5.2. */
+#define BPF_ROUTES_MAX 1024
+#define BPF_FDB_MAX 65536
+/* The broadcasts are sent to this many more routes after every reload of the program */
+#define BPF_FLOOD_STEP 64
+/* Without the tunnel label and local IP, accepted by all kernels */
+#define BPF_TUNNEL_KEY_SIZE offsetof(struct bpf_tunnel_key, tunnel_label)
+
+struct bpf_fdb_key {
+	lsdn_mac_t mac;
+	uint8_t pad[2];
+};
+
+/* Value of the routes map, read by the program */
+struct bpf_route {
+	/* Zero if the route ID is not used */
+	uint32_t ifindex;
+	uint32_t has_tunnel;
+	/* Flags of bpf_skb_set_tunnel_key */
+	uint32_t tunnel_flags;
+	uint32_t pad;
+	uint8_t tunnel_key[BPF_TUNNEL_KEY_SIZE];
+};
+
+#define BPF_ROUTE_OFF(field) ((int16_t) offsetof(struct bpf_route, field))
+
+/* Stack slots of the program */
+#define BPF_STACK_MAC (-8)
+#define BPF_STACK_ROUTE (-16)
+
+struct prog_buf {
+	struct bpf_insn *insns;
+	size_t count;
+	size_t size;
+};
+
+static size_t emit(struct prog_buf *p, struct bpf_insn insn)
+{
+	if (p->count == p->size) {
+		size_t size = p->size ? p->size * 2 : 256;
+		struct bpf_insn *insns = realloc(p->insns, size * sizeof(*insns));
+		if (!insns)
+			abort();
+		p->insns = insns;
+		p->size = size;
+	}
+	p->insns[p->count] = insn;
+	return p->count++;
+}
+
+/* Point a jump emitted earlier to the next instruction */
+static void jump_here(struct prog_buf *p, size_t jump)
+{
+	p->insns[jump].off = p->count - jump - 1;
+}
+
+static void emit_ld_map(struct prog_buf *p, int reg, int fd)
+{
+	emit(p, BPF_LD_MAP_FD(reg, fd));
+	emit(p, BPF_LD_IMM64_HIGH());
+}
+
+/* Go on if `reg OP imm`, drop the packet otherwise */
+static void emit_drop_unless(struct prog_buf *p, int op, int reg, int32_t imm)
+{
+	emit(p, BPF_JMP_IMM(op, reg, imm, 2));
+	emit(p, BPF_MOV64_IMM(BPF_REG_0, TC_ACT_SHOT));
+	emit(p, BPF_EXIT_INSN());
+}
+
+/* R0 = the route whose ID is on the stack, or NULL */
+static void emit_route_lookup(struct prog_buf *p, struct lsdn_sbridge *br)
+{
+	emit_ld_map(p, BPF_REG_1, br->bpf.routes_fd);
+	emit(p, BPF_MOV64_REG(BPF_REG_2, BPF_REG_10));
+	emit(p, BPF_ALU64_IMM(BPF_ADD, BPF_REG_2, BPF_STACK_ROUTE));
+	emit(p, BPF_CALL_HELPER(BPF_FUNC_map_lookup_elem));
+}
+
+/* Set the tunnel metadata of the packet, if the route in R7 has any */
+static void emit_set_tunnel(struct prog_buf *p)
+{
+	emit(p, BPF_LDX_MEM(BPF_W, BPF_REG_1, BPF_REG_7, BPF_ROUTE_OFF(has_tunnel)));
+	size_t no_tunnel = emit(p, BPF_JMP_IMM(BPF_JEQ, BPF_REG_1, 0, 0));
+	emit(p, BPF_MOV64_REG(BPF_REG_1, BPF_REG_6));
+	emit(p, BPF_MOV64_REG(BPF_REG_2, BPF_REG_7));
+	emit(p, BPF_ALU64_IMM(BPF_ADD, BPF_REG_2, BPF_ROUTE_OFF(tunnel_key)));
+	emit(p, BPF_MOV64_IMM(BPF_REG_3, BPF_TUNNEL_KEY_SIZE));
+	emit(p, BPF_LDX_MEM(BPF_W, BPF_REG_4, BPF_REG_7, BPF_ROUTE_OFF(tunnel_flags)));
+	emit(p, BPF_CALL_HELPER(BPF_FUNC_skb_set_tunnel_key));
+	jump_here(p, no_tunnel);
+}
+
+/* Build the switching program. R6 holds the packet, R7 the route.
+ *
+ * Unicasts are redirected by the fdb and routes maps. Broadcasts (and multicasts) are cloned to
+ * every used route below flood_slots, except for those leading back to the ingress interface. */
+static void build_prog(struct lsdn_sbridge *br, struct prog_buf *p)
+{
+	emit(p, BPF_MOV64_REG(BPF_REG_6, BPF_REG_1));
+	emit(p, BPF_ST_MEM(BPF_DW, BPF_REG_10, BPF_STACK_MAC, 0));
+	emit(p, BPF_MOV64_IMM(BPF_REG_2, 0));
+	emit(p, BPF_MOV64_REG(BPF_REG_3, BPF_REG_10));
+	emit(p, BPF_ALU64_IMM(BPF_ADD, BPF_REG_3, BPF_STACK_MAC));
+	emit(p, BPF_MOV64_IMM(BPF_REG_4, sizeof(lsdn_mac_t)));
+	emit(p, BPF_CALL_HELPER(BPF_FUNC_skb_load_bytes));
+	emit_drop_unless(p, BPF_JEQ, BPF_REG_0, 0);
+	emit(p, BPF_LDX_MEM(BPF_B, BPF_REG_1, BPF_REG_10, BPF_STACK_MAC));
+	emit(p, BPF_ALU64_IMM(BPF_AND, BPF_REG_1, 1));
+	size_t flood = emit(p, BPF_JMP_IMM(BPF_JNE, BPF_REG_1, 0, 0));
+
+	/* Unicast */
+	emit_ld_map(p, BPF_REG_1, br->bpf.fdb_fd);
+	emit(p, BPF_MOV64_REG(BPF_REG_2, BPF_REG_10));
+	emit(p, BPF_ALU64_IMM(BPF_ADD, BPF_REG_2, BPF_STACK_MAC));
+	emit(p, BPF_CALL_HELPER(BPF_FUNC_map_lookup_elem));
+	emit_drop_unless(p, BPF_JNE, BPF_REG_0, 0);
+	emit(p, BPF_LDX_MEM(BPF_W, BPF_REG_1, BPF_REG_0, 0));
+	emit(p, BPF_STX_MEM(BPF_W, BPF_REG_10, BPF_REG_1, BPF_STACK_ROUTE));
+	emit_route_lookup(p, br);
+	emit_drop_unless(p, BPF_JNE, BPF_REG_0, 0);
+	emit(p, BPF_MOV64_REG(BPF_REG_7, BPF_REG_0));
+	emit(p, BPF_LDX_MEM(BPF_W, BPF_REG_1, BPF_REG_7, BPF_ROUTE_OFF(ifindex)));
+	emit_drop_unless(p, BPF_JNE, BPF_REG_1, 0);
+	emit_set_tunnel(p);
+	emit(p, BPF_LDX_MEM(BPF_W, BPF_REG_1, BPF_REG_7, BPF_ROUTE_OFF(ifindex)));
+	emit(p, BPF_MOV64_IMM(BPF_REG_2, 0));
+	emit(p, BPF_CALL_HELPER(BPF_FUNC_redirect));
+	emit(p, BPF_EXIT_INSN());
+
+	/* Broadcast, unrolled for the old kernels without bounded loops */
+	jump_here(p, flood);
+	for (uint32_t id = 0; id < br->bpf.flood_slots; id++) {
+		emit(p, BPF_ST_MEM(BPF_W, BPF_REG_10, BPF_STACK_ROUTE, id));
+		emit_route_lookup(p, br);
+		size_t missing = emit(p, BPF_JMP_IMM(BPF_JEQ, BPF_REG_0, 0, 0));
+		emit(p, BPF_MOV64_REG(BPF_REG_7, BPF_REG_0));
+		emit(p, BPF_LDX_MEM(BPF_W, BPF_REG_1, BPF_REG_7, BPF_ROUTE_OFF(ifindex)));
+		size_t unused = emit(p, BPF_JMP_IMM(BPF_JEQ, BPF_REG_1, 0, 0));
+		emit(p, BPF_LDX_MEM(BPF_W, BPF_REG_2, BPF_REG_6,
+			offsetof(struct __sk_buff, ingress_ifindex)));
+		size_t ingress = emit(p, BPF_JMP_REG(BPF_JEQ, BPF_REG_1, BPF_REG_2, 0));
+		emit_set_tunnel(p);
+		emit(p, BPF_MOV64_REG(BPF_REG_1, BPF_REG_6));
+		emit(p, BPF_LDX_MEM(BPF_W, BPF_REG_2, BPF_REG_7, BPF_ROUTE_OFF(ifindex)));
+		emit(p, BPF_MOV64_IMM(BPF_REG_3, 0));
+		emit(p, BPF_CALL_HELPER(BPF_FUNC_clone_redirect));
+		jump_here(p, missing);
+		jump_here(p, unused);
+		jump_here(p, ingress);
+	}
+	/* The clones are sent, not the packet itself */
+	emit(p, BPF_MOV64_IMM(BPF_REG_0, TC_ACT_SHOT));
+	emit(p, BPF_EXIT_INSN());
+}
+
+/* Load the program for the current flood_slots and switch all the tables to it */
+static void bpf_load(struct lsdn_sbridge *br)
+{
+	struct prog_buf p = {NULL, 0, 0};
+	build_prog(br, &p);
+	uint32_t id;
+	int fd = lsdn_bpf_prog_load(br->ctx->nlsock, p.insns, p.count, &id);
+	free(p.insns);
+	if (fd < 0)
 		abort();
+	lsdn_log(LSDNL_RULES, "bpf_load(prog=%u, flood_slots=%u)\n", id, br->bpf.flood_slots);
+	br->ctx->stats.bpf_prog_loads++;
 
-	err = lsdn_qdisc_ingress_create(ctx->nlsock, sbridge_if.ifindex);
-	if (err != LSDNE_OK)
+	if (br->bpf.prog_fd >= 0) {
+		lsdn_foreach(br->table_list, table_entry, struct lsdn_sbridge_table, table) {
+			lsdn_bpf_filter_set_prog(&table->bpf_filter, fd, id);
+		}
+		/* The filters still running the old program keep it alive until they are replaced */
+		lsdn_bpf_close(br->ctx->nlsock, br->bpf.prog_fd);
+	}
+	br->bpf.prog_fd = fd;
+	br->bpf.prog_id = id;
+}
+
+static void bpf_update(struct lsdn_sbridge *br, int fd, const void *key, const void *value)
+{
+	if (lsdn_bpf_map_update(br->ctx->nlsock, fd, key, value) < 0)
 		abort();
+	br->ctx->stats.bpf_map_updates++;
+}
 
-	err = lsdn_link_set(ctx->nlsock, sbridge_if.ifindex, true);
-	if (err != LSDNE_OK)
+static struct bpf_fdb_key bpf_fdb_key(lsdn_mac_t mac)
+{
+	struct bpf_fdb_key key;
+	bzero(&key, sizeof(key));
+	key.mac = mac;
+	return key;
+}
+
+static void bpf_fdb_write(struct lsdn_sbridge_mac *mac)
+{
+	struct bpf_fdb_key key = bpf_fdb_key(mac->mac);
+	bpf_update(mac->route->iface->bridge, mac->route->iface->bridge->bpf.fdb_fd,
+		&key, &mac->route->bpf_id);
+}
+
+static void bpf_fdb_delete(struct lsdn_sbridge_mac *mac)
+{
+	struct lsdn_sbridge *br = mac->route->iface->bridge;
+	if (br->ctx->disable_decommit)
+		return;
+	struct bpf_fdb_key key = bpf_fdb_key(mac->mac);
+	if (lsdn_bpf_map_delete(br->ctx->nlsock, br->bpf.fdb_fd, &key) < 0)
 		abort();
+	br->ctx->stats.bpf_map_deletes++;
+}
 
-	br->bridge_if = sbridge_if;
-	br->ctx = ctx;
-	lsdn_ruleset_init(
-		&br->bridge_ruleset_main, ctx, &br->bridge_if,
-		LSDN_INGRESS_HANDLE, LSDN_DEFAULT_CHAIN, LSDN_DEFAULT_PRIORITY, 1);
-	struct lsdn_ruleset_prio *prio = br->bridge_ruleset =
-			lsdn_ruleset_define_prio(&br->bridge_ruleset_main, 0);
+static void bpf_route_write(struct lsdn_sbridge_route *route)
+{
+	struct lsdn_sbridge *br = route->iface->bridge;
+	struct bpf_route value;
+	bzero(&value, sizeof(value));
+	value.ifindex = route->iface->phys_if->iface->ifindex;
+	if (route->has_tunnel) {
+		struct bpf_tunnel_key key;
+		bzero(&key, sizeof(key));
+		key.tunnel_id = route->tunnel_vni;
+		if (route->tunnel_dst.v == LSDN_IPv4) {
+			key.remote_ipv4 = lsdn_ip4_u32(&route->tunnel_dst.v4);
+		} else {
+			memcpy(key.remote_ipv6, route->tunnel_dst.v6.bytes, sizeof(key.remote_ipv6));
+			value.tunnel_flags = BPF_F_TUNINFO_IPV6;
+		}
+		value.has_tunnel = 1;
+		memcpy(value.tunnel_key, &key, sizeof(value.tunnel_key));
+	}
+	bpf_update(br, br->bpf.routes_fd, &route->bpf_id, &value);
+}
+
+static void bpf_route_add(struct lsdn_sbridge_route *route)
+{
+	struct lsdn_sbridge *br = route->iface->bridge;
+	if (!lsdn_idalloc_get(&br->bpf.route_ids, &route->bpf_id))
+		abort();
+	bpf_route_write(route);
+	if (route->bpf_id >= br->bpf.flood_slots) {
+		br->bpf.flood_slots += BPF_FLOOD_STEP;
+		bpf_load(br);
+	}
+}
+
+static void bpf_route_remove(struct lsdn_sbridge_route *route)
+{
+	struct lsdn_sbridge *br = route->iface->bridge;
+	/* Array elements can not be deleted, the zero ifindex marks the ID as unused */
+	if (!br->ctx->disable_decommit) {
+		struct bpf_route value;
+		bzero(&value, sizeof(value));
+		bpf_update(br, br->bpf.routes_fd, &route->bpf_id, &value);
+	}
+	lsdn_idalloc_return(&br->bpf.route_ids, route->bpf_id);
+}
+
+/* Define the priorities of a table, once its ruleset is initialized */
+static void table_init(struct lsdn_sbridge *br, struct lsdn_sbridge_table *table)
+{
+	struct lsdn_ruleset_prio *prio = table->rules_mac =
+			lsdn_ruleset_define_prio(&table->ruleset, 0);
 	if (!prio)
 		abort();
 	prio->targets[0] = LSDN_MATCH_DST_MAC;
 	prio->masks[0].mac = lsdn_single_mac_mask;
+
+	/* Only reached by broadcasts, the ARP requests are the only ones forwarded */
+	struct lsdn_ruleset_prio *prio_arp = table->rules_arp =
+			lsdn_ruleset_define_prio(&table->ruleset, 1);
+	if (!prio_arp)
+		abort();
+	prio_arp->targets[0] = LSDN_MATCH_ARP_TIP;
+	prio_arp->masks[0].ipv4 = lsdn_single_ipv4_mask.v4;
+
+	lsdn_clist_init(&table->cl_owner, CL_OWNER);
+	table->users = 0;
+	lsdn_list_init_add(&br->table_list, &table->table_entry);
+}
+
+/* Get the forwarding table for a new interface of the bridge. With use_chains, the interfaces
+ * sharing a ruleset share the table, otherwise there is just the one on the dummy interface. */
+static struct lsdn_sbridge_table *table_get(struct lsdn_sbridge *br, struct lsdn_sbridge_if *iface)
+{
+	if (!br->use_chains)
+		return &br->bridge_table;
+
+	struct lsdn_ruleset *parent = iface->phys_if->rules_match_mac->parent;
+	lsdn_foreach(br->table_list, table_entry, struct lsdn_sbridge_table, table) {
+		if (table->parent == parent) {
+			table->users++;
+			return table;
+		}
+	}
+
+	struct lsdn_sbridge_table *table = malloc(sizeof(*table));
+	if (!table)
+		abort();
+	table->parent = parent;
+	table->chain_ids = iface->phys_if->chain_ids;
+	if (!lsdn_idalloc_get(table->chain_ids, &table->chain))
+		abort();
+	if (br->use_bpf) {
+		lsdn_ruleset_init_chain(&table->ruleset, parent, table->chain, LSDN_DEFAULT_PRIORITY, 1);
+		lsdn_bpf_filter_init(&table->bpf_filter, &table->ruleset, br->bpf.prog_fd, br->bpf.prog_id);
+		table->users = 1;
+		lsdn_list_init_add(&br->table_list, &table->table_entry);
+		return table;
+	}
+	lsdn_ruleset_init_chain(&table->ruleset, parent, table->chain, LSDN_DEFAULT_PRIORITY, 3);
+	table_init(br, table);
+	table->users = 1;
+
+	/* unlike the dummy interface, the chain does not end in a drop on its own */
+	struct lsdn_ruleset_prio *prio_drop = table->rules_drop =
+			lsdn_ruleset_define_prio(&table->ruleset, 2);
+	if (!prio_drop)
+		abort();
+	struct lsdn_rule *drop = &table->rule_drop;
+	drop->subprio = 0;
+	bzero(&drop->matches, sizeof(drop->matches));
+	lsdn_action_init(&drop->action, 1, mkaction_drop, NULL);
+	if (lsdn_ruleset_add(prio_drop, drop) != LSDNE_OK)
+		abort();
+
+	/* pull forwarding rules */
+	lsdn_foreach(br->if_list, if_entry, struct lsdn_sbridge_if, other_if) {
+		lsdn_foreach(other_if->route_list, route_entry, struct lsdn_sbridge_route, route) {
+			lsdn_foreach(route->mac_list, mac_entry, struct lsdn_sbridge_mac, mac) {
+				br_forward_make_table(mac, table);
+			}
+		}
+	}
+	return table;
+}
+
+static void table_put(struct lsdn_sbridge *br, struct lsdn_sbridge_table *table)
+{
+	if (!table->parent || --table->users > 0)
+		return;
+	if (br->use_bpf) {
+		lsdn_bpf_filter_free(&table->bpf_filter);
+	} else {
+		lsdn_clist_flush(&table->cl_owner);
+		lsdn_ruleset_remove(&table->rule_drop);
+	}
+	/* Sends the pending filter changes */
+	lsdn_ruleset_free(&table->ruleset);
+	lsdn_idalloc_return(table->chain_ids, table->chain);
+	lsdn_list_remove(&table->table_entry);
+	free(table);
+}
+
+void lsdn_sbridge_init(struct lsdn_context *ctx, struct lsdn_sbridge *br, bool use_chains)
+{
+	br->ctx = ctx;
+	br->use_chains = use_chains;
+	br->use_bpf = false;
+	br->suppress_neigh = false;
 	lsdn_list_init(&br->if_list);
+	lsdn_list_init(&br->table_list);
+	if (use_chains)
+		return;
+
+	struct lsdn_if sbridge_if;
+	lsdn_if_init(&sbridge_if);
+	lsdn_err_t err = lsdn_link_dummy_create(ctx->nlsock, &sbridge_if, lsdn_mk_ifname(ctx), 0, true);
+	if (err != LSDNE_OK)
+		abort();
+
+	lsdn_qdisc_ingress_create_async(ctx->nlsock, sbridge_if.ifindex, lsdn_nl_problem_cb, ctx);
+
+	br->bridge_if = sbridge_if;
+	lsdn_ruleset_init(
+		&br->bridge_table.ruleset, ctx, &br->bridge_if,
+		LSDN_INGRESS_HANDLE, LSDN_DEFAULT_CHAIN, LSDN_DEFAULT_PRIORITY, 2);
+	br->bridge_table.parent = NULL;
+	table_init(br, &br->bridge_table);
+}
+
+void lsdn_sbridge_init_bpf(struct lsdn_context *ctx, struct lsdn_sbridge *br)
+{
+	lsdn_sbridge_init(ctx, br, true);
+	br->use_bpf = true;
+	struct lsdn_sbridge_bpf *bpf = &br->bpf;
+	bpf->fdb_fd = lsdn_bpf_map_create(ctx->nlsock, BPF_MAP_TYPE_HASH,
+		sizeof(struct bpf_fdb_key), sizeof(uint32_t), BPF_FDB_MAX, BPF_F_NO_PREALLOC);
+	if (bpf->fdb_fd < 0)
+		abort();
+	bpf->routes_fd = lsdn_bpf_map_create(ctx->nlsock, BPF_MAP_TYPE_ARRAY,
+		sizeof(uint32_t), sizeof(struct bpf_route), BPF_ROUTES_MAX, 0);
+	if (bpf->routes_fd < 0)
+		abort();
+	lsdn_idalloc_init(&bpf->route_ids, 0, BPF_ROUTES_MAX);
+	bpf->prog_fd = -1;
+	bpf->flood_slots = BPF_FLOOD_STEP;
+	bpf_load(br);
 }
 
 void lsdn_sbridge_free(struct lsdn_sbridge *br)
 {
 	assert(lsdn_is_list_empty(&br->if_list));
+	if (br->use_bpf) {
+		/* The filters (if left in place) keep the program and the maps alive */
+		lsdn_bpf_close(br->ctx->nlsock, br->bpf.prog_fd);
+		lsdn_bpf_close(br->ctx->nlsock, br->bpf.routes_fd);
+		lsdn_bpf_close(br->ctx->nlsock, br->bpf.fdb_fd);
+		lsdn_idalloc_free(&br->bpf.route_ids);
+	}
+	if (br->use_chains) {
+		assert(lsdn_is_list_empty(&br->table_list));
+		return;
+	}
+	/* Sends the pending filter changes, must be done while the interface exists */
+	lsdn_ruleset_free(&br->bridge_table.ruleset);
 	if (!br->ctx->disable_decommit) {
 		lsdn_err_t err = lsdn_link_delete(br->ctx->nlsock, &br->bridge_if);
 		if (err != LSDNE_OK)
 			abort();
 	}
-	lsdn_ruleset_free(&br->bridge_ruleset_main);
 	lsdn_if_free(&br->bridge_if);
 }
 
@@ -140,7 +584,10 @@ static void mkaction_goto_br_chain(struct lsdn_filter *filter, uint16_t order, v
 static void mkaction_goto_switch(struct lsdn_filter *filter, uint16_t order, void *user)
 {
 	struct lsdn_sbridge_if *iface = user;
-	lsdn_action_redir_ingress_add(filter, order, iface->bridge->bridge_if.ifindex);
+	if (iface->bridge->use_chains)
+		lsdn_action_goto_chain(filter, order, iface->table->chain);
+	else
+		lsdn_action_redir_ingress_add(filter, order, iface->bridge->bridge_if.ifindex);
 }
 
 void lsdn_sbridge_add_if(struct lsdn_sbridge *br, struct lsdn_sbridge_if *iface)
@@ -150,11 +597,26 @@ void lsdn_sbridge_add_if(struct lsdn_sbridge *br, struct lsdn_sbridge_if *iface)
 	lsdn_clist_init(&iface->cl_owner, CL_OWNER);
 	iface->bridge = br;
 
+	if (br->use_bpf) {
+		/* The program takes care of the broadcasts too, send everything there */
+		iface->table = table_get(br, iface);
+		struct lsdn_rule* fallback = &iface->rule_fallback;
+		fallback->subprio = LSDN_SBRIDGE_IF_SUBPRIO;
+		fallback->matches[0] = iface->additional_matchdata;
+		lsdn_action_init(&fallback->action, 1, mkaction_goto_switch, iface);
+		err = lsdn_ruleset_add(iface->phys_if->rules_fallback, fallback);
+		if (err != LSDNE_OK)
+			abort();
+		lsdn_list_init_add(&br->if_list, &iface->if_entry);
+		return;
+	}
+
 	/* create the broadcast chain */
 	uint32_t br_handle;
-	if(!lsdn_idalloc_get(&iface->phys_if->br_chain_ids, &br_handle))
+	if(!lsdn_idalloc_get(iface->phys_if->chain_ids, &br_handle))
 		abort();
-	lsdn_broadcast_init(&iface->broadcast, br->ctx, iface->phys_if->iface, br_handle);
+	lsdn_broadcast_init(
+		&iface->broadcast, br->ctx, iface->phys_if->rules_match_mac->parent, br_handle);
 
 	/* check that the ruleset is correctly setup by the caller, at least the targets */
 	assert(iface->phys_if->rules_match_mac->targets[0] == LSDN_MATCH_DST_MAC);
@@ -162,6 +624,8 @@ void lsdn_sbridge_add_if(struct lsdn_sbridge *br, struct lsdn_sbridge_if *iface)
 	assert(iface->phys_if->rules_fallback->targets[0] == iface->additional_match);
 	assert(iface->phys_if->rules_fallback->targets[1] == LSDN_MATCH_NONE);
 
+	iface->table = table_get(br, iface);
+
 	/* setup basic broadcast/non-broadcast classification */
 	struct lsdn_rule* match_mac = &iface->rule_match_br;
 	match_mac->subprio = LSDN_SBRIDGE_IF_SUBPRIO;
@@ -180,6 +644,28 @@ void lsdn_sbridge_add_if(struct lsdn_sbridge *br, struct lsdn_sbridge_if *iface)
 	if (err != LSDNE_OK)
 		abort();
 
+	/* send the ARP requests and neighbor solicitations to the switch instead of the broadcast
+	 * chain, the switch knows where the address lives */
+	if (br->suppress_neigh) {
+		struct lsdn_rule *arp = &iface->rule_suppress_arp;
+		arp->subprio = LSDN_SBRIDGE_IF_SUBPRIO;
+		bzero(&arp->matches[0], sizeof(arp->matches[0]));
+		arp->matches[1] = iface->additional_matchdata;
+		lsdn_action_init(&arp->action, 1, mkaction_goto_switch, iface);
+		err = lsdn_ruleset_add(iface->phys_if->rules_suppress_arp, arp);
+		if (err != LSDNE_OK)
+			abort();
+
+		struct lsdn_rule *nd = &iface->rule_suppress_nd;
+		nd->subprio = LSDN_SBRIDGE_IF_SUBPRIO;
+		nd->matches[0].mac = lsdn_nd_solicit_mac;
+		nd->matches[1] = iface->additional_matchdata;
+		lsdn_action_init(&nd->action, 1, mkaction_goto_switch, iface);
+		err = lsdn_ruleset_add(iface->phys_if->rules_suppress_nd, nd);
+		if (err != LSDNE_OK)
+			abort();
+	}
+
 	/* pull broadcast rules */
 	lsdn_foreach(br->if_list, if_entry, struct lsdn_sbridge_if, other_if) {
 		lsdn_foreach(other_if->route_list, route_entry, struct lsdn_sbridge_route, route) {
@@ -192,12 +678,20 @@ void lsdn_sbridge_add_if(struct lsdn_sbridge *br, struct lsdn_sbridge_if *iface)
 
 void lsdn_sbridge_remove_if(struct lsdn_sbridge_if *iface)
 {
+	struct lsdn_sbridge *br = iface->bridge;
 	assert(lsdn_is_list_empty(&iface->route_list));
 	lsdn_clist_flush(&iface->cl_owner);
-	lsdn_ruleset_remove(&iface->rule_match_br);
 	lsdn_ruleset_remove(&iface->rule_fallback);
-	lsdn_idalloc_return(&iface->phys_if->br_chain_ids, iface->broadcast.chain);
-	lsdn_broadcast_free(&iface->broadcast);
+	if (!br->use_bpf) {
+		lsdn_ruleset_remove(&iface->rule_match_br);
+		lsdn_idalloc_return(iface->phys_if->chain_ids, iface->broadcast.chain);
+		lsdn_broadcast_free(&iface->broadcast);
+	}
+	if (br->suppress_neigh) {
+		lsdn_ruleset_remove(&iface->rule_suppress_arp);
+		lsdn_ruleset_remove(&iface->rule_suppress_nd);
+	}
+	table_put(br, iface->table);
 
 	lsdn_list_remove(&iface->if_entry);
 }
@@ -208,6 +702,12 @@ void lsdn_sbridge_add_route(struct lsdn_sbridge_if *iface, struct lsdn_sbridge_r
 	lsdn_clist_init(&route->cl_dest, CL_DEST);
 	route->iface = iface;
 
+	if (iface->bridge->use_bpf) {
+		bpf_route_add(route);
+		lsdn_list_init_add(&iface->route_list, &route->route_entry);
+		return;
+	}
+
 	/* push broadcast rules */
 	lsdn_foreach(iface->bridge->if_list, if_entry, struct lsdn_sbridge_if, other_if) {
 		if (other_if == iface)
@@ -223,6 +723,7 @@ void lsdn_sbridge_add_route_default(struct lsdn_sbridge_if *iface, struct lsdn_s
 	route->tunnel_action.fn = NULL;
 	route->tunnel_action.actions_count = 0;
 	route->tunnel_action.user = NULL;
+	route->has_tunnel = false;
 	lsdn_sbridge_add_route(iface, route);
 }
 
@@ -230,34 +731,70 @@ void lsdn_sbridge_remove_route(struct lsdn_sbridge_route *route)
 {
 	assert(lsdn_is_list_empty(&route->mac_list));
 	lsdn_clist_flush(&route->cl_dest);
+	if (route->iface->bridge->use_bpf)
+		bpf_route_remove(route);
 	lsdn_list_remove(&route->route_entry);
 }
 
+void lsdn_sbridge_update_route(struct lsdn_sbridge_route *route)
+{
+	assert(route->iface->bridge->use_bpf);
+	bpf_route_write(route);
+}
+
 void lsdn_sbridge_add_mac(
-	struct lsdn_sbridge_route* route, struct lsdn_sbridge_mac *mac_entry, lsdn_mac_t mac)
+	struct lsdn_sbridge_route* route, struct lsdn_sbridge_mac *mac_entry, lsdn_mac_t mac,
+	const lsdn_ip_t *ip)
 {
 	mac_entry->route = route;
 	mac_entry->mac = mac;
+	mac_entry->has_ip = ip != NULL;
+	if (ip)
+		mac_entry->ip = *ip;
 	lsdn_list_init_add(&route->mac_list, &mac_entry->mac_entry);
 	lsdn_clist_init(&mac_entry->cl_dest, CL_DEST);
+	lsdn_list_init(&mac_entry->forward_list);
 
-	/* push forwarding rule */
-	br_forward_make(mac_entry);
+	if (route->iface->bridge->use_bpf) {
+		bpf_fdb_write(mac_entry);
+		return;
+	}
+	/* push forwarding rules */
+	br_forward_make_all(mac_entry);
 }
 
 void lsdn_sbridge_remove_mac(struct lsdn_sbridge_mac *mac)
 {
 	lsdn_list_remove(&mac->mac_entry);
 	lsdn_clist_flush(&mac->cl_dest);
+	if (mac->route->iface->bridge->use_bpf)
+		bpf_fdb_delete(mac);
+}
+
+void lsdn_sbridge_move_mac(struct lsdn_sbridge_mac *mac, struct lsdn_sbridge_route *route)
+{
+	assert(route->iface->bridge == mac->route->iface->bridge);
+	lsdn_list_remove(&mac->mac_entry);
+	lsdn_list_init_add(&route->mac_list, &mac->mac_entry);
+	mac->route = route;
+
+	if (route->iface->bridge->use_bpf) {
+		bpf_fdb_write(mac);
+		return;
+	}
+	lsdn_foreach(mac->forward_list, forward_entry, struct br_forward_rule, fwdr) {
+		br_forward_retarget(fwdr, route);
+	}
 }
 
 void lsdn_sbridge_phys_if_init(
 	struct lsdn_context *ctx, struct lsdn_sbridge_phys_if *sbridge_if,
-	struct lsdn_if* iface, bool match_vni,
+	struct lsdn_if* iface, enum lsdn_rule_target additional_match,
 	struct lsdn_ruleset *rules_in)
 {
 	sbridge_if->iface = iface;
 	lsdn_idalloc_init(&sbridge_if->br_chain_ids, 1, 0xFFFF);
+	sbridge_if->chain_ids = &sbridge_if->br_chain_ids;
 
 	// define the ruleset with priorities for match and fallback and subpriorities for us.
 	// Someone else (the firewall) can share the priorities with us.
@@ -267,20 +804,57 @@ void lsdn_sbridge_phys_if_init(
 		abort();
 	prio_match->targets[0] = LSDN_MATCH_DST_MAC;
 	prio_match->masks[0].mac = lsdn_multicast_mac_mask;
-	if (match_vni)
-		prio_match->targets[1]= LSDN_MATCH_ENC_KEY_ID;
+	prio_match->targets[1] = additional_match;
 
 	struct lsdn_ruleset_prio *prio_fallback = sbridge_if->rules_fallback =
 		lsdn_ruleset_define_prio(rules_in, LSDN_SBRIDGE_IF_PRIO_FALLBACK);
 	if(!prio_fallback)
 		abort();
-	if (match_vni)
-		prio_fallback->targets[0]= LSDN_MATCH_ENC_KEY_ID;
+	prio_fallback->targets[0] = additional_match;
+
+	// ARP requests of any target IP and solicited-node multicasts, used if the bridge
+	// suppresses the neighbor discovery. Checked before the broadcasts are matched.
+	struct lsdn_ruleset_prio *prio_arp = sbridge_if->rules_suppress_arp =
+		lsdn_ruleset_define_prio(rules_in, LSDN_SBRIDGE_IF_PRIO_SUPPRESS_ARP);
+	if(!prio_arp)
+		abort();
+	prio_arp->targets[0] = LSDN_MATCH_ARP_TIP;
+	prio_arp->targets[1] = additional_match;
+
+	struct lsdn_ruleset_prio *prio_nd = sbridge_if->rules_suppress_nd =
+		lsdn_ruleset_define_prio(rules_in, LSDN_SBRIDGE_IF_PRIO_SUPPRESS_ND);
+	if(!prio_nd)
+		abort();
+	prio_nd->targets[0] = LSDN_MATCH_DST_MAC;
+	prio_nd->masks[0].mac = lsdn_nd_solicit_mac_mask;
+	prio_nd->targets[1] = additional_match;
+
+	if (additional_match == LSDN_MATCH_SRC_MAC) {
+		prio_match->masks[1].mac = lsdn_single_mac_mask;
+		prio_fallback->masks[0].mac = lsdn_single_mac_mask;
+		prio_arp->masks[1].mac = lsdn_single_mac_mask;
+		prio_nd->masks[1].mac = lsdn_single_mac_mask;
+	} else {
+		assert(additional_match == LSDN_MATCH_NONE || additional_match == LSDN_MATCH_ENC_KEY_ID);
+	}
+}
+
+void lsdn_sbridge_phys_if_init_shared(
+	struct lsdn_sbridge_phys_if *sbridge_if, struct lsdn_if* iface,
+	struct lsdn_sbridge_phys_if *shared)
+{
+	sbridge_if->iface = iface;
+	sbridge_if->chain_ids = shared->chain_ids;
+	sbridge_if->rules_match_mac = shared->rules_match_mac;
+	sbridge_if->rules_fallback = shared->rules_fallback;
+	sbridge_if->rules_suppress_arp = shared->rules_suppress_arp;
+	sbridge_if->rules_suppress_nd = shared->rules_suppress_nd;
 }
 
 void lsdn_sbridge_phys_if_free(struct lsdn_sbridge_phys_if *iface)
 {
-	lsdn_idalloc_free(&iface->br_chain_ids);
+	if (iface->chain_ids == &iface->br_chain_ids)
+		lsdn_idalloc_free(&iface->br_chain_ids);
 }
 
 /* This are chain and priority numbers for rules on virts and shared tunnels. */
@@ -289,23 +863,34 @@ void lsdn_sbridge_phys_if_free(struct lsdn_sbridge_phys_if *iface)
 
 void lsdn_sbridge_add_virt(struct lsdn_sbridge *br, struct lsdn_virt *virt)
 {
-	lsdn_err_t err;
 	struct lsdn_context *ctx = virt->network->ctx;
-	err = lsdn_prepare_rulesets(ctx, &virt->committed_if, &virt->rules_in, &virt->rules_out);
-	if (err != LSDNE_OK)
-		abort();
+	struct lsdn_phys_attachment *pa = virt->committed_to;
+	struct lsdn_ruleset *rules_in = lsdn_virt_prepare_rulesets(virt);
+	struct lsdn_sbridge_if *iface = &virt->sbridge_if;
 
-	lsdn_sbridge_phys_if_init(ctx, &virt->sbridge_phys_if, &virt->committed_if, false, &virt->rules_in);
+	if (virt->in_shared_blocks) {
+		/* The block does not tell which interface a packet came from, so the broadcasts
+		 * (which must not be sent back) are told apart by the source MAC */
+		if (pa->shared_block_users == 1)
+			lsdn_sbridge_phys_if_init(
+				ctx, &pa->shared_phys_if, NULL, LSDN_MATCH_SRC_MAC, rules_in);
+		lsdn_sbridge_phys_if_init_shared(
+			&virt->sbridge_phys_if, &virt->committed_if, &pa->shared_phys_if);
+		iface->additional_match = LSDN_MATCH_SRC_MAC;
+		iface->additional_matchdata.mac = *virt->attr_mac;
+	} else {
+		lsdn_sbridge_phys_if_init(
+			ctx, &virt->sbridge_phys_if, &virt->committed_if, LSDN_MATCH_NONE, rules_in);
+		iface->additional_match = LSDN_MATCH_NONE;
+	}
 
-	struct lsdn_sbridge_if *iface = &virt->sbridge_if;
 	iface->phys_if = &virt->sbridge_phys_if;
-	iface->additional_match = LSDN_MATCH_NONE;
 	lsdn_sbridge_add_if(br, iface);
 
 	struct lsdn_sbridge_route *route = &virt->sbridge_route;
 	lsdn_sbridge_add_route_default(iface, route);
 
-	lsdn_sbridge_add_mac(route, &virt->sbridge_mac, *virt->attr_mac);
+	lsdn_sbridge_add_mac(route, &virt->sbridge_mac, *virt->attr_mac, virt->attr_ip);
 }
 void lsdn_sbridge_remove_virt(struct lsdn_virt *virt)
 {
@@ -313,9 +898,10 @@ void lsdn_sbridge_remove_virt(struct lsdn_virt *virt)
 	lsdn_sbridge_remove_route(&virt->sbridge_route);
 	lsdn_sbridge_remove_if(&virt->sbridge_if);
 	lsdn_sbridge_phys_if_free(&virt->sbridge_phys_if);
-	// TODO: also remove the qdiscs
-	lsdn_ruleset_free(&virt->rules_in);
-	lsdn_ruleset_free(&virt->rules_out);
+	if (virt->in_shared_blocks && virt->committed_to->shared_block_users == 1)
+		lsdn_sbridge_phys_if_free(&virt->committed_to->shared_phys_if);
+	// TODO: also remove the qdiscs of unshared rulesets
+	lsdn_virt_free_rulesets(virt);
 }
 
 
@@ -0,0 +1,149 @@
+/** \file
+ * Slab allocation routines. */
+#include "private/slab.h"
+#include <assert.h>
+#include <stdlib.h>
+
+#define FIRST_CHUNK 4
+#define MAX_CHUNK 256
+
+/** Anything the objects could contain, for alignment. */
+union slab_align {
+	long double ld;
+	uint64_t u;
+	void *p;
+};
+
+struct lsdn_slab_chunk {
+	struct lsdn_slab_chunk *next;
+	union slab_align data[];
+};
+
+/** Set up a slab allocator for objects of `size` bytes.
+ * No memory is allocated until the first object is requested. */
+void lsdn_slab_init(struct lsdn_slab *slab, size_t size)
+{
+	size_t align = __alignof__(union slab_align);
+	if (size < sizeof(void *))
+		size = sizeof(void *);
+	slab->size = (size + align - 1) / align * align;
+	slab->chunks = NULL;
+	slab->fresh = NULL;
+	slab->fresh_count = 0;
+	slab->free_list = NULL;
+	slab->capacity = 0;
+	slab->chunk_count = 0;
+	slab->allocated = 0;
+	slab->peak = 0;
+}
+
+static void release_chunks(struct lsdn_slab *slab)
+{
+	struct lsdn_slab_chunk *c = slab->chunks;
+	while (c) {
+		struct lsdn_slab_chunk *next = c->next;
+		free(c);
+		c = next;
+	}
+	slab->chunks = NULL;
+	slab->fresh = NULL;
+	slab->fresh_count = 0;
+	slab->free_list = NULL;
+	slab->capacity = 0;
+	slab->chunk_count = 0;
+}
+
+/* Start a new chunk with at least `min` objects. The objects never handed out from the
+ * previous chunk go to the free list. */
+static bool add_chunk(struct lsdn_slab *slab, size_t min)
+{
+	size_t count = slab->capacity ? slab->capacity : FIRST_CHUNK;
+	if (count > MAX_CHUNK)
+		count = MAX_CHUNK;
+	if (count < min)
+		count = min;
+	struct lsdn_slab_chunk *c = malloc(sizeof(*c) + count * slab->size);
+	if (!c)
+		return false;
+	for (; slab->fresh_count > 0; slab->fresh_count--) {
+		*(void **) slab->fresh = slab->free_list;
+		slab->free_list = slab->fresh;
+		slab->fresh += slab->size;
+	}
+	c->next = slab->chunks;
+	slab->chunks = c;
+	slab->fresh = (char *) c->data;
+	slab->fresh_count = count;
+	slab->capacity += count;
+	slab->chunk_count++;
+	return true;
+}
+
+static void count_allocated(struct lsdn_slab *slab, size_t count)
+{
+	slab->allocated += count;
+	if (slab->allocated > slab->peak)
+		slab->peak = slab->allocated;
+}
+
+/** Allocate an object.
+ * @return `NULL` if a new chunk could not be allocated. */
+void *lsdn_slab_alloc(struct lsdn_slab *slab)
+{
+	void *obj;
+	if (slab->free_list) {
+		obj = slab->free_list;
+		slab->free_list = *(void **) obj;
+	} else {
+		if (slab->fresh_count == 0 && !add_chunk(slab, 1))
+			return NULL;
+		obj = slab->fresh;
+		slab->fresh += slab->size;
+		slab->fresh_count--;
+	}
+	count_allocated(slab, 1);
+	return obj;
+}
+
+/** Allocate `count` objects next to each other in memory.
+ * The objects are stored to `objs` and can be returned one by one.
+ * @return false if a new chunk could not be allocated, nothing is allocated then. */
+bool lsdn_slab_alloc_array(struct lsdn_slab *slab, void **objs, size_t count)
+{
+	if (slab->fresh_count < count && !add_chunk(slab, count))
+		return false;
+	for (size_t i = 0; i < count; i++) {
+		objs[i] = slab->fresh;
+		slab->fresh += slab->size;
+	}
+	slab->fresh_count -= count;
+	count_allocated(slab, count);
+	return true;
+}
+
+/** Return an object allocated by `lsdn_slab_alloc`. */
+void lsdn_slab_return(struct lsdn_slab *slab, void *obj)
+{
+	assert(slab->allocated > 0);
+	*(void **) obj = slab->free_list;
+	slab->free_list = obj;
+	if (--slab->allocated == 0)
+		release_chunks(slab);
+}
+
+/** Get statistics of the slab allocator. */
+void lsdn_slab_get_stats(struct lsdn_slab *slab, struct lsdn_slab_stats *stats)
+{
+	stats->allocated = slab->allocated;
+	stats->peak = slab->peak;
+	stats->capacity = slab->capacity;
+	stats->chunks = slab->chunk_count;
+}
+
+/** Release all memory of the slab allocator.
+ * The objects still allocated become invalid. */
+void lsdn_slab_free(struct lsdn_slab *slab)
+{
+	release_chunks(slab);
+	slab->allocated = 0;
+}
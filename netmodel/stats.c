@@ -0,0 +1,150 @@
+/** \file
+ * Counters of the work done by the commits, see `lsdn_commit_stats`. */
+#include "private/lsdn.h"
+#include "private/net.h"
+#include <assert.h>
+#include <inttypes.h>
+#include <string.h>
+#include <time.h>
+
+static const size_t object_size[LSDN_OBJ_COUNT] = {
+	[LSDN_OBJ_SETTINGS] = sizeof(struct lsdn_settings),
+	[LSDN_OBJ_NET] = sizeof(struct lsdn_net),
+	[LSDN_OBJ_PHYS] = sizeof(struct lsdn_phys),
+	[LSDN_OBJ_PA] = sizeof(struct lsdn_phys_attachment),
+	[LSDN_OBJ_VIRT] = sizeof(struct lsdn_virt),
+	[LSDN_OBJ_REMOTE_PA] = sizeof(struct lsdn_remote_pa),
+	[LSDN_OBJ_REMOTE_VIRT] = sizeof(struct lsdn_remote_virt)
+};
+
+static const char *const object_name[LSDN_OBJ_COUNT] = {
+	[LSDN_OBJ_SETTINGS] = "settings",
+	[LSDN_OBJ_NET] = "net",
+	[LSDN_OBJ_PHYS] = "phys",
+	[LSDN_OBJ_PA] = "pa",
+	[LSDN_OBJ_VIRT] = "virt",
+	[LSDN_OBJ_REMOTE_PA] = "remote_pa",
+	[LSDN_OBJ_REMOTE_VIRT] = "remote_virt"
+};
+
+static const char *const phase_name[LSDN_PHASE_COUNT] = {
+	[LSDN_PHASE_VALIDATE] = "validate",
+	[LSDN_PHASE_DECOMMIT] = "decommit",
+	[LSDN_PHASE_COMMIT] = "commit",
+	[LSDN_PHASE_ACK] = "ack"
+};
+
+static const char *const op_name[LSDN_OP_COUNT] = {
+	[LSDN_OP_CREATE_PA] = "create_pa",
+	[LSDN_OP_DESTROY_PA] = "destroy_pa",
+	[LSDN_OP_ADD_VIRT] = "add_virt",
+	[LSDN_OP_REMOVE_VIRT] = "remove_virt",
+	[LSDN_OP_ADD_REMOTE_PA] = "add_remote_pa",
+	[LSDN_OP_REMOVE_REMOTE_PA] = "remove_remote_pa",
+	[LSDN_OP_ADD_REMOTE_VIRT] = "add_remote_virt",
+	[LSDN_OP_REMOVE_REMOTE_VIRT] = "remove_remote_virt",
+	[LSDN_OP_MOVE_REMOTE_VIRT] = "move_remote_virt",
+	[LSDN_OP_UPDATE_REMOTE_PA] = "update_remote_pa",
+	[LSDN_OP_VALIDATE_PA] = "validate_pa",
+	[LSDN_OP_VALIDATE_VIRT] = "validate_virt"
+};
+
+static const char *const kind_name[LSDN_NL_KIND_COUNT] = {
+	[LSDN_NL_LINK] = "link",
+	[LSDN_NL_ADDR] = "addr",
+	[LSDN_NL_QDISC] = "qdisc",
+	[LSDN_NL_FILTER] = "filter",
+	[LSDN_NL_NEIGH] = "neigh",
+	[LSDN_NL_ACTION] = "action",
+	[LSDN_NL_OTHER] = "other"
+};
+
+/** Count a newly allocated model object. */
+void lsdn_stats_object_new(struct lsdn_context *ctx, enum lsdn_object_class cls)
+{
+	struct lsdn_commit_stats *stats = &ctx->stats;
+	if (++stats->objects[cls].live > stats->objects[cls].peak) {
+		stats->objects[cls].peak = stats->objects[cls].live;
+		stats->objects[cls].peak_bytes = stats->objects[cls].peak * object_size[cls];
+	}
+}
+
+/** Count a freed model object. */
+void lsdn_stats_object_free(struct lsdn_context *ctx, enum lsdn_object_class cls)
+{
+	assert(ctx->stats.objects[cls].live > 0);
+	ctx->stats.objects[cls].live--;
+}
+
+/** Current time for measuring the phases, in nanoseconds. */
+uint64_t lsdn_stats_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/** Account the time since `*start` to a commit phase and start measuring the next one. */
+void lsdn_stats_phase_end(struct lsdn_context *ctx, enum lsdn_commit_phase phase, uint64_t *start)
+{
+	uint64_t now = lsdn_stats_now();
+	ctx->stats.phase_ns[phase] += now - *start;
+	*start = now;
+}
+
+/** Get the work done by the commits of the context so far.
+ * @param ctx LSDN context.
+ * @param stats Filled in with the counters. */
+void lsdn_context_get_commit_stats(struct lsdn_context *ctx, struct lsdn_commit_stats *stats)
+{
+	*stats = ctx->stats;
+	stats->nl = ctx->nlsock->stats;
+}
+
+/** Start counting the work of the commits from zero.
+ * The peaks of the model objects start from the objects currently allocated. The netlink
+ * traffic is reset by `lsdn_context_reset_nl_stats`.
+ * @param ctx LSDN context. */
+void lsdn_context_reset_commit_stats(struct lsdn_context *ctx)
+{
+	struct lsdn_commit_stats *stats = &ctx->stats;
+	uint64_t live[LSDN_OBJ_COUNT];
+	for (size_t i = 0; i < LSDN_OBJ_COUNT; i++)
+		live[i] = stats->objects[i].live;
+
+	bzero(stats, sizeof(*stats));
+	for (size_t i = 0; i < LSDN_OBJ_COUNT; i++) {
+		stats->objects[i].live = live[i];
+		stats->objects[i].peak = live[i];
+		stats->objects[i].peak_bytes = live[i] * object_size[i];
+	}
+}
+
+/** Print the commit statistics in a human-readable form, one counter per line.
+ * @param out Output stream.
+ * @param stats The statistics, see `lsdn_context_get_commit_stats`. */
+void lsdn_commit_stats_format(FILE *out, const struct lsdn_commit_stats *stats)
+{
+	fprintf(out, "commits: %" PRIu64 "\n", stats->commits);
+	for (size_t i = 0; i < LSDN_PHASE_COUNT; i++)
+		fprintf(out, "phase %s: %.3f ms\n", phase_name[i], stats->phase_ns[i] / 1e6);
+	for (size_t i = 0; i < LSDN_OP_COUNT; i++)
+		fprintf(out, "net_op %s: %" PRIu64 "\n", op_name[i], stats->net_ops[i]);
+	fprintf(out, "filters: %" PRIu64 " created, %" PRIu64 " updated, %" PRIu64 " deleted\n",
+		stats->filters_created, stats->filters_updated, stats->filters_deleted);
+	fprintf(out, "broadcast filters: %" PRIu64 " rewritten, %" PRIu64 " deleted\n",
+		stats->broadcast_rewrites, stats->broadcast_deletes);
+	fprintf(out, "bpf: %" PRIu64 " programs loaded, %" PRIu64 " map updates, %" PRIu64
+		" map deletes\n",
+		stats->bpf_prog_loads, stats->bpf_map_updates, stats->bpf_map_deletes);
+	for (size_t i = 0; i < LSDN_OBJ_COUNT; i++)
+		fprintf(out, "objects %s: %" PRIu64 " live, %" PRIu64 " peak (%" PRIu64 " bytes)\n",
+			object_name[i], stats->objects[i].live, stats->objects[i].peak,
+			stats->objects[i].peak_bytes);
+	fprintf(out, "netlink: %" PRIu64 " batches, %" PRIu64 " messages, %" PRIu64 " bytes, "
+		"%" PRIu64 " errors\n",
+		stats->nl.batches, stats->nl.messages, stats->nl.bytes, stats->nl.errors);
+	for (size_t i = 0; i < LSDN_NL_KIND_COUNT; i++)
+		fprintf(out, "netlink %s: %" PRIu64 " messages, %" PRIu64 " bytes\n",
+			kind_name[i], stats->nl.kinds[i].messages, stats->nl.kinds[i].bytes);
+}
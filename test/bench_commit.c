@@ -0,0 +1,105 @@
+#include <lsdn.h>
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+/* Measures the cost of committing a small change (one virt added and removed) in a model of
+ * growing size. With incremental commit the time should not depend on the number of networks.
+ *
+ * The first phys is claimed local, but the changes are applied to the simulated kernel, so the
+ * benchmark can run unprivileged. The netlink traffic of the small commits is reported too. */
+
+#define PHYS_COUNT 16
+#define PHYS_PER_NET 4
+#define ITERATIONS 200
+
+static double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void commit(struct lsdn_context *ctx)
+{
+	lsdn_err_t err = lsdn_commit(ctx, lsdn_problem_stderr_handler, NULL);
+	if (err != LSDNE_OK)
+		abort();
+}
+
+static size_t tap_count;
+
+/* Connect the virt to a new interface in the simulated kernel */
+static void connect_virt(struct lsdn_context *ctx, struct lsdn_virt *virt, struct lsdn_phys *phys)
+{
+	char name[16];
+	snprintf(name, sizeof(name), "tap%zu", tap_count++);
+	if (lsdn_sim_add_link(ctx, name) != LSDNE_OK)
+		abort();
+	lsdn_virt_connect(virt, phys, name);
+}
+
+static void run(size_t net_count)
+{
+	struct lsdn_context *ctx = lsdn_context_new_backend("ls", LSDN_BACKEND_SIMULATOR);
+	struct lsdn_nl_stats stats;
+	lsdn_context_abort_on_nomem(ctx);
+	if (lsdn_sim_add_link(ctx, "out") != LSDNE_OK)
+		abort();
+	struct lsdn_settings *s = lsdn_settings_new_vxlan_e2e(ctx, 4789);
+	struct lsdn_phys *phys[PHYS_COUNT];
+	struct lsdn_net *first = NULL;
+
+	for (size_t i = 0; i < PHYS_COUNT; i++) {
+		phys[i] = lsdn_phys_new(ctx);
+		lsdn_phys_set_ip(phys[i], LSDN_MK_IPV4(172, 16, 0, i + 1));
+		lsdn_phys_set_iface(phys[i], "out");
+	}
+	lsdn_phys_claim_local(phys[0]);
+
+	double start = now();
+	for (size_t n = 0; n < net_count; n++) {
+		struct lsdn_net *net = lsdn_net_new(s, n + 1);
+		if (!first)
+			first = net;
+		for (size_t p = 0; p < PHYS_PER_NET; p++) {
+			struct lsdn_phys *ph = phys[(n + p) % PHYS_COUNT];
+			lsdn_phys_attach(ph, net);
+			struct lsdn_virt *virt = lsdn_virt_new(net);
+			connect_virt(ctx, virt, ph);
+		}
+	}
+	commit(ctx);
+	double initial = now() - start;
+
+	lsdn_context_reset_nl_stats(ctx);
+	start = now();
+	for (size_t i = 0; i < ITERATIONS; i++) {
+		struct lsdn_virt *virt = lsdn_virt_new(first);
+		connect_virt(ctx, virt, phys[0]);
+		commit(ctx);
+		lsdn_virt_free(virt);
+		commit(ctx);
+	}
+	double incremental = (now() - start) / (2 * ITERATIONS);
+	lsdn_context_get_nl_stats(ctx, &stats);
+
+	printf("%8zu networks %8zu virts: initial commit %10.3f ms, small commit %8.3f us"
+	       " (%.1f messages, %.0f bytes)\n",
+	       net_count, net_count * PHYS_PER_NET, initial * 1e3, incremental * 1e6,
+	       (double) stats.messages / (2 * ITERATIONS), (double) stats.bytes / (2 * ITERATIONS));
+
+	lsdn_context_free(ctx);
+}
+
+int main(int argc, const char *argv[])
+{
+	size_t max = 10000;
+	if (argc > 1)
+		max = strtoul(argv[1], NULL, 10);
+
+	for (size_t n = 10; n <= max; n *= 10)
+		run(n);
+	return 0;
+}
@@ -0,0 +1,87 @@
+#include <lsdn.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+/* Measures the time of committing and tearing down full-mesh networks of a growing number of
+ * physes. The local phys sees every other phys and every remote virt in each network, so the
+ * number of remote PA and remote virt views grows with the size of the topology.
+ *
+ * The first phys is claimed local, but the changes are applied to the simulated kernel, so the
+ * benchmark can run unprivileged. */
+
+#define NET_COUNT 16
+#define VIRTS_PER_PHYS 4
+
+static double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void run(size_t phys_count)
+{
+	struct lsdn_context *ctx = lsdn_context_new_backend("ls", LSDN_BACKEND_SIMULATOR);
+	struct lsdn_commit_stats stats;
+	lsdn_context_abort_on_nomem(ctx);
+	if (lsdn_sim_add_link(ctx, "out") != LSDNE_OK)
+		abort();
+	struct lsdn_settings *s = lsdn_settings_new_vxlan_static(ctx, 4789);
+	struct lsdn_phys **phys = calloc(phys_count, sizeof(*phys));
+	if (!phys)
+		abort();
+
+	for (size_t i = 0; i < phys_count; i++) {
+		phys[i] = lsdn_phys_new(ctx);
+		lsdn_phys_set_ip(phys[i], LSDN_MK_IPV4(172, 16, i / 256, i % 256 + 1));
+		lsdn_phys_set_iface(phys[i], "out");
+	}
+	lsdn_phys_claim_local(phys[0]);
+
+	size_t tap_count = 0;
+	for (size_t n = 0; n < NET_COUNT; n++) {
+		struct lsdn_net *net = lsdn_net_new(s, n + 1);
+		for (size_t p = 0; p < phys_count; p++) {
+			lsdn_phys_attach(phys[p], net);
+			for (size_t v = 0; v < VIRTS_PER_PHYS; v++) {
+				struct lsdn_virt *virt = lsdn_virt_new(net);
+				char name[16];
+				snprintf(name, sizeof(name), "tap%zu", tap_count++);
+				if (p == 0 && lsdn_sim_add_link(ctx, name) != LSDNE_OK)
+					abort();
+				lsdn_virt_connect(virt, phys[p], name);
+				lsdn_virt_set_mac(virt, LSDN_MK_MAC(0x02, 0x00, n, p / 256, p % 256, v));
+			}
+		}
+	}
+
+	double start = now();
+	if (lsdn_commit(ctx, lsdn_problem_stderr_handler, NULL) != LSDNE_OK)
+		abort();
+	double commit = now() - start;
+	lsdn_context_get_commit_stats(ctx, &stats);
+
+	start = now();
+	lsdn_context_cleanup(ctx, lsdn_problem_stderr_handler, NULL);
+	double teardown = now() - start;
+
+	printf("%6zu physes %8zu virts: %8" PRIu64 " remote PAs %8" PRIu64 " remote virts,"
+	       " commit %10.3f ms, teardown %10.3f ms\n",
+	       phys_count, phys_count * NET_COUNT * VIRTS_PER_PHYS,
+	       stats.objects[LSDN_OBJ_REMOTE_PA].peak, stats.objects[LSDN_OBJ_REMOTE_VIRT].peak,
+	       commit * 1e3, teardown * 1e3);
+	free(phys);
+}
+
+int main(int argc, const char *argv[])
+{
+	size_t max = 256;
+	if (argc > 1)
+		max = strtoul(argv[1], NULL, 10);
+
+	for (size_t p = 4; p <= max; p *= 2)
+		run(p);
+	return 0;
+}
@@ -2,7 +2,7 @@
 #include <stdlib.h>
 #include <string.h>
 
-struct lsdn_settings *settings_from_env(struct lsdn_context *ctx) {
+static struct lsdn_settings *settings_from_nettype(struct lsdn_context *ctx) {
 	const char *nettype = getenv("LSCTL_NETTYPE");
 	if (!nettype) {
 		fprintf(stderr, "no LSCTL_NETTYPE\n");
@@ -21,5 +21,15 @@ struct lsdn_settings *settings_from_env(struct lsdn_context *ctx) {
 		fprintf(stderr, "Unknown nettype: %s\n", nettype);
 		abort();
 	}
+}
 
+struct lsdn_settings *settings_from_env(struct lsdn_context *ctx) {
+	struct lsdn_settings *s = settings_from_nettype(ctx);
+	if (getenv("LSCTL_SHARED_BLOCKS"))
+		lsdn_settings_set_shared_blocks(s, true);
+	if (getenv("LSCTL_CHAIN_SWITCHING"))
+		lsdn_settings_set_chain_switching(s, true);
+	if (getenv("LSCTL_BPF_SWITCHING"))
+		lsdn_settings_set_bpf_switching(s, true);
+	return s;
 }
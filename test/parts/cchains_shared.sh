@@ -0,0 +1,11 @@
+NETCONF="cchains_shared"
+export LSCTL_CHAIN_SWITCHING=1
+export LSCTL_SHARED_BLOCKS=1
+
+function connect(){
+	for p in $PHYS_LIST; do
+		pass in_phys $p ${TEST_RUNNER:-} ./test_basic $p
+	done
+}
+
+source "parts/basic_common.sh"
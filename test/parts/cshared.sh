@@ -0,0 +1,10 @@
+NETCONF="cshared"
+export LSCTL_SHARED_BLOCKS=1
+
+function connect(){
+	for p in $PHYS_LIST; do
+		pass in_phys $p ${TEST_RUNNER:-} ./test_basic $p
+	done
+}
+
+source "parts/basic_common.sh"
@@ -0,0 +1,23 @@
+# Measures the latency and packet rate between the virts, for comparing the switching methods.
+# Flood ping sends the next packet as soon as the reply comes back, so the rate is also bounded
+# by the latency. The numbers are only printed, the test fails only if the packets are lost.
+perf_count=20000
+
+function perf_ping(){
+	local phys="$1"
+	local virt="$2"
+	local ip="$3"
+	# resolve the neighbors first, so that only the switching is measured
+	pass in_virt $phys $virt $qping $ip
+	local start=$(date +%s%N)
+	pass in_virt $phys $virt ping -q -f -c $perf_count -w 60 $ip
+	local end=$(date +%s%N)
+	echo "perf $NETCONF $phys-$virt -> $ip: $((perf_count * 1000000000 / (end - start))) pps"
+}
+
+function test(){
+	# same phys
+	perf_ping a 1 192.168.99.2
+	# through the tunnel
+	perf_ping a 1 192.168.99.4
+}
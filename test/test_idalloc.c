@@ -0,0 +1,56 @@
+#include "../netmodel/private/idalloc.h"
+#include <stdlib.h>
+
+static uint32_t get(struct lsdn_idalloc *a)
+{
+	uint32_t id;
+	if (!lsdn_idalloc_get(a, &id))
+		abort();
+	return id;
+}
+
+static void check_stats(struct lsdn_idalloc *a, uint32_t allocated, uint32_t peak, uint32_t span)
+{
+	struct lsdn_idalloc_stats stats;
+	lsdn_idalloc_get_stats(a, &stats);
+	if (stats.allocated != allocated || stats.peak != peak || stats.span != span)
+		abort();
+}
+
+int main()
+{
+	struct lsdn_idalloc a;
+	uint32_t id;
+
+	/* the whole range is given out, lowest first, and then exhausted */
+	lsdn_idalloc_init(&a, 1, 200);
+	for (uint32_t i = 1; i < 200; i++)
+		if (get(&a) != i)
+			abort();
+	if (lsdn_idalloc_get(&a, &id))
+		abort();
+	check_stats(&a, 199, 199, 199);
+
+	/* returned IDs are reused, the lowest one first */
+	lsdn_idalloc_return(&a, 150);
+	lsdn_idalloc_return(&a, 70);
+	lsdn_idalloc_return(&a, 199);
+	check_stats(&a, 196, 199, 198);
+	if (get(&a) != 70 || get(&a) != 150 || get(&a) != 199)
+		abort();
+	lsdn_idalloc_free(&a);
+
+	/* long churn does not exhaust the range */
+	lsdn_idalloc_init(&a, 1, 0xFFFF);
+	for (uint32_t i = 1; i <= 1000; i++)
+		get(&a);
+	for (uint32_t i = 0; i < 1000000; i++) {
+		uint32_t returned = 1 + (i * 7) % 1000;
+		lsdn_idalloc_return(&a, returned);
+		if (get(&a) != returned)
+			abort();
+	}
+	check_stats(&a, 1000, 1000, 1000);
+	lsdn_idalloc_free(&a);
+	return 0;
+}
@@ -0,0 +1,860 @@
+#include <lsdn.h>
+#include <rules.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/* Commits a small network into the simulated kernel and checks that the kernel state is created
+ * without errors and torn down completely again. Runs unprivileged. */
+
+static struct lsdn_settings *mk_vlan(struct lsdn_context *ctx)
+{
+	return lsdn_settings_new_vlan(ctx);
+}
+
+static struct lsdn_settings *mk_vxlan_e2e(struct lsdn_context *ctx)
+{
+	return lsdn_settings_new_vxlan_e2e(ctx, 4789);
+}
+
+static struct lsdn_settings *mk_vxlan_static(struct lsdn_context *ctx)
+{
+	return lsdn_settings_new_vxlan_static(ctx, 4789);
+}
+
+static struct lsdn_settings *mk_vxlan_static_chains(struct lsdn_context *ctx)
+{
+	struct lsdn_settings *s = lsdn_settings_new_vxlan_static(ctx, 4789);
+	lsdn_settings_set_chain_switching(s, true);
+	return s;
+}
+
+static struct lsdn_settings *mk_vxlan_static_bpf(struct lsdn_context *ctx)
+{
+	struct lsdn_settings *s = lsdn_settings_new_vxlan_static(ctx, 4789);
+	lsdn_settings_set_bpf_switching(s, true);
+	return s;
+}
+
+static struct lsdn_settings *mk_vxlan_static_shared(struct lsdn_context *ctx)
+{
+	struct lsdn_settings *s = lsdn_settings_new_vxlan_static(ctx, 4789);
+	lsdn_settings_set_shared_blocks(s, true);
+	return s;
+}
+
+static void commit(struct lsdn_context *ctx)
+{
+	if (lsdn_commit(ctx, lsdn_problem_stderr_handler, NULL) != LSDNE_OK)
+		abort();
+}
+
+static void count_problems(const struct lsdn_problem *problem, void *user)
+{
+	(void) problem;
+	(*(int *) user)++;
+}
+
+static void add_link(struct lsdn_context *ctx, const char *name)
+{
+	if (lsdn_sim_add_link(ctx, name) != LSDNE_OK)
+		abort();
+}
+
+struct network {
+	struct lsdn_settings *s;
+	struct lsdn_net *net;
+	struct lsdn_phys *local;
+	struct lsdn_phys *remote;
+	struct lsdn_virt *v1;
+	struct lsdn_virt *v2;
+	struct lsdn_virt *v3;
+};
+
+static void build(struct lsdn_context *ctx, struct network *n,
+	struct lsdn_settings *(*mk_settings)(struct lsdn_context *ctx))
+{
+	n->s = mk_settings(ctx);
+	n->net = lsdn_net_new(n->s, 10);
+	n->local = lsdn_phys_new(ctx);
+	n->remote = lsdn_phys_new(ctx);
+	lsdn_phys_set_ip(n->local, LSDN_MK_IPV4(172, 16, 0, 1));
+	lsdn_phys_set_iface(n->local, "out");
+	lsdn_phys_set_ip(n->remote, LSDN_MK_IPV4(172, 16, 0, 2));
+	lsdn_phys_set_iface(n->remote, "out");
+	lsdn_phys_attach(n->local, n->net);
+	lsdn_phys_attach(n->remote, n->net);
+	lsdn_phys_claim_local(n->local);
+
+	n->v1 = lsdn_virt_new(n->net);
+	lsdn_virt_connect(n->v1, n->local, "tap0");
+	lsdn_virt_set_mac(n->v1, LSDN_MK_MAC(0x00, 0x00, 0x00, 0x00, 0x00, 0xa1));
+	n->v2 = lsdn_virt_new(n->net);
+	lsdn_virt_connect(n->v2, n->local, "tap1");
+	lsdn_virt_set_mac(n->v2, LSDN_MK_MAC(0x00, 0x00, 0x00, 0x00, 0x00, 0xa2));
+	n->v3 = lsdn_virt_new(n->net);
+	lsdn_virt_connect(n->v3, n->remote, "tap0");
+	lsdn_virt_set_mac(n->v3, LSDN_MK_MAC(0x00, 0x00, 0x00, 0x00, 0x00, 0xb1));
+}
+
+static void teardown(struct lsdn_context *ctx, struct network *n)
+{
+	struct lsdn_nl_stats stats;
+	struct lsdn_sim_state state;
+
+	lsdn_net_free(n->net);
+	lsdn_phys_free(n->local);
+	lsdn_phys_free(n->remote);
+	lsdn_settings_free(n->s);
+	commit(ctx);
+	lsdn_context_get_nl_stats(ctx, &stats);
+	lsdn_sim_get_state(ctx, &state);
+	if (stats.errors != 0)
+		abort();
+	if (state.links != 3 || state.blocks != 0 || state.chains != 0
+	    || state.filters != 0 || state.actions != 0 || state.fdb_entries != 0
+	    || state.bpf_progs != 0 || state.bpf_maps != 0)
+		abort();
+}
+
+static struct lsdn_phys *add_remote(struct lsdn_context *ctx, struct network *n, uint8_t host)
+{
+	struct lsdn_phys *phys = lsdn_phys_new(ctx);
+	lsdn_phys_set_ip(phys, LSDN_MK_IPV4(172, 16, 1, host));
+	lsdn_phys_set_iface(phys, "out");
+	lsdn_phys_attach(phys, n->net);
+	return phys;
+}
+
+static struct lsdn_context *new_context()
+{
+	struct lsdn_context *ctx = lsdn_context_new_backend("ls", LSDN_BACKEND_SIMULATOR);
+	lsdn_context_abort_on_nomem(ctx);
+	add_link(ctx, "out");
+	add_link(ctx, "tap0");
+	add_link(ctx, "tap1");
+	return ctx;
+}
+
+static void run(struct lsdn_settings *(*mk_settings)(struct lsdn_context *ctx))
+{
+	struct lsdn_context *ctx = new_context();
+	struct lsdn_sim_state state;
+	struct lsdn_nl_stats stats;
+	struct lsdn_commit_stats cstats;
+	struct network n;
+	if (lsdn_sim_add_link(ctx, "tap1") != LSDNE_DUPLICATE)
+		abort();
+
+	build(ctx, &n, mk_settings);
+	commit(ctx);
+
+	lsdn_context_get_nl_stats(ctx, &stats);
+	lsdn_sim_get_state(ctx, &state);
+	if (stats.messages == 0 || stats.errors != 0)
+		abort();
+	/* at least the tunnel interface was created and the virts got their qdiscs */
+	if (state.links <= 3 || state.qdiscs < 2)
+		abort();
+	lsdn_context_get_commit_stats(ctx, &cstats);
+	if (cstats.commits != 1 || cstats.net_ops[LSDN_OP_CREATE_PA] != 1
+	    || cstats.objects[LSDN_OBJ_VIRT].live != 3
+	    || cstats.nl.kinds[LSDN_NL_QDISC].messages < 2)
+		abort();
+
+	/* a vanished interface is noticed and the virt is recommitted once it is back */
+	int problems = 0;
+	if (lsdn_sim_del_link(ctx, "tap1") != LSDNE_OK)
+		abort();
+	if (lsdn_commit(ctx, count_problems, &problems) != LSDNE_VALIDATE || problems != 1)
+		abort();
+	add_link(ctx, "tap1");
+	commit(ctx);
+	lsdn_context_get_nl_stats(ctx, &stats);
+	if (stats.errors != 0)
+		abort();
+
+	/* names can be looked up, changed and removed */
+	if (lsdn_virt_set_name(n.v2, "v2") != LSDNE_OK || lsdn_virt_by_name(n.net, "v2") != n.v2
+	    || lsdn_virt_set_name(n.v2, "tap1") != LSDNE_OK || lsdn_virt_by_name(n.net, "v2")
+	    || lsdn_virt_set_name(n.v2, NULL) != LSDNE_OK || lsdn_virt_by_name(n.net, "tap1"))
+		abort();
+
+	/* removing a virt removes its rules, but not its interface */
+	lsdn_virt_free(n.v2);
+	commit(ctx);
+	lsdn_sim_get_state(ctx, &state);
+	if (state.links <= 3)
+		abort();
+
+	teardown(ctx, &n);
+	lsdn_context_free(ctx);
+}
+
+static void same_state(const struct lsdn_sim_state *a, const struct lsdn_sim_state *b)
+{
+	if (a->links != b->links || a->qdiscs != b->qdiscs || a->blocks != b->blocks
+	    || a->chains != b->chains || a->filters != b->filters || a->actions != b->actions
+	    || a->fdb_entries != b->fdb_entries || a->bpf_progs != b->bpf_progs
+	    || a->bpf_maps != b->bpf_maps || a->bpf_map_entries != b->bpf_map_entries)
+		abort();
+}
+
+/* A restarted context takes over the kernel state of its predecessor instead of rebuilding it */
+static void run_restart(struct lsdn_settings *(*mk_settings)(struct lsdn_context *ctx))
+{
+	struct lsdn_context *old = new_context();
+	struct lsdn_sim_state before, after;
+	struct lsdn_nl_stats initial, stats;
+	struct network n;
+	int problems = 0;
+
+	build(old, &n, mk_settings);
+	commit(old);
+	lsdn_context_get_nl_stats(old, &initial);
+	lsdn_sim_get_state(old, &before);
+	/* something left by an even older context */
+	add_link(old, "ls-99");
+
+	struct lsdn_context *ctx = lsdn_context_new_sim_peer("ls", old);
+	lsdn_context_abort_on_nomem(ctx);
+	/* leaves the kernel state as it is */
+	lsdn_context_free(old);
+
+	build(ctx, &n, mk_settings);
+	if (lsdn_context_warm_restart(ctx) != LSDNE_OK)
+		abort();
+	commit(ctx);
+	lsdn_context_get_nl_stats(ctx, &stats);
+	lsdn_sim_get_state(ctx, &after);
+	if (stats.errors != 0 || stats.messages >= initial.messages)
+		abort();
+	same_state(&before, &after);
+	/* the adopted filters and actions match the kernel's dumps */
+	if (lsdn_audit(ctx, false, count_problems, &problems) != LSDNE_OK || problems != 0)
+		abort();
+
+	teardown(ctx, &n);
+	lsdn_context_free(ctx);
+}
+
+/* The restarted context adopts the tunnel_key actions of its predecessor by their index, updates
+ * the ones it uses for other remotes and deletes the ones it does not use at all */
+static void run_restart_tunnel_keys(void)
+{
+	struct lsdn_context *old = new_context();
+	struct lsdn_sim_state before, after;
+	struct lsdn_nl_stats stats;
+	struct network n;
+	int problems = 0;
+
+	build(old, &n, mk_vxlan_static);
+	add_remote(old, &n, 1);
+	add_remote(old, &n, 2);
+	commit(old);
+	lsdn_sim_get_state(old, &before);
+	if (before.actions != 3)
+		abort();
+
+	struct lsdn_context *ctx = lsdn_context_new_sim_peer("ls", old);
+	lsdn_context_abort_on_nomem(ctx);
+	lsdn_context_free(old);
+
+	build(ctx, &n, mk_vxlan_static);
+	struct lsdn_phys *remote = add_remote(ctx, &n, 2);
+	if (lsdn_context_warm_restart(ctx) != LSDNE_OK)
+		abort();
+	commit(ctx);
+	lsdn_context_get_nl_stats(ctx, &stats);
+	lsdn_sim_get_state(ctx, &after);
+	if (stats.errors != 0 || after.actions != 2)
+		abort();
+	if (lsdn_audit(ctx, false, count_problems, &problems) != LSDNE_OK || problems != 0)
+		abort();
+
+	lsdn_phys_free(remote);
+	teardown(ctx, &n);
+	lsdn_context_free(ctx);
+}
+
+/* The tunnel_key actions live in a netns-wide index space. An index taken by another context is
+ * reported and left alone, not replaced. */
+static void run_foreign_tunnel_key(void)
+{
+	struct lsdn_context *ctx = new_context();
+	struct lsdn_sim_state before, after;
+	struct network n;
+	int problems = 0;
+
+	build(ctx, &n, mk_vxlan_static);
+	commit(ctx);
+	lsdn_sim_get_state(ctx, &before);
+	if (before.actions != 1)
+		abort();
+
+	struct lsdn_context *other = lsdn_context_new_sim_peer("lt", ctx);
+	lsdn_context_abort_on_nomem(other);
+	struct lsdn_settings *s = lsdn_settings_new_vxlan_static(other, 4790);
+	struct lsdn_net *net = lsdn_net_new(s, 20);
+	struct lsdn_phys *local = lsdn_phys_new(other);
+	struct lsdn_phys *remote = lsdn_phys_new(other);
+	lsdn_phys_set_ip(local, LSDN_MK_IPV4(172, 16, 2, 1));
+	lsdn_phys_set_iface(local, "out");
+	lsdn_phys_set_ip(remote, LSDN_MK_IPV4(172, 16, 2, 2));
+	lsdn_phys_attach(local, net);
+	lsdn_phys_attach(remote, net);
+	lsdn_phys_claim_local(local);
+	if (lsdn_commit(other, count_problems, &problems) != LSDNE_COMMIT || problems != 1)
+		abort();
+	lsdn_sim_get_state(ctx, &after);
+	if (after.actions != 1)
+		abort();
+
+	/* the foreign action is not deleted with the remote */
+	problems = 0;
+	lsdn_context_cleanup(other, count_problems, &problems);
+	lsdn_sim_get_state(ctx, &after);
+	if (problems != 0)
+		abort();
+	same_state(&before, &after);
+
+	teardown(ctx, &n);
+	lsdn_context_free(ctx);
+}
+
+/* A request the kernel rejects fails the commit with a problem, the rest is still committed */
+static void run_rejected(void)
+{
+	struct lsdn_context *ctx = new_context();
+	struct lsdn_nl_stats stats;
+	struct network n;
+	int problems = 0;
+
+	build(ctx, &n, mk_vlan);
+	commit(ctx);
+
+	/* the interface has the qdiscs of the first context already, it can not be bound to blocks */
+	struct lsdn_context *other = lsdn_context_new_sim_peer("lt", ctx);
+	lsdn_context_abort_on_nomem(other);
+	struct lsdn_settings *s = mk_vxlan_static_shared(other);
+	struct lsdn_net *net = lsdn_net_new(s, 20);
+	struct lsdn_phys *local = lsdn_phys_new(other);
+	lsdn_phys_set_ip(local, LSDN_MK_IPV4(172, 16, 2, 1));
+	lsdn_phys_set_iface(local, "out");
+	lsdn_phys_attach(local, net);
+	lsdn_phys_claim_local(local);
+	struct lsdn_virt *virt = lsdn_virt_new(net);
+	lsdn_virt_connect(virt, local, "tap0");
+	lsdn_virt_set_mac(virt, LSDN_MK_MAC(0x00, 0x00, 0x00, 0x00, 0x00, 0xc1));
+	/* the clsact qdisc and the filters in its blocks */
+	if (lsdn_commit(other, count_problems, &problems) != LSDNE_COMMIT || problems != 3)
+		abort();
+	lsdn_context_get_nl_stats(other, &stats);
+	if (stats.errors != 3)
+		abort();
+
+	/* the links of the other context were created nevertheless */
+	lsdn_context_free(other);
+	if (lsdn_sim_del_link(ctx, "lt-1") != LSDNE_OK || lsdn_sim_del_link(ctx, "lt-2") != LSDNE_OK)
+		abort();
+	teardown(ctx, &n);
+	lsdn_context_free(ctx);
+}
+
+/* Changes made to the kernel behind the context's back are found by an audit and repaired */
+static void run_audit(struct lsdn_settings *(*mk_settings)(struct lsdn_context *ctx))
+{
+	struct lsdn_context *ctx = new_context();
+	struct lsdn_sim_state before, after;
+	struct network n;
+	int problems = 0;
+
+	build(ctx, &n, mk_settings);
+	commit(ctx);
+	lsdn_sim_get_state(ctx, &before);
+	if (lsdn_audit(ctx, false, count_problems, &problems) != LSDNE_OK || problems != 0)
+		abort();
+
+	if (lsdn_sim_del_qdiscs(ctx, "tap0") != LSDNE_OK)
+		abort();
+	add_link(ctx, "ls-50");
+	if (lsdn_audit(ctx, false, count_problems, &problems) != LSDNE_DRIFT || problems < 2)
+		abort();
+	problems = 0;
+	if (lsdn_audit(ctx, true, count_problems, &problems) != LSDNE_DRIFT || problems < 2)
+		abort();
+	problems = 0;
+	if (lsdn_audit(ctx, false, count_problems, &problems) != LSDNE_OK || problems != 0)
+		abort();
+	lsdn_sim_get_state(ctx, &after);
+	same_state(&before, &after);
+
+	teardown(ctx, &n);
+	lsdn_context_free(ctx);
+}
+
+/* The virts are bound to the shared blocks by their clsact qdiscs. The blocks are destroyed with
+ * the last qdisc, the repair creates them again and sends their filters. */
+static void run_audit_blocks(void)
+{
+	struct lsdn_context *ctx = new_context();
+	struct lsdn_sim_state before, after;
+	struct network n;
+	int problems = 0;
+
+	build(ctx, &n, mk_vxlan_static_shared);
+	commit(ctx);
+	lsdn_sim_get_state(ctx, &before);
+	if (before.blocks != 2)
+		abort();
+
+	/* tap1 still holds the blocks, only the binding of tap0 is missing */
+	if (lsdn_sim_del_qdiscs(ctx, "tap0") != LSDNE_OK)
+		abort();
+	if (lsdn_audit(ctx, true, count_problems, &problems) != LSDNE_DRIFT || problems != 1)
+		abort();
+	problems = 0;
+	if (lsdn_audit(ctx, false, count_problems, &problems) != LSDNE_OK || problems != 0)
+		abort();
+	lsdn_sim_get_state(ctx, &after);
+	same_state(&before, &after);
+
+	/* both qdiscs and both blocks are missing */
+	if (lsdn_sim_del_qdiscs(ctx, "tap0") != LSDNE_OK || lsdn_sim_del_qdiscs(ctx, "tap1") != LSDNE_OK)
+		abort();
+	lsdn_sim_get_state(ctx, &after);
+	if (after.blocks != 0)
+		abort();
+	if (lsdn_audit(ctx, true, count_problems, &problems) != LSDNE_DRIFT || problems != 4)
+		abort();
+	problems = 0;
+	if (lsdn_audit(ctx, false, count_problems, &problems) != LSDNE_OK || problems != 0)
+		abort();
+	lsdn_sim_get_state(ctx, &after);
+	same_state(&before, &after);
+
+	teardown(ctx, &n);
+	lsdn_context_free(ctx);
+}
+
+/* A virt migrating between two remote physes is moved in place, its forwarding is only updated */
+static void run_migrate(struct lsdn_settings *(*mk_settings)(struct lsdn_context *ctx))
+{
+	struct lsdn_context *ctx = new_context();
+	struct lsdn_commit_stats stats;
+	struct network n;
+
+	build(ctx, &n, mk_settings);
+	struct lsdn_phys *other = lsdn_phys_new(ctx);
+	lsdn_phys_set_ip(other, LSDN_MK_IPV4(172, 16, 0, 3));
+	lsdn_phys_set_iface(other, "out");
+	lsdn_phys_attach(other, n.net);
+	struct lsdn_virt *v = lsdn_virt_new(n.net);
+	lsdn_virt_connect(v, n.remote, "tap9");
+	lsdn_virt_set_mac(v, LSDN_MK_MAC(0x00, 0x00, 0x00, 0x00, 0x00, 0xc1));
+	commit(ctx);
+
+	lsdn_context_reset_commit_stats(ctx);
+	lsdn_virt_connect(v, other, "tap9");
+	commit(ctx);
+	lsdn_context_get_commit_stats(ctx, &stats);
+	if (stats.net_ops[LSDN_OP_REMOVE_REMOTE_VIRT] != 0 || stats.net_ops[LSDN_OP_ADD_REMOTE_VIRT] != 0
+	    || stats.filters_created != 0 || stats.filters_deleted != 0 || stats.nl.errors != 0)
+		abort();
+	if (mk_settings == mk_vxlan_static
+	    && (stats.net_ops[LSDN_OP_MOVE_REMOTE_VIRT] != 1 || stats.filters_updated != 1))
+		abort();
+	if (mk_settings == mk_vxlan_static_bpf
+	    && (stats.net_ops[LSDN_OP_MOVE_REMOTE_VIRT] != 1 || stats.filters_updated != 0
+	        || stats.bpf_map_updates != 1))
+		abort();
+
+	lsdn_phys_free(other);
+	teardown(ctx, &n);
+	lsdn_context_free(ctx);
+}
+
+/* A remote phys changing its IP only updates the tunnel_key action shared by the filters */
+static void run_readdress(struct lsdn_settings *(*mk_settings)(struct lsdn_context *ctx))
+{
+	struct lsdn_context *ctx = new_context();
+	struct lsdn_commit_stats stats;
+	struct lsdn_sim_state state;
+	struct network n;
+
+	build(ctx, &n, mk_settings);
+	commit(ctx);
+	lsdn_sim_get_state(ctx, &state);
+	if (state.actions != 1)
+		abort();
+
+	lsdn_context_reset_commit_stats(ctx);
+	lsdn_context_reset_nl_stats(ctx);
+	lsdn_phys_set_ip(n.remote, LSDN_MK_IPV4(172, 16, 0, 4));
+	commit(ctx);
+	lsdn_context_get_commit_stats(ctx, &stats);
+	lsdn_sim_get_state(ctx, &state);
+	if (stats.net_ops[LSDN_OP_UPDATE_REMOTE_PA] != 1 || stats.net_ops[LSDN_OP_ADD_REMOTE_PA] != 0
+	    || stats.net_ops[LSDN_OP_REMOVE_REMOTE_PA] != 0
+	    || stats.filters_created != 0 || stats.filters_updated != 0 || stats.filters_deleted != 0
+	    || stats.nl.kinds[LSDN_NL_ACTION].messages != 1 || stats.nl.errors != 0
+	    || state.actions != 1)
+		abort();
+
+	/* the local phys changing its IP recreates the views */
+	lsdn_context_reset_commit_stats(ctx);
+	lsdn_phys_set_ip(n.local, LSDN_MK_IPV4(172, 16, 0, 5));
+	commit(ctx);
+	lsdn_context_get_commit_stats(ctx, &stats);
+	lsdn_sim_get_state(ctx, &state);
+	if (stats.net_ops[LSDN_OP_UPDATE_REMOTE_PA] != 0 || stats.net_ops[LSDN_OP_ADD_REMOTE_PA] != 1
+	    || stats.nl.errors != 0 || state.actions != 1)
+		abort();
+
+	teardown(ctx, &n);
+	lsdn_context_free(ctx);
+}
+
+/* Virts created in bulk are committed like the ones created one by one */
+static void run_bulk(struct lsdn_settings *(*mk_settings)(struct lsdn_context *ctx))
+{
+	struct lsdn_context *ctx = new_context();
+	struct lsdn_commit_stats stats;
+	struct lsdn_virt *virts[3];
+	struct network n;
+	lsdn_mac_t macs[] = {
+		LSDN_MK_MAC(0x00, 0x00, 0x00, 0x00, 0x00, 0xd1),
+		LSDN_MK_MAC(0x00, 0x00, 0x00, 0x00, 0x00, 0xd2),
+		LSDN_MK_MAC(0x00, 0x00, 0x00, 0x00, 0x00, 0xd3)
+	};
+	struct lsdn_virt_desc descs[] = {
+		{ .name = "b1", .iface = "tap1", .mac = &macs[0] },
+		{ .name = "b2", .iface = "tap2", .mac = &macs[1] },
+		{ .name = "b1", .iface = "tap3", .mac = &macs[2] }
+	};
+
+	build(ctx, &n, mk_settings);
+	commit(ctx);
+
+	if (lsdn_virts_new(n.net, n.remote, descs, 0, virts) != LSDNE_OK)
+		abort();
+	/* a repeated name is found before anything is created */
+	if (lsdn_virts_new(n.net, n.remote, descs, 3, virts) != LSDNE_DUPLICATE)
+		abort();
+	lsdn_context_get_commit_stats(ctx, &stats);
+	if (stats.objects[LSDN_OBJ_VIRT].live != 3)
+		abort();
+
+	descs[2].name = "b3";
+	if (lsdn_virts_new(n.net, n.remote, descs, 3, virts) != LSDNE_OK)
+		abort();
+	if (lsdn_virt_by_name(n.net, "b2") != virts[1] || lsdn_virt_by_name(n.net, "b3") != virts[2])
+		abort();
+	lsdn_context_reset_commit_stats(ctx);
+	commit(ctx);
+	lsdn_context_get_commit_stats(ctx, &stats);
+	if (stats.objects[LSDN_OBJ_VIRT].live != 6 || stats.nl.errors != 0)
+		abort();
+	if (mk_settings == mk_vxlan_static && stats.net_ops[LSDN_OP_ADD_REMOTE_VIRT] != 3)
+		abort();
+
+	teardown(ctx, &n);
+	lsdn_context_free(ctx);
+}
+
+/* With neighbor suppression, the virts need unique IPs and get rules for their ARP and ND */
+static void run_suppress(struct lsdn_settings *(*mk_settings)(struct lsdn_context *ctx))
+{
+	struct lsdn_context *ctx = new_context();
+	struct lsdn_commit_stats stats;
+	struct network n;
+	int problems = 0;
+
+	build(ctx, &n, mk_settings);
+	lsdn_settings_set_neigh_suppression(n.s, true);
+	lsdn_virt_set_ip(n.v1, LSDN_MK_IPV4(10, 0, 0, 1));
+	lsdn_virt_set_ip(n.v2, LSDN_MK_IPV4(10, 0, 0, 1));
+	lsdn_virt_set_ip(n.v3, LSDN_MK_IPV6(
+		0xfd, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0x03));
+	if (lsdn_commit(ctx, count_problems, &problems) != LSDNE_VALIDATE || problems == 0)
+		abort();
+
+	lsdn_virt_set_ip(n.v2, LSDN_MK_IPV4(10, 0, 0, 2));
+	commit(ctx);
+	lsdn_context_get_commit_stats(ctx, &stats);
+	if (stats.nl.errors != 0 || stats.filters_created == 0)
+		abort();
+
+	/* switching it off again recreates the networks without the rules */
+	lsdn_settings_set_neigh_suppression(n.s, false);
+	commit(ctx);
+	lsdn_context_get_commit_stats(ctx, &stats);
+	if (stats.nl.errors != 0)
+		abort();
+
+	teardown(ctx, &n);
+	lsdn_context_free(ctx);
+}
+
+/* Chain switching needs no dummy interface, the forwarding tables go to chains instead */
+static void run_chains(void)
+{
+	struct lsdn_sim_state redirect, chains;
+	struct network n;
+
+	struct lsdn_context *ctx = new_context();
+	build(ctx, &n, mk_vxlan_static);
+	commit(ctx);
+	lsdn_sim_get_state(ctx, &redirect);
+	teardown(ctx, &n);
+	lsdn_context_free(ctx);
+
+	ctx = new_context();
+	build(ctx, &n, mk_vxlan_static_chains);
+	commit(ctx);
+	lsdn_sim_get_state(ctx, &chains);
+	teardown(ctx, &n);
+	lsdn_context_free(ctx);
+
+	if (chains.links >= redirect.links || chains.chains <= redirect.chains)
+		abort();
+}
+
+/* With BPF switching, the forwarding lives in maps and adding a remote virt changes no filters */
+static void run_bpf(void)
+{
+	struct lsdn_context *ctx = new_context();
+	struct lsdn_commit_stats stats;
+	struct lsdn_sim_state state;
+	struct network n;
+
+	build(ctx, &n, mk_vxlan_static_bpf);
+	commit(ctx);
+	lsdn_sim_get_state(ctx, &state);
+	if (state.bpf_progs != 1 || state.bpf_maps != 2 || state.bpf_map_entries == 0
+	    || state.actions != 0)
+		abort();
+
+	lsdn_context_reset_commit_stats(ctx);
+	struct lsdn_virt *v = lsdn_virt_new(n.net);
+	lsdn_virt_connect(v, n.remote, "tap9");
+	lsdn_virt_set_mac(v, LSDN_MK_MAC(0x00, 0x00, 0x00, 0x00, 0x00, 0xc2));
+	commit(ctx);
+	lsdn_context_get_commit_stats(ctx, &stats);
+	if (stats.bpf_map_updates != 1 || stats.bpf_prog_loads != 0 || stats.filters_created != 0
+	    || stats.filters_updated != 0 || stats.filters_deleted != 0 || stats.nl.errors != 0)
+		abort();
+
+	/* the remote phys changing its IP only rewrites its route */
+	lsdn_context_reset_commit_stats(ctx);
+	lsdn_phys_set_ip(n.remote, LSDN_MK_IPV4(172, 16, 0, 4));
+	commit(ctx);
+	lsdn_context_get_commit_stats(ctx, &stats);
+	if (stats.net_ops[LSDN_OP_UPDATE_REMOTE_PA] != 1 || stats.bpf_map_updates != 1
+	    || stats.filters_created != 0 || stats.filters_updated != 0 || stats.nl.errors != 0)
+		abort();
+
+	/* neighbor suppression is ignored, so the virts still need no IPs */
+	lsdn_settings_set_neigh_suppression(n.s, true);
+	commit(ctx);
+
+	teardown(ctx, &n);
+	lsdn_context_free(ctx);
+}
+
+static struct lsdn_vr *add_drop_ip(struct lsdn_virt *virt, uint16_t prio, lsdn_ip_t ip)
+{
+	struct lsdn_vr *vr = lsdn_vr_new(virt, prio, LSDN_IN);
+	lsdn_vr_add_src_ip(vr, ip, &lsdn_vr_drop);
+	return vr;
+}
+
+/* Rule priorities with the same mask share a filter priority, if the rules between allow it */
+static void run_vr_compile(void)
+{
+	struct lsdn_context *ctx = new_context();
+	struct lsdn_commit_stats stats;
+	struct network n;
+
+	build(ctx, &n, mk_vxlan_static);
+	struct lsdn_vr *first = add_drop_ip(n.v1, 1, LSDN_MK_IPV4(10, 0, 0, 1));
+	add_drop_ip(n.v1, 2, LSDN_MK_IPV6(0xfd, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0x01));
+	add_drop_ip(n.v1, 3, LSDN_MK_IPV4(10, 0, 0, 3));
+	struct lsdn_vr *mac = lsdn_vr_new(n.v1, 4, LSDN_IN);
+	lsdn_vr_add_src_mac(mac, LSDN_MK_MAC(0x00, 0x00, 0x00, 0x00, 0x00, 0xc1), &lsdn_vr_drop);
+	add_drop_ip(n.v1, 5, LSDN_MK_IPV4(10, 0, 0, 5));
+	commit(ctx);
+	if (lsdn_vr_count_lookups(n.v1, LSDN_IN) != 3 || lsdn_vr_count_lookups(n.v1, LSDN_OUT) != 0)
+		abort();
+
+	/* the same match again can not go to the same filter priority */
+	add_drop_ip(n.v1, 6, LSDN_MK_IPV4(10, 0, 0, 1));
+	commit(ctx);
+	if (lsdn_vr_count_lookups(n.v1, LSDN_IN) != 4)
+		abort();
+
+	/* without the first priority, the others are merged to the next one */
+	lsdn_context_reset_commit_stats(ctx);
+	lsdn_vr_free(first);
+	commit(ctx);
+	lsdn_context_get_commit_stats(ctx, &stats);
+	if (lsdn_vr_count_lookups(n.v1, LSDN_IN) != 3 || stats.nl.errors != 0)
+		abort();
+
+	teardown(ctx, &n);
+	lsdn_context_free(ctx);
+}
+
+/* Check the broadcast filters of an interface (those outside the ruleset's chain 0): their
+ * prios are 1..count and each has the given number of actions, including the continue */
+static void check_br_filters(struct lsdn_context *ctx, const char *ifname,
+	const size_t *actions, size_t count)
+{
+	struct lsdn_sim_filter all[64];
+	size_t total = lsdn_sim_get_filters(ctx, ifname, all, 64);
+	size_t br = 0;
+	if (total > 64)
+		abort();
+	for (size_t i = 0; i < total; i++) {
+		if (all[i].chain == 0)
+			continue;
+		if (br >= count || all[i].prio != br + 1 || all[i].actions != actions[br])
+			abort();
+		br++;
+	}
+	if (br != count)
+		abort();
+}
+
+/* A broadcast filter holds 31 actions, the routes are packed into the first filters as they
+ * come and go and the drained filters are deleted */
+static void run_broadcast_packing(void)
+{
+	struct lsdn_context *ctx = new_context();
+	struct lsdn_commit_stats stats;
+	struct lsdn_phys *physes[22];
+	struct network n;
+
+	/* tap0 broadcasts to tap1 (mirred) and 21 remotes (tunnel_key + mirred), 43 actions */
+	build(ctx, &n, mk_vxlan_static);
+	for (uint8_t i = 0; i < 20; i++)
+		physes[i] = add_remote(ctx, &n, i + 1);
+	commit(ctx);
+	check_br_filters(ctx, "tap0", (size_t[]) {32, 13}, 2);
+
+	/* the first filter is refilled from the last one */
+	for (uint8_t i = 0; i < 3; i++)
+		lsdn_phys_free(physes[i]);
+	commit(ctx);
+	check_br_filters(ctx, "tap0", (size_t[]) {32, 7}, 2);
+
+	/* the second filters of tap0 and tap1 are drained and deleted */
+	lsdn_context_reset_commit_stats(ctx);
+	for (uint8_t i = 3; i < 7; i++)
+		lsdn_phys_free(physes[i]);
+	commit(ctx);
+	lsdn_context_get_commit_stats(ctx, &stats);
+	check_br_filters(ctx, "tap0", (size_t[]) {30}, 1);
+	check_br_filters(ctx, "tap1", (size_t[]) {30}, 1);
+	if (stats.broadcast_deletes != 2 || stats.nl.errors != 0)
+		abort();
+
+	/* the first new remote fills the first filter, the next one gets the recycled prio */
+	physes[20] = add_remote(ctx, &n, 21);
+	physes[21] = add_remote(ctx, &n, 22);
+	commit(ctx);
+	check_br_filters(ctx, "tap0", (size_t[]) {32, 3}, 2);
+
+	for (uint8_t i = 7; i < 22; i++)
+		lsdn_phys_free(physes[i]);
+	teardown(ctx, &n);
+	lsdn_context_free(ctx);
+}
+
+/* Commit several networks over a pair of physes, using the given number of threads */
+static void commit_nets(struct lsdn_settings *(*mk_settings)(struct lsdn_context *ctx),
+	unsigned int threads, struct lsdn_sim_state *state)
+{
+	struct lsdn_context *ctx = new_context();
+	struct lsdn_settings *s = mk_settings(ctx);
+	struct lsdn_phys *local = lsdn_phys_new(ctx);
+	struct lsdn_phys *remote = lsdn_phys_new(ctx);
+	struct lsdn_nl_stats stats;
+
+	lsdn_context_set_commit_threads(ctx, threads);
+	lsdn_phys_set_ip(local, LSDN_MK_IPV4(172, 16, 0, 1));
+	lsdn_phys_set_iface(local, "out");
+	lsdn_phys_set_ip(remote, LSDN_MK_IPV4(172, 16, 0, 2));
+	lsdn_phys_set_iface(remote, "out");
+	lsdn_phys_claim_local(local);
+	for (int i = 0; i < 4; i++) {
+		char tap[16];
+		snprintf(tap, sizeof(tap), "vtap%d", i);
+		add_link(ctx, tap);
+		struct lsdn_net *net = lsdn_net_new(s, 10 + i);
+		lsdn_phys_attach(local, net);
+		lsdn_phys_attach(remote, net);
+		struct lsdn_virt *v = lsdn_virt_new(net);
+		lsdn_virt_connect(v, local, tap);
+		lsdn_virt_set_mac(v, LSDN_MK_MAC(0x00, 0x00, 0x00, 0x00, 0x00, 0xa1 + i));
+		v = lsdn_virt_new(net);
+		lsdn_virt_connect(v, remote, "tap0");
+		lsdn_virt_set_mac(v, LSDN_MK_MAC(0x00, 0x00, 0x00, 0x00, 0x00, 0xb1 + i));
+	}
+	commit(ctx);
+
+	lsdn_context_get_nl_stats(ctx, &stats);
+	lsdn_sim_get_state(ctx, state);
+	if (stats.errors != 0)
+		abort();
+	lsdn_context_cleanup(ctx, lsdn_problem_stderr_handler, NULL);
+}
+
+/* The networks committed by several threads end up the same as when committed serially */
+static void run_parallel(struct lsdn_settings *(*mk_settings)(struct lsdn_context *ctx))
+{
+	struct lsdn_sim_state serial, parallel;
+	commit_nets(mk_settings, 1, &serial);
+	commit_nets(mk_settings, 3, &parallel);
+	same_state(&serial, &parallel);
+}
+
+int main()
+{
+	run(mk_vlan);
+	run(mk_vxlan_e2e);
+	run(mk_vxlan_static);
+	run_restart(mk_vlan);
+	run_restart(mk_vxlan_e2e);
+	run_restart(mk_vxlan_static);
+	run_restart_tunnel_keys();
+	run_foreign_tunnel_key();
+	run_rejected();
+	run_audit(mk_vlan);
+	run_audit(mk_vxlan_e2e);
+	run_audit(mk_vxlan_static);
+	run_parallel(mk_vlan);
+	run_parallel(mk_vxlan_e2e);
+	run_parallel(mk_vxlan_static);
+	run_migrate(mk_vlan);
+	run_migrate(mk_vxlan_e2e);
+	run_migrate(mk_vxlan_static);
+	run_bulk(mk_vlan);
+	run_bulk(mk_vxlan_e2e);
+	run_bulk(mk_vxlan_static);
+	run_suppress(mk_vxlan_static);
+	run_readdress(mk_vxlan_static);
+	run(mk_vxlan_static_chains);
+	run_migrate(mk_vxlan_static_chains);
+	run_suppress(mk_vxlan_static_chains);
+	run_readdress(mk_vxlan_static_chains);
+	run_chains();
+	run(mk_vxlan_static_bpf);
+	run_audit(mk_vxlan_static_bpf);
+	run_audit(mk_vxlan_static_shared);
+	run_audit_blocks();
+	run_migrate(mk_vxlan_static_bpf);
+	run_bpf();
+	run_vr_compile();
+	run_broadcast_packing();
+	return 0;
+}
@@ -0,0 +1,70 @@
+#include "../netmodel/private/slab.h"
+#include <stdlib.h>
+
+struct obj {
+	char c;
+	double d;
+};
+
+static struct obj *alloc(struct lsdn_slab *s)
+{
+	struct obj *o = lsdn_slab_alloc(s);
+	if (!o || (uintptr_t) o % __alignof__(struct obj) != 0)
+		abort();
+	return o;
+}
+
+static void check_stats(struct lsdn_slab *s, size_t allocated, size_t peak, size_t capacity)
+{
+	struct lsdn_slab_stats stats;
+	lsdn_slab_get_stats(s, &stats);
+	if (stats.allocated != allocated || stats.peak != peak || stats.capacity != capacity)
+		abort();
+}
+
+int main()
+{
+	struct lsdn_slab s;
+	struct obj *objs[1000];
+
+	/* the objects are distinct and usable, the chunks grow */
+	lsdn_slab_init(&s, sizeof(struct obj));
+	for (size_t i = 0; i < 1000; i++) {
+		objs[i] = alloc(&s);
+		objs[i]->c = i;
+		objs[i]->d = i;
+	}
+	for (size_t i = 0; i < 1000; i++)
+		if (objs[i]->d != i)
+			abort();
+	check_stats(&s, 1000, 1000, 1024);
+
+	/* returned objects are reused, the last returned first */
+	lsdn_slab_return(&s, objs[10]);
+	lsdn_slab_return(&s, objs[500]);
+	check_stats(&s, 998, 1000, 1024);
+	if (alloc(&s) != objs[500] || alloc(&s) != objs[10])
+		abort();
+
+	/* the memory is released with the last object */
+	for (size_t i = 0; i < 1000; i++)
+		lsdn_slab_return(&s, objs[i]);
+	check_stats(&s, 0, 1000, 0);
+	alloc(&s);
+	check_stats(&s, 1, 1000, 4);
+
+	/* arrays are allocated contiguously, in a new chunk if they do not fit */
+	void *array[10];
+	if (!lsdn_slab_alloc_array(&s, array, 10))
+		abort();
+	for (size_t i = 1; i < 10; i++)
+		if ((char *) array[i] - (char *) array[i - 1] != (char *) array[1] - (char *) array[0])
+			abort();
+	check_stats(&s, 11, 1000, 14);
+	/* the rest of the previous chunk is still used */
+	for (size_t i = 0; i < 3; i++)
+		alloc(&s);
+	check_stats(&s, 14, 1000, 14);
+	lsdn_slab_free(&s);
+	return 0;
+}